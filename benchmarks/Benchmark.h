@@ -0,0 +1,52 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+
+// Shared helpers of the benchmarks. Each benchmark prints one table to
+// stdout; times are the fastest of --repeat runs (default 5).
+
+
+class Stopwatch
+{
+public:
+    Stopwatch() : start(std::chrono::steady_clock::now()) {}
+
+    double milliseconds() const
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - this->start).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+
+// Fastest of `repeat` calls of `run`, in milliseconds.
+template <typename Function>
+double bestOf(int repeat, Function run)
+{
+    double best = std::numeric_limits<double>::max();
+    for (int i = 0; i < repeat; ++i) {
+        Stopwatch stopwatch;
+        run();
+        best = std::min(best, stopwatch.milliseconds());
+    }
+    return best;
+}
+
+
+inline int repeatArgument(int argc, char** argv, int defaultRepeat = 5)
+{
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::strcmp(argv[i], "--repeat") == 0) {
+            return std::max(1, std::atoi(argv[i + 1]));
+        }
+    }
+    return defaultRepeat;
+}
@@ -0,0 +1,175 @@
+// Times the separating axis box-triangle test used by the octree traversal
+// (intersectBoxTriangle) against the previous test, which intersected the
+// triangle with the 12 triangles of the box faces. Both are also checked
+// against a separating axis test in double on the same pairs.
+//
+//     boxTriangle [--repeat N]
+
+#include "Benchmark.h"
+#include "utility.h"
+
+#include <maya/MBoundingBox.h>
+#include <maya/MPoint.h>
+#include <maya/MVector.h>
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+
+const int NUM_PAIRS = 200000;
+
+
+struct BoxTrianglePair
+{
+    MBoundingBox box;
+    TriangleData triangle;
+};
+
+
+// intersectBoxTriangle before the separating axis test
+static bool previousIntersectBoxTriangle(const MBoundingBox& box, const TriangleData& triangle)
+{
+    if (boxContainsAnyVertices(box, triangle)) { return true; }
+
+    MBoundingBox triBox;
+    triBox.expand(triangle.vertices[0]);
+    triBox.expand(triangle.vertices[1]);
+    triBox.expand(triangle.vertices[2]);
+    if (!intersectBoxBox(box, triBox)) { return false; }
+
+    const glm::vec3 a0(triangle.vertices[0].x, triangle.vertices[0].y, triangle.vertices[0].z);
+    const glm::vec3 a1(triangle.vertices[1].x, triangle.vertices[1].y, triangle.vertices[1].z);
+    const glm::vec3 a2(triangle.vertices[2].x, triangle.vertices[2].y, triangle.vertices[2].z);
+
+    const glm::vec3 min(box.min().x, box.min().y, box.min().z);
+    const glm::vec3 max(box.max().x, box.max().y, box.max().z);
+    const glm::vec3 b0(min.x, min.y, min.z);
+    const glm::vec3 b1(min.x, min.y, max.z);
+    const glm::vec3 b2(min.x, max.y, min.z);
+    const glm::vec3 b3(min.x, max.y, max.z);
+    const glm::vec3 b4(max.x, min.y, min.z);
+    const glm::vec3 b5(max.x, min.y, max.z);
+    const glm::vec3 b6(max.x, max.y, min.z);
+    const glm::vec3 b7(max.x, max.y, max.z);
+
+    return intersectTriangleTriangle(a0,a1,a2, b0,b2,b6) || intersectTriangleTriangle(a0,a1,a2, b0,b6,b4) ||
+           intersectTriangleTriangle(a0,a1,a2, b0,b1,b3) || intersectTriangleTriangle(a0,a1,a2, b0,b3,b2) ||
+           intersectTriangleTriangle(a0,a1,a2, b0,b4,b5) || intersectTriangleTriangle(a0,a1,a2, b0,b5,b1) ||
+           intersectTriangleTriangle(a0,a1,a2, b7,b3,b1) || intersectTriangleTriangle(a0,a1,a2, b7,b1,b5) ||
+           intersectTriangleTriangle(a0,a1,a2, b7,b6,b2) || intersectTriangleTriangle(a0,a1,a2, b7,b2,b3) ||
+           intersectTriangleTriangle(a0,a1,a2, b7,b4,b6) || intersectTriangleTriangle(a0,a1,a2, b7,b5,b4);
+}
+
+
+// The 13 axis test in double, without padding, as the reference.
+static bool referenceOverlap(const MBoundingBox& box, const TriangleData& triangle)
+{
+    const MPoint center = box.center();
+    const double h[3] = { 0.5 * box.width(), 0.5 * box.height(), 0.5 * box.depth() };
+    MVector v[3];
+    for (int i = 0; i < 3; ++i) {
+        v[i] = triangle.vertices[i] - center;
+    }
+
+    for (int k = 0; k < 3; ++k) {
+        if (std::min({ v[0][k], v[1][k], v[2][k] }) > h[k] || std::max({ v[0][k], v[1][k], v[2][k] }) < -h[k]) {
+            return false;
+        }
+    }
+
+    const MVector e[3] = { v[1] - v[0], v[2] - v[1], v[0] - v[2] };
+    const MVector n = e[0] ^ e[1];
+    if (std::fabs(n * v[0]) > std::fabs(n.x) * h[0] + std::fabs(n.y) * h[1] + std::fabs(n.z) * h[2]) {
+        return false;
+    }
+
+    for (int j = 0; j < 3; ++j) {
+        for (int k = 0; k < 3; ++k) {
+            const int u = (k + 1) % 3;
+            const int w = (k + 2) % 3;
+            double p[3];
+            for (int i = 0; i < 3; ++i) {
+                p[i] = v[i][w] * e[j][u] - v[i][u] * e[j][w];
+            }
+            const double r = h[u] * std::fabs(e[j][w]) + h[w] * std::fabs(e[j][u]);
+            if (std::min({ p[0], p[1], p[2] }) > r || std::max({ p[0], p[1], p[2] }) < -r) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+// Boxes of octree node sizes, and triangles around them that often straddle
+// a face, an edge or the whole box, moved `offset` away from the origin.
+static std::vector<BoxTrianglePair> createPairs(double offset, unsigned seed)
+{
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> unit(-1.0, 1.0);
+    std::uniform_real_distribution<double> size(0.05, 0.5);
+
+    std::vector<BoxTrianglePair> pairs;
+    pairs.reserve(NUM_PAIRS);
+    for (int i = 0; i < NUM_PAIRS; ++i) {
+        const MPoint center(offset + unit(random), offset + unit(random), offset + unit(random));
+        const MVector half(size(random), size(random), size(random));
+
+        MPoint vertices[3];
+        for (MPoint& vertex : vertices) {
+            vertex = center + MVector(unit(random), unit(random), unit(random)) * 0.8;
+        }
+        pairs.push_back({ MBoundingBox(center - half, center + half), TriangleData(i, 0, vertices[0], vertices[1], vertices[2]) });
+    }
+    return pairs;
+}
+
+
+template <typename Test>
+static double nanosecondsPerCall(const std::vector<BoxTrianglePair>& pairs, int repeat, Test test, size_t& overlaps)
+{
+    const double milliseconds = bestOf(repeat, [&]() {
+        overlaps = 0;
+        for (const BoxTrianglePair& pair : pairs) {
+            overlaps += test(pair.box, pair.triangle) ? 1 : 0;
+        }
+    });
+    return milliseconds * 1e6 / pairs.size();
+}
+
+
+int main(int argc, char** argv)
+{
+    const int repeat = repeatArgument(argc, argv);
+
+    std::printf("%-10s %-10s %10s %10s %10s %10s\n", "offset", "test", "ns/call", "overlaps", "missed", "extra");
+    for (double offset : { 0.0, 1000.0 }) {
+        const std::vector<BoxTrianglePair> pairs = createPairs(offset, 1);
+
+        std::vector<bool> expected(pairs.size());
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            expected[i] = referenceOverlap(pairs[i].box, pairs[i].triangle);
+        }
+
+        struct { const char* name; bool (*test)(const MBoundingBox&, const TriangleData&); } tests[] = {
+            { "SAT", intersectBoxTriangle },
+            { "previous", previousIntersectBoxTriangle },
+        };
+        for (const auto& test : tests) {
+            size_t overlaps = 0;
+            const double time = nanosecondsPerCall(pairs, repeat, test.test, overlaps);
+
+            size_t missed = 0;
+            size_t extra = 0;
+            for (size_t i = 0; i < pairs.size(); ++i) {
+                const bool actual = test.test(pairs[i].box, pairs[i].triangle);
+                missed += expected[i] && !actual ? 1 : 0;
+                extra += !expected[i] && actual ? 1 : 0;
+            }
+            std::printf("%-10g %-10s %10.1f %10zu %10zu %10zu\n", offset, test.name, time, overlaps, missed, extra);
+        }
+    }
+    return 0;
+}
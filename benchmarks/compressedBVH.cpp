@@ -0,0 +1,86 @@
+// Measures the quantized inner nodes of EmbreeKernel (compressBVH) against
+// the full float boxes: node memory, build time, and kernel-kernel and
+// kernel-triangle query times of a large static sphere against a small one
+// resting on its surface.
+//
+//     compressedBVH [--repeat N]
+
+#include "Benchmark.h"
+#include "TestMeshes.h"
+#include "BatchScan.h"
+#include "kernel/EmbreeKernel.h"
+#include "kernel/TriangleBlocks.h"
+
+#include <maya/MBoundingBox.h>
+#include <maya/MFnMesh.h>
+#include <maya/MMatrix.h>
+
+#include <cstdio>
+#include <memory>
+#include <unordered_set>
+
+
+struct SphereSize
+{
+    int segments;
+    int rings;
+};
+
+const SphereSize SIZES[] = { { 160, 100 }, { 800, 500 }, { 1600, 1000 } };
+
+
+static void run(const char* name, bool quantizedNodes, const MObject& meshA, const MObject& meshB, int repeat)
+{
+    const MMatrix identity;
+    const MBoundingBox bboxA = pointsBoundingBox(meshA, identity);
+    const MBoundingBox bboxB = pointsBoundingBox(meshB, identity);
+
+    std::unique_ptr<EmbreeKernel> kernelA;
+    const double buildTime = bestOf(repeat, [&]() {
+        kernelA = std::make_unique<EmbreeKernel>(quantizedNodes);
+        kernelA->build(meshA, bboxA, identity);
+    });
+
+    EmbreeKernel kernelB(quantizedNodes);
+    kernelB.build(meshB, bboxB, identity);
+
+    size_t kernelPairs = 0;
+    const double kernelTime = bestOf(repeat, [&]() {
+        kernelPairs = kernelA->intersectKernelKernel(kernelB).first.size();
+    });
+
+    size_t triangleFaces = 0;
+    const double triangleTime = bestOf(repeat, [&]() {
+        std::unordered_set<int> facesA;
+        std::unordered_set<int> facesB;
+        intersectKernelMesh(*kernelA, meshB, identity, facesA, facesB);
+        triangleFaces = facesA.size() + facesB.size();
+    });
+
+    std::printf("  %-12s %10.2f %10.2f %10.3f %10.3f %10zu %10zu\n", name, kernelA->nodeBytes() / (1024.0 * 1024.0),
+        buildTime, kernelTime, triangleTime, kernelPairs, triangleFaces);
+}
+
+
+int main(int argc, char** argv)
+{
+    MayaSession session(argv[0]);
+    if (!session.ok()) {
+        return 2;
+    }
+    selectBlockKernels();
+    const int repeat = repeatArgument(argc, argv);
+
+    std::printf("  %-12s %10s %10s %10s %10s %10s %10s\n", "nodes", "node MB", "build ms", "K2K ms", "K2T ms", "K2K pairs", "K2T faces");
+    for (const SphereSize& size : SIZES) {
+        MObject meshA = createSphere(size.segments, size.rings, 10.0, 0.0, 0.0, 0.0, 0.001, 1);
+        MObject meshB = createSphere(64, 40, 0.5, 10.0, 0.0, 0.0, 0.01, 2);
+        std::printf("%d triangles against %d\n",
+            MFnMesh(meshA).numFaceVertices() - 2 * MFnMesh(meshA).numPolygons(),
+            MFnMesh(meshB).numFaceVertices() - 2 * MFnMesh(meshB).numPolygons());
+
+        run("float boxes", false, meshA, meshB, repeat);
+        run("quantized", true, meshA, meshB, repeat);
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+// Compares EmbreeSceneKernel, native Embree triangle scenes queried with edge
+// segment rays, against EmbreeKernel, the user BVH with our own traversal, on
+// pairs of overlapping spheres of growing size.
+//
+//     embreeSceneKernel [--repeat N]
+
+#include "Benchmark.h"
+#include "TestMeshes.h"
+#include "BatchScan.h"
+#include "kernel/EmbreeKernel.h"
+#include "kernel/EmbreeSceneKernel.h"
+#include "kernel/TriangleBlocks.h"
+
+#include <maya/MBoundingBox.h>
+#include <maya/MFnMesh.h>
+#include <maya/MMatrix.h>
+
+#include <cstdio>
+#include <memory>
+#include <unordered_set>
+
+
+struct SphereSize
+{
+    int segments;
+    int rings;
+};
+
+const SphereSize SIZES[] = { { 64, 40 }, { 160, 100 }, { 400, 250 }, { 800, 500 } };
+
+
+template <typename KernelType>
+static void run(const char* name, const MObject& meshA, const MObject& meshB, int repeat)
+{
+    const MMatrix identity;
+    const MBoundingBox bboxA = pointsBoundingBox(meshA, identity);
+    const MBoundingBox bboxB = pointsBoundingBox(meshB, identity);
+
+    std::unique_ptr<KernelType> kernelA;
+    std::unique_ptr<KernelType> kernelB;
+    const double buildTime = bestOf(repeat, [&]() {
+        kernelA = std::make_unique<KernelType>();
+        kernelB = std::make_unique<KernelType>();
+        kernelA->build(meshA, bboxA, identity);
+        kernelB->build(meshB, bboxB, identity);
+    });
+
+    // faces found, both meshes together, so that the kernels can be compared
+    size_t kernelFaces = 0;
+    const double kernelTime = bestOf(repeat, [&]() {
+        K2KIntersection pairs = kernelA->intersectKernelKernel(*kernelB);
+        std::unordered_set<int> facesA;
+        std::unordered_set<int> facesB;
+        for (const TriangleData& triangle : pairs.first) {
+            facesA.insert(triangle.faceIndex);
+        }
+        for (const TriangleData& triangle : pairs.second) {
+            facesB.insert(triangle.faceIndex);
+        }
+        kernelFaces = facesA.size() + facesB.size();
+    });
+
+    size_t triangleFaces = 0;
+    const double triangleTime = bestOf(repeat, [&]() {
+        std::unordered_set<int> facesA;
+        std::unordered_set<int> facesB;
+        intersectKernelMesh(*kernelA, meshB, identity, facesA, facesB);
+        triangleFaces = facesA.size() + facesB.size();
+    });
+
+    std::printf("  %-12s %10.2f %10.2f %10.2f %10zu %10zu\n", name, buildTime, kernelTime, triangleTime, kernelFaces, triangleFaces);
+}
+
+
+int main(int argc, char** argv)
+{
+    MayaSession session(argv[0]);
+    if (!session.ok()) {
+        return 2;
+    }
+    selectBlockKernels();
+    const int repeat = repeatArgument(argc, argv);
+
+    std::printf("  %-12s %10s %10s %10s %10s %10s\n", "kernel", "build ms", "K2K ms", "K2T ms", "K2K faces", "K2T faces");
+    for (const SphereSize& size : SIZES) {
+        MObject meshA = createSphere(size.segments, size.rings, 1.0, 0.0, 0.0, 0.0, 0.01, 1);
+        MObject meshB = createSphere(size.segments, size.rings, 0.8, 0.7, -0.3, 0.2, 0.01, 2);
+        std::printf("%d triangles per mesh\n", MFnMesh(meshA).numFaceVertices() - 2 * MFnMesh(meshA).numPolygons());
+
+        run<EmbreeKernel>("Embree", meshA, meshB, repeat);
+        run<EmbreeSceneKernel>("EmbreeScene", meshA, meshB, repeat);
+    }
+    return 0;
+}
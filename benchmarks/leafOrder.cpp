@@ -0,0 +1,73 @@
+// Measures how much the kernel queries depend on the face order of the
+// meshes. EmbreeKernel stores its triangles in leaf order, so a mesh with
+// shuffled faces should query as fast as the same mesh in its coherent,
+// generated order; without that layout the shuffled one jumps through memory
+// on every leaf. Only the kernel mesh, a 31k quad sphere, is shuffled; the
+// triangle queries walk the 20k quad sphere in the same order both times.
+//
+//     leafOrder [--repeat N]
+
+#include "Benchmark.h"
+#include "TestMeshes.h"
+#include "BatchScan.h"
+#include "kernel/EmbreeKernel.h"
+#include "kernel/TriangleBlocks.h"
+
+#include <maya/MBoundingBox.h>
+#include <maya/MMatrix.h>
+
+#include <cstdio>
+#include <memory>
+#include <unordered_set>
+
+
+static void run(const char* name, const MObject& meshA, const MObject& meshB, int repeat)
+{
+    const MMatrix identity;
+    const MBoundingBox bboxA = pointsBoundingBox(meshA, identity);
+    const MBoundingBox bboxB = pointsBoundingBox(meshB, identity);
+
+    std::unique_ptr<EmbreeKernel> kernelA;
+    const double buildTime = bestOf(repeat, [&]() {
+        kernelA = std::make_unique<EmbreeKernel>();
+        kernelA->build(meshA, bboxA, identity);
+    });
+
+    EmbreeKernel kernelB;
+    kernelB.build(meshB, bboxB, identity);
+
+    size_t kernelPairs = 0;
+    const double kernelTime = bestOf(repeat, [&]() {
+        kernelPairs = kernelA->intersectKernelKernel(kernelB).first.size();
+    });
+
+    size_t triangleFaces = 0;
+    const double triangleTime = bestOf(repeat, [&]() {
+        std::unordered_set<int> facesA;
+        std::unordered_set<int> facesB;
+        intersectKernelMesh(*kernelA, meshB, identity, facesA, facesB);
+        triangleFaces = facesA.size() + facesB.size();
+    });
+
+    std::printf("%-10s %10.2f %10.3f %10.3f %10zu %10zu\n", name, buildTime, kernelTime, triangleTime, kernelPairs, triangleFaces);
+}
+
+
+int main(int argc, char** argv)
+{
+    MayaSession session(argv[0]);
+    if (!session.ok()) {
+        return 2;
+    }
+    selectBlockKernels();
+    const int repeat = repeatArgument(argc, argv);
+
+    // 250 x 124 and 200 x 100 quads, plus the pole fans
+    const MObject sphereA = createSphere(250, 126, 1.0, 0.0, 0.0, 0.0, 0.01, 1);
+    const MObject sphereB = createSphere(200, 102, 0.7, 1.2, 0.1, 0.0, 0.01, 2);
+
+    std::printf("%-10s %10s %10s %10s %10s %10s\n", "faces", "build ms", "K2K ms", "K2T ms", "K2K pairs", "K2T faces");
+    run("coherent", sphereA, sphereB, repeat);
+    run("shuffled", shuffleFaces(sphereA, 3), sphereB, repeat);
+    return 0;
+}
@@ -0,0 +1,685 @@
+#include "MeshReader.h"
+#include "MappedFile.h"
+
+#include <omp.h>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+
+
+const size_t OBJ_MIN_CHUNK_SIZE = 1 << 20;     // bytes parsed by one task at least
+const int OBJ_CHUNKS_PER_THREAD = 4;            // so uneven chunks still balance
+
+
+// -------------------------------------------------------------------------------------------
+// Text parsing, on ranges that are not null terminated and independent of the locale
+
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+
+static const char* skipSpaces(const char* p, const char* end)
+{
+    while (p < end && isSpace(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+
+static const char* nextLine(const char* p, const char* end)
+{
+    const char* newline = (const char*)std::memchr(p, '\n', end - p);
+    return newline ? newline + 1 : end;
+}
+
+
+// nullptr when there is no number at p
+static const char* parseInteger(const char* p, const char* end, int64_t& value)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+    }
+    if (p == end || !std::isdigit((unsigned char)*p)) {
+        return nullptr;
+    }
+
+    int64_t result = 0;
+    while (p < end && std::isdigit((unsigned char)*p)) {
+        result = result * 10 + (*p - '0');
+        ++p;
+    }
+    value = negative ? -result : result;
+    return p;
+}
+
+
+static const char* parseReal(const char* p, const char* end, double& value)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+    }
+
+    // digits past the 19th do not fit the mantissa and only shift the exponent
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool any = false;
+    while (p < end && std::isdigit((unsigned char)*p)) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa > 0 ? 1 : 0;
+        } else {
+            ++exponent;
+        }
+        any = true;
+        ++p;
+    }
+    if (p < end && *p == '.') {
+        ++p;
+        while (p < end && std::isdigit((unsigned char)*p)) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa > 0 ? 1 : 0;
+                --exponent;
+            }
+            any = true;
+            ++p;
+        }
+    }
+    if (!any) {
+        return nullptr;
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        int64_t power = 0;
+        const char* after = parseInteger(p + 1, end, power);
+        if (after) {
+            exponent += (int)std::max<int64_t>(-1000, std::min<int64_t>(1000, power));
+            p = after;
+        }
+    }
+
+    const double result = exponent == 0 ? (double)mantissa : (double)mantissa * std::pow(10.0, exponent);
+    value = negative ? -result : result;
+    return p;
+}
+
+
+static bool startsWith(const char* p, const char* end, const char* word)
+{
+    const size_t length = std::strlen(word);
+    return (size_t)(end - p) >= length && std::memcmp(p, word, length) == 0 && (p + length == end || isSpace(p[length]) || p[length] == '\n');
+}
+
+
+// -------------------------------------------------------------------------------------------
+// OBJ
+
+// Part of an OBJ file between two line starts. Negative (relative) vertex ids
+// are resolved against the vertices of the chunk and fixed up once the number
+// of vertices in the chunks before is known.
+struct ObjChunk
+{
+    const char* begin;
+    const char* end;
+    std::vector<float> points;
+    std::vector<int> polygonCounts;
+    std::vector<int> polygonConnects;
+    std::vector<size_t> relativeConnects;   // ids in polygonConnects relative to the chunk's first vertex
+    size_t errorOffset = SIZE_MAX;          // offset of the first line that failed to parse
+    bool outOfMemory = false;               // an allocation failed, must not leave the parallel loop
+};
+
+
+static void parseObjChunk(ObjChunk& chunk, const char* fileBegin)
+{
+    const char* end = chunk.end;
+    for (const char* line = chunk.begin; line < end; line = nextLine(line, end)) {
+        const char* p = skipSpaces(line, end);
+
+        if (startsWith(p, end, "v")) {
+            p += 1;
+            for (int axis = 0; axis < 3; ++axis) {
+                double value;
+                p = parseReal(skipSpaces(p, end), end, value);
+                if (!p) {
+                    chunk.errorOffset = line - fileBegin;
+                    return;
+                }
+                chunk.points.push_back((float)value);
+            }
+
+        } else if (startsWith(p, end, "f")) {
+            p += 1;
+            const int numLocalVertices = (int)(chunk.points.size() / 3);
+            int count = 0;
+            for (p = skipSpaces(p, end); p < end && *p != '\n' && *p != '#'; p = skipSpaces(p, end)) {
+                // v, v/vt, v//vn or v/vt/vn, only v is used
+                int64_t id;
+                p = parseInteger(p, end, id);
+                if (!p || id == 0) {
+                    chunk.errorOffset = line - fileBegin;
+                    return;
+                }
+                while (p < end && !isSpace(*p) && *p != '\n') {
+                    ++p;
+                }
+
+                if (id < 0) {
+                    chunk.relativeConnects.push_back(chunk.polygonConnects.size());
+                    chunk.polygonConnects.push_back(numLocalVertices + (int)id);
+                } else {
+                    chunk.polygonConnects.push_back((int)(id - 1));
+                }
+                ++count;
+            }
+            if (count < 3) {
+                chunk.errorOffset = line - fileBegin;
+                return;
+            }
+            chunk.polygonCounts.push_back(count);
+        }
+        // normals, uvs, groups, materials and comments are not needed
+    }
+}
+
+
+static size_t lineNumber(const char* begin, size_t offset)
+{
+    return 1 + std::count(begin, begin + offset, '\n');
+}
+
+
+static bool readObj(const MappedFile& file, MeshArrays& mesh, std::string& error)
+{
+    const char* begin = file.data();
+    const char* end = begin + file.size();
+
+    // chunks of about the same size, each starting on a line
+    const size_t maxChunks = std::max<size_t>(1, file.size() / OBJ_MIN_CHUNK_SIZE);
+    const size_t numChunks = std::min<size_t>(maxChunks, (size_t)omp_get_max_threads() * OBJ_CHUNKS_PER_THREAD);
+    std::vector<ObjChunk> chunks(numChunks);
+    const char* start = begin;
+    for (size_t i = 0; i < numChunks; ++i) {
+        const char* stop = i + 1 == numChunks ? end : std::max(start, begin + file.size() * (i + 1) / numChunks);
+        stop = stop < end ? nextLine(stop, end) : end;
+        chunks[i].begin = start;
+        chunks[i].end = stop;
+        start = stop;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < (int)numChunks; ++i) {
+        try {
+            parseObjChunk(chunks[i], begin);
+        } catch (const std::bad_alloc&) {
+            chunks[i].outOfMemory = true;
+        }
+    }
+
+    size_t numPoints = 0;
+    size_t numPolygons = 0;
+    size_t numConnects = 0;
+    for (const ObjChunk& chunk : chunks) {
+        if (chunk.outOfMemory) {
+            throw std::bad_alloc();
+        }
+        if (chunk.errorOffset != SIZE_MAX) {
+            error = "cannot parse line " + std::to_string(lineNumber(begin, chunk.errorOffset));
+            return false;
+        }
+        numPoints += chunk.points.size();
+        numPolygons += chunk.polygonCounts.size();
+        numConnects += chunk.polygonConnects.size();
+    }
+
+    mesh.points.clear();
+    mesh.polygonCounts.clear();
+    mesh.polygonConnects.clear();
+    mesh.points.reserve(numPoints);
+    mesh.polygonCounts.reserve(numPolygons);
+    mesh.polygonConnects.reserve(numConnects);
+
+    for (ObjChunk& chunk : chunks) {
+        const int firstVertex = (int)mesh.numVertices();
+        for (size_t i : chunk.relativeConnects) {
+            chunk.polygonConnects[i] += firstVertex;
+        }
+        mesh.points.insert(mesh.points.end(), chunk.points.begin(), chunk.points.end());
+        mesh.polygonCounts.insert(mesh.polygonCounts.end(), chunk.polygonCounts.begin(), chunk.polygonCounts.end());
+        mesh.polygonConnects.insert(mesh.polygonConnects.end(), chunk.polygonConnects.begin(), chunk.polygonConnects.end());
+    }
+
+    return true;
+}
+
+
+// -------------------------------------------------------------------------------------------
+// PLY
+
+enum class PlyFormat { Ascii, BinaryLittleEndian, BinaryBigEndian };
+
+struct PlyProperty
+{
+    std::string name;
+    int size = 0;               // bytes of a value, of each item for lists
+    bool floating = false;
+    bool isSigned = false;
+    int countSize = 0;          // bytes of the item count, 0 for scalar properties
+};
+
+struct PlyElement
+{
+    std::string name;
+    size_t count = 0;
+    std::vector<PlyProperty> properties;
+};
+
+
+static bool plyType(const std::string& name, int& size, bool& floating, bool& isSigned)
+{
+    struct Type { const char* name; int size; bool floating; bool isSigned; };
+    static const Type types[] = {
+        { "char", 1, false, true }, { "int8", 1, false, true },
+        { "uchar", 1, false, false }, { "uint8", 1, false, false },
+        { "short", 2, false, true }, { "int16", 2, false, true },
+        { "ushort", 2, false, false }, { "uint16", 2, false, false },
+        { "int", 4, false, true }, { "int32", 4, false, true },
+        { "uint", 4, false, false }, { "uint32", 4, false, false },
+        { "float", 4, true, true }, { "float32", 4, true, true },
+        { "double", 8, true, true }, { "float64", 8, true, true },
+    };
+    for (const Type& type : types) {
+        if (name == type.name) {
+            size = type.size;
+            floating = type.floating;
+            isSigned = type.isSigned;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Reads binary values of either byte order.
+class PlyBinaryValue
+{
+public:
+    explicit PlyBinaryValue(bool swap) : swap(swap) {}
+
+    double read(const char* p, int size, bool floating, bool isSigned) const
+    {
+        unsigned char bytes[8];
+        for (int i = 0; i < size; ++i) {
+            bytes[i] = (unsigned char)p[this->swap ? size - 1 - i : i];
+        }
+
+        switch (size) {
+        case 1: return isSigned ? (double)(int8_t)bytes[0] : (double)bytes[0];
+        case 2: { uint16_t v; std::memcpy(&v, bytes, 2); return isSigned ? (double)(int16_t)v : (double)v; }
+        case 4:
+            if (floating) { float v; std::memcpy(&v, bytes, 4); return v; }
+            { uint32_t v; std::memcpy(&v, bytes, 4); return isSigned ? (double)(int32_t)v : (double)v; }
+        default: { double v; std::memcpy(&v, bytes, 8); return v; }
+        }
+    }
+
+private:
+    bool swap;
+};
+
+
+static bool hostIsLittleEndian()
+{
+    const uint16_t one = 1;
+    unsigned char first;
+    std::memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+
+static bool readPlyHeader(const char*& p, const char* end, PlyFormat& format, std::vector<PlyElement>& elements, std::string& error)
+{
+    if (!startsWith(p, end, "ply")) {
+        error = "not a PLY file";
+        return false;
+    }
+
+    bool hasFormat = false;
+    for (p = nextLine(p, end); p < end; p = nextLine(p, end)) {
+        // split the header line into words
+        std::vector<std::string> words;
+        const char* lineEnd = nextLine(p, end);
+        for (const char* q = skipSpaces(p, lineEnd); q < lineEnd && *q != '\n'; q = skipSpaces(q, lineEnd)) {
+            const char* wordEnd = q;
+            while (wordEnd < lineEnd && !isSpace(*wordEnd) && *wordEnd != '\n') {
+                ++wordEnd;
+            }
+            words.emplace_back(q, wordEnd);
+            q = wordEnd;
+        }
+        if (words.empty() || words[0] == "comment" || words[0] == "obj_info") {
+            continue;
+        }
+
+        if (words[0] == "end_header") {
+            p = lineEnd;
+            if (!hasFormat) {
+                error = "PLY header without a format";
+                return false;
+            }
+            return true;
+
+        } else if (words[0] == "format" && words.size() >= 2) {
+            hasFormat = true;
+            if (words[1] == "ascii") {
+                format = PlyFormat::Ascii;
+            } else if (words[1] == "binary_little_endian") {
+                format = PlyFormat::BinaryLittleEndian;
+            } else if (words[1] == "binary_big_endian") {
+                format = PlyFormat::BinaryBigEndian;
+            } else {
+                error = "unknown PLY format " + words[1];
+                return false;
+            }
+
+        } else if (words[0] == "element" && words.size() == 3) {
+            PlyElement element;
+            element.name = words[1];
+            element.count = (size_t)std::strtoull(words[2].c_str(), nullptr, 10);
+            elements.push_back(element);
+
+        } else if (words[0] == "property" && !elements.empty()) {
+            PlyProperty property;
+            bool valid;
+            if (words.size() == 5 && words[1] == "list") {
+                int countSize;
+                bool countFloating;
+                bool countSigned;
+                valid = plyType(words[2], countSize, countFloating, countSigned) && !countFloating &&
+                    plyType(words[3], property.size, property.floating, property.isSigned);
+                property.countSize = countSize;
+                property.name = words[4];
+            } else {
+                valid = words.size() == 3 && plyType(words[1], property.size, property.floating, property.isSigned);
+                property.name = words.back();
+            }
+            if (!valid) {
+                error = "unsupported PLY property " + words.back();
+                return false;
+            }
+            elements.back().properties.push_back(property);
+
+        } else {
+            error = "unexpected PLY header line " + words[0];
+            return false;
+        }
+    }
+
+    error = "PLY header without end_header";
+    return false;
+}
+
+
+static int propertyIndex(const PlyElement& element, const char* name)
+{
+    for (size_t i = 0; i < element.properties.size(); ++i) {
+        if (element.properties[i].name == name) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+
+static bool readPlyAscii(const char* p, const char* end, const std::vector<PlyElement>& elements, MeshArrays& mesh, std::string& error)
+{
+    for (const PlyElement& element : elements) {
+        const bool isVertex = element.name == "vertex";
+        const bool isFace = element.name == "face";
+        const int axes[3] = { propertyIndex(element, "x"), propertyIndex(element, "y"), propertyIndex(element, "z") };
+        int indices = propertyIndex(element, "vertex_indices");
+        if (indices < 0) {
+            indices = propertyIndex(element, "vertex_index");
+        }
+
+        for (size_t item = 0; item < element.count; ++item) {
+            for (int i = 0; i < (int)element.properties.size(); ++i) {
+                const PlyProperty& property = element.properties[i];
+                size_t count = 1;
+
+                if (property.countSize > 0) {
+                    int64_t listCount;
+                    p = parseInteger(skipSpaces(p, end), end, listCount);
+                    if (!p || listCount < 0) {
+                        error = "cannot parse PLY " + element.name;
+                        return false;
+                    }
+                    count = (size_t)listCount;
+                    if (isFace && i == indices) {
+                        mesh.polygonCounts.push_back((int)count);
+                    }
+                }
+
+                for (size_t j = 0; j < count; ++j) {
+                    double value;
+                    p = parseReal(skipSpaces(p, end), end, value);
+                    if (!p) {
+                        error = "cannot parse PLY " + element.name;
+                        return false;
+                    }
+                    if (isVertex && (i == axes[0] || i == axes[1] || i == axes[2])) {
+                        mesh.points[item * 3 + (i == axes[0] ? 0 : i == axes[1] ? 1 : 2)] = (float)value;
+                    } else if (isFace && i == indices) {
+                        mesh.polygonConnects.push_back((int)value);
+                    }
+                }
+            }
+            p = nextLine(p, end);
+        }
+    }
+    return true;
+}
+
+
+static bool readPlyBinary(const char* p, const char* end, bool swap, const std::vector<PlyElement>& elements, MeshArrays& mesh, std::string& error)
+{
+    const PlyBinaryValue value(swap);
+
+    for (const PlyElement& element : elements) {
+        const bool isVertex = element.name == "vertex";
+        const bool isFace = element.name == "face";
+        int indices = propertyIndex(element, "vertex_indices");
+        if (indices < 0) {
+            indices = propertyIndex(element, "vertex_index");
+        }
+
+        // elements of scalar properties have a fixed size, their items can
+        // be read in any order
+        size_t stride = 0;
+        bool fixed = true;
+        std::vector<size_t> offsets;
+        for (const PlyProperty& property : element.properties) {
+            offsets.push_back(stride);
+            stride += property.size;
+            fixed = fixed && property.countSize == 0;
+        }
+
+        if (fixed) {
+            if ((size_t)(end - p) / std::max<size_t>(1, stride) < element.count) {
+                error = "PLY file ends in " + element.name;
+                return false;
+            }
+            if (isVertex) {
+                int axes[3] = { propertyIndex(element, "x"), propertyIndex(element, "y"), propertyIndex(element, "z") };
+                #pragma omp parallel for schedule(static)
+                for (int64_t item = 0; item < (int64_t)element.count; ++item) {
+                    for (int axis = 0; axis < 3; ++axis) {
+                        const PlyProperty& property = element.properties[axes[axis]];
+                        mesh.points[item * 3 + axis] = (float)value.read(p + item * stride + offsets[axes[axis]], property.size, property.floating, property.isSigned);
+                    }
+                }
+            }
+            p += stride * element.count;
+            continue;
+        }
+
+        for (size_t item = 0; item < element.count; ++item) {
+            for (int i = 0; i < (int)element.properties.size(); ++i) {
+                const PlyProperty& property = element.properties[i];
+                size_t count = 1;
+                if (property.countSize > 0) {
+                    if (end - p < property.countSize) {
+                        error = "PLY file ends in " + element.name;
+                        return false;
+                    }
+                    count = (size_t)value.read(p, property.countSize, false, false);
+                    p += property.countSize;
+                    if (isFace && i == indices) {
+                        mesh.polygonCounts.push_back((int)count);
+                    }
+                }
+
+                if ((size_t)(end - p) / property.size < count) {
+                    error = "PLY file ends in " + element.name;
+                    return false;
+                }
+                if (isFace && i == indices) {
+                    for (size_t j = 0; j < count; ++j) {
+                        mesh.polygonConnects.push_back((int)value.read(p + j * property.size, property.size, property.floating, property.isSigned));
+                    }
+                } else if (isVertex && count == 1) {
+                    const char* axis = property.name.c_str();
+                    if (property.name == "x" || property.name == "y" || property.name == "z") {
+                        mesh.points[item * 3 + (axis[0] - 'x')] = (float)value.read(p, property.size, property.floating, property.isSigned);
+                    }
+                }
+                p += count * property.size;
+            }
+        }
+    }
+    return true;
+}
+
+
+// Whether the body after the header can hold the items the header counts,
+// each at least one byte per property in ASCII and the size of its scalars
+// and list counts in binary. Checked before anything is allocated from them.
+static bool plyCountsFit(const std::vector<PlyElement>& elements, PlyFormat format, size_t bytes)
+{
+    for (const PlyElement& element : elements) {
+        size_t itemBytes = 0;
+        for (const PlyProperty& property : element.properties) {
+            itemBytes += format == PlyFormat::Ascii ? 1 : property.countSize > 0 ? property.countSize : property.size;
+        }
+        itemBytes = std::max<size_t>(1, itemBytes);
+        if (bytes / itemBytes < element.count) {
+            return false;
+        }
+        bytes -= itemBytes * element.count;
+    }
+    return true;
+}
+
+
+static bool readPly(const MappedFile& file, MeshArrays& mesh, std::string& error)
+{
+    const char* p = file.data();
+    const char* end = p + file.size();
+
+    PlyFormat format = PlyFormat::Ascii;
+    std::vector<PlyElement> elements;
+    if (!readPlyHeader(p, end, format, elements, error)) {
+        return false;
+    }
+
+    const PlyElement* vertex = nullptr;
+    const PlyElement* face = nullptr;
+    for (const PlyElement& element : elements) {
+        if (element.name == "vertex") {
+            vertex = &element;
+        } else if (element.name == "face") {
+            face = &element;
+        }
+    }
+    if (!vertex || propertyIndex(*vertex, "x") < 0 || propertyIndex(*vertex, "y") < 0 || propertyIndex(*vertex, "z") < 0) {
+        error = "PLY file without vertex positions";
+        return false;
+    }
+    if (!face || (propertyIndex(*face, "vertex_indices") < 0 && propertyIndex(*face, "vertex_index") < 0)) {
+        error = "PLY file without faces";
+        return false;
+    }
+
+    if (!plyCountsFit(elements, format, (size_t)(end - p))) {
+        error = "PLY file is shorter than its header says";
+        return false;
+    }
+
+    mesh.points.assign(vertex->count * 3, 0.0f);
+    mesh.polygonCounts.clear();
+    mesh.polygonConnects.clear();
+    mesh.polygonCounts.reserve(face->count);
+    mesh.polygonConnects.reserve(face->count * 3);
+
+    if (format == PlyFormat::Ascii) {
+        return readPlyAscii(p, end, elements, mesh, error);
+    }
+    const bool swap = (format == PlyFormat::BinaryLittleEndian) != hostIsLittleEndian();
+    return readPlyBinary(p, end, swap, elements, mesh, error);
+}
+
+
+// -------------------------------------------------------------------------------------------
+
+bool readMeshFile(const std::string& path, MeshArrays& mesh, std::string& error)
+{
+    std::string extension = path.substr(std::min(path.size(), path.find_last_of('.')));
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return (char)std::tolower((unsigned char)c); });
+    if (extension != ".obj" && extension != ".ply") {
+        error = "unknown mesh format " + extension;
+        return false;
+    }
+
+    std::shared_ptr<MappedFile> file = MappedFile::open(path);
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    const bool read = extension == ".obj" ? readObj(*file, mesh, error) : readPly(*file, mesh, error);
+    if (!read) {
+        return false;
+    }
+
+    const int numVertices = (int)mesh.numVertices();
+    for (int id : mesh.polygonConnects) {
+        if (id < 0 || id >= numVertices) {
+            error = "face vertex id " + std::to_string(id) + " is out of range";
+            return false;
+        }
+    }
+    for (int count : mesh.polygonCounts) {
+        if (count < 3) {
+            error = "face with fewer than 3 vertices";
+            return false;
+        }
+    }
+    if (mesh.polygonCounts.empty()) {
+        error = "no faces";
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+
+// A polygon mesh as plain arrays, the way MFnMesh::create takes it.
+struct MeshArrays
+{
+    std::vector<float> points;          // x y z of each vertex
+    std::vector<int> polygonCounts;     // vertices of each polygon
+    std::vector<int> polygonConnects;   // vertex ids of all polygons in order
+
+    size_t numVertices() const { return this->points.size() / 3; }
+    size_t numPolygons() const { return this->polygonCounts.size(); }
+};
+
+
+// Read a Wavefront OBJ or a PLY (ascii or binary) file, picked by the
+// extension. Only vertex positions and faces are read; OBJ groups, objects
+// and materials are merged into one mesh. The file is mapped, OBJ files and
+// binary PLY vertices are parsed in parallel. Returns false and sets `error`
+// when the file cannot be read.
+bool readMeshFile(const std::string& path, MeshArrays& mesh, std::string& error);
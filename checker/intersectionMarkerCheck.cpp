@@ -0,0 +1,431 @@
+// intersectionMarkerCheck, a command line intersection test of two OBJ or
+// PLY meshes with the plug-in's kernels, for checking deliveries without
+// opening Maya and as a repeatable profiling target. Runs as a Maya library
+// application, so it needs a Maya installation but no scene or UI.
+//
+//     intersectionMarkerCheck [options] meshA meshB
+//
+//     --kernel N       kernel, the values of the node's kernel attribute (default 0, BVH)
+//     --mode MODE      kernelToTriangle, kernelToKernel or all (default all)
+//     --compress-bvh   8 bit quantized node boxes for the BVH kernels
+//     --repeat N       run each check N times and report the fastest
+//     --report PATH    write a .json or .csv report, JSON goes to stdout without
+//
+// Exits with 0 when the meshes do not intersect, 1 when they do and 2 on errors.
+
+#include "MeshReader.h"
+#include "BatchScan.h"
+#include "MappedFile.h"
+#include "kernel/TriangleBlocks.h"
+
+#include <maya/MBoundingBox.h>
+#include <maya/MFloatPointArray.h>
+#include <maya/MFnMesh.h>
+#include <maya/MFnMeshData.h>
+#include <maya/MIntArray.h>
+#include <maya/MLibrary.h>
+#include <maya/MMatrix.h>
+#include <maya/MObject.h>
+
+#include <omp.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+
+const int EXIT_CLEAN = 0;
+const int EXIT_INTERSECTED = 1;
+const int EXIT_ERROR = 2;
+
+
+struct CheckOptions
+{
+    std::string pathA;
+    std::string pathB;
+    short kernel = 0;
+    bool kernelToTriangle = true;
+    bool kernelToKernel = true;
+    bool compressBVH = false;
+    int repeat = 1;
+    std::string report;
+};
+
+
+struct LoadedMesh
+{
+    std::string path;
+    MeshArrays arrays;
+    MObject meshData;
+    double loadSeconds = 0.0;
+};
+
+
+struct CheckResult
+{
+    const char* mode;
+    double buildSeconds = 0.0;
+    double querySeconds = 0.0;
+    std::vector<int> facesA;
+    std::vector<int> facesB;
+};
+
+
+class Stopwatch
+{
+public:
+    Stopwatch() : start(std::chrono::steady_clock::now()) {}
+
+    double seconds() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - this->start).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+
+static void printUsage()
+{
+    std::cerr <<
+        "usage: intersectionMarkerCheck [options] meshA meshB\n"
+        "  --kernel N       kernel, the values of the node's kernel attribute (default 0, BVH)\n"
+        "  --mode MODE      kernelToTriangle, kernelToKernel or all (default all)\n"
+        "  --compress-bvh   8 bit quantized node boxes for the BVH kernels\n"
+        "  --repeat N       run each check N times and report the fastest\n"
+        "  --report PATH    write a .json or .csv report, JSON goes to stdout without\n";
+}
+
+
+static bool parseArguments(int argc, char** argv, CheckOptions& options)
+{
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        const std::string argument = argv[i];
+        const bool hasValue = i + 1 < argc;
+
+        if (argument == "--kernel" && hasValue) {
+            options.kernel = (short)std::atoi(argv[++i]);
+        } else if (argument == "--mode" && hasValue) {
+            const std::string mode = argv[++i];
+            options.kernelToTriangle = mode == "kernelToTriangle" || mode == "all";
+            options.kernelToKernel = mode == "kernelToKernel" || mode == "all";
+            if (!options.kernelToTriangle && !options.kernelToKernel) {
+                std::cerr << "unknown mode " << mode << "\n";
+                return false;
+            }
+        } else if (argument == "--compress-bvh") {
+            options.compressBVH = true;
+        } else if (argument == "--repeat" && hasValue) {
+            options.repeat = std::max(1, std::atoi(argv[++i]));
+        } else if (argument == "--report" && hasValue) {
+            options.report = argv[++i];
+        } else if (argument.compare(0, 2, "--") == 0) {
+            std::cerr << "unknown option " << argument << "\n";
+            return false;
+        } else {
+            paths.push_back(argument);
+        }
+    }
+
+    if (paths.size() != 2) {
+        return false;
+    }
+    options.pathA = paths[0];
+    options.pathB = paths[1];
+    return true;
+}
+
+
+// Mesh data outside any DG, like the point cache scans use.
+static MStatus createMeshData(const MeshArrays& arrays, MObject& meshData)
+{
+    MStatus status;
+    MFnMeshData dataFn;
+    meshData = dataFn.create(&status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    MFloatPointArray points((unsigned int)arrays.numVertices());
+    for (unsigned int i = 0; i < points.length(); ++i) {
+        points.set(i, arrays.points[i * 3 + 0], arrays.points[i * 3 + 1], arrays.points[i * 3 + 2]);
+    }
+    MIntArray counts(arrays.polygonCounts.data(), (unsigned int)arrays.polygonCounts.size());
+    MIntArray connects(arrays.polygonConnects.data(), (unsigned int)arrays.polygonConnects.size());
+
+    MFnMesh meshFn;
+    meshFn.create((int)points.length(), (int)counts.length(), points, counts, connects, meshData, &status);
+    return status;
+}
+
+
+static MBoundingBox boundingBox(const MeshArrays& arrays)
+{
+    MBoundingBox bbox;
+    for (size_t i = 0; i < arrays.numVertices(); ++i) {
+        bbox.expand(MPoint(arrays.points[i * 3 + 0], arrays.points[i * 3 + 1], arrays.points[i * 3 + 2]));
+    }
+    return bbox;
+}
+
+
+static int countTriangles(const MeshArrays& arrays)
+{
+    int numTriangles = 0;
+    for (int count : arrays.polygonCounts) {
+        numTriangles += count - 2;
+    }
+    return numTriangles;
+}
+
+
+// One check with its build and query timed apart. Kernels are built and
+// tested like intersectMeshes does, without the shared result cache.
+static MStatus runCheck(const CheckOptions& options, int collisionMode, const LoadedMesh& meshA, const LoadedMesh& meshB, CheckResult& result)
+{
+    MStatus status;
+    const MMatrix identity;
+    const int numTriangles = std::max(countTriangles(meshA.arrays), countTriangles(meshB.arrays));
+
+    Stopwatch buildTime;
+    std::shared_ptr<SpatialDivisionKernel> kernelA = createKernel(options.kernel, options.compressBVH, numTriangles);
+    if (!kernelA) {
+        std::cerr << "unknown kernel " << options.kernel << "\n";
+        return MStatus::kFailure;
+    }
+    status = kernelA->build(meshA.meshData, boundingBox(meshA.arrays), identity);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    std::shared_ptr<SpatialDivisionKernel> kernelB;
+    if (collisionMode == 1) {
+        kernelB = createKernel(options.kernel, options.compressBVH, numTriangles);
+        status = kernelB->build(meshB.meshData, boundingBox(meshB.arrays), identity);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+    }
+    result.buildSeconds = buildTime.seconds();
+
+    Stopwatch queryTime;
+    std::unordered_set<int> facesA;
+    std::unordered_set<int> facesB;
+    if (collisionMode == 0) {
+        status = intersectKernelMesh(*kernelA, meshB.meshData, identity, facesA, facesB);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+    } else {
+        K2KIntersection pairs = kernelA->intersectKernelKernel(*kernelB);
+        for (const TriangleData& triangle : pairs.first) {
+            facesA.insert(triangle.faceIndex);
+        }
+        for (const TriangleData& triangle : pairs.second) {
+            facesB.insert(triangle.faceIndex);
+        }
+    }
+    result.querySeconds = queryTime.seconds();
+
+    result.facesA.assign(facesA.begin(), facesA.end());
+    result.facesB.assign(facesB.begin(), facesB.end());
+    std::sort(result.facesA.begin(), result.facesA.end());
+    std::sort(result.facesB.begin(), result.facesB.end());
+    return MStatus::kSuccess;
+}
+
+
+static std::string jsonString(const std::string& value)
+{
+    std::string quoted = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+
+static void writeFaces(std::ostringstream& out, const std::vector<int>& faces, const char* separator)
+{
+    for (size_t i = 0; i < faces.size(); ++i) {
+        out << (i > 0 ? separator : "") << faces[i];
+    }
+}
+
+
+static std::string jsonReport(const CheckOptions& options, const LoadedMesh& meshA, const LoadedMesh& meshB, const std::vector<CheckResult>& results, double meshSeconds, double totalSeconds)
+{
+    std::ostringstream out;
+    out.precision(6);
+
+    out << "{\n";
+    for (const LoadedMesh* mesh : { &meshA, &meshB }) {
+        out << "  \"" << (mesh == &meshA ? "meshA" : "meshB") << "\": {"
+            << "\"path\": " << jsonString(mesh->path)
+            << ", \"vertices\": " << mesh->arrays.numVertices()
+            << ", \"polygons\": " << mesh->arrays.numPolygons()
+            << ", \"loadSeconds\": " << mesh->loadSeconds << "},\n";
+    }
+    out << "  \"kernel\": " << options.kernel << ",\n";
+    out << "  \"compressBVH\": " << (options.compressBVH ? "true" : "false") << ",\n";
+    out << "  \"threads\": " << omp_get_max_threads() << ",\n";
+    out << "  \"repeat\": " << options.repeat << ",\n";
+    out << "  \"meshSeconds\": " << meshSeconds << ",\n";
+    out << "  \"checks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const CheckResult& result = results[i];
+        out << (i > 0 ? ",\n" : "\n")
+            << "    {\"mode\": \"" << result.mode << "\""
+            << ", \"intersected\": " << (result.facesA.empty() && result.facesB.empty() ? "false" : "true")
+            << ", \"buildSeconds\": " << result.buildSeconds
+            << ", \"querySeconds\": " << result.querySeconds
+            << ", \"facesA\": [";
+        writeFaces(out, result.facesA, ", ");
+        out << "], \"facesB\": [";
+        writeFaces(out, result.facesB, ", ");
+        out << "]}";
+    }
+    out << (results.empty() ? "],\n" : "\n  ],\n");
+    out << "  \"totalSeconds\": " << totalSeconds << "\n";
+    out << "}\n";
+    return out.str();
+}
+
+
+// One row per check, face ids separated by spaces.
+static std::string csvReport(const CheckOptions& options, const LoadedMesh& meshA, const LoadedMesh& meshB, const std::vector<CheckResult>& results)
+{
+    auto quoted = [](const std::string& value) {
+        std::string result = "\"";
+        for (char c : value) {
+            result += c == '"' ? std::string("\"\"") : std::string(1, c);
+        }
+        return result + "\"";
+    };
+
+    std::ostringstream out;
+    out.precision(6);
+    out << "meshA,meshB,mode,kernel,loadSecondsA,loadSecondsB,buildSeconds,querySeconds,numFacesA,numFacesB,facesA,facesB\n";
+    for (const CheckResult& result : results) {
+        out << quoted(meshA.path) << "," << quoted(meshB.path) << "," << result.mode << "," << options.kernel << ","
+            << meshA.loadSeconds << "," << meshB.loadSeconds << ","
+            << result.buildSeconds << "," << result.querySeconds << ","
+            << result.facesA.size() << "," << result.facesB.size() << ",";
+        writeFaces(out, result.facesA, " ");
+        out << ",";
+        writeFaces(out, result.facesB, " ");
+        out << "\n";
+    }
+    return out.str();
+}
+
+
+static bool endsWith(const std::string& value, const char* suffix)
+{
+    const size_t length = std::strlen(suffix);
+    return value.size() >= length && value.compare(value.size() - length, length, suffix) == 0;
+}
+
+
+static int check(const CheckOptions& options)
+{
+    Stopwatch totalTime;
+
+    LoadedMesh meshA;
+    LoadedMesh meshB;
+    meshA.path = options.pathA;
+    meshB.path = options.pathB;
+    for (LoadedMesh* mesh : { &meshA, &meshB }) {
+        Stopwatch loadTime;
+        std::string error;
+        // counts in a damaged file can ask for more than there is
+        bool read;
+        try {
+            read = readMeshFile(mesh->path, mesh->arrays, error);
+        } catch (const std::bad_alloc&) {
+            read = false;
+            error = "not enough memory to read the mesh";
+        } catch (const std::length_error&) {
+            read = false;
+            error = "the mesh is too large to read";
+        }
+        if (!read) {
+            std::cerr << mesh->path << ": " << error << "\n";
+            return EXIT_ERROR;
+        }
+        mesh->loadSeconds = loadTime.seconds();
+    }
+
+    Stopwatch meshTime;
+    for (LoadedMesh* mesh : { &meshA, &meshB }) {
+        if (!createMeshData(mesh->arrays, mesh->meshData)) {
+            std::cerr << mesh->path << ": cannot create the mesh\n";
+            return EXIT_ERROR;
+        }
+    }
+    const double meshSeconds = meshTime.seconds();
+
+    std::vector<CheckResult> results;
+    for (int collisionMode = 0; collisionMode < 2; ++collisionMode) {
+        if ((collisionMode == 0 && !options.kernelToTriangle) || (collisionMode == 1 && !options.kernelToKernel)) {
+            continue;
+        }
+
+        CheckResult best;
+        for (int run = 0; run < options.repeat; ++run) {
+            CheckResult result;
+            result.mode = collisionMode == 0 ? "kernelToTriangle" : "kernelToKernel";
+            if (!runCheck(options, collisionMode, meshA, meshB, result)) {
+                return EXIT_ERROR;
+            }
+            if (run == 0 || result.buildSeconds + result.querySeconds < best.buildSeconds + best.querySeconds) {
+                best = std::move(result);
+            }
+        }
+        results.push_back(std::move(best));
+    }
+
+    const std::string report = endsWith(options.report, ".csv")
+        ? csvReport(options, meshA, meshB, results)
+        : jsonReport(options, meshA, meshB, results, meshSeconds, totalTime.seconds());
+
+    if (options.report.empty()) {
+        std::cout << report;
+    } else if (!writeFileAtomically(options.report, { { report.data(), report.size() } })) {
+        std::cerr << "cannot write report " << options.report << "\n";
+        return EXIT_ERROR;
+    }
+
+    for (const CheckResult& result : results) {
+        if (!result.facesA.empty() || !result.facesB.empty()) {
+            return EXIT_INTERSECTED;
+        }
+    }
+    return EXIT_CLEAN;
+}
+
+
+int main(int argc, char** argv)
+{
+    CheckOptions options;
+    if (!parseArguments(argc, argv, options)) {
+        printUsage();
+        return EXIT_ERROR;
+    }
+
+    MStatus status = MLibrary::initialize(true, argv[0], true);
+    if (!status) {
+        std::cerr << "cannot initialize Maya: " << status.errorString().asChar() << "\n";
+        return EXIT_ERROR;
+    }
+    selectBlockKernels();
+
+    const int exitCode = check(options);
+
+    MLibrary::cleanup(exitCode, false);
+    return exitCode;
+}
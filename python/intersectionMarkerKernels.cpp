@@ -0,0 +1,623 @@
+// _intersectionMarkerKernels, the collision kernels as a Python module for
+// tools that test many meshes outside the DG.
+//
+//     import maya.standalone
+//     maya.standalone.initialize()
+//     import _intersectionMarkerKernels as imk
+//
+//     body = imk.Kernel(points, triangles, kernel=0)
+//     pairs = body.intersect_triangles(cloth_points, cloth_triangles)
+//     faces, cloth_faces = body.intersect_kernel(imk.Kernel(cloth_points, cloth_triangles))
+//     self_pairs = body.self_intersections()
+//
+// Points are (n, 3) float32 or float64 arrays in world space, triangles (m, 3)
+// int32 or int64 vertex ids, both C contiguous; any object with the buffer
+// protocol works, NumPy is only needed for the results. Face ids are
+// triangle indices. Kernels are built over the points rounded to float32, the
+// precision Maya stores meshes in, while query triangles keep the precision
+// they are given in, so float64 inputs can give other results near contacts
+// than a test of the unrounded points. Inputs are read in place, results are int32 NumPy arrays
+// that own the memory the query wrote. The mesh data is created and the
+// kernel built with the GIL held, since both go through the Maya API, which
+// is not thread safe. Queries only touch the built kernel and release it, so
+// Python threads can test different pairs at the same time.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "BatchScan.h"
+#include "SpatialDivisionKernel.h"
+#include "utility.h"
+#include "kernel/TriangleBlocks.h"
+
+#include <maya/MBoundingBox.h>
+#include <maya/MFloatPointArray.h>
+#include <maya/MFnMesh.h>
+#include <maya/MFnMeshData.h>
+#include <maya/MIntArray.h>
+#include <maya/MMatrix.h>
+#include <maya/MObject.h>
+#include <maya/MPointArray.h>
+
+#include <omp.h>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+
+// -------------------------------------------------------------------------------------------
+// Input arrays
+
+// A C contiguous buffer of `columns` numbers per row, held for as long as it is read.
+class ArrayView
+{
+public:
+    ~ArrayView()
+    {
+        if (this->held) {
+            PyBuffer_Release(&this->view);
+        }
+    }
+
+    bool get(PyObject* object, int columns, bool floating, const char* name)
+    {
+        if (PyObject_GetBuffer(object, &this->view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+            return false;
+        }
+        this->held = true;
+
+        // skip the byte order prefix, native order is all we read
+        const char* format = this->view.format ? this->view.format : "B";
+        if (*format == '@' || *format == '=' || *format == '<') {
+            ++format;
+        }
+        this->kind = format[1] == '\0' ? format[0] : '?';
+
+        const bool supported = floating
+            ? ((this->kind == 'f' && this->view.itemsize == 4) || (this->kind == 'd' && this->view.itemsize == 8))
+            : ((this->kind == 'i' || this->kind == 'l' || this->kind == 'q') && (this->view.itemsize == 4 || this->view.itemsize == 8));
+        if (!supported) {
+            PyErr_Format(PyExc_TypeError, "%s must hold %s", name, floating ? "float32 or float64" : "int32 or int64");
+            return false;
+        }
+
+        const Py_ssize_t count = this->view.len / this->view.itemsize;
+        const bool shaped = this->view.ndim == 2
+            ? this->view.shape[1] == columns
+            : this->view.ndim == 1 && count % columns == 0;
+        if (!shaped) {
+            PyErr_Format(PyExc_ValueError, "%s must have the shape (n, %d)", name, columns);
+            return false;
+        }
+
+        this->rows = count / columns;
+        return true;
+    }
+
+    Py_ssize_t numRows() const { return this->rows; }
+
+    double real(Py_ssize_t i) const
+    {
+        return this->view.itemsize == 4 ? (double)((const float*)this->view.buf)[i] : ((const double*)this->view.buf)[i];
+    }
+
+    int64_t integer(Py_ssize_t i) const
+    {
+        return this->view.itemsize == 4 ? (int64_t)((const int32_t*)this->view.buf)[i] : ((const int64_t*)this->view.buf)[i];
+    }
+
+private:
+    Py_buffer view;
+    bool held = false;
+    char kind = '?';
+    Py_ssize_t rows = 0;
+};
+
+
+// Triangle vertex ids as int, checked against the number of points.
+static bool readTriangles(const ArrayView& triangles, Py_ssize_t numPoints, std::vector<int>& vertexIds)
+{
+    vertexIds.resize((size_t)triangles.numRows() * 3);
+    for (size_t i = 0; i < vertexIds.size(); ++i) {
+        const int64_t id = triangles.integer((Py_ssize_t)i);
+        if (id < 0 || id >= numPoints) {
+            PyErr_Format(PyExc_IndexError, "triangle vertex id %lld is out of range", (long long)id);
+            return false;
+        }
+        vertexIds[i] = (int)id;
+    }
+    return true;
+}
+
+
+static void readPoints(const ArrayView& points, MPointArray& result)
+{
+    result.setLength((unsigned int)points.numRows());
+    for (unsigned int i = 0; i < result.length(); ++i) {
+        result[i] = MPoint(points.real(i * 3 + 0), points.real(i * 3 + 1), points.real(i * 3 + 2));
+    }
+}
+
+
+static void raiseStatus(const MStatus& status, const char* what)
+{
+    PyErr_Format(PyExc_RuntimeError, "%s failed: %s", what, status.errorString().asChar());
+}
+
+
+// -------------------------------------------------------------------------------------------
+// Results
+
+// int32 values owned by a Python object that hands them out through the
+// buffer protocol, so NumPy wraps them without a copy.
+struct ResultObject
+{
+    PyObject_HEAD
+    std::vector<int32_t>* values;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+    int ndim;
+};
+
+static PyTypeObject ResultType;
+static PyObject* numpyModule = nullptr;
+
+
+static void Result_dealloc(ResultObject* self)
+{
+    delete self->values;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+static int Result_getbuffer(ResultObject* self, Py_buffer* view, int flags)
+{
+    static char format[] = "i";
+    view->obj = (PyObject*)self;
+    view->buf = self->values->data();
+    view->len = (Py_ssize_t)(self->values->size() * sizeof(int32_t));
+    view->readonly = 0;
+    view->itemsize = sizeof(int32_t);
+    view->format = (flags & PyBUF_FORMAT) ? format : nullptr;
+    view->ndim = self->ndim;
+    view->shape = (flags & PyBUF_ND) ? self->shape : nullptr;
+    view->strides = (flags & PyBUF_STRIDES) ? self->strides : nullptr;
+    view->suboffsets = nullptr;
+    view->internal = nullptr;
+    Py_INCREF(self);
+    return 0;
+}
+
+
+static PyBufferProcs ResultBufferProcs = {
+    (getbufferproc)Result_getbuffer,
+    nullptr,
+};
+
+
+// `values` as a NumPy array of `columns` columns, or one dimension for 1.
+static PyObject* toArray(std::vector<int32_t>&& values, int columns)
+{
+    if (!numpyModule) {
+        numpyModule = PyImport_ImportModule("numpy");
+        if (!numpyModule) {
+            return nullptr;
+        }
+    }
+
+    ResultObject* result = PyObject_New(ResultObject, &ResultType);
+    if (!result) {
+        return nullptr;
+    }
+    values.reserve(1);      // a valid pointer for empty results
+    result->values = new std::vector<int32_t>(std::move(values));
+    result->ndim = columns == 1 ? 1 : 2;
+    result->shape[0] = (Py_ssize_t)(result->values->size() / columns);
+    result->shape[1] = columns;
+    result->strides[0] = (Py_ssize_t)(sizeof(int32_t) * columns);
+    result->strides[1] = sizeof(int32_t);
+
+    PyObject* array = PyObject_CallMethod(numpyModule, "asarray", "O", (PyObject*)result);
+    Py_DECREF(result);
+    return array;
+}
+
+
+// Pairs as an (n, 2) array, sorted so results do not depend on the thread count.
+static PyObject* pairsToArray(std::vector<std::pair<int, int>>& pairs)
+{
+    std::sort(pairs.begin(), pairs.end());
+    std::vector<int32_t> values;
+    values.reserve(pairs.size() * 2);
+    for (const auto& pair : pairs) {
+        values.push_back(pair.first);
+        values.push_back(pair.second);
+    }
+    return toArray(std::move(values), 2);
+}
+
+
+// -------------------------------------------------------------------------------------------
+// Kernel
+
+struct KernelData
+{
+    MObject meshData;
+    MBoundingBox bbox;
+    short kernelType;
+    bool compressBVH;
+    std::shared_ptr<SpatialDivisionKernel> kernel;
+    std::shared_ptr<SpatialDivisionKernel> pairKernel;  // "Auto" resolved for a larger mesh, built on first use
+    MPointArray points;
+    std::vector<int> vertexIds;     // three per triangle
+
+    int numTriangles() const { return (int)(this->vertexIds.size() / 3); }
+
+    TriangleData triangle(int index) const
+    {
+        return TriangleData(
+            index, 0,
+            this->points[this->vertexIds[index * 3 + 0]],
+            this->points[this->vertexIds[index * 3 + 1]],
+            this->points[this->vertexIds[index * 3 + 2]]);
+    }
+
+    bool sharesVertex(int a, int b) const
+    {
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                if (this->vertexIds[a * 3 + i] == this->vertexIds[b * 3 + j]) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+};
+
+
+struct KernelObject
+{
+    PyObject_HEAD
+    KernelData* data;
+};
+
+static PyTypeObject KernelType;
+
+
+static void Kernel_dealloc(KernelObject* self)
+{
+    delete self->data;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+static PyObject* Kernel_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    static const char* keywords[] = { "points", "triangles", "kernel", "compress_bvh", nullptr };
+    PyObject* pointsObject = nullptr;
+    PyObject* trianglesObject = nullptr;
+    short kernelType = 0;
+    int compressBVH = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|hp", (char**)keywords, &pointsObject, &trianglesObject, &kernelType, &compressBVH)) {
+        return nullptr;
+    }
+
+    ArrayView points;
+    ArrayView triangles;
+    if (!points.get(pointsObject, 3, true, "points") || !triangles.get(trianglesObject, 3, false, "triangles")) {
+        return nullptr;
+    }
+    if (triangles.numRows() == 0) {
+        PyErr_SetString(PyExc_ValueError, "triangles is empty");
+        return nullptr;
+    }
+
+    std::unique_ptr<KernelData> data(new KernelData());
+    if (!readTriangles(triangles, points.numRows(), data->vertexIds)) {
+        return nullptr;
+    }
+    readPoints(points, data->points);
+
+    data->kernelType = kernelType;
+    data->compressBVH = compressBVH != 0;
+    data->kernel = createKernel(kernelType, data->compressBVH, (int)triangles.numRows());
+    if (!data->kernel) {
+        PyErr_Format(PyExc_ValueError, "unknown kernel %d", (int)kernelType);
+        return nullptr;
+    }
+
+    // mesh data outside the DG, one polygon per triangle
+    MStatus status;
+    MFnMeshData dataFn;
+    data->meshData = dataFn.create(&status);
+    if (!status) {
+        raiseStatus(status, "Creating the mesh data");
+        return nullptr;
+    }
+
+    MFloatPointArray meshPoints(data->points.length());
+    for (unsigned int i = 0; i < meshPoints.length(); ++i) {
+        meshPoints.set(i, (float)data->points[i].x, (float)data->points[i].y, (float)data->points[i].z);
+    }
+    MIntArray counts((unsigned int)triangles.numRows(), 3);
+    MIntArray connects(data->vertexIds.data(), (unsigned int)data->vertexIds.size());
+
+    MFnMesh meshFn;
+    meshFn.create((int)meshPoints.length(), (int)counts.length(), meshPoints, counts, connects, data->meshData, &status);
+    if (!status) {
+        raiseStatus(status, "Creating the mesh");
+        return nullptr;
+    }
+
+    for (unsigned int i = 0; i < data->points.length(); ++i) {
+        data->bbox.expand(data->points[i]);
+    }
+
+    // builds read the mesh through MFnMesh and MItMeshPolygon, so the GIL
+    // stays held and serializes them like the mesh creation above
+    status = data->kernel->build(data->meshData, data->bbox, MMatrix::identity);
+    if (!status) {
+        raiseStatus(status, "Building the kernel");
+        return nullptr;
+    }
+
+    KernelObject* self = (KernelObject*)type->tp_alloc(type, 0);
+    if (!self) {
+        return nullptr;
+    }
+    self->data = data.release();
+    return (PyObject*)self;
+}
+
+
+static PyObject* Kernel_intersectTriangles(KernelObject* self, PyObject* args)
+{
+    PyObject* pointsObject = nullptr;
+    PyObject* trianglesObject = nullptr;
+    if (!PyArg_ParseTuple(args, "OO", &pointsObject, &trianglesObject)) {
+        return nullptr;
+    }
+
+    ArrayView points;
+    ArrayView triangles;
+    std::vector<int> vertexIds;
+    if (!points.get(pointsObject, 3, true, "points") ||
+        !triangles.get(trianglesObject, 3, false, "triangles") ||
+        !readTriangles(triangles, points.numRows(), vertexIds)
+    ) {
+        return nullptr;
+    }
+
+    const KernelData& data = *self->data;
+    const int numTriangles = (int)triangles.numRows();
+    std::vector<std::pair<int, int>> pairs;
+
+    Py_BEGIN_ALLOW_THREADS
+    // faces of the kernel hit by each triangle
+    std::vector<std::vector<int>> found(numTriangles);
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int t = 0; t < numTriangles; ++t) {
+        MPoint vertices[3];
+        for (int i = 0; i < 3; ++i) {
+            const Py_ssize_t id = vertexIds[t * 3 + i];
+            vertices[i] = MPoint(points.real(id * 3 + 0), points.real(id * 3 + 1), points.real(id * 3 + 2));
+        }
+        TriangleData triangle(t, 0, vertices[0], vertices[1], vertices[2]);
+        for (const TriangleData& hit : data.kernel->intersectKernelTriangle(triangle)) {
+            found[t].push_back(hit.faceIndex);
+        }
+    }
+
+    // kernels that store a triangle in several cells report it once for each
+    for (int t = 0; t < numTriangles; ++t) {
+        std::sort(found[t].begin(), found[t].end());
+        found[t].erase(std::unique(found[t].begin(), found[t].end()), found[t].end());
+        for (int face : found[t]) {
+            pairs.emplace_back(face, t);
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    return pairsToArray(pairs);
+}
+
+
+// The kernel of `data` to test against a mesh of a pair with `pairTriangles`
+// triangles in the larger mesh. "Auto" decides by the larger mesh, like the
+// node does for both kernels of a pair, so a kernel built for a smaller mesh
+// may have to be built again with the type the pair resolves to; that kernel
+// is kept for later pairs. nullptr with a Python error set when the build fails.
+static SpatialDivisionKernel* pairKernel(KernelData& data, int pairTriangles)
+{
+    if (data.kernelType != 7) {
+        return data.kernel.get();
+    }
+
+    std::shared_ptr<SpatialDivisionKernel> resolved = createKernel(data.kernelType, data.compressBVH, pairTriangles);
+    if (typeid(*resolved) == typeid(*data.kernel)) {
+        return data.kernel.get();
+    }
+    if (data.pairKernel && typeid(*resolved) == typeid(*data.pairKernel)) {
+        return data.pairKernel.get();
+    }
+
+    // a build with the GIL held, see Kernel_new
+    MStatus status = resolved->build(data.meshData, data.bbox, MMatrix::identity);
+    if (!status) {
+        raiseStatus(status, "Building the kernel");
+        return nullptr;
+    }
+    data.pairKernel = resolved;
+    return data.pairKernel.get();
+}
+
+
+static PyObject* Kernel_intersectKernel(KernelObject* self, PyObject* args)
+{
+    KernelObject* other = nullptr;
+    if (!PyArg_ParseTuple(args, "O!", &KernelType, &other)) {
+        return nullptr;
+    }
+
+    const int pairTriangles = std::max(self->data->numTriangles(), other->data->numTriangles());
+    SpatialDivisionKernel* kernel = pairKernel(*self->data, pairTriangles);
+    SpatialDivisionKernel* otherKernel = kernel ? pairKernel(*other->data, pairTriangles) : nullptr;
+    if (!otherKernel) {
+        return nullptr;
+    }
+
+    // kernels only test against their own type
+    if (typeid(*kernel) != typeid(*otherKernel)) {
+        PyErr_SetString(PyExc_TypeError, "both kernels must be of the same type");
+        return nullptr;
+    }
+
+    K2KIntersection intersection;
+    Py_BEGIN_ALLOW_THREADS
+    intersection = kernel->intersectKernelKernel(*otherKernel);
+    Py_END_ALLOW_THREADS
+
+    std::vector<int32_t> faces;
+    std::vector<int32_t> otherFaces;
+    for (const TriangleData& triangle : intersection.first) {
+        faces.push_back(triangle.faceIndex);
+    }
+    for (const TriangleData& triangle : intersection.second) {
+        otherFaces.push_back(triangle.faceIndex);
+    }
+    std::sort(faces.begin(), faces.end());
+    faces.erase(std::unique(faces.begin(), faces.end()), faces.end());
+    std::sort(otherFaces.begin(), otherFaces.end());
+    otherFaces.erase(std::unique(otherFaces.begin(), otherFaces.end()), otherFaces.end());
+
+    PyObject* facesArray = toArray(std::move(faces), 1);
+    PyObject* otherFacesArray = facesArray ? toArray(std::move(otherFaces), 1) : nullptr;
+    if (!otherFacesArray) {
+        Py_XDECREF(facesArray);
+        return nullptr;
+    }
+    return Py_BuildValue("(NN)", facesArray, otherFacesArray);
+}
+
+
+// Every triangle of the mesh against its own kernel. Neighbours that share a
+// vertex always touch, so such pairs are not reported.
+static PyObject* Kernel_selfIntersections(KernelObject* self, PyObject*)
+{
+    const KernelData& data = *self->data;
+    const int numTriangles = (int)(data.vertexIds.size() / 3);
+    std::vector<std::pair<int, int>> pairs;
+
+    Py_BEGIN_ALLOW_THREADS
+    std::vector<std::vector<int>> found(numTriangles);
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int t = 0; t < numTriangles; ++t) {
+        for (const TriangleData& hit : data.kernel->intersectKernelTriangle(data.triangle(t))) {
+            // each pair is found from both sides, keep one
+            if (hit.faceIndex > t && !data.sharesVertex(t, hit.faceIndex)) {
+                found[t].push_back(hit.faceIndex);
+            }
+        }
+    }
+
+    for (int t = 0; t < numTriangles; ++t) {
+        std::sort(found[t].begin(), found[t].end());
+        found[t].erase(std::unique(found[t].begin(), found[t].end()), found[t].end());
+        for (int face : found[t]) {
+            pairs.emplace_back(t, face);
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    return pairsToArray(pairs);
+}
+
+
+static PyObject* Kernel_numTriangles(KernelObject* self, void*)
+{
+    return PyLong_FromLong(self->data->numTriangles());
+}
+
+
+static PyMethodDef KernelMethods[] = {
+    { "intersect_triangles", (PyCFunction)Kernel_intersectTriangles, METH_VARARGS,
+      "intersect_triangles(points, triangles) -> (n, 2) int32 array of (kernel face, triangle) pairs" },
+    { "intersect_kernel", (PyCFunction)Kernel_intersectKernel, METH_VARARGS,
+      "intersect_kernel(other) -> (faces, other_faces), the intersecting faces of both kernels" },
+    { "self_intersections", (PyCFunction)Kernel_selfIntersections, METH_NOARGS,
+      "self_intersections() -> (n, 2) int32 array of intersecting face pairs that share no vertex" },
+    { nullptr, nullptr, 0, nullptr },
+};
+
+
+static PyGetSetDef KernelGetSet[] = {
+    { "num_triangles", (getter)Kernel_numTriangles, nullptr, "number of triangles the kernel was built over", nullptr },
+    { nullptr, nullptr, nullptr, nullptr, nullptr },
+};
+
+
+// -------------------------------------------------------------------------------------------
+// Module
+
+static PyModuleDef ModuleDefinition = {
+    PyModuleDef_HEAD_INIT,
+    "_intersectionMarkerKernels",
+    "The intersection marker collision kernels, for meshes given as arrays.",
+    -1,
+    nullptr,
+};
+
+
+PyMODINIT_FUNC PyInit__intersectionMarkerKernels()
+{
+    // this module has its own copy of the block kernels, pick them like the plug-in does
+    selectBlockKernels();
+
+    ResultType.tp_name = "_intersectionMarkerKernels.Result";
+    ResultType.tp_basicsize = sizeof(ResultObject);
+    ResultType.tp_flags = Py_TPFLAGS_DEFAULT;
+    ResultType.tp_dealloc = (destructor)Result_dealloc;
+    ResultType.tp_as_buffer = &ResultBufferProcs;
+    ResultType.tp_doc = "Memory of a query result, wrapped by NumPy.";
+
+    KernelType.tp_name = "_intersectionMarkerKernels.Kernel";
+    KernelType.tp_basicsize = sizeof(KernelObject);
+    KernelType.tp_flags = Py_TPFLAGS_DEFAULT;
+    KernelType.tp_new = Kernel_new;
+    KernelType.tp_dealloc = (destructor)Kernel_dealloc;
+    KernelType.tp_methods = KernelMethods;
+    KernelType.tp_getset = KernelGetSet;
+    KernelType.tp_doc =
+        "Kernel(points, triangles, kernel=0, compress_bvh=False)\n\n"
+        "A collision kernel built over a triangle mesh. `kernel` takes the values\n"
+        "of the intersectionMarker node's kernel attribute. With kernel=7 (Auto),\n"
+        "intersect_kernel picks the type by the larger mesh of the pair, like the\n"
+        "node; a kernel built for the smaller mesh is built again once with that\n"
+        "type. The mesh is built from the points rounded to float32, while query\n"
+        "triangles keep float64 points, so results near contacts can differ from\n"
+        "a test of the unrounded points.";
+
+    if (PyType_Ready(&ResultType) < 0 || PyType_Ready(&KernelType) < 0) {
+        return nullptr;
+    }
+
+    PyObject* module = PyModule_Create(&ModuleDefinition);
+    if (!module) {
+        return nullptr;
+    }
+
+    Py_INCREF(&KernelType);
+    if (PyModule_AddObject(module, "Kernel", (PyObject*)&KernelType) < 0) {
+        Py_DECREF(&KernelType);
+        Py_DECREF(module);
+        return nullptr;
+    }
+
+    return module;
+}
@@ -0,0 +1,294 @@
+// intersectionMarkerReplay, runs the kernel work of a marker node from an
+// input capture (intersectionMarker -captureInputs), frame by frame, for
+// profiling a slow shot outside the artist's session and for tracking
+// regressions between builds. Runs as a Maya library application.
+//
+//     intersectionMarkerReplay [options] capture.imcap
+//
+//     --kernel N           replay with another kernel than the captured one
+//     --collision-mode N   replay with another collision mode, 0 or 1
+//     --repeat N           replay the capture N times, report the fastest time of each frame
+//     --report PATH        write the JSON report to a file instead of stdout
+//
+// Each frame goes through intersectFrame, the pipeline the node's compute runs:
+// the skip apart test, then the incremental update or a full kernel build and
+// query. The vertex checksums and result caches the node consults between
+// the two are left out, so every frame that is not skipped costs the kernel
+// work.
+
+#include "InputCapture.h"
+#include "BatchScan.h"
+#include "IncrementalIntersection.h"
+#include "MappedFile.h"
+#include "MotionBound.h"
+#include "kernel/TriangleBlocks.h"
+
+#include <maya/MLibrary.h>
+#include <maya/MObject.h>
+
+#include <omp.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+
+const int EXIT_REPLAYED = 0;
+const int EXIT_ERROR = 2;
+
+
+struct ReplayOptions
+{
+    std::string capturePath;
+    int kernel = -1;            // -1 keeps the captured settings
+    int collisionMode = -1;
+    int repeat = 1;
+    std::string report;
+};
+
+
+struct ReplayFrame
+{
+    double time = 0.0;
+    bool skipped = false;
+    double seconds = 0.0;       // kernel work of the frame, the fastest of all passes
+    std::vector<int> facesA;
+    std::vector<int> facesB;
+};
+
+
+class Stopwatch
+{
+public:
+    Stopwatch() : start(std::chrono::steady_clock::now()) {}
+
+    double seconds() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - this->start).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+
+static void printUsage()
+{
+    std::cerr <<
+        "usage: intersectionMarkerReplay [options] capture.imcap\n"
+        "  --kernel N           replay with another kernel than the captured one\n"
+        "  --collision-mode N   replay with another collision mode, 0 or 1\n"
+        "  --repeat N           replay the capture N times, report the fastest time of each frame\n"
+        "  --report PATH        write the JSON report to a file instead of stdout\n";
+}
+
+
+static bool parseArguments(int argc, char** argv, ReplayOptions& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        const std::string argument = argv[i];
+        const bool hasValue = i + 1 < argc;
+
+        if (argument == "--kernel" && hasValue) {
+            options.kernel = std::atoi(argv[++i]);
+        } else if (argument == "--collision-mode" && hasValue) {
+            options.collisionMode = std::atoi(argv[++i]);
+        } else if (argument == "--repeat" && hasValue) {
+            options.repeat = std::max(1, std::atoi(argv[++i]));
+        } else if (argument == "--report" && hasValue) {
+            options.report = argv[++i];
+        } else if (argument.compare(0, 2, "--") == 0 || !options.capturePath.empty()) {
+            return false;
+        } else {
+            options.capturePath = argument;
+        }
+    }
+    return !options.capturePath.empty();
+}
+
+
+// The marker node's state that carries over from frame to frame.
+struct ReplayState
+{
+    MObject meshData[2];
+    MotionBound motionBound;
+    IncrementalIntersection incremental;
+};
+
+
+static MStatus replayFrame(const CaptureSettings& settings, const CapturedFrame& frame, ReplayState& state, ReplayFrame& result)
+{
+    FrameSettings frameSettings;
+    frameSettings.scan = settings.scan;
+    frameSettings.skipApartFrames = settings.skipApartFrames;
+    frameSettings.incremental = settings.incremental;
+    frameSettings.sharedResults = false;
+
+    std::unordered_set<int> facesA;
+    std::unordered_set<int> facesB;
+    result.time = frame.time;
+    MStatus status = intersectFrame(
+        FrameMesh(state.meshData[0], frame.meshes[0].offsetMatrix),
+        FrameMesh(state.meshData[1], frame.meshes[1].offsetMatrix),
+        frameSettings, frame.time, &state.motionBound, &state.incremental, facesA, facesB, &result.skipped);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    result.facesA.assign(facesA.begin(), facesA.end());
+    result.facesB.assign(facesB.begin(), facesB.end());
+    std::sort(result.facesA.begin(), result.facesA.end());
+    std::sort(result.facesB.begin(), result.facesB.end());
+    return MStatus::kSuccess;
+}
+
+
+static void writeFaces(std::ostringstream& out, const std::vector<int>& faces)
+{
+    out << "[";
+    for (size_t i = 0; i < faces.size(); ++i) {
+        out << (i > 0 ? ", " : "") << faces[i];
+    }
+    out << "]";
+}
+
+
+static std::string jsonReport(const ReplayOptions& options, const CaptureSettings& settings, const std::vector<ReplayFrame>& frames, double meshSeconds)
+{
+    double totalSeconds = 0.0;
+    double maxSeconds = 0.0;
+    size_t intersectedFrames = 0;
+    size_t skippedFrames = 0;
+    for (const ReplayFrame& frame : frames) {
+        totalSeconds += frame.seconds;
+        maxSeconds = std::max(maxSeconds, frame.seconds);
+        intersectedFrames += (!frame.facesA.empty() || !frame.facesB.empty()) ? 1 : 0;
+        skippedFrames += frame.skipped ? 1 : 0;
+    }
+
+    std::string path;
+    for (char c : options.capturePath) {
+        path += (c == '"' || c == '\\') ? std::string("\\") + c : std::string(1, c);
+    }
+
+    std::ostringstream out;
+    out.precision(6);
+    out << "{\n";
+    out << "  \"capture\": \"" << path << "\",\n";
+    out << "  \"kernel\": " << settings.scan.kernel << ",\n";
+    out << "  \"collisionMode\": " << settings.scan.collisionMode << ",\n";
+    out << "  \"compressBVH\": " << (settings.scan.compressBVH ? "true" : "false") << ",\n";
+    out << "  \"incremental\": " << (settings.incremental ? "true" : "false") << ",\n";
+    out << "  \"skipApartFrames\": " << (settings.skipApartFrames ? "true" : "false") << ",\n";
+    out << "  \"threads\": " << omp_get_max_threads() << ",\n";
+    out << "  \"repeat\": " << options.repeat << ",\n";
+    out << "  \"replayedFrames\": " << frames.size() << ",\n";
+    out << "  \"intersectedFrames\": " << intersectedFrames << ",\n";
+    out << "  \"skippedFrames\": " << skippedFrames << ",\n";
+    out << "  \"totalSeconds\": " << totalSeconds << ",\n";
+    out << "  \"meanSeconds\": " << (frames.empty() ? 0.0 : totalSeconds / frames.size()) << ",\n";
+    out << "  \"maxSeconds\": " << maxSeconds << ",\n";
+    out << "  \"meshSeconds\": " << meshSeconds << ",\n";
+    out << "  \"frames\": [";
+    for (size_t i = 0; i < frames.size(); ++i) {
+        const ReplayFrame& frame = frames[i];
+        out << (i > 0 ? ",\n" : "\n")
+            << "    {\"time\": " << frame.time
+            << ", \"skipped\": " << (frame.skipped ? "true" : "false")
+            << ", \"seconds\": " << frame.seconds
+            << ", \"facesA\": ";
+        writeFaces(out, frame.facesA);
+        out << ", \"facesB\": ";
+        writeFaces(out, frame.facesB);
+        out << "}";
+    }
+    out << (frames.empty() ? "]\n" : "\n  ]\n");
+    out << "}\n";
+    return out.str();
+}
+
+
+static int replay(const ReplayOptions& options)
+{
+    std::shared_ptr<InputCapture> capture = InputCapture::open(options.capturePath);
+    if (!capture) {
+        std::cerr << "cannot read input capture " << options.capturePath << "\n";
+        return EXIT_ERROR;
+    }
+
+    CaptureSettings settings = capture->settings();
+    if (options.kernel >= 0) {
+        settings.scan.kernel = (short)options.kernel;
+    }
+    if (options.collisionMode >= 0) {
+        settings.scan.collisionMode = options.collisionMode;
+    }
+
+    std::vector<ReplayFrame> frames(capture->numFrames());
+    double meshSeconds = 0.0;
+    for (int pass = 0; pass < options.repeat; ++pass) {
+        // every pass starts like a node that has not evaluated yet
+        ReplayState state;
+
+        for (size_t i = 0; i < capture->numFrames(); ++i) {
+            const CapturedFrame& frame = capture->frame(i);
+
+            // moving the captured points into the mesh data is not part of the node's work
+            Stopwatch meshTime;
+            for (int side = 0; side < 2; ++side) {
+                MStatus status = (i == 0 || frame.meshes[side].topologyChanged)
+                    ? InputCapture::createMesh(frame.meshes[side], state.meshData[side])
+                    : InputCapture::setPoints(frame.meshes[side], state.meshData[side]);
+                if (!status) {
+                    std::cerr << "cannot create the meshes of frame " << frame.time << "\n";
+                    return EXIT_ERROR;
+                }
+            }
+            meshSeconds += pass == 0 ? meshTime.seconds() : 0.0;
+
+            ReplayFrame result;
+            Stopwatch frameTime;
+            if (!replayFrame(settings, frame, state, result)) {
+                return EXIT_ERROR;
+            }
+            result.seconds = frameTime.seconds();
+
+            if (pass == 0 || result.seconds < frames[i].seconds) {
+                frames[i] = std::move(result);
+            }
+        }
+    }
+
+    const std::string report = jsonReport(options, settings, frames, meshSeconds);
+    if (options.report.empty()) {
+        std::cout << report;
+    } else if (!writeFileAtomically(options.report, { { report.data(), report.size() } })) {
+        std::cerr << "cannot write report " << options.report << "\n";
+        return EXIT_ERROR;
+    }
+    return EXIT_REPLAYED;
+}
+
+
+int main(int argc, char** argv)
+{
+    ReplayOptions options;
+    if (!parseArguments(argc, argv, options)) {
+        printUsage();
+        return EXIT_ERROR;
+    }
+
+    MStatus status = MLibrary::initialize(true, argv[0], true);
+    if (!status) {
+        std::cerr << "cannot initialize Maya: " << status.errorString().asChar() << "\n";
+        return EXIT_ERROR;
+    }
+    selectBlockKernels();
+
+    const int exitCode = replay(options);
+
+    MLibrary::cleanup(exitCode, false);
+    return exitCode;
+}
@@ -0,0 +1,169 @@
+# # -*- coding: utf-8 -*-
+"""Scan a frame range with several mayapy processes on this machine.
+
+DG evaluation of a rig is mostly serial, so one process cannot keep a many
+core host busy. The range is split into contiguous shards, each shard opens
+the scene in its own mayapy and runs `intersectionMarker -scan`, writing a
+per frame result file, and the files are merged into one JSON report.
+
+    mayapy intersectionMarkerBatch.py scene.ma body cloth 1 2000 report.json
+
+or from Python running in Maya:
+
+    import intersectionMarkerBatch
+    intersectionMarkerBatch.scan_frame_range("scene.ma", "body", "cloth", 1, 2000, "report.json")
+"""
+import argparse
+import multiprocessing
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+if sys.version_info > (3, 0):
+    from typing import TYPE_CHECKING
+    if TYPE_CHECKING:
+        from typing import (
+            Optional,  # noqa: F401
+            List,  # noqa: F401
+            Tuple,  # noqa: F401
+        )
+
+
+PLUGIN_NAME = "MayaIntersectionMarker"
+
+
+##############################################################################
+def split_frame_range(start, end, shards):
+    # type: (int, int, int) -> List[Tuple[int, int]]
+    """Split the inclusive range into at most `shards` contiguous ranges."""
+
+    num_frames = end - start + 1
+    shards = max(1, min(shards, num_frames))
+    size, rest = divmod(num_frames, shards)
+
+    ranges = []
+    first = start
+    for i in range(shards):
+        last = first + size - 1 + (1 if i < rest else 0)
+        ranges.append((first, last))
+        first = last + 1
+
+    return ranges
+
+
+def find_mayapy():
+    # type: () -> str
+    """mayapy of the running Maya, or this interpreter when it is mayapy."""
+
+    executable = os.path.basename(sys.executable).lower()
+    if executable.startswith("mayapy"):
+        return sys.executable
+
+    name = "mayapy.exe" if sys.platform == "win32" else "mayapy"
+    return os.path.join(os.path.dirname(sys.executable), name)
+
+
+def scan_frame_range(
+        scene,
+        mesh_a,
+        mesh_b,
+        start,
+        end,
+        report,
+        shards=None,
+        kernel=0,
+        collision_mode=0,
+        mayapy=None
+):
+    # type: (str, str, str, int, int, str, Optional[int], int, int, Optional[str]) -> None
+    """Scan the frame range in parallel shards and write the merged report."""
+
+    cores = multiprocessing.cpu_count()
+    ranges = split_frame_range(int(start), int(end), shards or cores)
+    work_dir = tempfile.mkdtemp(prefix="intersectionMarker_")
+
+    # the cores are shared out between the shards, so their OpenMP loops do
+    # not oversubscribe the machine
+    env = dict(os.environ)
+    env["OMP_NUM_THREADS"] = str(max(1, cores // len(ranges)))
+
+    try:
+        processes = []
+        result_files = []
+        for first, last in ranges:
+            result_file = os.path.join(work_dir, "{}_{}.imres".format(first, last))
+            result_files.append(result_file)
+            processes.append(subprocess.Popen([
+                mayapy or find_mayapy(), os.path.abspath(__file__), "--shard",
+                scene, mesh_a, mesh_b, str(first), str(last), result_file,
+                "--kernel", str(kernel),
+                "--collision-mode", str(collision_mode),
+            ], env=env))
+
+        failed = [r for r, p in zip(ranges, processes) if p.wait() != 0]
+        if failed:
+            raise RuntimeError("IntersectionMarker: shards failed: {}".format(failed))
+
+        from maya import cmds
+        cmds.loadPlugin(PLUGIN_NAME, quiet=True)
+        cmds.intersectionMarker(mergeResults=report, resultFile=result_files)
+
+    finally:
+        shutil.rmtree(work_dir, ignore_errors=True)
+
+
+def run_shard(scene, mesh_a, mesh_b, start, end, result_file, kernel, collision_mode):
+    # type: (str, str, str, int, int, str, int, int) -> None
+    """Scan one shard in this process."""
+
+    from maya import cmds
+    cmds.loadPlugin(PLUGIN_NAME, quiet=True)
+    cmds.file(scene, open=True, force=True)
+    cmds.intersectionMarker(
+        mesh_a,
+        mesh_b,
+        scan=True,
+        startFrame=start,
+        endFrame=end,
+        resultFile=result_file,
+        kernel=kernel,
+        collisionMode=collision_mode
+    )
+
+
+def main(argv):
+    # type: (List[str]) -> int
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--shard", action="store_true", help=argparse.SUPPRESS)
+    parser.add_argument("scene")
+    parser.add_argument("mesh_a")
+    parser.add_argument("mesh_b")
+    parser.add_argument("start", type=int)
+    parser.add_argument("end", type=int)
+    parser.add_argument("output", help="JSON report, or the result file of a shard")
+    parser.add_argument("--shards", type=int, default=None)
+    parser.add_argument("--kernel", type=int, default=0)
+    parser.add_argument("--collision-mode", type=int, default=0)
+    args = parser.parse_args(argv)
+
+    import maya.standalone
+    maya.standalone.initialize()
+    try:
+        if args.shard:
+            run_shard(
+                args.scene, args.mesh_a, args.mesh_b, args.start, args.end,
+                args.output, args.kernel, args.collision_mode)
+        else:
+            scan_frame_range(
+                args.scene, args.mesh_a, args.mesh_b, args.start, args.end,
+                args.output, args.shards, args.kernel, args.collision_mode)
+    finally:
+        maya.standalone.uninitialize()
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,378 @@
+#include "BatchScan.h"
+#include "IncrementalIntersection.h"
+#include "MotionBound.h"
+#include "PointCache.h"
+#include "SharedResultCache.h"
+
+#include "kernel/KDTreeKernel.h"
+#include "kernel/EmbreeKernel.h"
+#include "kernel/OctreeKernel.h"
+#include "kernel/ProxyKernel.h"
+#include "kernel/OBBTreeKernel.h"
+#include "kernel/ClusterKernel.h"
+#include "kernel/BruteForceKernel.h"
+#include "kernel/EmbreeSceneKernel.h"
+#include "kernel/TriangleBlocks.h"
+
+#include <maya/MFnMesh.h>
+#include <maya/MGlobal.h>
+#include <maya/MIntArray.h>
+#include <maya/MPointArray.h>
+#include <maya/MBoundingBox.h>
+
+#include <omp.h>
+#include <algorithm>
+
+
+const int AUTO_BRUTE_FORCE_MAX_TRIANGLES = 2048;   // "Auto" kernel: brute force up to this size, BVH above
+const size_t POINT_CACHE_PREFETCH_FRAMES = 4;      // frames read ahead of the one being tested
+
+
+std::shared_ptr<SpatialDivisionKernel> createKernel(short kernelType, bool quantizedNodes, int numTriangles)
+{
+    switch (kernelType) {
+    case 0: // Embree
+        return std::make_unique<EmbreeKernel>(quantizedNodes);
+    case 1: // Octree
+        return std::make_unique<OctreeKernel>();
+    case 2: // KDTree
+        return std::make_unique<KDTreeKernel>();
+    case 3: // Decimated proxy + exact refinement
+        return std::make_unique<ProxyKernel>();
+    case 4: // OBB tree, object space
+        return std::make_unique<OBBTreeKernel>();
+    case 5: // Triangle clusters, refit per frame
+        return std::make_unique<ClusterKernel>();
+    case 6: // All pairs, no tree
+        return std::make_unique<BruteForceKernel>();
+    case 7: // Auto
+        if (numTriangles <= AUTO_BRUTE_FORCE_MAX_TRIANGLES) {
+            return std::make_unique<BruteForceKernel>();
+        }
+        return std::make_unique<EmbreeKernel>(quantizedNodes);
+    case 8: // Native Embree scene, edge segment rays
+        return std::make_unique<EmbreeSceneKernel>();
+    default:
+        return nullptr;
+    }
+}
+
+
+bool kernelUpdatesPoints(short kernelType, int numTriangles)
+{
+    switch (kernelType) {
+    case 5: // Cluster
+    case 6: // BruteForce
+        return true;
+    case 7: // Auto
+        return numTriangles <= AUTO_BRUTE_FORCE_MAX_TRIANGLES;
+    default:
+        return false;
+    }
+}
+
+
+const MBoundingBox& FrameMesh::worldBox() const
+{
+    if (!this->hasBox) {
+        this->box = pointsBoundingBox(this->mesh, this->offset);
+        this->hasBox = true;
+    }
+    return this->box;
+}
+
+
+bool skipFrame(const FrameSettings& settings, MotionBound* motionBound, double time, const FrameMesh& meshA, const FrameMesh& meshB)
+{
+    if (!settings.skipApartFrames) {
+        if (motionBound) {
+            motionBound->reset();
+        }
+        return false;
+    }
+    if (motionBound) {
+        return motionBound->canSkip(time, meshA.worldBox(), meshB.worldBox());
+    }
+    return !meshA.worldBox().intersects(meshB.worldBox());
+}
+
+
+MStatus intersectKernelMesh(
+    const SpatialDivisionKernel& kernel,
+    const MObject& meshB,
+    const MMatrix& offsetB,
+    std::unordered_set<int>& facesA,
+    std::unordered_set<int>& facesB
+) {
+    MStatus status;
+    MFnMesh meshBFn(meshB, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    MIntArray triangleCounts;   // number of triangles in each face
+    MIntArray triangleVertices; // The triangle vertex Ids for each triangle
+    MPointArray points;
+    status = meshBFn.getTriangles(triangleCounts, triangleVertices);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    status = meshBFn.getPoints(points, MSpace::kObject);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    transformPoints(points, offsetB);
+
+    // offset of each polygon's first triangle
+    const int numPolygons = (int)triangleCounts.length();
+    std::vector<int> polygonTriangleOffsets(numPolygons + 1, 0);
+    for (int polygonIndex = 0; polygonIndex < numPolygons; ++polygonIndex) {
+        polygonTriangleOffsets[polygonIndex + 1] = polygonTriangleOffsets[polygonIndex] + triangleCounts[polygonIndex];
+    }
+
+    // faces of A hit by each polygon of B
+    std::vector<std::vector<int>> found(numPolygons);
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int polygonIndex = 0; polygonIndex < numPolygons; ++polygonIndex) {
+        for (int t = polygonTriangleOffsets[polygonIndex]; t < polygonTriangleOffsets[polygonIndex + 1]; ++t) {
+            TriangleData triangle(
+                polygonIndex,
+                t - polygonTriangleOffsets[polygonIndex],
+                points[triangleVertices[t * 3 + 0]],
+                points[triangleVertices[t * 3 + 1]],
+                points[triangleVertices[t * 3 + 2]]);
+
+            for (const TriangleData& hit : kernel.intersectKernelTriangle(triangle)) {
+                found[polygonIndex].push_back(hit.faceIndex);
+            }
+        }
+    }
+
+    for (int polygonIndex = 0; polygonIndex < numPolygons; ++polygonIndex) {
+        if (!found[polygonIndex].empty()) {
+            facesA.insert(found[polygonIndex].begin(), found[polygonIndex].end());
+            facesB.insert(polygonIndex);
+        }
+    }
+
+    return MStatus::kSuccess;
+}
+
+
+static int countTriangles(const MObject& meshObject)
+{
+    MFnMesh meshFn(meshObject);
+    return meshFn.numFaceVertices() - 2 * meshFn.numPolygons();
+}
+
+
+bool runsIncremental(const FrameSettings& settings, const MObject& meshA, const MObject& meshB)
+{
+    // the pairs come from triangle queries, kernel against kernel always runs in full
+    return settings.incremental &&
+        settings.scan.collisionMode == 0 &&
+        kernelUpdatesPoints(settings.scan.kernel, std::max(countTriangles(meshA), countTriangles(meshB)));
+}
+
+
+MBoundingBox pointsBoundingBox(const MObject& meshObject, const MMatrix& offsetMatrix)
+{
+    // straight from the float points, no MPointArray copy: the apart test
+    // reads every frame's box before anything else is done with the mesh
+    MFnMesh meshFn(meshObject);
+    const float* points = meshFn.getRawPoints(nullptr);
+    const int numVertices = meshFn.numVertices();
+
+    MBoundingBox bbox;
+    for (int i = 0; i < numVertices; ++i) {
+        const double x = points[i * 3 + 0];
+        const double y = points[i * 3 + 1];
+        const double z = points[i * 3 + 2];
+        bbox.expand(MPoint(
+            x * offsetMatrix[0][0] + y * offsetMatrix[1][0] + z * offsetMatrix[2][0] + offsetMatrix[3][0],
+            x * offsetMatrix[0][1] + y * offsetMatrix[1][1] + z * offsetMatrix[2][1] + offsetMatrix[3][1],
+            x * offsetMatrix[0][2] + y * offsetMatrix[1][2] + z * offsetMatrix[2][2] + offsetMatrix[3][2]));
+    }
+    return bbox;
+}
+
+
+static MStatus computeIntersections(
+    const FrameMesh& meshA,
+    const FrameMesh& meshB,
+    const ScanSettings& settings,
+    std::unordered_set<int>& facesA,
+    std::unordered_set<int>& facesB
+) {
+    MStatus status;
+    facesA.clear();
+    facesB.clear();
+
+    // Both kernels must be of the same type, so the larger mesh decides
+    // what "Auto" picks
+    const int numTriangles = std::max(countTriangles(meshA.mesh), countTriangles(meshB.mesh));
+
+    std::shared_ptr<SpatialDivisionKernel> kernelA = createKernel(settings.kernel, settings.compressBVH, numTriangles);
+    if (!kernelA) {
+        MGlobal::displayError("Invalid kernel");
+        return MStatus::kFailure;
+    }
+    status = kernelA->build(meshA.mesh, meshA.worldBox(), meshA.offset);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    if (settings.collisionMode == 0) {
+        return intersectKernelMesh(*kernelA, meshB.mesh, meshB.offset, facesA, facesB);
+    }
+
+    if (settings.collisionMode != 1) {
+        MGlobal::displayError("Invalid collision mode");
+        return MStatus::kFailure;
+    }
+
+    std::shared_ptr<SpatialDivisionKernel> kernelB = createKernel(settings.kernel, settings.compressBVH, numTriangles);
+    status = kernelB->build(meshB.mesh, meshB.worldBox(), meshB.offset);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    K2KIntersection pairs = kernelA->intersectKernelKernel(*kernelB);
+    for (const TriangleData& triangle : pairs.first) {
+        facesA.insert(triangle.faceIndex);
+    }
+    for (const TriangleData& triangle : pairs.second) {
+        facesB.insert(triangle.faceIndex);
+    }
+
+    return MStatus::kSuccess;
+}
+
+
+MStatus intersectMeshes(
+    const FrameMesh& meshA,
+    const FrameMesh& meshB,
+    const ScanSettings& settings,
+    std::unordered_set<int>& facesA,
+    std::unordered_set<int>& facesB
+) {
+    SharedResultCache* sharedCache = SharedResultCache::instance();
+    if (!sharedCache) {
+        return computeIntersections(meshA, meshB, settings, facesA, facesB);
+    }
+
+    // shards scanning overlapping ranges of the same shot share their frames
+    const uint64_t key = sharedResultKey(meshA.mesh, meshA.offset, meshB.mesh, meshB.offset, settings);
+    if (sharedCache->find(key, facesA, facesB)) {
+        return MStatus::kSuccess;
+    }
+
+    MStatus status = computeIntersections(meshA, meshB, settings, facesA, facesB);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    sharedCache->insert(key, facesA, facesB);
+    return MStatus::kSuccess;
+}
+
+
+MStatus intersectFrame(
+    const FrameMesh& meshA,
+    const FrameMesh& meshB,
+    const FrameSettings& settings,
+    double time,
+    MotionBound* motionBound,
+    IncrementalIntersection* incremental,
+    std::unordered_set<int>& facesA,
+    std::unordered_set<int>& facesB,
+    bool* skipped
+) {
+    MStatus status;
+    facesA.clear();
+    facesB.clear();
+
+    const bool apart = motionBound && skipFrame(settings, motionBound, time, meshA, meshB);
+    if (skipped) {
+        *skipped = apart;
+    }
+    if (apart) {
+        return MStatus::kSuccess;
+    }
+
+    if (incremental && runsIncremental(settings, meshA.mesh, meshB.mesh)) {
+        if (!incremental->update(meshA.mesh, meshA.offset, meshB.mesh, meshB.offset, settings.scan)) {
+            status = incremental->rebuild(meshA.mesh, meshA.offset, meshB.mesh, meshB.offset, settings.scan);
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+        }
+        incremental->getIntersectedFaces(facesA, facesB);
+        return MStatus::kSuccess;
+    }
+    if (incremental) {
+        incremental->clear();
+    }
+
+    if (!settings.sharedResults) {
+        return computeIntersections(meshA, meshB, settings.scan, facesA, facesB);
+    }
+    return intersectMeshes(meshA, meshB, settings.scan, facesA, facesB);
+}
+
+
+MStatus scanPointCaches(
+    const PointCache& cacheA,
+    const PointCache& cacheB,
+    const ScanSettings& settings,
+    std::vector<FrameResult>& results
+) {
+    MStatus status;
+    results.clear();
+
+    const size_t numFrames = cacheA.numFrames();
+    if (cacheB.numFrames() != numFrames) {
+        MGlobal::displayError("Point caches cover different frame ranges");
+        return MStatus::kFailure;
+    }
+    for (size_t frame = 0; frame < numFrames; ++frame) {
+        if (cacheA.time(frame) != cacheB.time(frame)) {
+            MGlobal::displayError("Point caches cover different frame ranges");
+            return MStatus::kFailure;
+        }
+    }
+    if (numFrames == 0) {
+        return MStatus::kSuccess;
+    }
+
+    MObject meshA;
+    MObject meshB;
+    status = cacheA.createMesh(meshA);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    status = cacheB.createMesh(meshB);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    for (size_t frame = 0; frame < POINT_CACHE_PREFETCH_FRAMES; ++frame) {
+        cacheA.prefetch(frame);
+        cacheB.prefetch(frame);
+    }
+
+    const MMatrix identity;
+    MotionBound motionBound;
+    FrameSettings frameSettings;
+    frameSettings.scan = settings;
+    std::unordered_set<int> facesA;
+    std::unordered_set<int> facesB;
+    results.reserve(numFrames);
+    for (size_t frame = 0; frame < numFrames; ++frame) {
+        // the disk reads the frames ahead while this one is tested
+        cacheA.prefetch(frame + POINT_CACHE_PREFETCH_FRAMES);
+        cacheB.prefetch(frame + POINT_CACHE_PREFETCH_FRAMES);
+
+        status = cacheA.setPoints(meshA, frame);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+        status = cacheB.setPoints(meshB, frame);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+
+        status = intersectFrame(
+            FrameMesh(meshA, identity), FrameMesh(meshB, identity),
+            frameSettings, cacheA.time(frame), &motionBound, nullptr, facesA, facesB);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+
+        FrameResult result;
+        result.time = cacheA.time(frame);
+        result.facesA.assign(facesA.begin(), facesA.end());
+        result.facesB.assign(facesB.begin(), facesB.end());
+        std::sort(result.facesA.begin(), result.facesA.end());
+        std::sort(result.facesB.begin(), result.facesB.end());
+        results.push_back(std::move(result));
+    }
+
+    return MStatus::kSuccess;
+}
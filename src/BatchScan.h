@@ -0,0 +1,133 @@
+#pragma once
+
+#include "SpatialDivisionKernel.h"
+
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+#include <maya/MBoundingBox.h>
+#include <maya/MObject.h>
+#include <maya/MMatrix.h>
+#include <maya/MStatus.h>
+
+class IncrementalIntersection;
+class MotionBound;
+class PointCache;
+
+
+// The marker node settings that decide how a pair of meshes is tested, for
+// passes that run without a node.
+struct ScanSettings
+{
+    short kernel = 0;           // same values as the node's kernel enum
+    int collisionMode = 0;      // 0: kernel A against the triangles of B, 1: kernel against kernel
+    bool compressBVH = false;
+};
+
+
+// The marker node's per frame switches on top of its kernel settings.
+struct FrameSettings
+{
+    ScanSettings scan;
+    bool skipApartFrames = false;   // meshes whose world boxes are apart skip all kernel work
+    bool incremental = false;       // re-test only what moved since the last frame, see runsIncremental
+    bool sharedResults = true;      // use the shared result cache when it is enabled
+};
+
+
+// Faces of both meshes that intersect in one frame.
+struct FrameResult
+{
+    double time;
+    std::vector<int> facesA;
+    std::vector<int> facesB;
+};
+
+
+// A mesh of a frame and the matrix that moves it to world space. The world box
+// is taken from the points the first time it is asked for, then shared by the
+// apart test and the kernel builds of the frame.
+struct FrameMesh
+{
+    FrameMesh(const MObject& mesh, const MMatrix& offset) : mesh(mesh), offset(offset) {}
+
+    MObject mesh;
+    MMatrix offset;
+
+    const MBoundingBox& worldBox() const;
+
+private:
+    mutable MBoundingBox box;
+    mutable bool hasBox = false;
+};
+
+
+// A new, unbuilt kernel of the given type, nullptr for an unknown type.
+// "Auto" decides by the triangle count of the larger mesh.
+std::shared_ptr<SpatialDivisionKernel> createKernel(short kernelType, bool quantizedNodes, int numTriangles);
+
+// The box of the mesh's points moved by the offset matrix, the box kernels
+// are built with. MFnMesh::boundingBox() needs a DAG path, which mesh data
+// outside the DG does not have.
+MBoundingBox pointsBoundingBox(const MObject& meshObject, const MMatrix& offsetMatrix);
+
+// True when kernels of the type move their points in place
+// (SpatialDivisionKernel::updatePoints). Incremental updates need that; any
+// other kernel would be built again on every frame.
+bool kernelUpdatesPoints(short kernelType, int numTriangles);
+
+// True when intersectFrame updates the pairs kept from the last frame instead
+// of running a full pass: incremental updates are on, the collision mode is
+// triangle queries and the kernel updates its points in place.
+bool runsIncremental(const FrameSettings& settings, const MObject& meshA, const MObject& meshB);
+
+// True when the frame at `time` can skip all kernel work: skipping apart frames
+// is on and the world boxes of the meshes stay apart. With a motion bound the
+// frames the boxes need to close their gap are skipped on a revalidation of
+// the bound alone; without one the boxes are tested every frame. A motion
+// bound is reset when skipping is off.
+bool skipFrame(const FrameSettings& settings, MotionBound* motionBound, double time, const FrameMesh& meshA, const FrameMesh& meshB);
+
+// Test every triangle of mesh B, moved by its offset matrix, against a built kernel.
+MStatus intersectKernelMesh(
+    const SpatialDivisionKernel& kernel,
+    const MObject& meshB,
+    const MMatrix& offsetB,
+    std::unordered_set<int>& facesA,
+    std::unordered_set<int>& facesB);
+
+// Build the kernels for a pair of meshes and test them like the node does,
+// or take the result from the shared result cache when it is enabled.
+MStatus intersectMeshes(
+    const FrameMesh& meshA,
+    const FrameMesh& meshB,
+    const ScanSettings& settings,
+    std::unordered_set<int>& facesA,
+    std::unordered_set<int>& facesB);
+
+// One frame of a marker, the pipeline the node, the batch scans and the replay
+// share: the apart test (skipFrame), then either the incremental update of the
+// pairs kept in `incremental` or a full pass like intersectMeshes. The apart
+// test runs when `motionBound` is given; a caller that tests earlier passes
+// null. `incremental` may be null when incremental updates are off; a state
+// that is passed to a full pass is cleared. `skipped` tells whether the apart
+// test ended the frame.
+MStatus intersectFrame(
+    const FrameMesh& meshA,
+    const FrameMesh& meshB,
+    const FrameSettings& settings,
+    double time,
+    MotionBound* motionBound,
+    IncrementalIntersection* incremental,
+    std::unordered_set<int>& facesA,
+    std::unordered_set<int>& facesB,
+    bool* skipped = nullptr);
+
+// Test every frame of two point caches of the same frame range, streaming
+// the points from the mapped files into mesh data that is not part of the DG.
+MStatus scanPointCaches(
+    const PointCache& cacheA,
+    const PointCache& cacheB,
+    const ScanSettings& settings,
+    std::vector<FrameResult>& results);
@@ -0,0 +1,389 @@
+#include "IncrementalIntersection.h"
+#include "kernel/TriangleBlocks.h"
+
+#include <maya/MFnMesh.h>
+#include <maya/MIntArray.h>
+#include <maya/MBoundingBox.h>
+#include <maya/MGlobal.h>
+
+#include <omp.h>
+#include <algorithm>
+
+
+const int DIFF_CHUNK_SIZE = 4096;                 // vertices per parallel diff chunk
+const double INCREMENTAL_MAX_MOVED_FRACTION = 0.25;
+
+
+TriangleData MeshSnapshot::triangle(int index) const
+{
+    const int* v = &this->triangleVertices[index * 3];
+    const int face = this->faceIndices[index];
+    return TriangleData(
+        face,
+        index - this->faceOffsets[face],
+        this->points[v[0]],
+        this->points[v[1]],
+        this->points[v[2]]);
+}
+
+
+// Vertices whose position differs between the two packed x y z w arrays, in
+// ascending order. Each chunk is first compared as one flat run of doubles,
+// which vectorizes; only chunks that differ are scanned vertex by vertex.
+static std::vector<int> diffPoints(const std::vector<double>& previous, const std::vector<double>& current)
+{
+    const int numVertices = (int)(current.size() / 4);
+    const int numChunks = (numVertices + DIFF_CHUNK_SIZE - 1) / DIFF_CHUNK_SIZE;
+    std::vector<std::vector<int>> chunkMoved(numChunks);
+    if (numVertices == 0) {
+        return {};
+    }
+
+    const double* a = previous.data();
+    const double* b = current.data();
+
+    #pragma omp parallel for schedule(static)
+    for (int chunk = 0; chunk < numChunks; ++chunk) {
+        const int first = chunk * DIFF_CHUNK_SIZE;
+        const int last = std::min(numVertices, first + DIFF_CHUNK_SIZE);
+
+        int changed = 0;
+        #pragma omp simd reduction(|:changed)
+        for (int i = first * 4; i < last * 4; ++i) {
+            changed |= (int)(a[i] != b[i]);
+        }
+        if (!changed) {
+            continue;
+        }
+
+        for (int v = first; v < last; ++v) {
+            const double* p = a + 4 * v;
+            const double* q = b + 4 * v;
+            if (p[0] != q[0] || p[1] != q[1] || p[2] != q[2] || p[3] != q[3]) {
+                chunkMoved[chunk].push_back(v);
+            }
+        }
+    }
+
+    std::vector<int> moved;
+    for (const std::vector<int>& vertices : chunkMoved) {
+        moved.insert(moved.end(), vertices.begin(), vertices.end());
+    }
+    return moved;
+}
+
+
+static void packPoints(const MPointArray& points, std::vector<double>& coordinates)
+{
+    coordinates.resize(4 * (size_t)points.length());
+    if (!coordinates.empty()) {
+        points.get((double(*)[4])coordinates.data());
+    }
+}
+
+
+static bool sameSettings(const ScanSettings& a, const ScanSettings& b)
+{
+    return a.kernel == b.kernel && a.compressBVH == b.compressBVH && a.collisionMode == b.collisionMode;
+}
+
+
+static MStatus readPoints(const MObject& meshObject, const MMatrix& offsetMatrix, MPointArray& points)
+{
+    MStatus status;
+    MFnMesh meshFn(meshObject, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    status = meshFn.getPoints(points, MSpace::kObject);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    transformPoints(points, offsetMatrix);
+
+    return MStatus::kSuccess;
+}
+
+
+static uint64_t polygonTopologyHash(const MIntArray& polygonCounts, const MIntArray& polygonVertices)
+{
+    std::vector<int> data(polygonCounts.length() + polygonVertices.length());
+    polygonCounts.get(data.data());
+    polygonVertices.get(data.data() + polygonCounts.length());
+    return hashBytes64(data.data(), sizeof(int) * data.size());
+}
+
+
+// The counts turn away most topology edits without reading the polygons, the
+// hash of the polygons catches the rest.
+static bool sameTopology(const MObject& meshObject, const MeshSnapshot& mesh)
+{
+    MFnMesh meshFn(meshObject);
+    if (meshFn.numVertices() != (int)mesh.points.length() ||
+        meshFn.numPolygons() != (int)mesh.faceOffsets.size() ||
+        meshFn.numFaceVertices() != mesh.numFaceVertices
+    ) {
+        return false;
+    }
+
+    MIntArray polygonCounts;
+    MIntArray polygonVertices;
+    if (meshFn.getVertices(polygonCounts, polygonVertices) != MStatus::kSuccess) {
+        return false;
+    }
+    return polygonTopologyHash(polygonCounts, polygonVertices) == mesh.topologyHash;
+}
+
+
+MStatus IncrementalIntersection::readMesh(int side, const MObject& meshObject, const MMatrix& offsetMatrix)
+{
+    MStatus status;
+    MeshSnapshot& mesh = this->meshes[side];
+
+    status = readPoints(meshObject, offsetMatrix, mesh.points);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    packPoints(mesh.points, mesh.coordinates);
+
+    MFnMesh meshFn(meshObject, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    MIntArray polygonCounts;
+    MIntArray polygonVertices;
+    status = meshFn.getVertices(polygonCounts, polygonVertices);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    mesh.numFaceVertices = (int)polygonVertices.length();
+    mesh.topologyHash = polygonTopologyHash(polygonCounts, polygonVertices);
+
+    MIntArray triangleCounts;
+    MIntArray triangleVertices;
+    status = meshFn.getTriangles(triangleCounts, triangleVertices);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    const int numTriangles = (int)triangleVertices.length() / 3;
+    mesh.triangleVertices.resize(numTriangles * 3);
+    triangleVertices.get(mesh.triangleVertices.data());
+
+    mesh.faceIndices.resize(numTriangles);
+    mesh.faceOffsets.resize(triangleCounts.length());
+    int triangleId = 0;
+    for (unsigned int faceIndex = 0; faceIndex < triangleCounts.length(); ++faceIndex) {
+        mesh.faceOffsets[faceIndex] = triangleId;
+        for (int i = 0; i < triangleCounts[faceIndex]; ++i) {
+            mesh.faceIndices[triangleId++] = faceIndex;
+        }
+    }
+
+    // vertex -> triangles
+    const int numVertices = (int)mesh.points.length();
+    mesh.vertexOffsets.assign(numVertices + 1, 0);
+    for (int i = 0; i < numTriangles * 3; ++i) {
+        mesh.vertexOffsets[mesh.triangleVertices[i] + 1]++;
+    }
+    for (int v = 0; v < numVertices; ++v) {
+        mesh.vertexOffsets[v + 1] += mesh.vertexOffsets[v];
+    }
+    mesh.vertexTriangles.resize(numTriangles * 3);
+    std::vector<int> cursor(mesh.vertexOffsets.begin(), mesh.vertexOffsets.end() - 1);
+    for (int i = 0; i < numTriangles * 3; ++i) {
+        mesh.vertexTriangles[cursor[mesh.triangleVertices[i]]++] = i / 3;
+    }
+
+    return MStatus::kSuccess;
+}
+
+
+MStatus IncrementalIntersection::ensureKernel(int side, const MObject& meshObject, const MMatrix& offsetMatrix)
+{
+    if (!this->stale[side]) {
+        return MStatus::kSuccess;
+    }
+
+    // kernels are built once, a stale one is replaced rather than built again
+    std::shared_ptr<SpatialDivisionKernel> kernel = createKernel(this->settings.kernel, this->settings.compressBVH, this->numTriangles);
+    if (!kernel) {
+        return MStatus::kInvalidParameter;
+    }
+
+    MBoundingBox bbox;
+    for (unsigned int i = 0; i < this->meshes[side].points.length(); ++i) {
+        bbox.expand(this->meshes[side].points[i]);
+    }
+
+    MStatus status = kernel->build(meshObject, bbox, offsetMatrix);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    this->kernels[side] = kernel;
+    this->stale[side] = false;
+
+    return MStatus::kSuccess;
+}
+
+
+// Test the given triangles of one side against the other side's kernel and
+// record the pairs. Triangles of the other side flagged in `skipOther` were
+// already tested against everything and are left out.
+void IncrementalIntersection::testTriangles(int side, const std::vector<int>& triangles, const std::vector<char>& skipOther)
+{
+    const int other = 1 - side;
+    const MeshSnapshot& mesh = this->meshes[side];
+    const MeshSnapshot& otherMesh = this->meshes[other];
+    const SpatialDivisionKernel& kernel = *this->kernels[other];
+
+    std::vector<std::vector<int>> found(triangles.size());
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int i = 0; i < (int)triangles.size(); ++i) {
+        for (const TriangleData& hit : kernel.intersectKernelTriangle(mesh.triangle(triangles[i]))) {
+            int o = otherMesh.faceOffsets[hit.faceIndex] + hit.triangleIndex;
+            if (!skipOther.empty() && skipOther[o]) {
+                continue;
+            }
+            found[i].push_back(o);
+        }
+    }
+
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        for (int o : found[i]) {
+            this->partners[side][triangles[i]].push_back(o);
+            this->partners[other][o].push_back(triangles[i]);
+        }
+    }
+}
+
+
+MStatus IncrementalIntersection::rebuild(const MObject& meshA, const MMatrix& offsetA, const MObject& meshB, const MMatrix& offsetB, const ScanSettings& settings)
+{
+    MStatus status;
+    clear();
+    this->settings = settings;
+
+    const MObject* meshObjects[2] = { &meshA, &meshB };
+    const MMatrix* offsets[2] = { &offsetA, &offsetB };
+
+    for (int side = 0; side < 2; ++side) {
+        status = readMesh(side, *meshObjects[side], *offsets[side]);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+        this->partners[side].assign(this->meshes[side].numTriangles(), std::vector<int>());
+
+        // only kernel A is queried below, B is built once A's triangles move
+        this->stale[side] = true;
+    }
+    this->numTriangles = std::max(this->meshes[0].numTriangles(), this->meshes[1].numTriangles());
+
+    status = ensureKernel(0, meshA, offsetA);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    std::vector<int> all(this->meshes[1].numTriangles());
+    for (int t = 0; t < (int)all.size(); ++t) {
+        all[t] = t;
+    }
+    testTriangles(1, all, std::vector<char>());
+
+    this->recorded = true;
+    return MStatus::kSuccess;
+}
+
+
+bool IncrementalIntersection::update(const MObject& meshA, const MMatrix& offsetA, const MObject& meshB, const MMatrix& offsetB, const ScanSettings& settings)
+{
+    if (!this->recorded || !sameSettings(settings, this->settings)) {
+        return false;
+    }
+
+    const MObject* meshObjects[2] = { &meshA, &meshB };
+    const MMatrix* offsets[2] = { &offsetA, &offsetB };
+
+    MPointArray points[2];
+    std::vector<double> coordinates[2];
+    std::vector<int> moved[2];
+    for (int side = 0; side < 2; ++side) {
+        if (!sameTopology(*meshObjects[side], this->meshes[side]) ||
+            readPoints(*meshObjects[side], *offsets[side], points[side]) != MStatus::kSuccess ||
+            points[side].length() != this->meshes[side].points.length()
+        ) {
+            return false;
+        }
+
+        packPoints(points[side], coordinates[side]);
+        moved[side] = diffPoints(this->meshes[side].coordinates, coordinates[side]);
+        if (moved[side].size() > INCREMENTAL_MAX_MOVED_FRACTION * points[side].length()) {
+            return false;
+        }
+    }
+
+    // triangles using a moved vertex, and their old pairs dropped
+    std::vector<int> affected[2];
+    std::vector<char> isAffected[2];
+    for (int side = 0; side < 2; ++side) {
+        if (moved[side].empty()) {
+            continue;
+        }
+
+        MeshSnapshot& mesh = this->meshes[side];
+        isAffected[side].assign(mesh.numTriangles(), 0);
+        for (int v : moved[side]) {
+            for (int n = mesh.vertexOffsets[v]; n < mesh.vertexOffsets[v + 1]; ++n) {
+                int t = mesh.vertexTriangles[n];
+                if (!isAffected[side][t]) {
+                    isAffected[side][t] = 1;
+                    affected[side].push_back(t);
+                }
+            }
+        }
+
+        mesh.points = points[side];
+        mesh.coordinates.swap(coordinates[side]);
+        if (!this->stale[side] && !this->kernels[side]->updatePoints(mesh.points, moved[side])) {
+            this->stale[side] = true;
+        }
+
+        const int other = 1 - side;
+        for (int t : affected[side]) {
+            for (int o : this->partners[side][t]) {
+                std::vector<int>& back = this->partners[other][o];
+                back.erase(std::remove(back.begin(), back.end(), t), back.end());
+            }
+            this->partners[side][t].clear();
+        }
+    }
+
+    // moved A against all of B, then moved B against the A that did not move
+    if (!affected[0].empty()) {
+        if (ensureKernel(1, meshB, offsetB) != MStatus::kSuccess) {
+            return false;
+        }
+        testTriangles(0, affected[0], std::vector<char>());
+    }
+    if (!affected[1].empty()) {
+        if (ensureKernel(0, meshA, offsetA) != MStatus::kSuccess) {
+            return false;
+        }
+        testTriangles(1, affected[1], isAffected[0]);
+    }
+
+    return true;
+}
+
+
+void IncrementalIntersection::getIntersectedFaces(std::unordered_set<int>& facesA, std::unordered_set<int>& facesB) const
+{
+    std::unordered_set<int>* faces[2] = { &facesA, &facesB };
+    for (int side = 0; side < 2; ++side) {
+        faces[side]->clear();
+        for (int t = 0; t < (int)this->partners[side].size(); ++t) {
+            if (!this->partners[side][t].empty()) {
+                faces[side]->insert(this->meshes[side].faceIndices[t]);
+            }
+        }
+    }
+}
+
+
+void IncrementalIntersection::clear()
+{
+    this->recorded = false;
+    this->settings = ScanSettings();
+    this->numTriangles = 0;
+    for (int side = 0; side < 2; ++side) {
+        this->meshes[side] = MeshSnapshot();
+        this->kernels[side] = nullptr;
+        this->stale[side] = false;
+        this->partners[side].clear();
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "BatchScan.h"
+#include "SpatialDivisionKernel.h"
+#include "utility.h"
+
+#include <maya/MObject.h>
+#include <maya/MPointArray.h>
+#include <maya/MMatrix.h>
+#include <maya/MStatus.h>
+
+#include <cstdint>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+
+// One mesh as of the last evaluation: world space points and the triangle
+// lists in MFnMesh::getTriangles order.
+struct MeshSnapshot
+{
+    MPointArray points;                   // offset matrix applied
+    std::vector<double> coordinates;      // the same points as packed x y z w, for the diff
+    int numFaceVertices = 0;
+    uint64_t topologyHash = 0;            // of MFnMesh::getVertices, to notice topology changes
+    std::vector<int> triangleVertices;    // 3 vertex ids per triangle
+    std::vector<int> faceIndices;         // per triangle
+    std::vector<int> faceOffsets;         // first triangle of each face
+    std::vector<int> vertexOffsets;       // vertex v is used by vertexTriangles[vertexOffsets[v], vertexOffsets[v+1])
+    std::vector<int> vertexTriangles;
+
+    int numTriangles() const { return (int)faceIndices.size(); }
+    TriangleData triangle(int index) const;
+};
+
+
+// Keeps both kernels and every intersecting triangle pair between evaluations
+// of a node. When a stroke moves a few vertices, only the triangles using them
+// are updated in their kernel and tested again, so the cost follows the size
+// of the change rather than the size of the meshes. A kernel that cannot take
+// the moved points is replaced by a fresh one from createKernel.
+//
+// The pairs come from triangle queries, which is collision mode 0; kernel
+// against kernel runs are not incremental. Only kernels that move their points
+// in place pay off (kernelUpdatesPoints), intersectFrame runs the others in
+// full.
+class IncrementalIntersection
+{
+public:
+    // Full evaluation with kernels of the given settings; records every pair.
+    MStatus rebuild(const MObject& meshA, const MMatrix& offsetA, const MObject& meshB, const MMatrix& offsetB, const ScanSettings& settings);
+
+    // Diff both meshes against the last evaluation and re-test what moved.
+    // Returns false when there is nothing to diff against, the kernel settings
+    // changed or the change is too large to pay off; the caller then runs
+    // rebuild().
+    bool update(const MObject& meshA, const MMatrix& offsetA, const MObject& meshB, const MMatrix& offsetB, const ScanSettings& settings);
+
+    void getIntersectedFaces(std::unordered_set<int>& facesA, std::unordered_set<int>& facesB) const;
+    void clear();
+
+private:
+    bool recorded = false;                // pairs describe the snapshots
+    ScanSettings settings;
+    int numTriangles = 0;                 // of the larger mesh, what "Auto" decides by
+    MeshSnapshot meshes[2];
+    std::shared_ptr<SpatialDivisionKernel> kernels[2];
+    bool stale[2] = { false, false };     // kernel lags behind its snapshot, build before use
+    std::vector<std::vector<int>> partners[2];  // per triangle, the intersecting triangles of the other mesh
+
+    MStatus readMesh(int side, const MObject& meshObject, const MMatrix& offsetMatrix);
+    MStatus ensureKernel(int side, const MObject& meshObject, const MMatrix& offsetMatrix);
+    void testTriangles(int side, const std::vector<int>& triangles, const std::vector<char>& skipOther);
+};
@@ -0,0 +1,295 @@
+#include "InputCapture.h"
+
+#include <maya/MFnMesh.h>
+#include <maya/MFnMeshData.h>
+#include <maya/MGlobal.h>
+#include <maya/MIntArray.h>
+#include <maya/MPointArray.h>
+
+#include <algorithm>
+#include <cstring>
+
+
+const char INPUT_CAPTURE_MAGIC[8] = "IMCAP";
+const uint32_t INPUT_CAPTURE_VERSION = 2;
+const uint64_t INPUT_CAPTURE_ALIGNMENT = 8;
+
+
+InputCaptureWriter::~InputCaptureWriter()
+{
+    if (this->file) {
+        std::fclose(this->file);
+        std::remove(this->temporary.c_str());
+    }
+}
+
+
+bool InputCaptureWriter::write(const void* data, size_t size)
+{
+    if (size > 0 && std::fwrite(data, 1, size, this->file) != size) {
+        return false;
+    }
+    this->offset += size;
+    return true;
+}
+
+
+bool InputCaptureWriter::pad()
+{
+    static const char zeros[INPUT_CAPTURE_ALIGNMENT] = {};
+    return write(zeros, (size_t)((INPUT_CAPTURE_ALIGNMENT - this->offset % INPUT_CAPTURE_ALIGNMENT) % INPUT_CAPTURE_ALIGNMENT));
+}
+
+
+MStatus InputCaptureWriter::open(const std::string& path, const CaptureSettings& settings)
+{
+    this->path = path;
+    this->temporary = temporaryFilePath(path);
+    this->file = std::fopen(this->temporary.c_str(), "wb");
+    if (!this->file) {
+        MGlobal::displayError(MString("Cannot write input capture ") + path.c_str());
+        return MStatus::kFailure;
+    }
+
+    std::memset(&this->header, 0, sizeof(this->header));
+    std::memcpy(this->header.magic, INPUT_CAPTURE_MAGIC, sizeof(this->header.magic));
+    this->header.version = INPUT_CAPTURE_VERSION;
+    this->header.kernel = settings.scan.kernel;
+    this->header.collisionMode = settings.scan.collisionMode;
+    this->header.compressBVH = settings.scan.compressBVH;
+    this->header.incremental = settings.incremental;
+    this->header.skipApartFrames = settings.skipApartFrames;
+    for (int side = 0; side < 2; ++side) {
+        this->header.smoothMode[side] = settings.smoothMode[side];
+        this->header.smoothLevel[side] = settings.smoothLevel[side];
+        this->counts[side].clear();
+        this->connects[side].clear();
+    }
+
+    // the header is written again with the number of frames on close
+    return write(&this->header, sizeof(this->header)) ? MStatus::kSuccess : MStatus::kFailure;
+}
+
+
+MStatus InputCaptureWriter::appendFrame(double time, const MObject meshes[2], const MMatrix offsetMatrices[2])
+{
+    MStatus status;
+    if (!this->file) {
+        return MStatus::kFailure;
+    }
+
+    bool written = write(&time, sizeof(time));
+    for (int side = 0; side < 2 && written; ++side) {
+        MFnMesh meshFn(meshes[side], &status);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+
+        MPointArray points;
+        status = meshFn.getPoints(points, MSpace::kObject);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+        std::vector<double> coordinates((size_t)points.length() * 3);
+        for (unsigned int i = 0; i < points.length(); ++i) {
+            coordinates[i * 3 + 0] = points[i].x;
+            coordinates[i * 3 + 1] = points[i].y;
+            coordinates[i * 3 + 2] = points[i].z;
+        }
+
+        MIntArray polygonCounts;
+        MIntArray polygonConnects;
+        status = meshFn.getVertices(polygonCounts, polygonConnects);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+        std::vector<int32_t> counts(polygonCounts.length());
+        std::vector<int32_t> connects(polygonConnects.length());
+        polygonCounts.get(counts.data());
+        polygonConnects.get(connects.data());
+
+        // the topology rarely changes between frames, it is stored when it does
+        const bool hasTopology = counts != this->counts[side] || connects != this->connects[side] || this->header.numFrames == 0;
+
+        CapturedMeshHeader meshHeader;
+        std::memset(&meshHeader, 0, sizeof(meshHeader));
+        offsetMatrices[side].get(meshHeader.offsetMatrix);
+        meshHeader.numVertices = (uint32_t)points.length();
+        meshHeader.numPolygons = (uint32_t)counts.size();
+        meshHeader.numFaceVertices = (uint32_t)connects.size();
+        meshHeader.hasTopology = hasTopology;
+
+        written = write(&meshHeader, sizeof(meshHeader));
+        if (hasTopology) {
+            written = written &&
+                write(counts.data(), counts.size() * sizeof(int32_t)) &&
+                write(connects.data(), connects.size() * sizeof(int32_t)) &&
+                pad();
+            this->counts[side] = std::move(counts);
+            this->connects[side] = std::move(connects);
+        }
+        written = written && write(coordinates.data(), coordinates.size() * sizeof(double)) && pad();
+    }
+
+    if (!written) {
+        return MStatus::kFailure;
+    }
+    this->header.numFrames += 1;
+    return MStatus::kSuccess;
+}
+
+
+MStatus InputCaptureWriter::close()
+{
+    if (!this->file) {
+        return MStatus::kFailure;
+    }
+
+    bool written = std::fseek(this->file, 0, SEEK_SET) == 0;
+    written = written && std::fwrite(&this->header, sizeof(this->header), 1, this->file) == 1;
+    written = (std::fclose(this->file) == 0) && written;
+    this->file = nullptr;
+
+    written = written && replaceFile(this->temporary, this->path);
+    if (!written) {
+        std::remove(this->temporary.c_str());
+        MGlobal::displayError(MString("Failed to write input capture ") + this->path.c_str());
+        return MStatus::kFailure;
+    }
+
+    return MStatus::kSuccess;
+}
+
+
+std::shared_ptr<InputCapture> InputCapture::open(const std::string& path)
+{
+    std::shared_ptr<MappedFile> file = MappedFile::open(path);
+    if (!file || file->size() < sizeof(InputCaptureHeader)) {
+        return nullptr;
+    }
+
+    const InputCaptureHeader* header = (const InputCaptureHeader*)file->data();
+    if (std::memcmp(header->magic, INPUT_CAPTURE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != INPUT_CAPTURE_VERSION
+    ) {
+        return nullptr;
+    }
+
+    std::shared_ptr<InputCapture> capture(new InputCapture());
+    capture->file = file;
+    CaptureSettings& settings = capture->captureSettings;
+    settings.scan.kernel = (short)header->kernel;
+    settings.scan.collisionMode = header->collisionMode;
+    settings.scan.compressBVH = header->compressBVH != 0;
+    settings.incremental = header->incremental != 0;
+    settings.skipApartFrames = header->skipApartFrames != 0;
+    for (int side = 0; side < 2; ++side) {
+        settings.smoothMode[side] = header->smoothMode[side];
+        settings.smoothLevel[side] = header->smoothLevel[side];
+    }
+
+    // Walk the frames once, checking every block lies inside the file and
+    // every topology describes a valid mesh before it is handed to Maya
+    const char* cursor = file->data() + sizeof(InputCaptureHeader);
+    const char* end = file->data() + file->size();
+    auto take = [&cursor, end](uint64_t count, uint64_t elementSize) -> const char* {
+        const uint64_t size = (count * elementSize + INPUT_CAPTURE_ALIGNMENT - 1) / INPUT_CAPTURE_ALIGNMENT * INPUT_CAPTURE_ALIGNMENT;
+        if ((uint64_t)(end - cursor) < size || (elementSize > 0 && count > size / elementSize)) {
+            return nullptr;
+        }
+        const char* block = cursor;
+        cursor += size;
+        return block;
+    };
+
+    const CapturedMesh* previous[2] = { nullptr, nullptr };
+    capture->frames.resize(header->numFrames);
+    for (CapturedFrame& frame : capture->frames) {
+        const char* time = take(1, sizeof(double));
+        if (!time) {
+            return nullptr;
+        }
+        std::memcpy(&frame.time, time, sizeof(double));
+
+        for (int side = 0; side < 2; ++side) {
+            const CapturedMeshHeader* meshHeader = (const CapturedMeshHeader*)take(1, sizeof(CapturedMeshHeader));
+            if (!meshHeader) {
+                return nullptr;
+            }
+
+            CapturedMesh& mesh = frame.meshes[side];
+            mesh.offsetMatrix = MMatrix(meshHeader->offsetMatrix);
+            mesh.numVertices = meshHeader->numVertices;
+            mesh.numPolygons = meshHeader->numPolygons;
+            mesh.numFaceVertices = meshHeader->numFaceVertices;
+            mesh.topologyChanged = meshHeader->hasTopology != 0;
+
+            if (mesh.topologyChanged) {
+                mesh.polygonCounts = (const int32_t*)cursor;
+                mesh.polygonConnects = mesh.polygonCounts + mesh.numPolygons;
+                if (!take((uint64_t)mesh.numPolygons + mesh.numFaceVertices, sizeof(int32_t))) {
+                    return nullptr;
+                }
+
+                uint64_t faceVertices = 0;
+                for (unsigned int i = 0; i < mesh.numPolygons; ++i) {
+                    faceVertices += (uint64_t)std::max(0, (int)mesh.polygonCounts[i]);
+                }
+                if (faceVertices != mesh.numFaceVertices) {
+                    return nullptr;
+                }
+            } else if (previous[side] && previous[side]->numPolygons == mesh.numPolygons && previous[side]->numFaceVertices == mesh.numFaceVertices) {
+                mesh.polygonCounts = previous[side]->polygonCounts;
+                mesh.polygonConnects = previous[side]->polygonConnects;
+            } else {
+                return nullptr;
+            }
+
+            for (unsigned int i = 0; i < mesh.numFaceVertices; ++i) {
+                if (mesh.polygonConnects[i] < 0 || (unsigned int)mesh.polygonConnects[i] >= mesh.numVertices) {
+                    return nullptr;
+                }
+            }
+
+            mesh.points = (const double*)take((uint64_t)mesh.numVertices * 3, sizeof(double));
+            if (!mesh.points) {
+                return nullptr;
+            }
+            previous[side] = &mesh;
+        }
+    }
+
+    return capture;
+}
+
+
+static MPointArray capturedPoints(const CapturedMesh& mesh)
+{
+    MPointArray points(mesh.numVertices);
+    for (unsigned int i = 0; i < mesh.numVertices; ++i) {
+        points.set(i, mesh.points[i * 3 + 0], mesh.points[i * 3 + 1], mesh.points[i * 3 + 2]);
+    }
+    return points;
+}
+
+
+MStatus InputCapture::createMesh(const CapturedMesh& mesh, MObject& meshData)
+{
+    MStatus status;
+    MFnMeshData dataFn;
+    meshData = dataFn.create(&status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    MIntArray counts(mesh.polygonCounts, mesh.numPolygons);
+    MIntArray connects(mesh.polygonConnects, mesh.numFaceVertices);
+
+    MFnMesh meshFn;
+    meshFn.create((int)mesh.numVertices, (int)mesh.numPolygons, capturedPoints(mesh), counts, connects, meshData, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    return MStatus::kSuccess;
+}
+
+
+MStatus InputCapture::setPoints(const CapturedMesh& mesh, MObject& meshData)
+{
+    MStatus status;
+    MFnMesh meshFn(meshData, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    return meshFn.setPoints(capturedPoints(mesh), MSpace::kObject);
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "BatchScan.h"
+#include "MappedFile.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <maya/MMatrix.h>
+#include <maya/MObject.h>
+#include <maya/MStatus.h>
+
+
+// The marker node settings that shape its kernel work, as captured.
+struct CaptureSettings
+{
+    ScanSettings scan;
+    bool incremental = false;
+    bool skipApartFrames = false;
+    int smoothMode[2] = { 0, 0 };
+    int smoothLevel[2] = { 0, 0 };
+};
+
+
+// Input capture files: what a marker node tested in each captured frame,
+// so its kernel work can be replayed outside the session.
+//
+//   InputCaptureHeader
+//   per frame: double time, then for mesh A and B
+//     CapturedMeshHeader
+//     int32 polygon vertex counts, int32 polygon vertex ids  (only when the topology changed)
+//     double x y z of each vertex in object space
+//
+// Meshes are the ones the node tests, smoothed when its smooth mode is on.
+// Points are stored as the node reads them, so a replay tests the same
+// values near contacts.
+// Every block is padded to 8 bytes.
+struct InputCaptureHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t numFrames;
+    int32_t kernel;
+    int32_t collisionMode;
+    int32_t compressBVH;
+    int32_t incremental;
+    int32_t skipApartFrames;
+    int32_t smoothMode[2];
+    int32_t smoothLevel[2];
+    uint32_t reserved;
+};
+
+struct CapturedMeshHeader
+{
+    double offsetMatrix[4][4];
+    uint32_t numVertices;
+    uint32_t numPolygons;
+    uint32_t numFaceVertices;
+    uint32_t hasTopology;
+};
+
+
+// Writes a capture one frame at a time to a temporary file, which replaces
+// `path` on close(). A writer destroyed before close() leaves nothing behind.
+class InputCaptureWriter
+{
+public:
+    ~InputCaptureWriter();
+
+    MStatus open(const std::string& path, const CaptureSettings& settings);
+    MStatus appendFrame(double time, const MObject meshes[2], const MMatrix offsetMatrices[2]);
+    MStatus close();
+
+private:
+    std::string path;
+    std::string temporary;
+    FILE* file = nullptr;
+    uint64_t offset = 0;
+    InputCaptureHeader header;
+    std::vector<int32_t> counts[2];         // topology last written for each mesh
+    std::vector<int32_t> connects[2];
+
+    bool write(const void* data, size_t size);
+    bool pad();
+};
+
+
+// One mesh of a captured frame, pointing into the mapped file. The topology
+// is that of the last frame that stored one.
+struct CapturedMesh
+{
+    MMatrix offsetMatrix;
+    unsigned int numVertices = 0;
+    unsigned int numPolygons = 0;
+    unsigned int numFaceVertices = 0;
+    bool topologyChanged = false;
+    const double* points = nullptr;
+    const int32_t* polygonCounts = nullptr;
+    const int32_t* polygonConnects = nullptr;
+};
+
+struct CapturedFrame
+{
+    double time;
+    CapturedMesh meshes[2];
+};
+
+
+class InputCapture
+{
+public:
+    // nullptr when the file is missing or not a capture of this version
+    static std::shared_ptr<InputCapture> open(const std::string& path);
+
+    const CaptureSettings& settings() const { return this->captureSettings; }
+    size_t numFrames() const { return this->frames.size(); }
+    const CapturedFrame& frame(size_t index) const { return this->frames[index]; }
+
+    // A mesh data object, not part of the DG, with the captured mesh; or
+    // only its points moved when the topology did not change.
+    static MStatus createMesh(const CapturedMesh& mesh, MObject& meshData);
+    static MStatus setPoints(const CapturedMesh& mesh, MObject& meshData);
+
+private:
+    InputCapture() {}
+
+    std::shared_ptr<MappedFile> file;
+    CaptureSettings captureSettings;
+    std::vector<CapturedFrame> frames;
+};
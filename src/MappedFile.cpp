@@ -0,0 +1,217 @@
+#include "MappedFile.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::string& path)
+{
+    std::shared_ptr<MappedFile> file(new MappedFile());
+
+#ifdef _WIN32
+    HANDLE fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    file->fileHandle = fileHandle;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(fileHandle, &size) || size.QuadPart == 0) {
+        return nullptr;
+    }
+
+    HANDLE mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mappingHandle) {
+        return nullptr;
+    }
+    file->mappingHandle = mappingHandle;
+
+    file->address = (const char*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    if (!file->address) {
+        return nullptr;
+    }
+    file->length = (size_t)size.QuadPart;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    // the mapping keeps its own reference to the file
+    void* address = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        return nullptr;
+    }
+    file->address = (const char*)address;
+    file->length = (size_t)info.st_size;
+#endif
+
+    return file;
+}
+
+
+std::shared_ptr<MappedFile> MappedFile::openShared(const std::string& path, size_t size)
+{
+    std::shared_ptr<MappedFile> file(new MappedFile());
+    file->writable = true;
+
+#ifdef _WIN32
+    HANDLE fileHandle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    file->fileHandle = fileHandle;
+
+    LARGE_INTEGER existing;
+    if (!GetFileSizeEx(fileHandle, &existing)) {
+        return nullptr;
+    }
+    // the mapping extends an empty file to the requested size
+    const uint64_t mappedSize = existing.QuadPart > 0 ? (uint64_t)existing.QuadPart : (uint64_t)size;
+
+    HANDLE mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READWRITE, (DWORD)(mappedSize >> 32), (DWORD)mappedSize, nullptr);
+    if (!mappingHandle) {
+        return nullptr;
+    }
+    file->mappingHandle = mappingHandle;
+
+    file->address = (const char*)MapViewOfFile(mappingHandle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (!file->address) {
+        return nullptr;
+    }
+    file->length = (size_t)mappedSize;
+#else
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    // processes racing to create the file all extend it to the same size
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (info.st_size == 0 && (ftruncate(fd, (off_t)size) != 0 || fstat(fd, &info) != 0))) {
+        close(fd);
+        return nullptr;
+    }
+
+    void* address = mmap(nullptr, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        return nullptr;
+    }
+    file->address = (const char*)address;
+    file->length = (size_t)info.st_size;
+#endif
+
+    return file;
+}
+
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+    if (this->address) {
+        UnmapViewOfFile(this->address);
+    }
+    if (this->mappingHandle) {
+        CloseHandle(this->mappingHandle);
+    }
+    if (this->fileHandle) {
+        CloseHandle(this->fileHandle);
+    }
+#else
+    if (this->address) {
+        munmap((void*)this->address, this->length);
+    }
+#endif
+}
+
+
+void MappedFile::prefetch(size_t offset, size_t size) const
+{
+    if (offset >= this->length) {
+        return;
+    }
+    size = std::min(size, this->length - offset);
+
+#ifdef _WIN32
+    WIN32_MEMORY_RANGE_ENTRY range;
+    range.VirtualAddress = (void*)(this->address + offset);
+    range.NumberOfBytes = size;
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+    // madvise wants a page aligned start
+    const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t start = offset / pageSize * pageSize;
+    madvise((void*)(this->address + start), size + (offset - start), MADV_WILLNEED);
+#endif
+}
+
+
+std::string temporaryFilePath(const std::string& path)
+{
+#ifdef _WIN32
+    const int processId = _getpid();
+#else
+    const int processId = getpid();
+#endif
+    return path + ".tmp" + std::to_string(processId) + "_" +
+        std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+}
+
+
+bool replaceFile(const std::string& from, const std::string& to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+
+bool writeFileAtomically(const std::string& path, const FileBlocks& blocks)
+{
+    const std::string temporary = temporaryFilePath(path);
+
+    FILE* file = std::fopen(temporary.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+
+    bool written = true;
+    for (const auto& block : blocks) {
+        if (block.second > 0 && std::fwrite(block.first, 1, block.second, file) != block.second) {
+            written = false;
+            break;
+        }
+    }
+    written = (std::fclose(file) == 0) && written;
+
+    written = written && replaceFile(temporary, path);
+    if (!written) {
+        std::remove(temporary.c_str());
+    }
+    return written;
+}
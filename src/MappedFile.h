@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// A whole file mapped read only into memory. Data written with
+// writeFileAtomically is used in place, so the layout of such files must be
+// plain arrays at known offsets.
+class MappedFile
+{
+public:
+    // nullptr when the file does not exist or cannot be mapped
+    static std::shared_ptr<MappedFile> open(const std::string& path);
+
+    // The file mapped for reading and writing, shared with every other
+    // process mapping it. A missing or empty file is created with `size`
+    // zero bytes, an existing one is mapped at its own size.
+    static std::shared_ptr<MappedFile> openShared(const std::string& path, size_t size);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return this->address; }
+    char* writableData() const { return this->writable ? (char*)this->address : nullptr; }
+    size_t size() const { return this->length; }
+
+    // Ask the OS to start reading the given byte range in the background, so
+    // that a later access does not stall on the disk.
+    void prefetch(size_t offset, size_t size) const;
+
+private:
+    MappedFile() {}
+
+    const char* address = nullptr;
+    size_t length = 0;
+    bool writable = false;
+#ifdef _WIN32
+    void* fileHandle = nullptr;
+    void* mappingHandle = nullptr;
+#endif
+};
+
+
+// Blocks of one file, written in order.
+using FileBlocks = std::vector<std::pair<const void*, size_t>>;
+
+// Write to a temporary file next to `path` and rename it into place, so that
+// concurrent readers and writers of the same path only ever see complete files.
+bool writeFileAtomically(const std::string& path, const FileBlocks& blocks);
+
+// The two halves of writeFileAtomically, for files written in several steps:
+// a temporary path next to `path` unique to this process and thread, and the
+// rename that replaces `path` with it.
+std::string temporaryFilePath(const std::string& path);
+bool replaceFile(const std::string& from, const std::string& to);
@@ -0,0 +1,101 @@
+#include "MotionBound.h"
+
+#include <maya/MPoint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+
+const double MOTION_BOUND_SAFETY = 2.0;     // headroom over the speed seen so far
+
+
+// Largest separation of the boxes along any axis, negative when they overlap.
+static double boxGap(const MBoundingBox& a, const MBoundingBox& b)
+{
+    const MPoint aMin = a.min(), aMax = a.max();
+    const MPoint bMin = b.min(), bMax = b.max();
+
+    double gap = -std::numeric_limits<double>::infinity();
+    for (int axis = 0; axis < 3; ++axis) {
+        gap = std::max(gap, std::max(aMin[axis] - bMax[axis], bMin[axis] - aMax[axis]));
+    }
+    return gap;
+}
+
+
+// How far any face of the box has moved.
+static double boxDisplacement(const MBoundingBox& from, const MBoundingBox& to)
+{
+    const MPoint fromMin = from.min(), fromMax = from.max();
+    const MPoint toMin = to.min(), toMax = to.max();
+
+    double displacement = 0.0;
+    for (int axis = 0; axis < 3; ++axis) {
+        displacement = std::max(displacement, std::fabs(toMin[axis] - fromMin[axis]));
+        displacement = std::max(displacement, std::fabs(toMax[axis] - fromMax[axis]));
+    }
+    return displacement;
+}
+
+
+bool MotionBound::canSkip(double frame, const MBoundingBox& boxA, const MBoundingBox& boxB)
+{
+    // Revalidate: while every face of a box moved at most `speed` per frame,
+    // the gap along the separating axis shrinks by at most the sum of both
+    // speeds per frame, which is what `frames` was derived from.
+    if (this->valid) {
+        const MBoundingBox boxes[2] = { boxA, boxB };
+        const double elapsed = std::fabs(frame - this->anchorFrame);
+
+        bool inside = elapsed < this->frames;
+        for (int side = 0; side < 2 && inside; ++side) {
+            inside = boxDisplacement(this->anchorBoxes[side], boxes[side]) <= this->speed[side] * elapsed;
+        }
+        if (inside) {
+            return true;
+        }
+    }
+
+    anchor(frame, boxA, boxB);
+    return this->frames > 0.0;
+}
+
+
+void MotionBound::anchor(double frame, const MBoundingBox& boxA, const MBoundingBox& boxB)
+{
+    const MBoundingBox boxes[2] = { boxA, boxB };
+
+    // The speed is re-measured from the last anchor, so a mesh that stopped
+    // gives its share of the gap back to the other one.
+    if (this->valid) {
+        const double elapsed = std::max(1.0, std::fabs(frame - this->anchorFrame));
+        for (int side = 0; side < 2; ++side) {
+            this->speed[side] = MOTION_BOUND_SAFETY * boxDisplacement(this->anchorBoxes[side], boxes[side]) / elapsed;
+        }
+    }
+
+    const double gap = boxGap(boxA, boxB);
+    const double closing = this->speed[0] + this->speed[1];
+    if (gap <= 0.0) {
+        this->frames = 0.0;
+    } else if (closing > 0.0) {
+        this->frames = gap / closing;
+    } else {
+        this->frames = std::numeric_limits<double>::infinity();
+    }
+
+    this->valid = true;
+    this->anchorFrame = frame;
+    this->anchorBoxes[0] = boxA;
+    this->anchorBoxes[1] = boxB;
+}
+
+
+void MotionBound::reset()
+{
+    this->valid = false;
+    this->speed[0] = 0.0;
+    this->speed[1] = 0.0;
+    this->frames = 0.0;
+}
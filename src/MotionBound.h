@@ -0,0 +1,30 @@
+#pragma once
+
+#include <maya/MBoundingBox.h>
+
+
+// Conservative advancement across frames. While the world boxes of the two
+// meshes are apart, the gap between them and how far each box has moved per
+// frame give the number of frames in which they cannot touch, and those frames
+// skip the intersection pass. Each skipped frame still checks that both boxes
+// stay inside the envelope the prediction assumed; a mesh that moves faster
+// than before ends the skip instead of missing a contact.
+class MotionBound
+{
+public:
+    // True when the meshes cannot intersect at `frame`. Boxes are world space.
+    bool canSkip(double frame, const MBoundingBox& boxA, const MBoundingBox& boxB);
+    void reset();
+
+    // Frames after the anchor frame that are known to be free of contact.
+    double skippableFrames() const { return this->frames; }
+
+private:
+    bool valid = false;
+    double anchorFrame = 0.0;         // frame the prediction was made at
+    MBoundingBox anchorBoxes[2];
+    double speed[2] = { 0.0, 0.0 };   // bound on each box's displacement per frame
+    double frames = 0.0;
+
+    void anchor(double frame, const MBoundingBox& boxA, const MBoundingBox& boxB);
+};
@@ -0,0 +1,254 @@
+#include "PointCache.h"
+
+#include <maya/MFloatPointArray.h>
+#include <maya/MFnMesh.h>
+#include <maya/MFnMeshData.h>
+#include <maya/MGlobal.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+
+const char POINT_CACHE_MAGIC[8] = "IMPTC";
+const uint32_t POINT_CACHE_VERSION = 1;
+const uint64_t POINT_CACHE_ALIGNMENT = 4096;    // frame blocks start on a page
+
+
+static uint64_t alignUp(uint64_t offset, uint64_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+
+PointCacheWriter::~PointCacheWriter()
+{
+    if (this->file) {
+        std::fclose(this->file);
+        std::remove(this->temporary.c_str());
+    }
+}
+
+
+bool PointCacheWriter::write(const void* data, size_t size)
+{
+    if (size > 0 && std::fwrite(data, 1, size, this->file) != size) {
+        return false;
+    }
+    this->offset += size;
+    return true;
+}
+
+
+bool PointCacheWriter::pad(uint64_t alignment)
+{
+    static const char zeros[POINT_CACHE_ALIGNMENT] = {};
+    return write(zeros, (size_t)(alignUp(this->offset, alignment) - this->offset));
+}
+
+
+MStatus PointCacheWriter::open(
+    const std::string& path,
+    const MIntArray& polygonCounts,
+    const MIntArray& polygonConnects,
+    unsigned int numVertices
+) {
+    this->path = path;
+    this->temporary = temporaryFilePath(path);
+    this->file = std::fopen(this->temporary.c_str(), "wb");
+    if (!this->file) {
+        MGlobal::displayError(MString("Cannot write point cache ") + path.c_str());
+        return MStatus::kFailure;
+    }
+
+    std::memset(&this->header, 0, sizeof(this->header));
+    std::memcpy(this->header.magic, POINT_CACHE_MAGIC, sizeof(this->header.magic));
+    this->header.version = POINT_CACHE_VERSION;
+    this->header.numVertices = numVertices;
+    this->header.numPolygons = polygonCounts.length();
+    this->header.numFaceVertices = polygonConnects.length();
+    this->header.frameStride = alignUp((uint64_t)numVertices * 3 * sizeof(float), POINT_CACHE_ALIGNMENT);
+
+    std::vector<int32_t> counts(polygonCounts.length());
+    std::vector<int32_t> connects(polygonConnects.length());
+    polygonCounts.get(counts.data());
+    polygonConnects.get(connects.data());
+
+    // the header is written again with the final counts on close
+    bool written = write(&this->header, sizeof(this->header));
+    this->header.countsOffset = this->offset;
+    written = written && write(counts.data(), counts.size() * sizeof(int32_t));
+    this->header.connectsOffset = this->offset;
+    written = written && write(connects.data(), connects.size() * sizeof(int32_t));
+    written = written && pad(POINT_CACHE_ALIGNMENT);
+    this->header.framesOffset = this->offset;
+
+    this->block.assign((size_t)this->header.frameStride, 0);
+    return written ? MStatus::kSuccess : MStatus::kFailure;
+}
+
+
+MStatus PointCacheWriter::appendFrame(double time, const MPointArray& points)
+{
+    if (!this->file || points.length() != this->header.numVertices) {
+        MGlobal::displayError("Point caches need the same number of vertices in every frame");
+        return MStatus::kFailure;
+    }
+
+    float* values = (float*)this->block.data();
+    for (unsigned int i = 0; i < points.length(); ++i) {
+        values[i * 3 + 0] = (float)points[i].x;
+        values[i * 3 + 1] = (float)points[i].y;
+        values[i * 3 + 2] = (float)points[i].z;
+    }
+
+    if (!write(this->block.data(), this->block.size())) {
+        return MStatus::kFailure;
+    }
+    this->times.push_back(time);
+
+    return MStatus::kSuccess;
+}
+
+
+MStatus PointCacheWriter::close()
+{
+    if (!this->file) {
+        return MStatus::kFailure;
+    }
+
+    this->header.numFrames = this->times.size();
+    this->header.timesOffset = this->offset;
+    bool written = write(this->times.data(), this->times.size() * sizeof(double));
+    written = written && std::fseek(this->file, 0, SEEK_SET) == 0;
+    written = written && std::fwrite(&this->header, sizeof(this->header), 1, this->file) == 1;
+    written = (std::fclose(this->file) == 0) && written;
+    this->file = nullptr;
+
+    written = written && replaceFile(this->temporary, this->path);
+    if (!written) {
+        std::remove(this->temporary.c_str());
+        MGlobal::displayError(MString("Failed to write point cache ") + this->path.c_str());
+        return MStatus::kFailure;
+    }
+
+    return MStatus::kSuccess;
+}
+
+
+std::shared_ptr<PointCache> PointCache::open(const std::string& path)
+{
+    std::shared_ptr<MappedFile> file = MappedFile::open(path);
+    if (!file || file->size() < sizeof(PointCacheHeader)) {
+        return nullptr;
+    }
+
+    const PointCacheHeader* header = (const PointCacheHeader*)file->data();
+    if (std::memcmp(header->magic, POINT_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != POINT_CACHE_VERSION
+    ) {
+        return nullptr;
+    }
+
+    // counts the accessors hand out as unsigned int, frame blocks whose size
+    // does not overflow and that do not all start at the same offset
+    const uint64_t maxCount = std::numeric_limits<unsigned int>::max();
+    if (header->numVertices > maxCount ||
+        header->numPolygons > maxCount ||
+        header->numFaceVertices > maxCount ||
+        header->frameStride == 0
+    ) {
+        return nullptr;
+    }
+
+    // every section inside the file, each frame block large enough
+    const uint64_t size = file->size();
+    auto fits = [size](uint64_t offset, uint64_t count, uint64_t elementSize) {
+        return offset <= size && count <= (size - offset) / elementSize;
+    };
+    if (!fits(header->countsOffset, header->numPolygons, sizeof(int32_t)) ||
+        !fits(header->connectsOffset, header->numFaceVertices, sizeof(int32_t)) ||
+        !fits(header->timesOffset, header->numFrames, sizeof(double)) ||
+        header->timesOffset % sizeof(double) != 0 ||
+        header->framesOffset % POINT_CACHE_ALIGNMENT != 0 ||
+        header->frameStride < header->numVertices * 3 * sizeof(float) ||
+        header->frameStride % POINT_CACHE_ALIGNMENT != 0 ||
+        (header->numFrames > 0 && !fits(header->framesOffset, header->numFrames, header->frameStride))
+    ) {
+        return nullptr;
+    }
+
+    std::shared_ptr<PointCache> cache(new PointCache());
+    cache->file = file;
+    cache->header = header;
+    cache->polygonCounts = (const int32_t*)(file->data() + header->countsOffset);
+    cache->polygonConnects = (const int32_t*)(file->data() + header->connectsOffset);
+    cache->times = (const double*)(file->data() + header->timesOffset);
+
+    // the topology must describe a valid mesh before it is handed to Maya
+    uint64_t faceVertices = 0;
+    for (uint64_t i = 0; i < header->numPolygons; ++i) {
+        faceVertices += (uint64_t)std::max(0, (int)cache->polygonCounts[i]);
+    }
+    if (faceVertices != header->numFaceVertices) {
+        return nullptr;
+    }
+    for (uint64_t i = 0; i < header->numFaceVertices; ++i) {
+        if (cache->polygonConnects[i] < 0 || (uint64_t)cache->polygonConnects[i] >= header->numVertices) {
+            return nullptr;
+        }
+    }
+
+    return cache;
+}
+
+
+void PointCache::prefetch(size_t frame) const
+{
+    if (frame < numFrames()) {
+        this->file->prefetch((size_t)(this->header->framesOffset + frame * this->header->frameStride), (size_t)this->header->frameStride);
+    }
+}
+
+
+static MFloatPointArray framePoints(const PointCache& cache, size_t frame)
+{
+    const float* values = cache.points(frame);
+    MFloatPointArray points(cache.numVertices());
+    for (unsigned int i = 0; i < cache.numVertices(); ++i) {
+        points.set(i, values[i * 3 + 0], values[i * 3 + 1], values[i * 3 + 2]);
+    }
+    return points;
+}
+
+
+MStatus PointCache::createMesh(MObject& meshData) const
+{
+    MStatus status;
+    if (numFrames() == 0) {
+        return MStatus::kFailure;
+    }
+
+    MFnMeshData dataFn;
+    meshData = dataFn.create(&status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    MIntArray counts(this->polygonCounts, numPolygons());
+    MIntArray connects(this->polygonConnects, (unsigned int)this->header->numFaceVertices);
+
+    MFnMesh meshFn;
+    meshFn.create(numVertices(), numPolygons(), framePoints(*this, 0), counts, connects, meshData, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    return MStatus::kSuccess;
+}
+
+
+MStatus PointCache::setPoints(MObject& meshData, size_t frame) const
+{
+    MStatus status;
+    MFnMesh meshFn(meshData, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    return meshFn.setPoints(framePoints(*this, frame), MSpace::kObject);
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "MappedFile.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <maya/MObject.h>
+#include <maya/MStatus.h>
+#include <maya/MIntArray.h>
+#include <maya/MPointArray.h>
+
+
+// Point cache files: the topology of one mesh once, then its points for each
+// frame as float x y z triples. Every frame block starts on a page boundary,
+// so a reader maps the file and hands out pointers into it, and the blocks of
+// upcoming frames can be prefetched while the current one is tested.
+//
+//   PointCacheHeader
+//   int32 polygon vertex counts [numPolygons]
+//   int32 polygon vertex ids    [numFaceVertices]
+//   frame blocks                [numFrames], frameStride bytes apart
+//   double frame times          [numFrames]
+//
+// Points are stored in world space, readers use them with an identity offset.
+struct PointCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t numVertices;
+    uint64_t numPolygons;
+    uint64_t numFaceVertices;
+    uint64_t numFrames;
+    uint64_t countsOffset;
+    uint64_t connectsOffset;
+    uint64_t framesOffset;
+    uint64_t frameStride;
+    uint64_t timesOffset;
+};
+
+
+// Writes a point cache one frame at a time to a temporary file, which replaces
+// `path` on close(). A writer destroyed before close() leaves nothing behind.
+class PointCacheWriter
+{
+public:
+    ~PointCacheWriter();
+
+    MStatus open(const std::string& path, const MIntArray& polygonCounts, const MIntArray& polygonConnects, unsigned int numVertices);
+    MStatus appendFrame(double time, const MPointArray& points);
+    MStatus close();
+
+private:
+    std::string path;
+    std::string temporary;
+    FILE* file = nullptr;
+    uint64_t offset = 0;            // bytes written so far
+    PointCacheHeader header;
+    std::vector<double> times;
+    std::vector<char> block;
+
+    bool write(const void* data, size_t size);
+    bool pad(uint64_t alignment);
+};
+
+
+class PointCache
+{
+public:
+    // nullptr when the file is missing or not a point cache of this version
+    static std::shared_ptr<PointCache> open(const std::string& path);
+
+    unsigned int numVertices() const { return (unsigned int)this->header->numVertices; }
+    unsigned int numPolygons() const { return (unsigned int)this->header->numPolygons; }
+    size_t numFrames() const { return (size_t)this->header->numFrames; }
+    double time(size_t frame) const { return this->times[frame]; }
+
+    // numVertices() x y z triples of the given frame
+    const float* points(size_t frame) const
+    {
+        return (const float*)(this->file->data() + this->header->framesOffset + frame * this->header->frameStride);
+    }
+
+    // Start reading the given frame in the background.
+    void prefetch(size_t frame) const;
+
+    // A mesh data object with the cached topology, not part of the DG, and
+    // the points of one frame written into it.
+    MStatus createMesh(MObject& meshData) const;
+    MStatus setPoints(MObject& meshData, size_t frame) const;
+
+private:
+    PointCache() {}
+
+    std::shared_ptr<MappedFile> file;
+    const PointCacheHeader* header = nullptr;
+    const int32_t* polygonCounts = nullptr;
+    const int32_t* polygonConnects = nullptr;
+    const double* times = nullptr;
+};
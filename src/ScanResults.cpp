@@ -0,0 +1,153 @@
+#include "ScanResults.h"
+#include "MappedFile.h"
+
+#include <maya/MGlobal.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+
+
+const char SCAN_RESULTS_MAGIC[8] = "IMRES";
+const uint32_t SCAN_RESULTS_VERSION = 1;
+
+
+bool writeScanResults(const std::string& path, const std::vector<FrameResult>& results)
+{
+    std::vector<char> buffer;
+    auto append = [&buffer](const void* data, size_t size) {
+        buffer.insert(buffer.end(), (const char*)data, (const char*)data + size);
+    };
+
+    const uint32_t version = SCAN_RESULTS_VERSION;
+    const uint32_t numFrames = (uint32_t)results.size();
+    append(SCAN_RESULTS_MAGIC, sizeof(SCAN_RESULTS_MAGIC));
+    append(&version, sizeof(version));
+    append(&numFrames, sizeof(numFrames));
+
+    for (const FrameResult& result : results) {
+        const uint32_t counts[2] = { (uint32_t)result.facesA.size(), (uint32_t)result.facesB.size() };
+        append(&result.time, sizeof(result.time));
+        append(counts, sizeof(counts));
+        append(result.facesA.data(), result.facesA.size() * sizeof(int));
+        append(result.facesB.data(), result.facesB.size() * sizeof(int));
+    }
+
+    return writeFileAtomically(path, { { buffer.data(), buffer.size() } });
+}
+
+
+bool readScanResults(const std::string& path, std::vector<FrameResult>& results)
+{
+    std::shared_ptr<MappedFile> file = MappedFile::open(path);
+    if (!file) {
+        return false;
+    }
+
+    const char* cursor = file->data();
+    const char* end = file->data() + file->size();
+    auto read = [&cursor, end](void* data, size_t size) {
+        if ((size_t)(end - cursor) < size) {
+            return false;
+        }
+        std::memcpy(data, cursor, size);
+        cursor += size;
+        return true;
+    };
+
+    char magic[8];
+    uint32_t version;
+    uint32_t numFrames;
+    if (!read(magic, sizeof(magic)) || std::memcmp(magic, SCAN_RESULTS_MAGIC, sizeof(magic)) != 0 ||
+        !read(&version, sizeof(version)) || version != SCAN_RESULTS_VERSION ||
+        !read(&numFrames, sizeof(numFrames))
+    ) {
+        return false;
+    }
+
+    for (uint32_t frame = 0; frame < numFrames; ++frame) {
+        FrameResult result;
+        uint32_t counts[2];
+        if (!read(&result.time, sizeof(result.time)) || !read(counts, sizeof(counts)) ||
+            (size_t)(end - cursor) / sizeof(int) < (size_t)counts[0] + counts[1]
+        ) {
+            return false;
+        }
+        result.facesA.resize(counts[0]);
+        result.facesB.resize(counts[1]);
+        read(result.facesA.data(), counts[0] * sizeof(int));
+        read(result.facesB.data(), counts[1] * sizeof(int));
+        results.push_back(std::move(result));
+    }
+
+    return true;
+}
+
+
+static void writeFaceList(std::ostringstream& out, const std::vector<int>& faces)
+{
+    out << "[";
+    for (size_t i = 0; i < faces.size(); ++i) {
+        out << (i > 0 ? ", " : "") << faces[i];
+    }
+    out << "]";
+}
+
+
+MStatus mergeScanResults(const std::vector<std::string>& paths, const std::string& reportPath)
+{
+    std::vector<FrameResult> results;
+    for (const std::string& path : paths) {
+        if (!readScanResults(path, results)) {
+            MGlobal::displayError(MString("Cannot read scan results ") + path.c_str());
+            return MStatus::kFailure;
+        }
+    }
+
+    std::stable_sort(results.begin(), results.end(), [](const FrameResult& a, const FrameResult& b) {
+        return a.time < b.time;
+    });
+    results.erase(
+        std::unique(results.begin(), results.end(), [](const FrameResult& a, const FrameResult& b) {
+            return a.time == b.time;
+        }),
+        results.end());
+
+    std::ostringstream out;
+    out.precision(17);
+    out << "{\n";
+    out << "  \"scannedFrames\": " << results.size() << ",\n";
+    out << "  \"intersectedFrames\": [";
+    bool first = true;
+    for (const FrameResult& result : results) {
+        if (!result.facesA.empty() || !result.facesB.empty()) {
+            out << (first ? "" : ", ") << result.time;
+            first = false;
+        }
+    }
+    out << "],\n";
+    out << "  \"frames\": [";
+    first = true;
+    for (const FrameResult& result : results) {
+        if (result.facesA.empty() && result.facesB.empty()) {
+            continue;
+        }
+        out << (first ? "\n" : ",\n") << "    {\"time\": " << result.time << ", \"facesA\": ";
+        writeFaceList(out, result.facesA);
+        out << ", \"facesB\": ";
+        writeFaceList(out, result.facesB);
+        out << "}";
+        first = false;
+    }
+    out << (first ? "]\n" : "\n  ]\n");
+    out << "}\n";
+
+    const std::string report = out.str();
+    if (!writeFileAtomically(reportPath, { { report.data(), report.size() } })) {
+        MGlobal::displayError(MString("Cannot write report ") + reportPath.c_str());
+        return MStatus::kFailure;
+    }
+
+    return MStatus::kSuccess;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "BatchScan.h"
+
+#include <string>
+#include <vector>
+
+
+// Scan result files: the faces found in each scanned frame, written by one
+// scan (or one shard of a frame range) and combined into a report by
+// mergeScanResults.
+//
+//   char[8] magic, uint32 version, uint32 number of frames
+//   per frame: double time, uint32 faces of A, uint32 faces of B, int32 face ids of A, then of B
+bool writeScanResults(const std::string& path, const std::vector<FrameResult>& results);
+bool readScanResults(const std::string& path, std::vector<FrameResult>& results);
+
+// Read the given result files, order their frames by time and write them as
+// one JSON report. Frames that appear in several files are kept once.
+MStatus mergeScanResults(const std::vector<std::string>& paths, const std::string& reportPath);
@@ -0,0 +1,270 @@
+#include "SharedResultCache.h"
+#include "MappedFile.h"
+#include "utility.h"
+
+#include <maya/MFnMesh.h>
+#include <maya/MGlobal.h>
+#include <maya/MIntArray.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+
+const char* const SHARED_CACHE_ENVIRONMENT_VARIABLE = "INTERSECTION_MARKER_SHARED_CACHE";
+const char* const SHARED_CACHE_SIZE_ENVIRONMENT_VARIABLE = "INTERSECTION_MARKER_SHARED_CACHE_MB";
+const size_t SHARED_CACHE_DEFAULT_MB = 256;
+const size_t SHARED_CACHE_BYTES_PER_SLOT = 1024;    // index slots for the expected number of results
+const int SHARED_CACHE_MAX_PROBES = 32;             // slots tried before a result is not stored
+const char SHARED_CACHE_MAGIC[8] = "IMSRC";
+const uint32_t SHARED_CACHE_VERSION = 1;
+
+enum SharedCacheState : uint32_t
+{
+    SHARED_CACHE_EMPTY = 0,           // fresh zero filled file
+    SHARED_CACHE_INITIALIZING = 1,
+    SHARED_CACHE_READY = 2,
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free,
+    "the shared cache needs address free atomics");
+
+
+struct SharedCacheHeader
+{
+    std::atomic<uint32_t> state;
+    uint32_t version;
+    char magic[8];
+    uint64_t numSlots;                // a power of two
+    uint64_t arenaOffset;
+    uint64_t arenaSize;
+    std::atomic<uint64_t> arenaUsed;
+};
+
+
+// A key of 0 marks a free slot, a location of 0 an entry that is still
+// being published.
+struct SharedCacheSlot
+{
+    std::atomic<uint64_t> key;
+    std::atomic<uint64_t> location;   // offset into the arena plus one
+};
+
+
+// Records in the arena, faces of A then of B follow.
+struct SharedCacheRecord
+{
+    uint64_t key;
+    uint32_t numFacesA;
+    uint32_t numFacesB;
+};
+
+
+// 0 is the free slot marker and never a key
+static uint64_t slotKey(uint64_t key)
+{
+    return key != 0 ? key : 1;
+}
+
+
+SharedResultCache* SharedResultCache::instance()
+{
+    static std::unique_ptr<SharedResultCache> cache = []() -> std::unique_ptr<SharedResultCache> {
+        const char* path = std::getenv(SHARED_CACHE_ENVIRONMENT_VARIABLE);
+        if (!path || !*path) {
+            return nullptr;
+        }
+
+        size_t megabytes = SHARED_CACHE_DEFAULT_MB;
+        if (const char* value = std::getenv(SHARED_CACHE_SIZE_ENVIRONMENT_VARIABLE)) {
+            megabytes = std::max<size_t>(1, (size_t)std::strtoull(value, nullptr, 10));
+        }
+
+        std::unique_ptr<SharedResultCache> cache(new SharedResultCache());
+        if (!cache->open(path, megabytes << 20)) {
+            MGlobal::displayWarning(MString("Cannot use the shared intersection cache ") + path);
+            return nullptr;
+        }
+        return cache;
+    }();
+
+    return cache.get();
+}
+
+
+bool SharedResultCache::open(const std::string& path, size_t size)
+{
+    this->file = MappedFile::openShared(path, size);
+    if (!this->file || this->file->size() < sizeof(SharedCacheHeader) + sizeof(SharedCacheSlot)) {
+        return false;
+    }
+
+    char* base = this->file->writableData();
+    this->header = (SharedCacheHeader*)base;
+
+    // The first process to map the fresh file lays it out; the others wait
+    // for it to finish, but not forever, in case it died halfway.
+    uint32_t state = SHARED_CACHE_EMPTY;
+    if (this->header->state.compare_exchange_strong(state, SHARED_CACHE_INITIALIZING)) {
+        uint64_t numSlots = 1;
+        while (numSlots * 2 * SHARED_CACHE_BYTES_PER_SLOT <= this->file->size()) {
+            numSlots *= 2;
+        }
+        std::memcpy(this->header->magic, SHARED_CACHE_MAGIC, sizeof(this->header->magic));
+        this->header->version = SHARED_CACHE_VERSION;
+        this->header->numSlots = numSlots;
+        this->header->arenaOffset = sizeof(SharedCacheHeader) + numSlots * sizeof(SharedCacheSlot);
+        this->header->arenaSize = this->file->size() - std::min<uint64_t>(this->file->size(), this->header->arenaOffset);
+        this->header->arenaUsed.store(0);
+        this->header->state.store(SHARED_CACHE_READY, std::memory_order_release);
+    } else {
+        for (int wait = 0; wait < 1000 && this->header->state.load(std::memory_order_acquire) != SHARED_CACHE_READY; ++wait) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    if (this->header->state.load(std::memory_order_acquire) != SHARED_CACHE_READY ||
+        std::memcmp(this->header->magic, SHARED_CACHE_MAGIC, sizeof(this->header->magic)) != 0 ||
+        this->header->version != SHARED_CACHE_VERSION ||
+        this->header->numSlots == 0 || (this->header->numSlots & (this->header->numSlots - 1)) != 0 ||
+        this->header->arenaOffset != sizeof(SharedCacheHeader) + this->header->numSlots * sizeof(SharedCacheSlot) ||
+        this->header->arenaOffset + this->header->arenaSize != this->file->size()
+    ) {
+        return false;
+    }
+
+    this->slots = (SharedCacheSlot*)(base + sizeof(SharedCacheHeader));
+    this->arena = base + this->header->arenaOffset;
+    return true;
+}
+
+
+bool SharedResultCache::find(uint64_t key, std::unordered_set<int>& facesA, std::unordered_set<int>& facesB) const
+{
+    key = slotKey(key);
+    const uint64_t mask = this->header->numSlots - 1;
+
+    for (int probe = 0; probe < SHARED_CACHE_MAX_PROBES; ++probe) {
+        const SharedCacheSlot& slot = this->slots[(key + probe) & mask];
+        const uint64_t slotKey = slot.key.load(std::memory_order_acquire);
+        if (slotKey == 0) {
+            return false;
+        }
+        if (slotKey != key) {
+            continue;
+        }
+
+        const uint64_t location = slot.location.load(std::memory_order_acquire);
+        if (location == 0 || location - 1 + sizeof(SharedCacheRecord) > this->header->arenaSize) {
+            return false;
+        }
+
+        const SharedCacheRecord* record = (const SharedCacheRecord*)(this->arena + location - 1);
+        const uint64_t bytes = sizeof(SharedCacheRecord) + ((uint64_t)record->numFacesA + record->numFacesB) * sizeof(int32_t);
+        if (record->key != key || location - 1 + bytes > this->header->arenaSize) {
+            return false;
+        }
+
+        const int32_t* faces = (const int32_t*)(record + 1);
+        facesA.clear();
+        facesB.clear();
+        facesA.insert(faces, faces + record->numFacesA);
+        facesB.insert(faces + record->numFacesA, faces + record->numFacesA + record->numFacesB);
+        return true;
+    }
+
+    return false;
+}
+
+
+void SharedResultCache::insert(uint64_t key, const std::unordered_set<int>& facesA, const std::unordered_set<int>& facesB)
+{
+    key = slotKey(key);
+    const uint64_t mask = this->header->numSlots - 1;
+
+    // a result that is already there costs no arena space
+    for (int probe = 0; probe < SHARED_CACHE_MAX_PROBES; ++probe) {
+        const uint64_t slotKey = this->slots[(key + probe) & mask].key.load(std::memory_order_acquire);
+        if (slotKey == 0) {
+            break;
+        }
+        if (slotKey == key) {
+            return;
+        }
+    }
+
+    // Reserve the record before a slot is claimed: a slot whose record does
+    // not fit would stay unpublished and hide the key for good. The arena
+    // never grows past its end, so a smaller result may still fit later.
+    const uint64_t bytes = (sizeof(SharedCacheRecord) + (facesA.size() + facesB.size()) * sizeof(int32_t) + 7) / 8 * 8;
+    uint64_t offset = this->header->arenaUsed.load(std::memory_order_relaxed);
+    do {
+        if (offset + bytes > this->header->arenaSize) {
+            return;
+        }
+    } while (!this->header->arenaUsed.compare_exchange_weak(offset, offset + bytes, std::memory_order_relaxed));
+
+    SharedCacheRecord* record = (SharedCacheRecord*)(this->arena + offset);
+    record->key = key;
+    record->numFacesA = (uint32_t)facesA.size();
+    record->numFacesB = (uint32_t)facesB.size();
+    int32_t* faces = (int32_t*)(record + 1);
+    for (int face : facesA) {
+        *faces++ = face;
+    }
+    for (int face : facesB) {
+        *faces++ = face;
+    }
+
+    // a process that stored the same result meanwhile wins, the record is left unused
+    for (int probe = 0; probe < SHARED_CACHE_MAX_PROBES; ++probe) {
+        SharedCacheSlot& slot = this->slots[(key + probe) & mask];
+        uint64_t expected = 0;
+        if (slot.key.compare_exchange_strong(expected, key, std::memory_order_acq_rel)) {
+            slot.location.store(offset + 1, std::memory_order_release);
+            return;
+        }
+        if (expected == key) {
+            return;
+        }
+    }
+}
+
+
+static uint64_t hashMesh(const MObject& meshObject, const MMatrix& offsetMatrix, uint64_t seed)
+{
+    MFnMesh meshFn(meshObject);
+    const float* points = meshFn.getRawPoints(nullptr);
+
+    MIntArray polygonCounts;
+    MIntArray polygonVertices;
+    meshFn.getVertices(polygonCounts, polygonVertices);
+    std::vector<int> counts(polygonCounts.length());
+    std::vector<int> vertices(polygonVertices.length());
+    polygonCounts.get(counts.data());
+    polygonVertices.get(vertices.data());
+
+    uint64_t hash = seed;
+    if (points) {
+        hash = hashBytes64(points, sizeof(float) * 3 * meshFn.numVertices(), hash);
+    }
+    hash = hashBytes64(counts.data(), sizeof(int) * counts.size(), hash);
+    hash = hashBytes64(vertices.data(), sizeof(int) * vertices.size(), hash);
+    hash = hashBytes64(offsetMatrix.matrix, sizeof(offsetMatrix.matrix), hash);
+    return hash;
+}
+
+
+uint64_t sharedResultKey(
+    const MObject& meshA, const MMatrix& offsetA,
+    const MObject& meshB, const MMatrix& offsetB,
+    const ScanSettings& settings
+) {
+    const int values[3] = { (int)settings.kernel, settings.collisionMode, (int)settings.compressBVH };
+    uint64_t hash = hashBytes64(values, sizeof(values), SHARED_CACHE_VERSION);
+    hash = hashMesh(meshA, offsetA, hash);
+    return hashMesh(meshB, offsetB, hash);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "BatchScan.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_set>
+
+#include <maya/MObject.h>
+#include <maya/MMatrix.h>
+
+class MappedFile;
+
+
+struct SharedCacheHeader;
+struct SharedCacheSlot;
+
+
+// Intersection results shared by every Maya process on a host, in a file
+// that all of them map. Results are appended to an arena with an atomic add
+// and published in an open addressing index whose slots are claimed with a
+// compare and swap, so processes never wait on each other and a process
+// that dies halfway leaves at most an entry nobody finds. The file has a
+// fixed size: once the arena is full new results are no longer stored;
+// deleting the file starts a fresh cache.
+//
+// Enabled by setting INTERSECTION_MARKER_SHARED_CACHE to the file path,
+// INTERSECTION_MARKER_SHARED_CACHE_MB sets the size of a new file.
+class SharedResultCache
+{
+public:
+    // nullptr when the cache is not enabled or its file cannot be used
+    static SharedResultCache* instance();
+
+    bool find(uint64_t key, std::unordered_set<int>& facesA, std::unordered_set<int>& facesB) const;
+    void insert(uint64_t key, const std::unordered_set<int>& facesA, const std::unordered_set<int>& facesB);
+
+    bool open(const std::string& path, size_t size);
+
+private:
+    std::shared_ptr<MappedFile> file;
+    SharedCacheHeader* header = nullptr;
+    SharedCacheSlot* slots = nullptr;
+    char* arena = nullptr;
+};
+
+
+// Key of a pair of meshes for the shared cache: a 64 bit hash of both meshes'
+// points, face vertex lists and offset matrices, and the settings.
+uint64_t sharedResultKey(
+    const MObject& meshA, const MMatrix& offsetA,
+    const MObject& meshB, const MMatrix& offsetB,
+    const ScanSettings& settings);
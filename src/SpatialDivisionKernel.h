@@ -7,6 +7,7 @@
 
 #include <maya/MDagPath.h>
 #include <maya/MPoint.h>
+#include <maya/MPointArray.h>
 #include <maya/MStatus.h>
 #include <maya/MMatrix.h>
 
@@ -21,5 +22,11 @@ public:
     virtual                   MStatus build(const MObject& meshObject, const MBoundingBox& bbox, const MMatrix& offsetMatrix) = 0;
     virtual std::vector<TriangleData> intersectKernelTriangle(const TriangleData& triangle) const = 0;
     virtual           K2KIntersection intersectKernelKernel(SpatialDivisionKernel& otherKernel) const = 0;
+
+    // Move the given vertices of the built mesh to `points`, which hold every
+    // vertex with the offset matrix already applied, and refit what depends on
+    // them. Kernels that cannot update in place return false and must be built
+    // again.
+    virtual                      bool updatePoints(const MPointArray& points, const std::vector<int>& movedVertices) { return false; }
 };
 
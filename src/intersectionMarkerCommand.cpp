@@ -6,8 +6,17 @@
 
 #include "intersectionMarkerNode.h"
 #include "intersectionMarkerCommand.h"
-
+#include "PointCache.h"
+#include "BatchScan.h"
+#include "MotionBound.h"
+#include "ScanResults.h"
+#include "InputCapture.h"
+#include "kernel/TriangleBlocks.h"
+
+#include <algorithm>
 #include <string>
+#include <unordered_set>
+#include <vector>
 
 #include <maya/MDagPath.h>
 #include <maya/MString.h>
@@ -23,7 +32,45 @@
 #include <maya/MGlobal.h>
 
 #include <maya/MFnMesh.h>
+#include <maya/MFnMatrixData.h>
 #include <maya/MPlug.h>
+#include <maya/MPointArray.h>
+#include <maya/MDoubleArray.h>
+#include <maya/MIntArray.h>
+#include <maya/MAnimControl.h>
+#include <maya/MTime.h>
+#include <maya/MDGContext.h>
+#include <maya/MDGContextGuard.h>
+
+
+// Batch modes, used instead of creating a marker node:
+//   -writePointCache  caches the selected mesh over a frame range
+//   -scanPointCache   tests two caches against each other
+//   -scan             evaluates the two selected meshes over a frame range and tests them
+//   -mergeResults     combines the -resultFile outputs of several scans into a report
+//   -captureInputs    writes what the selected marker node tests, for intersectionMarkerReplay
+const char* WRITE_POINT_CACHE_FLAG      = "-wpc";
+const char* WRITE_POINT_CACHE_FLAG_LONG = "-writePointCache";
+const char* START_FRAME_FLAG            = "-sf";
+const char* START_FRAME_FLAG_LONG       = "-startFrame";
+const char* END_FRAME_FLAG              = "-ef";
+const char* END_FRAME_FLAG_LONG         = "-endFrame";
+const char* SCAN_POINT_CACHE_FLAG       = "-spc";
+const char* SCAN_POINT_CACHE_FLAG_LONG  = "-scanPointCache";
+const char* KERNEL_FLAG                 = "-k";
+const char* KERNEL_FLAG_LONG            = "-kernel";
+const char* COLLISION_MODE_FLAG         = "-cm";
+const char* COLLISION_MODE_FLAG_LONG    = "-collisionMode";
+const char* COMPRESS_BVH_FLAG           = "-cb";
+const char* COMPRESS_BVH_FLAG_LONG      = "-compressBVH";
+const char* SCAN_FLAG                   = "-sc";
+const char* SCAN_FLAG_LONG              = "-scan";
+const char* RESULT_FILE_FLAG            = "-rf";
+const char* RESULT_FILE_FLAG_LONG       = "-resultFile";
+const char* MERGE_RESULTS_FLAG          = "-mr";
+const char* MERGE_RESULTS_FLAG_LONG     = "-mergeResults";
+const char* CAPTURE_INPUTS_FLAG         = "-ci";
+const char* CAPTURE_INPUTS_FLAG_LONG    = "-captureInputs";
 
 
 IntersectionMarkerCommand::IntersectionMarkerCommand()  {
@@ -43,9 +90,22 @@ MSyntax IntersectionMarkerCommand::getSyntax()
 {
     MSyntax syntax;
 
-    syntax.setObjectType(MSyntax::kSelectionList, 2, 2);
+    syntax.setObjectType(MSyntax::kSelectionList, 0, 2);
     syntax.useSelectionAsDefault(true);
 
+    syntax.addFlag(WRITE_POINT_CACHE_FLAG, WRITE_POINT_CACHE_FLAG_LONG, MSyntax::kString);
+    syntax.addFlag(START_FRAME_FLAG, START_FRAME_FLAG_LONG, MSyntax::kDouble);
+    syntax.addFlag(END_FRAME_FLAG, END_FRAME_FLAG_LONG, MSyntax::kDouble);
+    syntax.addFlag(SCAN_POINT_CACHE_FLAG, SCAN_POINT_CACHE_FLAG_LONG, MSyntax::kString, MSyntax::kString);
+    syntax.addFlag(KERNEL_FLAG, KERNEL_FLAG_LONG, MSyntax::kLong);
+    syntax.addFlag(COLLISION_MODE_FLAG, COLLISION_MODE_FLAG_LONG, MSyntax::kLong);
+    syntax.addFlag(COMPRESS_BVH_FLAG, COMPRESS_BVH_FLAG_LONG, MSyntax::kBoolean);
+    syntax.addFlag(SCAN_FLAG, SCAN_FLAG_LONG);
+    syntax.addFlag(RESULT_FILE_FLAG, RESULT_FILE_FLAG_LONG, MSyntax::kString);
+    syntax.makeFlagMultiUse(RESULT_FILE_FLAG);
+    syntax.addFlag(MERGE_RESULTS_FLAG, MERGE_RESULTS_FLAG_LONG, MSyntax::kString);
+    syntax.addFlag(CAPTURE_INPUTS_FLAG, CAPTURE_INPUTS_FLAG_LONG, MSyntax::kString);
+
     syntax.enableQuery(false);
     syntax.enableEdit(false);
 
@@ -57,10 +117,31 @@ MStatus IntersectionMarkerCommand::doIt(const MArgList& argList)
 {
     // MGlobal::displayInfo("IntersectionMarkerCommand::doIt");
     MStatus status;
-    MArgDatabase argsData(syntax(), argList);
+    MArgDatabase argsData(syntax(), argList, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    if (argsData.isFlagSet(WRITE_POINT_CACHE_FLAG)) {
+        return writePointCache(argsData);
+    }
+    if (argsData.isFlagSet(SCAN_POINT_CACHE_FLAG)) {
+        return scanPointCache(argsData);
+    }
+    if (argsData.isFlagSet(SCAN_FLAG)) {
+        return scanFrames(argsData);
+    }
+    if (argsData.isFlagSet(MERGE_RESULTS_FLAG)) {
+        return mergeResults(argsData);
+    }
+    if (argsData.isFlagSet(CAPTURE_INPUTS_FLAG)) {
+        return captureInputs(argsData);
+    }
 
     MSelectionList selection;
     argsData.getObjects(selection);
+    if (selection.length() != 2) {
+        MGlobal::displayError("Must select two meshes.");
+        return MStatus::kFailure;
+    }
 
     status = selection.getDagPath(0, this->meshA);
     CHECK_MSTATUS_AND_RETURN_IT(status);
@@ -142,6 +223,368 @@ MStatus IntersectionMarkerCommand::doIt(const MArgList& argList)
     return status;
 }
 
+// Frame range of a batch mode, the playback range unless given.
+static MStatus getFrameRange(const MArgDatabase& argsData, double& startFrame, double& endFrame)
+{
+    startFrame = MAnimControl::minTime().as(MTime::uiUnit());
+    endFrame = MAnimControl::maxTime().as(MTime::uiUnit());
+    if (argsData.isFlagSet(START_FRAME_FLAG)) {
+        argsData.getFlagArgument(START_FRAME_FLAG, 0, startFrame);
+    }
+    if (argsData.isFlagSet(END_FRAME_FLAG)) {
+        argsData.getFlagArgument(END_FRAME_FLAG, 0, endFrame);
+    }
+    if (endFrame < startFrame) {
+        MGlobal::displayError("The end frame is before the start frame.");
+        return MStatus::kFailure;
+    }
+    return MStatus::kSuccess;
+}
+
+
+static ScanSettings getScanSettings(const MArgDatabase& argsData)
+{
+    ScanSettings settings;
+    if (argsData.isFlagSet(KERNEL_FLAG)) {
+        int kernel;
+        argsData.getFlagArgument(KERNEL_FLAG, 0, kernel);
+        settings.kernel = (short)kernel;
+    }
+    if (argsData.isFlagSet(COLLISION_MODE_FLAG)) {
+        argsData.getFlagArgument(COLLISION_MODE_FLAG, 0, settings.collisionMode);
+    }
+    if (argsData.isFlagSet(COMPRESS_BVH_FLAG)) {
+        argsData.getFlagArgument(COMPRESS_BVH_FLAG, 0, settings.compressBVH);
+    }
+    return settings;
+}
+
+
+// A mesh as batch modes read it: its deformed shape and world matrix,
+// evaluated at a given frame through a DG context, so the current time and
+// the viewport are left alone.
+struct MeshPlugs
+{
+    MPlug outMesh;
+    MPlug worldMatrix;
+
+    MStatus find(const MDagPath& meshPath)
+    {
+        MStatus status;
+        this->outMesh = MFnDependencyNode(meshPath.node()).findPlug("outMesh", false, &status);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+        this->worldMatrix = MFnDependencyNode(meshPath.transform()).findPlug("worldMatrix", false, &status);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+        this->worldMatrix = this->worldMatrix.elementByLogicalIndex(0);
+        return MStatus::kSuccess;
+    }
+
+    MStatus evaluate(double frame, MObject& meshObject, MMatrix& matrix) const
+    {
+        MStatus status;
+        MDGContext context(MTime(frame, MTime::uiUnit()));
+        MDGContextGuard guard(context);
+
+        meshObject = this->outMesh.asMObject(&status);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+        MObject matrixObject = this->worldMatrix.asMObject(&status);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+        matrix = MFnMatrixData(matrixObject).matrix();
+        return MStatus::kSuccess;
+    }
+};
+
+
+static bool getSelectedMesh(const MSelectionList& selection, unsigned int index, MDagPath& meshPath)
+{
+    return selection.getDagPath(index, meshPath) == MStatus::kSuccess &&
+        meshPath.extendToShape() == MStatus::kSuccess &&
+        meshPath.hasFn(MFn::Type::kMesh);
+}
+
+
+// Write the world space points of the selected mesh over the frame range to
+// a point cache. Topology is taken from the first frame.
+MStatus IntersectionMarkerCommand::writePointCache(const MArgDatabase& argsData)
+{
+    MStatus status;
+
+    MSelectionList selection;
+    argsData.getObjects(selection);
+    MDagPath meshPath;
+    if (selection.length() != 1 || !getSelectedMesh(selection, 0, meshPath)) {
+        MGlobal::displayError("Must select one mesh to cache.");
+        return MStatus::kFailure;
+    }
+
+    MString path;
+    argsData.getFlagArgument(WRITE_POINT_CACHE_FLAG, 0, path);
+    double startFrame;
+    double endFrame;
+    status = getFrameRange(argsData, startFrame, endFrame);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    MeshPlugs plugs;
+    status = plugs.find(meshPath);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    PointCacheWriter writer;
+    const int numFrames = (int)(endFrame - startFrame) + 1;
+    for (int i = 0; i < numFrames; ++i) {
+        const double frame = startFrame + i;
+
+        MObject meshObject;
+        MMatrix worldMatrix;
+        status = plugs.evaluate(frame, meshObject, worldMatrix);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+
+        MFnMesh meshFn(meshObject, &status);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+        MPointArray points;
+        status = meshFn.getPoints(points, MSpace::kObject);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+        transformPoints(points, worldMatrix);
+
+        if (i == 0) {
+            MIntArray polygonCounts;
+            MIntArray polygonConnects;
+            status = meshFn.getVertices(polygonCounts, polygonConnects);
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+            status = writer.open(path.asChar(), polygonCounts, polygonConnects, points.length());
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+        }
+
+        status = writer.appendFrame(frame, points);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+    }
+
+    return writer.close();
+}
+
+
+// Test two point caches frame by frame.
+MStatus IntersectionMarkerCommand::scanPointCache(const MArgDatabase& argsData)
+{
+    MStatus status;
+
+    MString pathA;
+    MString pathB;
+    argsData.getFlagArgument(SCAN_POINT_CACHE_FLAG, 0, pathA);
+    argsData.getFlagArgument(SCAN_POINT_CACHE_FLAG, 1, pathB);
+
+    std::shared_ptr<PointCache> cacheA = PointCache::open(pathA.asChar());
+    std::shared_ptr<PointCache> cacheB = PointCache::open(pathB.asChar());
+    if (!cacheA || !cacheB) {
+        MGlobal::displayError(MString("Cannot read point cache ") + (cacheA ? pathB : pathA));
+        return MStatus::kFailure;
+    }
+
+    std::vector<FrameResult> results;
+    status = scanPointCaches(*cacheA, *cacheB, getScanSettings(argsData), results);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    return finishScan(argsData, results);
+}
+
+
+// Evaluate the two selected meshes at every frame of the range and test them.
+// This is the work one shard of a split frame range does.
+MStatus IntersectionMarkerCommand::scanFrames(const MArgDatabase& argsData)
+{
+    MStatus status;
+
+    MSelectionList selection;
+    argsData.getObjects(selection);
+    MDagPath meshPaths[2];
+    if (selection.length() != 2 || !getSelectedMesh(selection, 0, meshPaths[0]) || !getSelectedMesh(selection, 1, meshPaths[1])) {
+        MGlobal::displayError("Must select two meshes.");
+        return MStatus::kFailure;
+    }
+
+    double startFrame;
+    double endFrame;
+    status = getFrameRange(argsData, startFrame, endFrame);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    MeshPlugs plugs[2];
+    for (int side = 0; side < 2; ++side) {
+        status = plugs[side].find(meshPaths[side]);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+    }
+
+    FrameSettings settings;
+    settings.scan = getScanSettings(argsData);
+    MotionBound motionBound;
+    std::vector<FrameResult> results;
+    std::unordered_set<int> facesA;
+    std::unordered_set<int> facesB;
+
+    const int numFrames = (int)(endFrame - startFrame) + 1;
+    for (int i = 0; i < numFrames; ++i) {
+        const double frame = startFrame + i;
+
+        MObject meshObjects[2];
+        MMatrix worldMatrices[2];
+        for (int side = 0; side < 2; ++side) {
+            status = plugs[side].evaluate(frame, meshObjects[side], worldMatrices[side]);
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+        }
+
+        status = intersectFrame(
+            FrameMesh(meshObjects[0], worldMatrices[0]), FrameMesh(meshObjects[1], worldMatrices[1]),
+            settings, frame, &motionBound, nullptr, facesA, facesB);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+
+        FrameResult result;
+        result.time = frame;
+        result.facesA.assign(facesA.begin(), facesA.end());
+        result.facesB.assign(facesB.begin(), facesB.end());
+        std::sort(result.facesA.begin(), result.facesA.end());
+        std::sort(result.facesB.begin(), result.facesB.end());
+        results.push_back(std::move(result));
+    }
+
+    return finishScan(argsData, results);
+}
+
+
+// Write the per frame results when a result file is given, and return the
+// frames in which the meshes intersect.
+MStatus IntersectionMarkerCommand::finishScan(const MArgDatabase& argsData, const std::vector<FrameResult>& results)
+{
+    if (argsData.isFlagSet(RESULT_FILE_FLAG)) {
+        MString path;
+        argsData.getFlagArgument(RESULT_FILE_FLAG, 0, path);
+        if (!writeScanResults(path.asChar(), results)) {
+            MGlobal::displayError(MString("Cannot write scan results ") + path);
+            return MStatus::kFailure;
+        }
+    }
+
+    MDoubleArray intersectedFrames;
+    for (const FrameResult& result : results) {
+        if (!result.facesA.empty() || !result.facesB.empty()) {
+            intersectedFrames.append(result.time);
+        }
+    }
+    setResult(intersectedFrames);
+
+    return MStatus::kSuccess;
+}
+
+
+// Combine the result files of the shards of a frame range into one report.
+MStatus IntersectionMarkerCommand::mergeResults(const MArgDatabase& argsData)
+{
+    MString reportPath;
+    argsData.getFlagArgument(MERGE_RESULTS_FLAG, 0, reportPath);
+
+    std::vector<std::string> paths;
+    const unsigned int numFiles = argsData.numberOfFlagUses(RESULT_FILE_FLAG);
+    for (unsigned int i = 0; i < numFiles; ++i) {
+        MArgList arguments;
+        argsData.getFlagArgumentList(RESULT_FILE_FLAG, i, arguments);
+        paths.push_back(arguments.asString(0).asChar());
+    }
+
+    return mergeScanResults(paths, reportPath.asChar());
+}
+
+
+static bool getSelectedMarker(const MSelectionList& selection, MObject& markerNode)
+{
+    MDagPath markerPath;
+    if (selection.getDagPath(0, markerPath) != MStatus::kSuccess) {
+        return false;
+    }
+    markerPath.extendToShape();
+    markerNode = markerPath.node();
+    return MFnDependencyNode(markerNode).typeId() == IntersectionMarkerNode::NODE_ID;
+}
+
+
+// Write the inputs of the selected marker node, at the current frame or over
+// the given frame range, to an input capture that intersectionMarkerReplay
+// runs through the same kernel work outside the session.
+MStatus IntersectionMarkerCommand::captureInputs(const MArgDatabase& argsData)
+{
+    MStatus status;
+
+    MSelectionList selection;
+    argsData.getObjects(selection);
+    MObject marker;
+    if (selection.length() != 1 || !getSelectedMarker(selection, marker)) {
+        MGlobal::displayError("Must select one intersection marker.");
+        return MStatus::kFailure;
+    }
+
+    MString path;
+    argsData.getFlagArgument(CAPTURE_INPUTS_FLAG, 0, path);
+    double startFrame = MAnimControl::currentTime().as(MTime::uiUnit());
+    double endFrame = startFrame;
+    if (argsData.isFlagSet(START_FRAME_FLAG) || argsData.isFlagSet(END_FRAME_FLAG)) {
+        status = getFrameRange(argsData, startFrame, endFrame);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+    }
+
+    CaptureSettings settings;
+    settings.scan.kernel = MPlug(marker, IntersectionMarkerNode::kernelType).asShort();
+    settings.scan.collisionMode = MPlug(marker, IntersectionMarkerNode::collisionMode).asShort();
+    settings.scan.compressBVH = MPlug(marker, IntersectionMarkerNode::compressBVH).asBool();
+    settings.incremental = MPlug(marker, IntersectionMarkerNode::incrementalUpdate).asBool();
+    settings.skipApartFrames = MPlug(marker, IntersectionMarkerNode::skipApartFrames).asBool();
+
+    const MObject meshAttributes[2] = { IntersectionMarkerNode::meshA, IntersectionMarkerNode::meshB };
+    const MObject smoothMeshAttributes[2] = { IntersectionMarkerNode::smoothMeshA, IntersectionMarkerNode::smoothMeshB };
+    const MObject smoothModeAttributes[2] = { IntersectionMarkerNode::smoothModeA, IntersectionMarkerNode::smoothModeB };
+    const MObject smoothLevelAttributes[2] = { IntersectionMarkerNode::smoothLevelA, IntersectionMarkerNode::smoothLevelB };
+    const MObject offsetAttributes[2] = { IntersectionMarkerNode::offsetMatrixA, IntersectionMarkerNode::offsetMatrixB };
+    for (int side = 0; side < 2; ++side) {
+        settings.smoothMode[side] = MPlug(marker, smoothModeAttributes[side]).asInt();
+        settings.smoothLevel[side] = MPlug(marker, smoothLevelAttributes[side]).asInt();
+    }
+
+    InputCaptureWriter writer;
+    status = writer.open(path.asChar(), settings);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    const int numFrames = (int)(endFrame - startFrame) + 1;
+    for (int i = 0; i < numFrames; ++i) {
+        const double frame = startFrame + i;
+        MDGContext context(MTime(frame, MTime::uiUnit()));
+        MDGContextGuard guard(context);
+
+        // the meshes the node tests
+        MObject meshes[2];
+        MMatrix offsetMatrices[2];
+        for (int side = 0; side < 2; ++side) {
+            MObject shapeMesh = MPlug(marker, meshAttributes[side]).asMObject(&status);
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+
+            if (MPlug(marker, smoothModeAttributes[side]).asInt() == 0) {
+                meshes[side] = shapeMesh;
+            } else {
+                meshes[side] = MPlug(marker, smoothMeshAttributes[side]).asMObject(&status);
+                CHECK_MSTATUS_AND_RETURN_IT(status);
+            }
+
+            MObject matrixObject = MPlug(marker, offsetAttributes[side]).asMObject(&status);
+            CHECK_MSTATUS_AND_RETURN_IT(status);
+            offsetMatrices[side] = MFnMatrixData(matrixObject).matrix();
+        }
+
+        status = writer.appendFrame(frame, meshes, offsetMatrices);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+    }
+
+    status = writer.close();
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    setResult(numFrames);
+    return MStatus::kSuccess;
+}
+
+
 MStatus IntersectionMarkerCommand::redoIt()
 {
     // TODO: Implement this function.
@@ -4,7 +4,12 @@
 */
 #pragma once
 
+#include "BatchScan.h"
+
+#include <vector>
+
 #include <maya/MDagPath.h>
+#include <maya/MArgDatabase.h>
 #include <maya/MPxCommand.h>
 #include <maya/MSyntax.h>
 #include <maya/MStatus.h>
@@ -30,6 +35,13 @@ public:
     static MString      COMMAND_NAME;
 
 private:    
+    MStatus             writePointCache(const MArgDatabase& argsData);
+    MStatus             scanPointCache(const MArgDatabase& argsData);
+    MStatus             scanFrames(const MArgDatabase& argsData);
+    MStatus             finishScan(const MArgDatabase& argsData, const std::vector<FrameResult>& results);
+    MStatus             mergeResults(const MArgDatabase& argsData);
+    MStatus             captureInputs(const MArgDatabase& argsData);
+
     MDagPath            meshA;
     MDagPath            meshB;
     MObject             markerNode;
@@ -7,14 +7,12 @@
 
 #include "intersectionMarkerNode.h"
 #include "intersectionMarkerData.h"
-
-#include "kernel/KDTreeKernel.h"
-#include "kernel/EmbreeKernel.h"
-#include "kernel/OctreeKernel.h"
+#include "BatchScan.h"
 
 #include <omp.h>
 #include <string>
 #include <unordered_set>
+#include <algorithm>
 
 #include <maya/MDagPath.h>
 #include <maya/MDataBlock.h>
@@ -40,6 +38,8 @@
 #include <maya/MVector.h>
 #include <maya/MDGModifier.h>
 #include <maya/MEvaluationNode.h>
+#include <maya/MAnimControl.h>
+#include <maya/MTime.h>
 
 // Viewport 2.0
 #include <maya/MPxDrawOverride.h>
@@ -59,6 +59,9 @@ MObject IntersectionMarkerNode::showMeshA;
 MObject IntersectionMarkerNode::showMeshB;
 MObject IntersectionMarkerNode::kernelType;
 MObject IntersectionMarkerNode::collisionMode;
+MObject IntersectionMarkerNode::compressBVH;
+MObject IntersectionMarkerNode::incrementalUpdate;
+MObject IntersectionMarkerNode::skipApartFrames;
 
 MObject IntersectionMarkerNode::smoothModeA;
 MObject IntersectionMarkerNode::smoothModeB;
@@ -200,6 +203,12 @@ MStatus IntersectionMarkerNode::initialize()
     eAttr.addField("BVH", 0);
     eAttr.addField("Octree", 1);
     eAttr.addField("KDTree", 2);
+    eAttr.addField("Proxy", 3);
+    eAttr.addField("OBBTree", 4);
+    eAttr.addField("Cluster", 5);
+    eAttr.addField("BruteForce", 6);
+    eAttr.addField("Auto", 7);
+    eAttr.addField("EmbreeScene", 8);
     status = addAttribute(kernelType);
     CHECK_MSTATUS_AND_RETURN_IT(status);
 
@@ -211,6 +220,33 @@ MStatus IntersectionMarkerNode::initialize()
     status = addAttribute(collisionMode);
     CHECK_MSTATUS_AND_RETURN_IT(status);
 
+    // Initialize Compress BVH, 8 bit quantized node boxes for the BVH kernels
+    compressBVH = nAttr.create(COMPRESS_BVH, COMPRESS_BVH, MFnNumericData::kBoolean, 0);
+    nAttr.setStorable(true);
+    nAttr.setKeyable(false);
+    nAttr.setWritable(true);
+    nAttr.setReadable(true);
+    status = addAttribute(compressBVH);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    // Initialize Incremental, re-test only what moved since the last evaluation (collision mode 0, Cluster and BruteForce kernels)
+    incrementalUpdate = nAttr.create(INCREMENTAL_UPDATE, INCREMENTAL_UPDATE, MFnNumericData::kBoolean, 0);
+    nAttr.setStorable(true);
+    nAttr.setKeyable(false);
+    nAttr.setWritable(true);
+    nAttr.setReadable(true);
+    status = addAttribute(incrementalUpdate);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    // Initialize Skip Apart Frames, skip the intersection pass while the meshes cannot reach each other
+    skipApartFrames = nAttr.create(SKIP_APART_FRAMES, SKIP_APART_FRAMES, MFnNumericData::kBoolean, 0);
+    nAttr.setStorable(true);
+    nAttr.setKeyable(false);
+    nAttr.setWritable(true);
+    nAttr.setReadable(true);
+    status = addAttribute(skipApartFrames);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
     // Initialize Output Intersected
     outputIntersected = nAttr.create(OUTPUT_INTERSECTED, OUTPUT_INTERSECTED, MFnNumericData::kBoolean, 0);
     nAttr.setStorable(true);
@@ -240,6 +276,9 @@ MStatus IntersectionMarkerNode::initialize()
 
     status = attributeAffects(kernelType, outputIntersected);
     status = attributeAffects(collisionMode, outputIntersected);
+    status = attributeAffects(compressBVH, outputIntersected);
+    status = attributeAffects(incrementalUpdate, outputIntersected);
+    status = attributeAffects(skipApartFrames, outputIntersected);
     CHECK_MSTATUS_AND_RETURN_IT(status);
 
     return MS::kSuccess;
@@ -259,6 +298,9 @@ MStatus IntersectionMarkerNode::preEvaluation(
         dirty = dirty || evaluationNode.dirtyPlugExists(offsetMatrixB, &status);
         dirty = dirty || evaluationNode.dirtyPlugExists(kernelType, &status);
         dirty = dirty || evaluationNode.dirtyPlugExists(collisionMode, &status);
+        dirty = dirty || evaluationNode.dirtyPlugExists(compressBVH, &status);
+        dirty = dirty || evaluationNode.dirtyPlugExists(incrementalUpdate, &status);
+        dirty = dirty || evaluationNode.dirtyPlugExists(skipApartFrames, &status);
         dirty = dirty || evaluationNode.dirtyPlugExists(showMeshA, &status);
         dirty = dirty || evaluationNode.dirtyPlugExists(showMeshB, &status);
         dirty = dirty || evaluationNode.dirtyPlugExists(smoothModeA, &status);
@@ -296,6 +338,9 @@ MStatus IntersectionMarkerNode::postEvaluation(
         (evaluationNode.dirtyPlugExists(offsetMatrixB, &status) && status ) ||
         (evaluationNode.dirtyPlugExists(kernelType, &status) && status ) ||
         (evaluationNode.dirtyPlugExists(collisionMode, &status) && status ) ||
+        (evaluationNode.dirtyPlugExists(compressBVH, &status) && status ) ||
+        (evaluationNode.dirtyPlugExists(incrementalUpdate, &status) && status ) ||
+        (evaluationNode.dirtyPlugExists(skipApartFrames, &status) && status ) ||
         (evaluationNode.dirtyPlugExists(showMeshA, &status) && status ) ||
         (evaluationNode.dirtyPlugExists(showMeshB, &status) && status ) ||
         (evaluationNode.dirtyPlugExists(smoothModeA, &status) && status ) ||
@@ -419,101 +464,107 @@ MStatus IntersectionMarkerNode::compute(const MPlug &plug, MDataBlock &dataBlock
     showMeshAHandle.setClean();
     showMeshBHandle.setClean();
 
+    MDataHandle modeHandle = dataBlock.inputValue(collisionMode, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    MDataHandle incrementalHandle = dataBlock.inputValue(incrementalUpdate, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    MDataHandle skipApartHandle = dataBlock.inputValue(skipApartFrames, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    FrameSettings settings;
+    settings.scan.kernel = dataBlock.inputValue(kernelType).asShort();
+    settings.scan.collisionMode = (int)modeHandle.asBool();
+    settings.scan.compressBVH = dataBlock.inputValue(compressBVH).asBool();
+    settings.skipApartFrames = skipApartHandle.asBool();
+    settings.incremental = incrementalHandle.asBool();
+
+    // Incremental updates follow triangle queries with kernels that move
+    // their points in place, everything else runs the full pass
+    const bool incremental = runsIncremental(settings, meshAObject, meshBObject);
+
+    // Meshes that cannot reach each other are apart whatever their vertices
+    // are, so the test on their world boxes comes before the checksums
+    const FrameMesh frameA(meshAObject, offsetA);
+    const FrameMesh frameB(meshBObject, offsetB);
+    const double frame = MAnimControl::currentTime().as(MTime::uiUnit());
+    const bool apart = skipFrame(settings, &this->motionBound, frame, frameA, frameB);
+
     // -------------------------------------------------------------------------------------------
     // update checksums
     // MGlobal::displayInfo("update checksums...");
-    int newCheckA = getVertexChecksum(meshAObject, offsetA) ^ smoothModeAObject;
-    int newCheckB = getVertexChecksum(meshBObject, offsetB) ^ smoothModeBObject;
-
     MDataHandle vertexChecksumAHandle = dataBlock.outputValue(vertexChecksumA);
     MDataHandle vertexChecksumBHandle = dataBlock.outputValue(vertexChecksumB);
+    CacheKeyType key;
+    bool cached = false;
 
-    int checkA = vertexChecksumAHandle.asInt();
-    int checkB = vertexChecksumBHandle.asInt();
-    newCheckA = newCheckA ^ int(showA);
-    newCheckB = newCheckB ^ int(showB);
+    if (apart) {
+        // Nothing intersects; the checksums are reset so the first frame
+        // the meshes can touch again runs a pass
+        this->intersectedFaceIdsA.clear();
+        this->intersectedFaceIdsB.clear();
+        vertexChecksumAHandle.set(0);
+        vertexChecksumBHandle.set(0);
 
-    // If the checksums are the same, then we don't need to do anything
-    // because the meshes have not changed.
-    if (checkA == newCheckA && checkB == newCheckB) {
-        vertexChecksumAHandle.setClean();
-        vertexChecksumBHandle.setClean();
+    } else if (incremental) {
+        // The diff in IncrementalIntersection::update stands in for the
+        // checksums, which would walk every vertex once more. The stored
+        // checksums no longer describe the result, so the next full pass
+        // must not take the "unchanged" early out.
+        vertexChecksumAHandle.set(0);
+        vertexChecksumBHandle.set(0);
 
-        return MS::kSuccess;
-    }
+    } else {
+        int newCheckA = getVertexChecksum(meshAObject, offsetA) ^ smoothModeAObject;
+        int newCheckB = getVertexChecksum(meshBObject, offsetB) ^ smoothModeBObject;
+
+        int checkA = vertexChecksumAHandle.asInt();
+        int checkB = vertexChecksumBHandle.asInt();
+        newCheckA = newCheckA ^ int(showA);
+        newCheckB = newCheckB ^ int(showB);
 
-    vertexChecksumAHandle.set(newCheckA);
+        // If the checksums are the same, then we don't need to do anything
+        // because the meshes have not changed.
+        if (checkA == newCheckA && checkB == newCheckB) {
+            vertexChecksumAHandle.setClean();
+            vertexChecksumBHandle.setClean();
+
+            return MS::kSuccess;
+        }
+
+        vertexChecksumAHandle.set(newCheckA);
+        vertexChecksumBHandle.set(newCheckB);
+
+        // Check if the result cached
+        key = std::make_pair(newCheckA, newCheckB);
+        try {
+            CacheResultType res = this->cache.get(key);
+            this->intersectedFaceIdsA = res.first;
+            this->intersectedFaceIdsB = res.second;
+            cached = true;
+        } catch (const std::out_of_range&) {
+        }
+    }
     vertexChecksumAHandle.setClean();
-    vertexChecksumBHandle.set(newCheckB);
     vertexChecksumBHandle.setClean();
 
     // -------------------------------------------------------------------------------------------
-    // Calculate intersections
+    // Calculate intersections, the same frame pipeline the scans and the replay run
     // -------------------------------------------------------------------------------------------
-
-    // Check if the result cached
-    CacheKeyType key = std::make_pair(newCheckA, newCheckB);
-    try {
-
-        CacheResultType res = this->cache.get(key);
-        this->intersectedFaceIdsA = res.first;
-        this->intersectedFaceIdsB = res.second;
-
-    } catch (const std::out_of_range&) {
-
-        // The result is not in the cache
-        this->intersectedFaceIdsA.clear();
-        this->intersectedFaceIdsB.clear();
-
-        // Build kernel A
-        std::shared_ptr<SpatialDivisionKernel> kernelA = getActiveKernel();
-        MBoundingBox bboxA = getBoundingBox(meshA);
-        bboxA.transformUsing(offsetA);
-        status = kernelA->build(meshAObject, bboxA, offsetA);
-        CHECK_MSTATUS_AND_RETURN_IT(status);
-
-        MDataHandle modeHandle = dataBlock.inputValue(collisionMode, &status);
+    if (!apart && !cached) {
+        status = intersectFrame(
+            frameA, frameB, settings, frame, nullptr, &this->incremental,
+            this->intersectedFaceIdsA, this->intersectedFaceIdsB);
         CHECK_MSTATUS_AND_RETURN_IT(status);
-        bool mode = modeHandle.asBool();
-        if (mode == 0) {
-            // Kernel A vs Mesh B Triangles
-            // check intersections
-            status = checkIntersections(meshAObject, meshBObject, kernelA, offsetB);
-            if(status != MStatus::kSuccess) {
-                MGlobal::displayError("Failed to get offset data handle");
-                return status;
-            }
-
-        } else if (mode == 1) {
-            // Kernel A vs Kernel B
-            //
-            // Build kernel B
-            std::shared_ptr<SpatialDivisionKernel> kernelB = getActiveKernel();
-            MBoundingBox bboxB = getBoundingBox(meshB);
-            bboxB.transformUsing(offsetB);
-            status = kernelB->build(meshBObject, bboxB, offsetB);
-            CHECK_MSTATUS_AND_RETURN_IT(status);
-
-            K2KIntersection pairs = kernelA->intersectKernelKernel(*kernelB);
-            for (auto pair : pairs.first) {
-                this->intersectedFaceIdsA.insert(pair.faceIndex);
-            }
-            for (auto pair : pairs.second) {
-                this->intersectedFaceIdsB.insert(pair.faceIndex);
-            }
-
-        } else {
-            modeHandle.setClean();
-            MGlobal::displayError("Invalid collision mode");
-            return MStatus::kFailure;
-        }
 
-        // -------------------------------------------------------------------------------------------
         // Store the result in the cache
-        CacheResultType res{this->intersectedFaceIdsA, this->intersectedFaceIdsB};
-        this->cache.put(key, res);
-        modeHandle.setClean();
+        if (!incremental) {
+            CacheResultType res{this->intersectedFaceIdsA, this->intersectedFaceIdsB};
+            this->cache.put(key, res);
+        }
     }
+    skipApartHandle.setClean();
+    incrementalHandle.setClean();
+    modeHandle.setClean();
 
     // Get output data handle
     MDataHandle outputIntersectedHandle = dataBlock.outputValue(outputIntersected, &status);
@@ -533,112 +584,6 @@ MStatus IntersectionMarkerNode::compute(const MPlug &plug, MDataBlock &dataBlock
 }
 
 
-MStatus IntersectionMarkerNode::checkIntersections(
-    MObject &meshAObject,
-    MObject &meshBObject,
-    std::shared_ptr<SpatialDivisionKernel> kernel,
-    MMatrix offset
-){
-    MStatus status;
-    // MGlobal::displayInfo("checkIntersections...");
-    intersectedFaceIdsA.clear();
-    intersectedFaceIdsB.clear();
-
-    // Iterate through the polygons in meshB
-    MFnMesh meshBFn(meshBObject);
-    int numPolygons = meshBFn.numPolygons();
-
-    MIntArray triangleCounts;   // number of triangles in each face
-    MIntArray triangleVertices; // The triangle vertex Ids for each triangle
-    MIntArray triangleIndices;  // The index array for each triangle in face vertex space
-    MPointArray vertexPositions;
-
-    meshBFn.getTriangles(triangleCounts, triangleVertices);
-    meshBFn.getTriangleOffsets(triangleCounts, triangleIndices);
-    meshBFn.getPoints(vertexPositions, MSpace::kWorld);
-
-    // Calculate the offset into the triangleVertices array for each polygon
-    // And similarly, calculate the offset into the triangleIndices array for each polygon
-    MIntArray polygonTriangleOffsets(numPolygons, 0);
-    // MIntArray polygonIndexOffsets(numPolygons, 0);
-
-    for (int polygonIndex = 1; polygonIndex < numPolygons; polygonIndex++) {
-        int previousTriangles = triangleCounts[polygonIndex - 1];
-        polygonTriangleOffsets[polygonIndex] = polygonTriangleOffsets[polygonIndex - 1] + previousTriangles * 3;
-        // polygonIndexOffsets[polygonIndex] = polygonIndexOffsets[polygonIndex - 1] + previousTriangles;
-    }
-
-    // #pragma omp parallel
-    {
-        std::unordered_set<int> intersectedFaceIdsLocalA;
-        std::unordered_set<int> intersectedFaceIdsLocalB;
-
-        // #pragma omp for
-        for (int polygonIndex = 0; polygonIndex < numPolygons; polygonIndex++) {
-
-            TriangleData triangle;
-            int numTrianglesInPolygon = triangleCounts[polygonIndex];
-            int triangleVerticesOffset = polygonTriangleOffsets[polygonIndex];
-            // int triangleIndicesOffset = polygonIndexOffsets[polygonIndex];
-
-            for (int triangleIndex = 0; triangleIndex < numTrianglesInPolygon; triangleIndex++) {
-                // Get the vertex positions of each triangle
-
-                int vertexId0 = triangleVertices[triangleVerticesOffset + triangleIndex * 3 + 0];
-                int vertexId1 = triangleVertices[triangleVerticesOffset + triangleIndex * 3 + 1];
-                int vertexId2 = triangleVertices[triangleVerticesOffset + triangleIndex * 3 + 2];
-                MPoint p0 = vertexPositions[vertexId0] * offset;
-                MPoint p1 = vertexPositions[vertexId1] * offset;
-                MPoint p2 = vertexPositions[vertexId2] * offset;
-                TriangleData triangle(polygonIndex, triangleIndex, p0, p1, p2);
-
-                // Check intersection between triangle and the octree (kernel)
-                std::vector<TriangleData> intersectedTriangles = kernel->intersectKernelTriangle(triangle);
-
-                // If there is any intersection, store the intersection data into intersectedVertexIdsLocal
-                if (!intersectedTriangles.empty()) {
-                    for(int k = 0; k < intersectedTriangles.size(); ++k) {
-                        int a = intersectedTriangles[k].faceIndex;
-                        int b = polygonIndex;
-                        intersectedFaceIdsLocalA.insert(a);
-                        intersectedFaceIdsLocalB.insert(b);
-                    }
-                }
-            }
-        }
-
-        // #pragma omp critical
-        {
-            intersectedFaceIdsA.insert(intersectedFaceIdsLocalA.begin(), intersectedFaceIdsLocalA.end());
-            intersectedFaceIdsB.insert(intersectedFaceIdsLocalB.begin(), intersectedFaceIdsLocalB.end());
-        }
-    }
-
-    return MStatus::kSuccess;
-}
-
-
-std::shared_ptr<SpatialDivisionKernel> IntersectionMarkerNode::getActiveKernel() const
-{
-    // Get the value of the 'kernel' attribute
-    MPlug kernelPlug(thisMObject(), kernelType);
-    short kernelValue;
-    kernelPlug.getValue(kernelValue);
-
-    // Create the appropriate kernel based on the attribute value
-    switch (kernelValue) {
-    case 0: // Embree
-        return std::make_unique<EmbreeKernel>();
-    case 1: // Octree
-        return std::make_unique<OctreeKernel>();
-    case 2: // KDTree
-        return std::make_unique<KDTreeKernel>();
-    default:
-        return nullptr;
-    }
-}
-
-
 MStatus IntersectionMarkerNode::getInputDagMesh(const MObject inputAttr, MFnMesh &outMesh) const
 {
     MPlug inputMeshPlug(thisMObject(), inputAttr);
@@ -671,22 +616,7 @@ MStatus IntersectionMarkerNode::getOffsetMatrix(const MObject inputAttr, MMatrix
 }
 
 
-// Returns the bounding box of the mesh,
-// due to the fact that the MObject have no DAG information,
-// no dag path can returns no bounding box.
-// we need to get the DAG path of the mesh node first by traversing the input plug.
-MBoundingBox IntersectionMarkerNode::getBoundingBox(const MObject &meshObject) const
-{
-    MFnMesh fnMesh;
-
-    // TODO: check the MSatus
-    getInputDagMesh(meshObject, fnMesh);
-    MBoundingBox bbox = fnMesh.boundingBox();
-
-    return bbox;
-}
-
-
+// The vertex checksums stored by the last compute
 MStatus IntersectionMarkerNode::getChecksumA(int &outChecksum) const
 {
     MPlug checksumPlug(thisMObject(), vertexChecksumA);
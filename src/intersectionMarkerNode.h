@@ -5,6 +5,8 @@
 #pragma once
 
 #include "SpatialDivisionKernel.h"
+#include "IncrementalIntersection.h"
+#include "MotionBound.h"
 #include "IntersectionMarkerData.h"
 
 #include <string>
@@ -37,6 +39,9 @@
 
 #define KERNEL             "kernel"
 #define COLLISION_MODE     "collisionMode"
+#define COMPRESS_BVH       "compressBVH"
+#define INCREMENTAL_UPDATE "incrementalUpdate"
+#define SKIP_APART_FRAMES  "skipApartFrames"
 #define OUTPUT_INTERSECTED "outputIntersected"
 #define OUT_MESH           "outMesh"
 #define CACHE_SIZE         10000
@@ -135,14 +140,11 @@ public:
     static MStatus      getCacheKey(MObject &node, std::string &key);
     static MStatus      getCacheKeyFromMesh(MObject &meshObjA, MObject &meshObjB, std::string &key);
 
-std::shared_ptr<SpatialDivisionKernel> getActiveKernel() const;
-            MStatus     checkIntersections(MObject &meshAObject, MObject &meshBObject, std::shared_ptr<SpatialDivisionKernel> kernel, MMatrix offset);
             MStatus     preEvaluation(const MDGContext& context, const MEvaluationNode& evaluationNode) override;
             MStatus     getInputDagMesh(const MObject inputAttr, MFnMesh &outMesh) const;
             MStatus     getOffsetMatrix(const MObject inputAttr, MMatrix &outMatrix) const;
             MStatus     getChecksumA(int &outChecksum) const;
             MStatus     getChecksumB(int &outChecksum) const;
-      MBoundingBox      getBoundingBox(const MObject &meshObject) const;
            MStatus      createMeshFromTriangles(const MObject& meshAObject, const MIntArray& intersectedTriangleIDs, MFnMesh& outputMeshFn);
             MStatus     getSmoothMode( const MObject inputAttr, int &outSmoothMode ) const;
 
@@ -164,6 +166,9 @@ public:
     static MObject      showMeshB;
     static MObject      kernelType;
     static MObject      collisionMode;
+    static MObject      compressBVH;
+    static MObject      incrementalUpdate;
+    static MObject      skipApartFrames;
 
     static MObject      smoothModeA;
     static MObject      smoothModeB;
@@ -181,4 +186,6 @@ public:
   static CacheType      cache;
     std::unordered_set<int> intersectedFaceIdsA;
     std::unordered_set<int> intersectedFaceIdsB;
+    IncrementalIntersection incremental;
+    MotionBound motionBound;
 };
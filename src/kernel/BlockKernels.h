@@ -0,0 +1,53 @@
+#pragma once
+
+// Hot loops that are compiled once per instruction set (BlockKernelsSSE2.cpp,
+// BlockKernelsSSE42.cpp, ...) and picked at plugin load, see TriangleBlocks.h.
+//
+// Only loops over many elements are worth a variant. The triangle and box tests
+// in utility.h run one pair at a time in double on Maya types, where a call
+// through a pointer costs more than wider registers gain; filterBlock is their
+// batched form. The 64 bit hashes are a serial multiply chain with no lanes to
+// widen, so they stay in the baseline build.
+//
+// The variants only see the plain data below. Keeping the Maya and standard
+// headers out of those translation units means no inline function from them is
+// ever emitted with wider instructions than the running CPU may support.
+
+
+// Number of triangles a block filter pass works on at once; also the cluster size
+// of the cluster kernel.
+const int TRIANGLE_BLOCK_SIZE = 64;
+
+
+struct BlockView
+{
+    const float* v[9];              // x0 y0 z0 x1 y1 z1 x2 y2 z2
+    const float* lower[3];
+    const float* upper[3];
+};
+
+
+struct BlockQueryData
+{
+    float lower[3];
+    float upper[3];
+    float normal[3];
+    float offset;
+    float tolerance;
+};
+
+
+using FilterBlockFunction = int (*)(const BlockView& blocks, int first, int count, const BlockQueryData& query, int* candidates);
+using TransformPointsFunction = void (*)(double* xyzw, int count, const double (*matrix)[4]);
+
+
+#define DECLARE_BLOCK_KERNELS(ISA) \
+    namespace ISA { \
+        int filterBlock(const BlockView& blocks, int first, int count, const BlockQueryData& query, int* candidates); \
+        void transformPoints(double* xyzw, int count, const double (*matrix)[4]); \
+    }
+
+DECLARE_BLOCK_KERNELS(sse2)
+DECLARE_BLOCK_KERNELS(sse42)
+DECLARE_BLOCK_KERNELS(avx2)
+DECLARE_BLOCK_KERNELS(avx512)
@@ -0,0 +1,79 @@
+// Body of the per instruction set block kernels. Included by the
+// BlockKernels*.cpp files with BLOCK_KERNELS_ISA set to the namespace to fill;
+// CMakeLists.txt gives each of them its own target flags.
+
+#include "BlockKernels.h"
+
+#ifndef BLOCK_KERNELS_ISA
+#error "BLOCK_KERNELS_ISA must name the variant namespace"
+#endif
+
+
+namespace BLOCK_KERNELS_ISA {
+
+static inline float min3(float a, float b, float c) { float m = a < b ? a : b; return m < c ? m : c; }
+static inline float max3(float a, float b, float c) { float m = a > b ? a : b; return m > c ? m : c; }
+
+
+// One block of at most TRIANGLE_BLOCK_SIZE triangles: bounds overlap and the
+// query plane straddle, for all lanes at once, then compaction.
+int filterBlock(const BlockView& blocks, int first, int count, const BlockQueryData& q, int* candidates)
+{
+    const float* x0 = blocks.v[0] + first;
+    const float* y0 = blocks.v[1] + first;
+    const float* z0 = blocks.v[2] + first;
+    const float* x1 = blocks.v[3] + first;
+    const float* y1 = blocks.v[4] + first;
+    const float* z1 = blocks.v[5] + first;
+    const float* x2 = blocks.v[6] + first;
+    const float* y2 = blocks.v[7] + first;
+    const float* z2 = blocks.v[8] + first;
+    const float* lx = blocks.lower[0] + first;
+    const float* ly = blocks.lower[1] + first;
+    const float* lz = blocks.lower[2] + first;
+    const float* ux = blocks.upper[0] + first;
+    const float* uy = blocks.upper[1] + first;
+    const float* uz = blocks.upper[2] + first;
+
+    unsigned char keep[TRIANGLE_BLOCK_SIZE];
+
+    #pragma omp simd
+    for (int k = 0; k < count; ++k) {
+        bool overlap =
+            (lx[k] <= q.upper[0]) & (ux[k] >= q.lower[0]) &
+            (ly[k] <= q.upper[1]) & (uy[k] >= q.lower[1]) &
+            (lz[k] <= q.upper[2]) & (uz[k] >= q.lower[2]);
+
+        float d0 = q.normal[0] * x0[k] + q.normal[1] * y0[k] + q.normal[2] * z0[k] - q.offset;
+        float d1 = q.normal[0] * x1[k] + q.normal[1] * y1[k] + q.normal[2] * z1[k] - q.offset;
+        float d2 = q.normal[0] * x2[k] + q.normal[1] * y2[k] + q.normal[2] * z2[k] - q.offset;
+
+        keep[k] = overlap & (min3(d0, d1, d2) <= q.tolerance) & (max3(d0, d1, d2) >= -q.tolerance);
+    }
+
+    int numCandidates = 0;
+    for (int k = 0; k < count; ++k) {
+        if (keep[k]) {
+            candidates[numCandidates++] = first + k;
+        }
+    }
+    return numCandidates;
+}
+
+
+// Homogeneous row vector times matrix, the same product as MPoint * MMatrix,
+// over packed x y z w doubles.
+void transformPoints(double* xyzw, int count, const double (*m)[4])
+{
+    #pragma omp simd
+    for (int i = 0; i < count; ++i) {
+        double* p = xyzw + 4 * i;
+        double x = p[0], y = p[1], z = p[2], w = p[3];
+        p[0] = x * m[0][0] + y * m[1][0] + z * m[2][0] + w * m[3][0];
+        p[1] = x * m[0][1] + y * m[1][1] + z * m[2][1] + w * m[3][1];
+        p[2] = x * m[0][2] + y * m[1][2] + z * m[2][2] + w * m[3][2];
+        p[3] = x * m[0][3] + y * m[1][3] + z * m[2][3] + w * m[3][3];
+    }
+}
+
+}
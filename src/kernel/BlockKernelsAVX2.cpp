@@ -0,0 +1,3 @@
+// Compiled with AVX2 enabled, see CMakeLists.txt.
+#define BLOCK_KERNELS_ISA avx2
+#include "BlockKernels.inl"
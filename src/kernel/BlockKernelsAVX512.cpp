@@ -0,0 +1,3 @@
+// Compiled with AVX-512 enabled, see CMakeLists.txt.
+#define BLOCK_KERNELS_ISA avx512
+#include "BlockKernels.inl"
@@ -0,0 +1,3 @@
+// Baseline build, no extra target flags.
+#define BLOCK_KERNELS_ISA sse2
+#include "BlockKernels.inl"
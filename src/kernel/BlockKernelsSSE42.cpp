@@ -0,0 +1,3 @@
+// Compiled with SSE4.2 enabled, see CMakeLists.txt.
+#define BLOCK_KERNELS_ISA sse42
+#include "BlockKernels.inl"
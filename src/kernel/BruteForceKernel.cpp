@@ -0,0 +1,214 @@
+#include "BruteForceKernel.h"
+#include "../utility.h"
+
+#include <maya/MStatus.h>
+#include <maya/MMatrix.h>
+#include <maya/MFnMesh.h>
+#include <maya/MBoundingBox.h>
+#include <maya/MPoint.h>
+#include <maya/MPointArray.h>
+#include <maya/MIntArray.h>
+#include <maya/MGlobal.h>
+
+#include <omp.h>
+#include <vector>
+#include <algorithm>
+
+
+MStatus BruteForceKernel::build(const MObject& meshObject, const MBoundingBox& bbox, const MMatrix& offsetMatrix)
+{
+    MStatus status;
+
+    MFnMesh meshFn(meshObject, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    status = meshFn.getPoints(this->points, MSpace::kObject);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    transformPoints(this->points, offsetMatrix);
+
+    MIntArray triangleCounts;
+    MIntArray triangleVertices;
+    status = meshFn.getTriangles(triangleCounts, triangleVertices);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    if (triangleVertices.length() == 0) {
+        return MStatus::kFailure;
+    }
+
+    const int numTriangles = (int)triangleVertices.length() / 3;
+    this->triangleVertices.resize(numTriangles * 3);
+    this->faceIndices.resize(numTriangles);
+    this->triangleIndices.resize(numTriangles);
+    triangleVertices.get(this->triangleVertices.data());
+
+    int triangleId = 0;
+    for (unsigned int faceIndex = 0; faceIndex < triangleCounts.length(); ++faceIndex) {
+        for (int i = 0; i < triangleCounts[faceIndex]; ++i) {
+            this->faceIndices[triangleId] = faceIndex;
+            this->triangleIndices[triangleId] = i;
+            triangleId++;
+        }
+    }
+
+    this->blocks.resize(numTriangles);
+    #pragma omp parallel for
+    for (int t = 0; t < numTriangles; ++t) {
+        const int* v = &this->triangleVertices[t * 3];
+        this->blocks.set(t, this->points[v[0]], this->points[v[1]], this->points[v[2]]);
+    }
+
+    const int numTiles = (numTriangles + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+    this->tileBounds.resize(numTiles);
+    #pragma omp parallel for
+    for (int tile = 0; tile < numTiles; ++tile) {
+        computeTileBounds(tile);
+    }
+
+    return MStatus::kSuccess;
+}
+
+
+void BruteForceKernel::computeTileBounds(int tile)
+{
+    MBoundingBox bounds;
+    int last = std::min(numTriangles(), (tile + 1) * TRIANGLE_BLOCK_SIZE);
+    for (int i = tile * TRIANGLE_BLOCK_SIZE * 3; i < last * 3; ++i) {
+        bounds.expand(this->points[this->triangleVertices[i]]);
+    }
+    this->tileBounds[tile] = bounds;
+}
+
+
+bool BruteForceKernel::updatePoints(const MPointArray& points, const std::vector<int>& movedVertices)
+{
+    if (points.length() != this->points.length()) {
+        return false;
+    }
+
+    std::vector<char> moved(this->points.length(), 0);
+    for (int v : movedVertices) {
+        this->points[v] = points[v];
+        moved[v] = 1;
+    }
+
+    // rewrite the moved triangles' slots and refit the tiles holding them
+    const int numTiles = (int)this->tileBounds.size();
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int tile = 0; tile < numTiles; ++tile) {
+        bool changed = false;
+        int last = std::min(numTriangles(), (tile + 1) * TRIANGLE_BLOCK_SIZE);
+        for (int t = tile * TRIANGLE_BLOCK_SIZE; t < last; ++t) {
+            const int* v = &this->triangleVertices[t * 3];
+            if (moved[v[0]] || moved[v[1]] || moved[v[2]]) {
+                this->blocks.set(t, this->points[v[0]], this->points[v[1]], this->points[v[2]]);
+                changed = true;
+            }
+        }
+        if (changed) {
+            computeTileBounds(tile);
+        }
+    }
+
+    return true;
+}
+
+
+TriangleData BruteForceKernel::triangle(int index) const
+{
+    const int* v = &this->triangleVertices[index * 3];
+    return TriangleData(
+        this->faceIndices[index],
+        this->triangleIndices[index],
+        this->points[v[0]],
+        this->points[v[1]],
+        this->points[v[2]]);
+}
+
+
+std::vector<TriangleData> BruteForceKernel::intersectKernelTriangle(const TriangleData& incoming) const
+{
+    std::vector<TriangleData> intersectedTriangles;
+    BlockQuery query(incoming);
+    int candidates[TRIANGLE_BLOCK_SIZE];
+
+    for (int tile = 0; tile < (int)this->tileBounds.size(); ++tile) {
+        if (!intersectBoxBox(this->tileBounds[tile], incoming.bbox)) {
+            continue;
+        }
+
+        int first = tile * TRIANGLE_BLOCK_SIZE;
+        int count = std::min(TRIANGLE_BLOCK_SIZE, numTriangles() - first);
+        int numCandidates = filterTriangleBlock(this->blocks, first, count, query, candidates);
+
+        for (int i = 0; i < numCandidates; ++i) {
+            TriangleData ourTri = triangle(candidates[i]);
+            if (intersectBoxBox(ourTri.bbox, incoming.bbox) && intersectTriangleTriangle(ourTri, incoming)) {
+                intersectedTriangles.push_back(ourTri);
+            }
+        }
+    }
+
+    return intersectedTriangles;
+}
+
+
+K2KIntersection BruteForceKernel::intersectKernelKernel(SpatialDivisionKernel& otherKernel) const
+{
+    std::vector<TriangleData> intersectedTrianglesA;
+    std::vector<TriangleData> intersectedTrianglesB;
+
+    BruteForceKernel* other = dynamic_cast<BruteForceKernel*>(&otherKernel);
+    if (other == nullptr) {
+        MGlobal::displayError("Cannot intersect brute force kernel with other kernel type!");
+        return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
+    }
+
+    // all tile pairs, each one a row of triangles in A against a block of B
+    const int numTilesA = (int)this->tileBounds.size();
+    const int numTilesB = (int)other->tileBounds.size();
+
+    #pragma omp parallel
+    {
+        std::vector<TriangleData> localA;
+        std::vector<TriangleData> localB;
+        int candidates[TRIANGLE_BLOCK_SIZE];
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int n = 0; n < numTilesA * numTilesB; ++n) {
+            int tileA = n / numTilesB;
+            int tileB = n % numTilesB;
+            if (!intersectBoxBox(this->tileBounds[tileA], other->tileBounds[tileB])) {
+                continue;
+            }
+
+            int firstA = tileA * TRIANGLE_BLOCK_SIZE;
+            int lastA = std::min(this->numTriangles(), firstA + TRIANGLE_BLOCK_SIZE);
+            int firstB = tileB * TRIANGLE_BLOCK_SIZE;
+            int countB = std::min(TRIANGLE_BLOCK_SIZE, other->numTriangles() - firstB);
+
+            for (int a = firstA; a < lastA; ++a) {
+                TriangleData triA = triangle(a);
+                if (!intersectBoxBox(triA.bbox, other->tileBounds[tileB])) {
+                    continue;
+                }
+
+                int numCandidates = filterTriangleBlock(other->blocks, firstB, countB, BlockQuery(triA), candidates);
+                for (int i = 0; i < numCandidates; ++i) {
+                    TriangleData triB = other->triangle(candidates[i]);
+                    if (intersectBoxBox(triA.bbox, triB.bbox) && intersectTriangleTriangle(triA, triB)) {
+                        localA.push_back(triA);
+                        localB.push_back(triB);
+                    }
+                }
+            }
+        }
+
+        #pragma omp critical
+        {
+            intersectedTrianglesA.insert(intersectedTrianglesA.end(), localA.begin(), localA.end());
+            intersectedTrianglesB.insert(intersectedTrianglesB.end(), localB.begin(), localB.end());
+        }
+    }
+
+    return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
+}
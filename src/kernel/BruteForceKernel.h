@@ -0,0 +1,42 @@
+#pragma once
+
+#include "../SpatialDivisionKernel.h"
+#include "../utility.h"
+#include "TriangleBlocks.h"
+
+#include <maya/MPoint.h>
+#include <maya/MPointArray.h>
+#include <maya/MStatus.h>
+#include <maya/MMatrix.h>
+#include <maya/MBoundingBox.h>
+
+#include <vector>
+
+
+// Tests every triangle against every other one, with no acceleration structure
+// beyond tile bounds. Cheaper than any tree for small meshes since the build is
+// a single pass over the points, and the ground truth the other kernels are
+// checked against.
+class BruteForceKernel : public SpatialDivisionKernel
+{
+public:
+     BruteForceKernel() {}
+    ~BruteForceKernel() override {}
+
+                      MStatus build(const MObject& meshObject, const MBoundingBox& bbox, const MMatrix& offsetMatrix) override;
+    std::vector<TriangleData> intersectKernelTriangle(const TriangleData& triangle) const override;
+              K2KIntersection intersectKernelKernel(SpatialDivisionKernel& otherKernel) const override;
+                         bool updatePoints(const MPointArray& points, const std::vector<int>& movedVertices) override;
+
+private:
+    MPointArray points;
+    std::vector<int> triangleVertices;    // 3 vertex ids per triangle
+    std::vector<int> faceIndices;         // per triangle
+    std::vector<int> triangleIndices;     // per triangle
+    TriangleBlocks blocks;
+    std::vector<MBoundingBox> tileBounds; // per TRIANGLE_BLOCK_SIZE triangles
+
+    int numTriangles() const { return (int)faceIndices.size(); }
+    TriangleData triangle(int index) const;
+    void computeTileBounds(int tile);
+};
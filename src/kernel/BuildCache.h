@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+
+// Process-wide cache for kernel data that only depends on a mesh hash
+// (topology, rest shape), shared between the kernels of every marker node.
+// Entries are immutable once stored, so readers never need to lock them.
+// Keys are 64 bit hashes (hashBytes64), a collision would hand out the data
+// of another mesh.
+template <typename ValueType>
+class BuildCache
+{
+public:
+    explicit BuildCache(size_t maxSize) : maxSize(maxSize) {}
+
+    std::shared_ptr<const ValueType> get(uint64_t key) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = entries.find(key);
+        if (iter == entries.end()) {
+            return nullptr;
+        }
+        return iter->second;
+    }
+
+    void put(uint64_t key, std::shared_ptr<const ValueType> value)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (entries.size() >= maxSize) {
+            entries.clear();
+        }
+        entries[key] = value;
+    }
+
+private:
+    mutable std::mutex mutex;
+    size_t maxSize;
+    std::unordered_map<uint64_t, std::shared_ptr<const ValueType>> entries;
+};
@@ -0,0 +1,410 @@
+#include "ClusterKernel.h"
+#include "BuildCache.h"
+#include "../utility.h"
+
+#include <maya/MStatus.h>
+#include <maya/MMatrix.h>
+#include <maya/MFnMesh.h>
+#include <maya/MBoundingBox.h>
+#include <maya/MPoint.h>
+#include <maya/MPointArray.h>
+#include <maya/MIntArray.h>
+#include <maya/MGlobal.h>
+
+#include <omp.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+
+const int CLUSTER_SIZE = TRIANGLE_BLOCK_SIZE;
+const size_t CLUSTER_TOPOLOGY_CACHE_SIZE = 32;
+
+
+// Grow clusters breadth first over triangles that share a vertex, which keeps
+// each cluster a connected, roughly disk shaped patch of the surface.
+static std::shared_ptr<ClusterTopology> computeClusterTopology(
+    int numVertices,
+    const MIntArray& triangleCounts,
+    const MIntArray& triangleVertices
+) {
+    std::shared_ptr<ClusterTopology> topo = std::make_shared<ClusterTopology>();
+    topo->numVertices = numVertices;
+
+    const int numTriangles = (int)triangleVertices.length() / 3;
+
+    std::vector<int> faceOf(numTriangles);
+    std::vector<int> indexInFace(numTriangles);
+    int triangleId = 0;
+    for (unsigned int faceIndex = 0; faceIndex < triangleCounts.length(); ++faceIndex) {
+        for (int i = 0; i < triangleCounts[faceIndex]; ++i) {
+            faceOf[triangleId] = faceIndex;
+            indexInFace[triangleId] = i;
+            triangleId++;
+        }
+    }
+
+    // vertex -> triangles
+    std::vector<int> vertexOffsets(numVertices + 1, 0);
+    for (int i = 0; i < numTriangles * 3; ++i) {
+        vertexOffsets[triangleVertices[i] + 1]++;
+    }
+    for (int v = 0; v < numVertices; ++v) {
+        vertexOffsets[v + 1] += vertexOffsets[v];
+    }
+    std::vector<int> vertexTriangles(numTriangles * 3);
+    std::vector<int> cursor(vertexOffsets.begin(), vertexOffsets.end() - 1);
+    for (int i = 0; i < numTriangles * 3; ++i) {
+        vertexTriangles[cursor[triangleVertices[i]]++] = i / 3;
+    }
+
+    std::vector<int> order;
+    order.reserve(numTriangles);
+    topo->clusterOffsets.push_back(0);
+
+    std::vector<char> visited(numTriangles, 0);
+    std::vector<int> frontier;
+    for (int seed = 0; seed < numTriangles; ++seed) {
+        if (visited[seed]) {
+            continue;
+        }
+
+        frontier.clear();
+        frontier.push_back(seed);
+        visited[seed] = 1;
+
+        int clusterSize = 0;
+        size_t head = 0;
+        while (head < frontier.size() && clusterSize < CLUSTER_SIZE) {
+            int t = frontier[head++];
+            order.push_back(t);
+            clusterSize++;
+
+            for (int k = 0; k < 3; ++k) {
+                int v = triangleVertices[t * 3 + k];
+                for (int n = vertexOffsets[v]; n < vertexOffsets[v + 1]; ++n) {
+                    int neighbor = vertexTriangles[n];
+                    if (!visited[neighbor]) {
+                        visited[neighbor] = 1;
+                        frontier.push_back(neighbor);
+                    }
+                }
+            }
+        }
+
+        // release whatever was queued but did not fit
+        for (size_t i = head; i < frontier.size(); ++i) {
+            visited[frontier[i]] = 0;
+        }
+
+        topo->clusterOffsets.push_back((int)order.size());
+    }
+
+    topo->triangleVertices.resize(numTriangles * 3);
+    topo->faceIndices.resize(numTriangles);
+    topo->triangleIndices.resize(numTriangles);
+    for (int slot = 0; slot < numTriangles; ++slot) {
+        int t = order[slot];
+        topo->triangleVertices[slot * 3 + 0] = triangleVertices[t * 3 + 0];
+        topo->triangleVertices[slot * 3 + 1] = triangleVertices[t * 3 + 1];
+        topo->triangleVertices[slot * 3 + 2] = triangleVertices[t * 3 + 2];
+        topo->faceIndices[slot] = faceOf[t];
+        topo->triangleIndices[slot] = indexInFace[t];
+    }
+
+    return topo;
+}
+
+
+MStatus ClusterKernel::build(const MObject& meshObject, const MBoundingBox& bbox, const MMatrix& offsetMatrix)
+{
+    MStatus status;
+
+    MFnMesh meshFn(meshObject, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    status = meshFn.getPoints(this->points, MSpace::kObject);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    const int numVertices = (int)this->points.length();
+    transformPoints(this->points, offsetMatrix);
+
+    MIntArray triangleCounts;
+    MIntArray triangleVertices;
+    status = meshFn.getTriangles(triangleCounts, triangleVertices);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    if (triangleVertices.length() == 0) {
+        return MStatus::kFailure;
+    }
+
+    // 1. clusters, once per topology
+    const uint64_t key = topologyHash64(numVertices, triangleVertices);
+
+    static BuildCache<ClusterTopology> cache(CLUSTER_TOPOLOGY_CACHE_SIZE);
+    this->topology = cache.get(key);
+    if (!this->topology ||
+        this->topology->numVertices != numVertices ||
+        this->topology->triangleVertices.size() != triangleVertices.length()
+    ) {
+        this->topology = computeClusterTopology(numVertices, triangleCounts, triangleVertices);
+        cache.put(key, this->topology);
+    }
+
+    // 2. per frame triangle blocks
+    const ClusterTopology& topo = *this->topology;
+    const int numSlots = (int)topo.faceIndices.size();
+    this->blocks.resize(numSlots);
+
+    #pragma omp parallel for
+    for (int slot = 0; slot < numSlots; ++slot) {
+        const int* v = &topo.triangleVertices[slot * 3];
+        this->blocks.set(slot, this->points[v[0]], this->points[v[1]], this->points[v[2]]);
+    }
+
+    // 3. cluster bounds, also in parallel
+    const int numClusters = topo.numClusters();
+    this->clusterBounds.resize(numClusters);
+
+    #pragma omp parallel for
+    for (int c = 0; c < numClusters; ++c) {
+        computeClusterBounds(c);
+    }
+
+    // 4. the small BVH over the clusters
+    std::vector<int> clusters(numClusters);
+    for (int c = 0; c < numClusters; ++c) {
+        clusters[c] = c;
+    }
+    this->nodes.clear();
+    this->nodes.reserve(2 * numClusters);
+    buildBVHRecursive(clusters, 0, numClusters);
+
+    return MStatus::kSuccess;
+}
+
+
+void ClusterKernel::computeClusterBounds(int cluster)
+{
+    const ClusterTopology& topo = *this->topology;
+    double lower[3] = { DBL_MAX, DBL_MAX, DBL_MAX };
+    double upper[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+    for (int i = topo.clusterOffsets[cluster] * 3; i < topo.clusterOffsets[cluster + 1] * 3; ++i) {
+        const MPoint& p = this->points[topo.triangleVertices[i]];
+        for (int k = 0; k < 3; ++k) {
+            lower[k] = std::min(lower[k], p[k]);
+            upper[k] = std::max(upper[k], p[k]);
+        }
+    }
+    this->clusterBounds[cluster] = MBoundingBox(
+        MPoint(lower[0], lower[1], lower[2]),
+        MPoint(upper[0], upper[1], upper[2]));
+}
+
+
+bool ClusterKernel::updatePoints(const MPointArray& points, const std::vector<int>& movedVertices)
+{
+    if (!this->topology || points.length() != this->points.length()) {
+        return false;
+    }
+
+    std::vector<char> moved(this->points.length(), 0);
+    for (int v : movedVertices) {
+        this->points[v] = points[v];
+        moved[v] = 1;
+    }
+
+    // rewrite the moved triangles' slots and refit the clusters holding them
+    const ClusterTopology& topo = *this->topology;
+    const int numClusters = topo.numClusters();
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int c = 0; c < numClusters; ++c) {
+        bool changed = false;
+        for (int slot = topo.clusterOffsets[c]; slot < topo.clusterOffsets[c + 1]; ++slot) {
+            const int* v = &topo.triangleVertices[slot * 3];
+            if (moved[v[0]] || moved[v[1]] || moved[v[2]]) {
+                this->blocks.set(slot, this->points[v[0]], this->points[v[1]], this->points[v[2]]);
+                changed = true;
+            }
+        }
+        if (changed) {
+            computeClusterBounds(c);
+        }
+    }
+
+    // the BVH keeps its shape, children always come after their parent
+    for (int n = (int)this->nodes.size() - 1; n >= 0; --n) {
+        ClusterBVHNode& node = this->nodes[n];
+        if (node.isLeaf()) {
+            node.bounds = this->clusterBounds[node.cluster];
+        } else {
+            node.bounds = merge(this->nodes[node.children[0]].bounds, this->nodes[node.children[1]].bounds);
+        }
+    }
+
+    return true;
+}
+
+
+int ClusterKernel::buildBVHRecursive(std::vector<int>& clusters, int first, int count)
+{
+    int index = (int)this->nodes.size();
+    this->nodes.emplace_back();
+
+    MBoundingBox bounds;
+    for (int i = first; i < first + count; ++i) {
+        bounds.expand(this->clusterBounds[clusters[i]]);
+    }
+    this->nodes[index].bounds = bounds;
+
+    if (count == 1) {
+        this->nodes[index].cluster = clusters[first];
+        return index;
+    }
+
+    // median split of the cluster centers along the longest axis
+    int axis = 0;
+    if (bounds.height() > bounds.width()) axis = 1;
+    if (bounds.depth() > std::max(bounds.width(), bounds.height())) axis = 2;
+
+    auto begin = clusters.begin() + first;
+    auto middle = begin + count / 2;
+    std::nth_element(begin, middle, begin + count, [&](int a, int b) {
+        return this->clusterBounds[a].center()[axis] < this->clusterBounds[b].center()[axis];
+    });
+
+    int left = buildBVHRecursive(clusters, first, count / 2);
+    int right = buildBVHRecursive(clusters, first + count / 2, count - count / 2);
+    this->nodes[index].children[0] = left;
+    this->nodes[index].children[1] = right;
+    return index;
+}
+
+
+TriangleData ClusterKernel::triangle(int slot) const
+{
+    const int* v = &this->topology->triangleVertices[slot * 3];
+    return TriangleData(
+        this->topology->faceIndices[slot],
+        this->topology->triangleIndices[slot],
+        this->points[v[0]],
+        this->points[v[1]],
+        this->points[v[2]]);
+}
+
+
+std::vector<TriangleData> ClusterKernel::intersectKernelTriangle(const TriangleData& incoming) const
+{
+    std::vector<TriangleData> intersectedTriangles;
+    BlockQuery query(incoming);
+    int candidates[CLUSTER_SIZE];
+
+    std::vector<int> stack;
+    stack.push_back(0);
+
+    while (!stack.empty()) {
+        const ClusterBVHNode& node = this->nodes[stack.back()];
+        stack.pop_back();
+
+        if (!intersectBoxBox(node.bounds, incoming.bbox)) {
+            continue;
+        }
+
+        if (!node.isLeaf()) {
+            stack.push_back(node.children[0]);
+            stack.push_back(node.children[1]);
+            continue;
+        }
+
+        int first = this->topology->clusterOffsets[node.cluster];
+        int count = this->topology->clusterOffsets[node.cluster + 1] - first;
+        int numCandidates = filterTriangleBlock(this->blocks, first, count, query, candidates);
+
+        for (int i = 0; i < numCandidates; ++i) {
+            TriangleData ourTri = triangle(candidates[i]);
+            if (intersectBoxBox(ourTri.bbox, incoming.bbox) && intersectTriangleTriangle(ourTri, incoming)) {
+                intersectedTriangles.push_back(ourTri);
+            }
+        }
+    }
+
+    return intersectedTriangles;
+}
+
+
+K2KIntersection ClusterKernel::intersectKernelKernel(SpatialDivisionKernel& otherKernel) const
+{
+    std::vector<TriangleData> intersectedTrianglesA;
+    std::vector<TriangleData> intersectedTrianglesB;
+
+    ClusterKernel* other = dynamic_cast<ClusterKernel*>(&otherKernel);
+    if (other == nullptr) {
+        MGlobal::displayError("Cannot intersect cluster kernel with other kernel type!");
+        return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
+    }
+
+    // top level: overlapping cluster pairs
+    std::vector<std::pair<int, int>> clusterPairs;
+    std::vector<std::pair<int, int>> stack;
+    stack.emplace_back(0, 0);
+
+    while (!stack.empty()) {
+        std::pair<int, int> current = stack.back();
+        stack.pop_back();
+
+        const ClusterBVHNode& nodeA = this->nodes[current.first];
+        const ClusterBVHNode& nodeB = other->nodes[current.second];
+        if (!intersectBoxBox(nodeA.bounds, nodeB.bounds)) {
+            continue;
+        }
+
+        if (nodeA.isLeaf() && nodeB.isLeaf()) {
+            clusterPairs.emplace_back(nodeA.cluster, nodeB.cluster);
+        } else if (nodeB.isLeaf() || (!nodeA.isLeaf() && halfarea(nodeA.bounds) >= halfarea(nodeB.bounds))) {
+            stack.emplace_back(nodeA.children[0], current.second);
+            stack.emplace_back(nodeA.children[1], current.second);
+        } else {
+            stack.emplace_back(current.first, nodeB.children[0]);
+            stack.emplace_back(current.first, nodeB.children[1]);
+        }
+    }
+
+    // bottom level: each triangle of cluster A against the whole block of cluster B
+    #pragma omp parallel
+    {
+        std::vector<TriangleData> localA;
+        std::vector<TriangleData> localB;
+        int candidates[CLUSTER_SIZE];
+
+        #pragma omp for schedule(dynamic, 8)
+        for (int n = 0; n < (int)clusterPairs.size(); ++n) {
+            int clusterA = clusterPairs[n].first;
+            int clusterB = clusterPairs[n].second;
+            int firstB = other->topology->clusterOffsets[clusterB];
+            int countB = other->topology->clusterOffsets[clusterB + 1] - firstB;
+
+            for (int a = this->topology->clusterOffsets[clusterA]; a < this->topology->clusterOffsets[clusterA + 1]; ++a) {
+                TriangleData triA = triangle(a);
+                if (!intersectBoxBox(triA.bbox, other->clusterBounds[clusterB])) {
+                    continue;
+                }
+
+                int numCandidates = filterTriangleBlock(other->blocks, firstB, countB, BlockQuery(triA), candidates);
+                for (int i = 0; i < numCandidates; ++i) {
+                    TriangleData triB = other->triangle(candidates[i]);
+                    if (intersectBoxBox(triA.bbox, triB.bbox) && intersectTriangleTriangle(triA, triB)) {
+                        localA.push_back(triA);
+                        localB.push_back(triB);
+                    }
+                }
+            }
+        }
+
+        #pragma omp critical
+        {
+            intersectedTrianglesA.insert(intersectedTrianglesA.end(), localA.begin(), localA.end());
+            intersectedTrianglesB.insert(intersectedTrianglesB.end(), localB.begin(), localB.end());
+        }
+    }
+
+    return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
+}
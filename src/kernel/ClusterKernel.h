@@ -0,0 +1,65 @@
+#pragma once
+
+#include "../SpatialDivisionKernel.h"
+#include "../utility.h"
+#include "TriangleBlocks.h"
+
+#include <maya/MPoint.h>
+#include <maya/MPointArray.h>
+#include <maya/MStatus.h>
+#include <maya/MMatrix.h>
+#include <maya/MBoundingBox.h>
+
+#include <vector>
+#include <memory>
+
+
+// Partition of one mesh topology into connected clusters of about
+// CLUSTER_SIZE triangles. Computed once per topology hash.
+struct ClusterTopology
+{
+    int numVertices = 0;
+    std::vector<int> clusterOffsets;      // cluster c owns slots [clusterOffsets[c], clusterOffsets[c+1])
+    std::vector<int> triangleVertices;    // 3 vertex ids per slot, in cluster order
+    std::vector<int> faceIndices;         // per slot
+    std::vector<int> triangleIndices;     // per slot
+
+    int numClusters() const { return (int)clusterOffsets.size() - 1; }
+};
+
+
+struct ClusterBVHNode
+{
+    MBoundingBox bounds;
+    int children[2] = { -1, -1 };
+    int cluster = -1;                     // leaf only
+
+    bool isLeaf() const { return cluster >= 0; }
+};
+
+
+// Two level kernel for deforming meshes. The mesh is split into clusters
+// once per topology; each build only refits the cluster bounds and rebuilds
+// the small BVH over them.
+class ClusterKernel : public SpatialDivisionKernel
+{
+public:
+     ClusterKernel() {}
+    ~ClusterKernel() override {}
+
+                      MStatus build(const MObject& meshObject, const MBoundingBox& bbox, const MMatrix& offsetMatrix) override;
+    std::vector<TriangleData> intersectKernelTriangle(const TriangleData& triangle) const override;
+              K2KIntersection intersectKernelKernel(SpatialDivisionKernel& otherKernel) const override;
+                         bool updatePoints(const MPointArray& points, const std::vector<int>& movedVertices) override;
+
+private:
+    std::shared_ptr<const ClusterTopology> topology;
+    MPointArray points;
+    TriangleBlocks blocks;                // per frame triangles in cluster order
+    std::vector<MBoundingBox> clusterBounds;
+    std::vector<ClusterBVHNode> nodes;    // nodes[0] is the root
+
+    TriangleData triangle(int slot) const;
+    void computeClusterBounds(int cluster);
+    int buildBVHRecursive(std::vector<int>& clusters, int first, int count);
+};
@@ -1,4 +1,6 @@
 #include "EmbreeKernel.h"
+#include "BuildCache.h"
+#include "../MappedFile.h"
 #include "../utility.h"
 
 #include <glm/glm.hpp>
@@ -6,6 +8,7 @@
 #include <embree4/rtcore_geometry.h>
 #include <embree4/rtcore_scene.h>
 
+#include <maya/MTypes.h>
 #include <maya/MStatus.h>
 #include <maya/MMatrix.h>
 #include <maya/MFnMesh.h>
@@ -19,11 +22,37 @@
 #include <maya/MStatus.h>
 
 #include <stack>
-#include <queue>
 #include <vector>
+#include <string>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <functional>
+#include <type_traits>
 #include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+
+
+// Primitives per leaf. Small leaves make a deep tree with many nodes to visit,
+// large ones test triangles that a further split would have culled.
+const unsigned int BVH_MAX_LEAF_SIZE = 4;
+
+// Evaluations in a row with unchanged points before a HIGH quality tree is
+// built in the background, and how many of those trees are kept.
+const int HIGH_QUALITY_STABLE_EVALUATIONS = 3;
+const size_t HIGH_QUALITY_CACHE_SIZE = 8;
+
+// Prebuilt kernel files. Bump the version whenever the flattened layout or
+// the way a mesh is turned into primitives changes.
+const char* const KERNEL_CACHE_ENVIRONMENT_VARIABLE = "INTERSECTION_MARKER_KERNEL_CACHE";
+const char EMBREE_TREE_FILE_MAGIC[8] = "IMBVH";
+const uint32_t EMBREE_TREE_FILE_VERSION = 2;
+const size_t EMBREE_TREE_FILE_ALIGNMENT = 64;
 
 
 /* This function is called by the builder to signal progress and to
@@ -42,8 +71,9 @@ void splitPrimitive (const RTCBuildPrimitive* prim, unsigned int dim, float pos,
 {
     assert(dim < 3);
     assert(prim->geomID == 0);
-    *(MBoundingBox*) lprim = *(MBoundingBox*) prim;
-    *(MBoundingBox*) rprim = *(MBoundingBox*) prim;
+    // RTCBuildPrimitive starts with the same float layout as RTCBounds
+    *lprim = *(const RTCBounds*) prim;
+    *rprim = *(const RTCBounds*) prim;
     (&lprim->upper_x)[dim] = pos;
     (&rprim->lower_x)[dim] = pos;
 }
@@ -81,36 +111,571 @@ void errorHandler(void* userPtr, enum RTCError code, const char* str)
     }
 }
 
-MStatus EmbreeKernel::build(const MObject& meshObject, const MBoundingBox& bbox, const MMatrix& offsetMatrix)
+
+// Flatten the builder's nodes into the tree's arrays: inner nodes in depth
+// first order, leaves with their primitives and triangles in the order the
+// walk reaches them. The builder hands out leaf ranges in whatever order its
+// threads finish and triangles come in mesh face order; laid out this way a
+// traversal that stays inside one subtree reads memory front to back. A
+// primitive split between several leaves is copied into each.
+// `triangleSources`, when given, gets the build order index of every triangle.
+template <typename NodeType>
+static NodeRef flattenNode(
+    const BuildNode* node,
+    const std::vector<unsigned>& leafPrimitives,
+    const TriangleStorage& triangles,
+    const PrimitiveStorage& primitiveData,
+    std::vector<NodeType>& nodes,
+    EmbreeTree& tree,
+    std::vector<unsigned>* triangleSources
+) {
+    if (node->leaf) {
+        const BuildLeafNode* buildLeaf = (const BuildLeafNode*)node;
+
+        LeafData leaf;
+        leaf.first = (unsigned)tree.primitiveStorage.size();
+        leaf.count = buildLeaf->count;
+        for (unsigned i = buildLeaf->first; i < buildLeaf->first + buildLeaf->count; ++i) {
+            PrimitiveData primitive = primitiveData[leafPrimitives[i]];
+            const unsigned firstTriangle = (unsigned)tree.triangleStorage.size();
+            if (triangleSources) {
+                for (unsigned t = primitive.first; t < primitive.first + primitive.count; ++t) {
+                    triangleSources->push_back(t);
+                }
+            }
+            tree.triangleStorage.insert(
+                tree.triangleStorage.end(),
+                triangles.begin() + primitive.first,
+                triangles.begin() + primitive.first + primitive.count);
+            primitive.first = firstTriangle;
+            tree.primitiveStorage.push_back(primitive);
+            leaf.bounds.expand(primitive.bbox);
+        }
+        tree.leafStorage.push_back(leaf);
+
+        return ~(NodeRef)(tree.leafStorage.size() - 1);
+    }
+
+    const BuildInnerNode* inner = (const BuildInnerNode*)node;
+    const size_t index = nodes.size();
+    nodes.emplace_back();
+
+    const RTCBounds* bounds[2] = { &inner->bounds[0], &inner->bounds[1] };
+    nodes[index].setBounds(bounds);
+    for (int i = 0; i < 2; ++i) {
+        const NodeRef child = flattenNode(inner->children[i], leafPrimitives, triangles, primitiveData, nodes, tree, triangleSources);
+        nodes[index].children[i] = child;
+    }
+
+    return (NodeRef)index;
+}
+
+
+// Build a tree over the given primitives. The primitive array is used as
+// scratch space by the builder; for HIGH quality its capacity should leave
+// room for the references created by spatial splits. `triangleSources` is
+// filled for saveTree when given.
+static std::shared_ptr<EmbreeTree> buildTree(
+    std::vector<RTCBuildPrimitive>& primitives,
+    const TriangleStorage& triangles,
+    const PrimitiveStorage& primitiveData,
+    RTCBuildQuality quality,
+    bool quantizedNodes,
+    std::vector<unsigned>* triangleSources = nullptr
+) {
+    std::shared_ptr<EmbreeTree> tree = std::make_shared<EmbreeTree>();
+    tree->quantized = quantizedNodes;
+    tree->meshTriangles = triangles.size();
+
+    RTCDevice device = rtcNewDevice(nullptr);
+    if (!device) {
+        return nullptr;
+    }
+
+    rtcSetDeviceErrorFunction(device, errorHandler, nullptr);
+
+    RTCBVH bvh = rtcNewBVH(device);
+    if (!bvh) {
+        rtcReleaseDevice(device);
+        return nullptr;
+    }
+
+    LeafStorage leafStorage;
+    std::vector<unsigned> leafPrimitives(primitives.capacity());
+    leafStorage.primitives = leafPrimitives.data();
+
+    RTCBuildArguments arguments = rtcDefaultBuildArguments();
+    arguments.byteSize               = sizeof(arguments);
+    arguments.buildFlags             = quality == RTC_BUILD_QUALITY_HIGH ? RTC_BUILD_FLAG_NONE : RTC_BUILD_FLAG_DYNAMIC;
+    arguments.buildQuality           = quality;
+    arguments.maxBranchingFactor     = 2;
+    arguments.maxDepth               = 1024;
+    arguments.sahBlockSize           = 1;
+    arguments.minLeafSize            = 1;
+    arguments.maxLeafSize            = BVH_MAX_LEAF_SIZE;
+    arguments.traversalCost          = 1.0f;
+    arguments.intersectionCost       = 2.0f;
+    arguments.bvh                    = bvh;
+    arguments.primitives             = primitives.data();
+    arguments.primitiveCount         = primitives.size();
+    arguments.primitiveArrayCapacity = primitives.capacity();
+    arguments.createNode             = BuildInnerNode::create;
+    arguments.setNodeChildren        = BuildInnerNode::setChildren;
+    arguments.setNodeBounds          = BuildInnerNode::setBounds;
+    arguments.createLeaf             = BuildLeafNode::create;
+    arguments.splitPrimitive         = splitPrimitive;
+    arguments.buildProgress          = buildProgress;
+    arguments.userPtr                = &leafStorage;
+
+    const BuildNode* root = (const BuildNode*)rtcBuildBVH(&arguments);
+    if (root) {
+        leafPrimitives.resize(leafStorage.size);
+        tree->triangleStorage.reserve(triangles.size());
+        tree->primitiveStorage.reserve(leafPrimitives.size());
+        if (quantizedNodes) {
+            tree->root = flattenNode(root, leafPrimitives, triangles, primitiveData, tree->quantizedNodeStorage, *tree, triangleSources);
+        } else {
+            tree->root = flattenNode(root, leafPrimitives, triangles, primitiveData, tree->boxNodeStorage, *tree, triangleSources);
+        }
+        tree->bind();
+    }
+
+    // the builder's nodes are not needed once flattened
+    rtcReleaseBVH(bvh);
+    rtcReleaseDevice(device);
+
+    return root ? tree : nullptr;
+}
+
+
+// Prebuilt kernel files: this header, then plain arrays each starting on an
+// EMBREE_TREE_FILE_ALIGNMENT boundary. Inner nodes are stored as they are in
+// memory and used in place. Leaves, primitives and triangles are compact
+// records of indices, with the mesh's float points; loading turns them back
+// into TriangleData with the offset matrix, the same doubles a build makes.
+// The header records everything the layout depends on, and a file written by
+// a different build is ignored and rebuilt.
+struct EmbreeTreeFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t mayaApiVersion;
+    uint32_t layout[6];           // record sizes: BoxNode, QuantizedNode, leaf and primitive ranges, triangles, point coordinates
+    uint32_t quantized;
+    int32_t root;
+    uint64_t meshTriangles;
+    uint64_t counts[6];           // same order as layout
+    uint64_t offsets[6];
+    uint64_t checksum;            // header with this field zero, then every array
+};
+
+// Leaf primitives or primitive triangles.
+struct FileRange
+{
+    uint32_t first;
+    uint32_t count;
+};
+
+struct FileTriangle
+{
+    int32_t faceIndex;
+    int32_t triangleIndex;
+    uint32_t vertices[3];         // into the points
+};
+
+static_assert(std::is_trivially_copyable<BoxNode>::value, "BoxNode is mapped from kernel files");
+static_assert(std::is_trivially_copyable<QuantizedNode>::value, "QuantizedNode is mapped from kernel files");
+
+
+// What a prebuilt kernel file needs besides the tree: the object space points
+// and the vertices of every triangle in build order.
+struct TreeFileSource
+{
+    std::string path;
+    std::vector<float> points;
+    std::vector<int> triangleVertices;
+};
+
+
+static void fileLayout(uint32_t layout[6])
+{
+    layout[0] = (uint32_t)sizeof(BoxNode);
+    layout[1] = (uint32_t)sizeof(QuantizedNode);
+    layout[2] = (uint32_t)sizeof(FileRange);
+    layout[3] = (uint32_t)sizeof(FileRange);
+    layout[4] = (uint32_t)sizeof(FileTriangle);
+    layout[5] = (uint32_t)sizeof(float);
+}
+
+
+static size_t alignFileOffset(size_t offset)
+{
+    return (offset + EMBREE_TREE_FILE_ALIGNMENT - 1) / EMBREE_TREE_FILE_ALIGNMENT * EMBREE_TREE_FILE_ALIGNMENT;
+}
+
+
+static uint64_t fileChecksum(const EmbreeTreeFileHeader& header, const void* const arrays[6])
+{
+    EmbreeTreeFileHeader summed = header;
+    summed.checksum = 0;
+    uint64_t hash = hashBytes64(&summed, sizeof(summed));
+    for (int k = 0; k < 6; ++k) {
+        hash = hashBytes64(arrays[k], (size_t)(header.counts[k] * header.layout[k]), hash);
+    }
+    return hash;
+}
+
+
+// `triangleSources` holds the build order index of every triangle of the tree.
+static bool saveTree(const EmbreeTree& tree, const std::vector<unsigned>& triangleSources, const TreeFileSource& source)
+{
+    std::vector<FileRange> leaves(tree.leaves.size);
+    for (size_t i = 0; i < tree.leaves.size; ++i) {
+        leaves[i] = { tree.leaves[i].first, tree.leaves[i].count };
+    }
+    std::vector<FileRange> primitives(tree.primitives.size);
+    for (size_t i = 0; i < tree.primitives.size; ++i) {
+        primitives[i] = { tree.primitives[i].first, tree.primitives[i].count };
+    }
+    std::vector<FileTriangle> triangles(tree.triangles.size);
+    for (size_t i = 0; i < tree.triangles.size; ++i) {
+        const int* vertices = &source.triangleVertices[triangleSources[i] * 3];
+        triangles[i] = { tree.triangles[i].faceIndex, tree.triangles[i].triangleIndex,
+            { (uint32_t)vertices[0], (uint32_t)vertices[1], (uint32_t)vertices[2] } };
+    }
+
+    EmbreeTreeFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, EMBREE_TREE_FILE_MAGIC, sizeof(header.magic));
+    header.version = EMBREE_TREE_FILE_VERSION;
+    header.mayaApiVersion = MAYA_API_VERSION;
+    fileLayout(header.layout);
+    header.quantized = tree.quantized ? 1 : 0;
+    header.root = tree.root;
+    header.meshTriangles = tree.meshTriangles;
+
+    const void* const arrays[6] = { tree.boxNodes.data, tree.quantizedNodes.data, leaves.data(), primitives.data(), triangles.data(), source.points.data() };
+    header.counts[0] = tree.boxNodes.size;
+    header.counts[1] = tree.quantizedNodes.size;
+    header.counts[2] = leaves.size();
+    header.counts[3] = primitives.size();
+    header.counts[4] = triangles.size();
+    header.counts[5] = source.points.size();
+
+    static const char padding[EMBREE_TREE_FILE_ALIGNMENT] = {};
+    size_t offset = alignFileOffset(sizeof(header));
+    FileBlocks blocks = { { &header, sizeof(header) }, { padding, offset - sizeof(header) } };
+    for (int k = 0; k < 6; ++k) {
+        const size_t bytes = header.counts[k] * header.layout[k];
+        header.offsets[k] = offset;
+        blocks.push_back({ arrays[k], bytes });
+        blocks.push_back({ padding, alignFileOffset(offset + bytes) - (offset + bytes) });
+        offset = alignFileOffset(offset + bytes);
+    }
+    header.checksum = fileChecksum(header, arrays);
+
+    return writeFileAtomically(source.path, blocks);
+}
+
+
+template <typename T>
+static bool mapArray(const MappedFile& file, const EmbreeTreeFileHeader& header, int k, ArrayView<T>& view)
+{
+    const uint64_t offset = header.offsets[k];
+    const uint64_t count = header.counts[k];
+    if (offset % EMBREE_TREE_FILE_ALIGNMENT != 0 || offset > file.size() || count > (file.size() - offset) / sizeof(T)) {
+        return false;
+    }
+    view = ArrayView<T>((const T*)(file.data() + offset), (size_t)count);
+    return true;
+}
+
+
+// The checksum rejects damaged files without walking the tree. Indices that
+// are read while the records are turned back into triangles, primitives and
+// leaves are checked on the way, nothing else is.
+static std::shared_ptr<EmbreeTree> loadTree(const std::string& path, const MMatrix& offsetMatrix)
 {
+    std::shared_ptr<MappedFile> file = MappedFile::open(path);
+    if (!file || file->size() < sizeof(EmbreeTreeFileHeader)) {
+        return nullptr;
+    }
+
+    const EmbreeTreeFileHeader& header = *(const EmbreeTreeFileHeader*)file->data();
+    uint32_t layout[6];
+    fileLayout(layout);
+    if (std::memcmp(header.magic, EMBREE_TREE_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != EMBREE_TREE_FILE_VERSION ||
+        header.mayaApiVersion != MAYA_API_VERSION ||
+        std::memcmp(header.layout, layout, sizeof(layout)) != 0
+    ) {
+        return nullptr;
+    }
+
+    std::shared_ptr<EmbreeTree> tree = std::make_shared<EmbreeTree>();
+    ArrayView<BoxNode> boxNodes;
+    ArrayView<QuantizedNode> quantizedNodes;
+    ArrayView<FileRange> leaves;
+    ArrayView<FileRange> primitives;
+    ArrayView<FileTriangle> triangles;
+    ArrayView<float> points;
+    if (!mapArray(*file, header, 0, boxNodes) ||
+        !mapArray(*file, header, 1, quantizedNodes) ||
+        !mapArray(*file, header, 2, leaves) ||
+        !mapArray(*file, header, 3, primitives) ||
+        !mapArray(*file, header, 4, triangles) ||
+        !mapArray(*file, header, 5, points)
+    ) {
+        return nullptr;
+    }
+
+    const void* const arrays[6] = { boxNodes.data, quantizedNodes.data, leaves.data, primitives.data, triangles.data, points.data };
+    if (fileChecksum(header, arrays) != header.checksum) {
+        return nullptr;
+    }
+
+    const size_t numVertices = points.size / 3;
+    const int numTriangles = (int)triangles.size;
+    const int numPrimitives = (int)primitives.size;
+    const int numLeaves = (int)leaves.size;
+    int invalid = 0;
+
+    tree->triangleStorage.resize(numTriangles);
+    #pragma omp parallel for reduction(+:invalid)
+    for (int i = 0; i < numTriangles; ++i) {
+        const FileTriangle& triangle = triangles[i];
+        if (triangle.faceIndex < 0 || (uint64_t)triangle.faceIndex >= header.meshTriangles || triangle.triangleIndex < 0 ||
+            triangle.vertices[0] >= numVertices || triangle.vertices[1] >= numVertices || triangle.vertices[2] >= numVertices
+        ) {
+            invalid++;
+            continue;
+        }
+        MPoint vertices[3];
+        for (int k = 0; k < 3; ++k) {
+            const float* point = &points[triangle.vertices[k] * 3];
+            vertices[k] = MPoint(point[0], point[1], point[2]) * offsetMatrix;
+        }
+        tree->triangleStorage[i] = TriangleData(triangle.faceIndex, triangle.triangleIndex, vertices[0], vertices[1], vertices[2]);
+    }
+
+    tree->primitiveStorage.resize(numPrimitives);
+    #pragma omp parallel for reduction(+:invalid)
+    for (int i = 0; i < numPrimitives; ++i) {
+        const FileRange& range = primitives[i];
+        if (range.first > (uint32_t)numTriangles || range.count > (uint32_t)numTriangles - range.first) {
+            invalid++;
+            continue;
+        }
+        PrimitiveData& primitive = tree->primitiveStorage[i];
+        primitive.first = range.first;
+        primitive.count = range.count;
+        for (unsigned t = range.first; t < range.first + range.count; ++t) {
+            primitive.bbox.expand(tree->triangleStorage[t].bbox);
+        }
+    }
+
+    tree->leafStorage.resize(numLeaves);
+    #pragma omp parallel for reduction(+:invalid)
+    for (int i = 0; i < numLeaves; ++i) {
+        const FileRange& range = leaves[i];
+        if (range.first > (uint32_t)numPrimitives || range.count > (uint32_t)numPrimitives - range.first) {
+            invalid++;
+            continue;
+        }
+        LeafData& leaf = tree->leafStorage[i];
+        leaf.first = range.first;
+        leaf.count = range.count;
+        for (unsigned p = range.first; p < range.first + range.count; ++p) {
+            leaf.bounds.expand(tree->primitiveStorage[p].bbox);
+        }
+    }
+    if (invalid > 0) {
+        return nullptr;
+    }
+
+    tree->quantized = header.quantized != 0;
+    tree->root = header.root;
+    tree->meshTriangles = (size_t)header.meshTriangles;
+    tree->bind();
+    tree->boxNodes = boxNodes;
+    tree->quantizedNodes = quantizedNodes;
+    tree->file = file;
+    return tree;
+}
+
+
+// Directory of prebuilt kernel files, from the environment. Unset turns them off.
+static const std::string& kernelCacheDirectory()
+{
+    static const std::string directory = []() {
+        const char* value = std::getenv(KERNEL_CACHE_ENVIRONMENT_VARIABLE);
+        return std::string(value ? value : "");
+    }();
+    return directory;
+}
+
+
+// Prebuilt kernel file of this mesh, named after a 64 bit hash of its points,
+// face vertex lists, offset matrix and the build settings. Only the raw
+// arrays are hashed, so finding the file does not need the triangles.
+static std::string treeFilePath(const MObject& meshObject, const MMatrix& offsetMatrix, bool quantizedNodes)
+{
+    const std::string& directory = kernelCacheDirectory();
+    if (directory.empty()) {
+        return std::string();
+    }
+
     MStatus status;
+    MFnMesh meshFn(meshObject, &status);
+    if (status != MStatus::kSuccess) {
+        return std::string();
+    }
+
+    const float* points = meshFn.getRawPoints(&status);
+    if (status != MStatus::kSuccess) {
+        return std::string();
+    }
+
+    MIntArray polygonCounts;
+    MIntArray polygonVertices;
+    meshFn.getVertices(polygonCounts, polygonVertices);
+    std::vector<int> counts(polygonCounts.length());
+    std::vector<int> vertices(polygonVertices.length());
+    polygonCounts.get(counts.data());
+    polygonVertices.get(vertices.data());
+
+    const int settings[2] = { (int)quantizedNodes, (int)BVH_MAX_LEAF_SIZE };
+
+    uint64_t hash = hashBytes64(points, sizeof(float) * 3 * meshFn.numVertices(), EMBREE_TREE_FILE_VERSION);
+    hash = hashBytes64(counts.data(), sizeof(int) * counts.size(), hash);
+    hash = hashBytes64(vertices.data(), sizeof(int) * vertices.size(), hash);
+    hash = hashBytes64(offsetMatrix.matrix, sizeof(offsetMatrix.matrix), hash);
+    hash = hashBytes64(settings, sizeof(settings), hash);
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.imbvh", (unsigned long long)hash);
+    return directory + "/" + name;
+}
+
 
-    this->device = rtcNewDevice(nullptr);
-    if(!this->device)
+// Per frame builds use LOW quality. Meshes whose points stay the same over
+// several evaluations get a HIGH quality tree with spatial splits, built on a
+// background thread; once it is published every later build of the same
+// points returns it instead of building again. With a kernel cache directory
+// set, the HIGH quality tree is also written there for later sessions.
+class TreeUpgrades
+{
+public:
+    std::shared_ptr<const EmbreeTree> get(uint64_t key) const
     {
-        MGlobal::displayError("Failed to create Embree device");
-        return MStatus::kFailure;
+        return this->finished.get(key);
     }
 
-    rtcSetDeviceErrorFunction(this->device, errorHandler, nullptr);
+    // `topologyKey` names the mesh across evaluations, `key` its current
+    // points. The count restarts whenever the points of a topology change, so
+    // only evaluations in a row with the same points lead to an upgrade.
+    void evaluated(
+        uint64_t topologyKey,
+        uint64_t key,
+        const std::vector<RTCBuildPrimitive>& primitives,
+        const TriangleStorage& triangles,
+        const PrimitiveStorage& primitiveData,
+        bool quantizedNodes,
+        const TreeFileSource& file
+    ) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        this->workers.erase(
+            std::remove_if(this->workers.begin(), this->workers.end(), [](const std::future<void>& worker) {
+                return worker.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            }),
+            this->workers.end());
+
+        if (this->evaluations.size() >= HIGH_QUALITY_CACHE_SIZE * 16) {
+            this->evaluations.clear();
+        }
+        std::pair<uint64_t, int>& evaluation = this->evaluations[topologyKey];
+        if (evaluation.first != key) {
+            evaluation = std::make_pair(key, 0);
+        }
+        if (++evaluation.second != HIGH_QUALITY_STABLE_EVALUATIONS) {
+            return;
+        }
 
-    this->bvh = rtcNewBVH(this->device);
-    if (!this->bvh) {
-        MGlobal::displayError("Failed to create Embree BVH");
-        return MStatus::kFailure;
+        // spatial splits duplicate references, the builder needs the room
+        std::vector<RTCBuildPrimitive> scratch;
+        scratch.reserve(primitives.size() * 2);
+        scratch.assign(primitives.begin(), primitives.end());
+
+        this->workers.push_back(std::async(std::launch::async,
+            [this, key, scratch = std::move(scratch), triangles, primitiveData, quantizedNodes, file]() mutable {
+                std::vector<unsigned> triangleSources;
+                std::shared_ptr<EmbreeTree> tree = buildTree(scratch, triangles, primitiveData, RTC_BUILD_QUALITY_HIGH, quantizedNodes,
+                    file.path.empty() ? nullptr : &triangleSources);
+                if (tree) {
+                    this->finished.put(key, tree);
+                    if (!file.path.empty()) {
+                        saveTree(*tree, triangleSources, file);
+                    }
+                }
+            }));
+    }
+
+private:
+    std::mutex mutex;
+    std::unordered_map<uint64_t, std::pair<uint64_t, int>> evaluations;   // topology -> points and evaluations in a row
+    BuildCache<EmbreeTree> finished { HIGH_QUALITY_CACHE_SIZE };
+    std::vector<std::future<void>> workers;     // declared last: joined before `finished` goes away
+};
+
+static TreeUpgrades upgrades;
+
+// Trees loaded from prebuilt kernel files, by file path, so that a mesh that
+// stays the same is only read back once.
+static BuildCache<EmbreeTree> loadedTrees { HIGH_QUALITY_CACHE_SIZE };
+
+
+MStatus EmbreeKernel::build(const MObject& meshObject, const MBoundingBox& bbox, const MMatrix& offsetMatrix)
+{
+    MStatus status;
+
+    // a prebuilt kernel of the same mesh and settings skips everything below
+    TreeFileSource fileSource;
+    fileSource.path = treeFilePath(meshObject, offsetMatrix, this->quantizedNodes);
+    if (!fileSource.path.empty()) {
+        const uint64_t pathKey = hashBytes64(fileSource.path.data(), fileSource.path.size());
+        this->tree = loadedTrees.get(pathKey);
+        if (this->tree) {
+            return MStatus::kSuccess;
+        }
+        std::shared_ptr<EmbreeTree> loaded = loadTree(fileSource.path, offsetMatrix);
+        if (loaded) {
+            loadedTrees.put(pathKey, loaded);
+            this->tree = loaded;
+            return MStatus::kSuccess;
+        }
+
+        // what saving the HIGH quality tree needs besides the tree
+        MFnMesh meshFn(meshObject);
+        const float* points = meshFn.getRawPoints(&status);
+        CHECK_MSTATUS_AND_RETURN_IT(status);
+        fileSource.points.assign(points, points + 3 * meshFn.numVertices());
     }
 
     // store the PrimID to face id and triangle id mapping
-    this->triangles.clear();
+    TriangleStorage triangles;
+    PrimitiveStorage primitiveData;
+    std::vector<double> keyPoints;
+    std::vector<int> keyFaces;      // face and triangle id of every triangle, the first triangle of every primitive
 
-    // collect all triangles
+    // collect all triangles, a quad's two triangles make one primitive
     std::vector<RTCBuildPrimitive> primitives;
     MItMeshPolygon itPoly(meshObject);
-    int primId = 0;
     for(; !itPoly.isDone(); itPoly.next()) {
 
         int numTriangles;
         itPoly.numTriangles(numTriangles);
+        const bool isQuad = itPoly.polygonVertexCount() == 4 && numTriangles == 2;
 
         for (int triangleId=0; triangleId < numTriangles; ++triangleId) {
             MPointArray points;
@@ -123,52 +688,55 @@ MStatus EmbreeKernel::build(const MObject& meshObject, const MBoundingBox& bbox,
                     points[1] * offsetMatrix,
                     points[2] * offsetMatrix);
 
-            RTCBuildPrimitive prim;
-            prim.lower_x = (float)triangle.bbox.min().x;
-            prim.lower_y = (float)triangle.bbox.min().y;
-            prim.lower_z = (float)triangle.bbox.min().z;
-            prim.geomID = 0;
-            prim.upper_x = (float)triangle.bbox.max().x;
-            prim.upper_y = (float)triangle.bbox.max().y;
-            prim.upper_z = (float)triangle.bbox.max().z;
-            prim.primID = primId;
-            primitives.push_back(prim);
-
-            this->triangles.push_back(triangle);
+            if (!isQuad || triangleId == 0) {
+                primitiveData.push_back({ (unsigned)triangles.size(), 0, MBoundingBox() });
+                keyFaces.push_back((int)triangles.size());
+            }
+            keyFaces.insert(keyFaces.end(), { triangle.faceIndex, triangle.triangleIndex });
+            if (!fileSource.path.empty()) {
+                fileSource.triangleVertices.insert(fileSource.triangleVertices.end(), { vertexList[0], vertexList[1], vertexList[2] });
+            }
+            primitiveData.back().count++;
+            primitiveData.back().bbox.expand(triangle.bbox);
 
-            primId++;
+            for (int i = 0; i < 3; ++i) {
+                keyPoints.insert(keyPoints.end(), { triangle.vertices[i].x, triangle.vertices[i].y, triangle.vertices[i].z });
+            }
+            triangles.push_back(triangle);
         }
     }
 
-    // Build BVH
-    RTCBuildArguments arguments = rtcDefaultBuildArguments();
-    arguments.byteSize               = sizeof(arguments);
-    // arguments.buildFlags             = RTC_BUILD_FLAG_NONE;
-    arguments.buildFlags             = RTC_BUILD_FLAG_DYNAMIC;
-    arguments.buildQuality           = RTC_BUILD_QUALITY_LOW;
-    // arguments.buildQuality           = RTC_BUILD_QUALITY_MEDIUM;
-    arguments.maxBranchingFactor     = 2;
-    arguments.maxDepth               = 1024;
-    arguments.sahBlockSize           = 1;
-    arguments.minLeafSize            = 1;
-    arguments.maxLeafSize            = 8;
-    arguments.traversalCost          = 1.0f;
-    arguments.intersectionCost       = 2.0f;
-    arguments.bvh                    = this->bvh;
-    arguments.primitives             = primitives.data();
-    arguments.primitiveCount         = primitives.size();
-    arguments.primitiveArrayCapacity = primitives.capacity();
-    arguments.createNode             = InnerNode::create;
-    arguments.setNodeChildren        = InnerNode::setChildren;
-    arguments.setNodeBounds          = InnerNode::setBounds;
-    arguments.createLeaf             = LeafNode::create;
-    arguments.splitPrimitive         = splitPrimitive;
-    arguments.buildProgress          = buildProgress;
-    arguments.userPtr                = nullptr;
-    // arguments.userPtr                = userData.data();
+    primitives.reserve(primitiveData.size());
+    for (size_t primId = 0; primId < primitiveData.size(); ++primId) {
+        const MBoundingBox& bbox = primitiveData[primId].bbox;
+
+        RTCBuildPrimitive prim;
+        prim.lower_x = (float)bbox.min().x;
+        prim.lower_y = (float)bbox.min().y;
+        prim.lower_z = (float)bbox.min().z;
+        prim.geomID = 0;
+        prim.upper_x = (float)bbox.max().x;
+        prim.upper_y = (float)bbox.max().y;
+        prim.upper_z = (float)bbox.max().z;
+        prim.primID = (unsigned)primId;
+        primitives.push_back(prim);
+    }
+    // node layout is part of the key, both variants may be cached side by side.
+    // The face ids and the primitive grouping are, too: the same points with
+    // other face numbers must not share a tree.
+    const uint64_t topologyKey = hashBytes64(keyFaces.data(), sizeof(int) * keyFaces.size(), (uint64_t)this->quantizedNodes);
+    const uint64_t key = hashBytes64(keyPoints.data(), sizeof(double) * keyPoints.size(), topologyKey);
+
+    // a HIGH quality tree of the same points, if one has been built
+    this->tree = upgrades.get(key);
+    if (this->tree && this->tree->meshTriangles == triangles.size()) {
+        return MStatus::kSuccess;
+    }
+
+    upgrades.evaluated(topologyKey, key, primitives, triangles, primitiveData, this->quantizedNodes, fileSource);
 
-    root = (Node *)rtcBuildBVH(&arguments);
-    if (!root) {
+    this->tree = buildTree(primitives, triangles, primitiveData, RTC_BUILD_QUALITY_LOW, this->quantizedNodes);
+    if (!this->tree) {
         MGlobal::displayError("Failed to build Embree BVH");
         return MStatus::kFailure;
     }
@@ -177,131 +745,223 @@ MStatus EmbreeKernel::build(const MObject& meshObject, const MBoundingBox& bbox,
 }
 
 
-std::vector<TriangleData> EmbreeKernel::intersectKernelTriangle(const TriangleData& triangleB) const
-{
-    std::vector<TriangleData> intersectingA;
+template <typename NodeType>
+static const NodeType* treeNodes(const EmbreeTree& tree);
 
-    std::stack<Node*> stack;
-    stack.push(root);
+template <>
+const BoxNode* treeNodes<BoxNode>(const EmbreeTree& tree) { return tree.boxNodes.data; }
 
-    while (!stack.empty()) {
+template <>
+const QuantizedNode* treeNodes<QuantizedNode>(const EmbreeTree& tree) { return tree.quantizedNodes.data; }
 
-        Node* currentNode = stack.top();
-        stack.pop();
 
-        bool isAInner = currentNode->branch() != nullptr;
-        bool  isALeaf = currentNode->leaf() != nullptr;
+template <typename NodeType>
+static void intersectTreeTriangle(
+    const EmbreeTree& tree,
+    const TriangleData& triangleB,
+    std::vector<TriangleData>& intersectingA
+) {
+    const NodeType* nodes = treeNodes<NodeType>(tree);
+
+    std::stack<NodeRef> stack;
+    stack.push(tree.root);
+
+    while (!stack.empty()) {
 
-        if (isAInner) {
+        NodeRef current = stack.top();
+        stack.pop();
 
-            MBoundingBox bboxL = currentNode->branch()->bounds[0];
-            MBoundingBox bboxR = currentNode->branch()->bounds[1];
+        if (current >= 0) {
+            const NodeType& node = nodes[current];
 
-            if (intersectBoxBox(bboxL, triangleB.bbox)) {
-                stack.push(currentNode->branch()->children[0]);
+            if (intersectBoxBox(node.bounds(0), triangleB.bbox)) {
+                stack.push(node.children[0]);
             }
-            if (intersectBoxBox(bboxR, triangleB.bbox)) {
-                stack.push(currentNode->branch()->children[1]);
+            if (intersectBoxBox(node.bounds(1), triangleB.bbox)) {
+                stack.push(node.children[1]);
             }
+            continue;
         }
 
-        if (isALeaf) {
-
-            // While it's possible to determine intersections between bounding boxes and
-            // decide if they can be skipped, the subsequent code for triangle-to-triangle
-            // intersection checks is quite similar. Therefore, it might be more efficient
-            // to leave this task to the triangle-to-triangle intersection checks
-            // if (!intersectBoxBox(currentNode->leaf()->bounds, triangleB.bbox)) {
-            //     continue;
-            // }
-
-            int index = currentNode->leaf()->id;
-            TriangleData triangleA = this->triangles[index];
-            if (intersectTriangleTriangle(triangleB, triangleA)) {
-                intersectingA.push_back(triangleA);
+        // While it's possible to determine intersections between bounding boxes and
+        // decide if they can be skipped, the subsequent code for triangle-to-triangle
+        // intersection checks is quite similar. Therefore, it might be more efficient
+        // to leave this task to the triangle-to-triangle intersection checks
+        // if (!intersectBoxBox(leaf.bounds, triangleB.bbox)) {
+        //     continue;
+        // }
+
+        const LeafData& leaf = tree.leaves[~current];
+        for (unsigned i = leaf.first; i < leaf.first + leaf.count; ++i) {
+            const PrimitiveData& primitive = tree.primitives[i];
+            if (!intersectBoxBox(primitive.bbox, triangleB.bbox)) {
+                continue;
             }
 
-            // Depending on the quality of the BVH, overlapping regions might cause
-            // adjacent faces to be skipped. It's essential to address this issue.
-            // If this happens, we can check the adjacent triangles as well.
-            //
-            // if (index > 0) {
-            //     triangleA = this->triangles[index-1];
-            //     if (intersectTriangleTriangle(triangleB, triangleA)) {
-            //         intersectingA.push_back(triangleA);
-            //     }
-            // }
-            // 
-            // if (index < this->triangles.size()-1) {
-            //     triangleA = this->triangles[index+1];
-            //     if (intersectTriangleTriangle(triangleB, triangleA)) {
-            //         intersectingA.push_back(triangleA);
-            //     }
-            // }
+            for (unsigned t = primitive.first; t < primitive.first + primitive.count; ++t) {
+                const TriangleData& triangleA = tree.triangles[t];
+                if (intersectBoxBox(triangleA.bbox, triangleB.bbox) && intersectTriangleTriangle(triangleB, triangleA)) {
+                    intersectingA.push_back(triangleA);
+                }
+            }
         }
 
+        // Depending on the quality of the BVH, overlapping regions might cause
+        // adjacent faces to be skipped. It's essential to address this issue.
+        // If this happens, we can check the adjacent triangles as well.
+        //
+        // if (index > 0) {
+        //     triangleA = this->triangles[index-1];
+        //     if (intersectTriangleTriangle(triangleB, triangleA)) {
+        //         intersectingA.push_back(triangleA);
+        //     }
+        // }
+        // 
+        // if (index < this->triangles.size()-1) {
+        //     triangleA = this->triangles[index+1];
+        //     if (intersectTriangleTriangle(triangleB, triangleA)) {
+        //         intersectingA.push_back(triangleA);
+        //     }
+        // }
     };
+}
+
+
+std::vector<TriangleData> EmbreeKernel::intersectKernelTriangle(const TriangleData& triangleB) const
+{
+    std::vector<TriangleData> intersectingA;
+
+    if (this->tree->quantized) {
+        intersectTreeTriangle<QuantizedNode>(*this->tree, triangleB, intersectingA);
+    } else {
+        intersectTreeTriangle<BoxNode>(*this->tree, triangleB, intersectingA);
+    }
 
     return intersectingA;
 }
 
 
-void intersectBvhNodesRecursive(
-        Node* nodeA,
-        Node* nodeB,
-        std::vector<std::pair<Node*, Node*>>& intersectedNodes
-) {
-    if (!nodeA || !nodeB) {
-        return;
-    }
+// Both trees of a kernel-kernel query, which may use different node layouts.
+template <typename NodeTypeA, typename NodeTypeB>
+struct TreePair
+{
+    const EmbreeTree& treeA;
+    const EmbreeTree& treeB;
+    const NodeTypeA* nodesA;
+    const NodeTypeB* nodesB;
+
+    TreePair(const EmbreeTree& treeA, const EmbreeTree& treeB)
+        : treeA(treeA), treeB(treeB), nodesA(treeNodes<NodeTypeA>(treeA)), nodesB(treeNodes<NodeTypeB>(treeB)) {}
+
+    // box of a reference that is known to be a leaf
+    MBoundingBox leafBoundsA(NodeRef ref) const { return treeA.leaves[~ref].bounds; }
+    MBoundingBox leafBoundsB(NodeRef ref) const { return treeB.leaves[~ref].bounds; }
+};
 
-    bool isAInner = nodeA->branch() != nullptr;
-    bool isBInner = nodeB->branch() != nullptr;
-    bool isALeaf = nodeA->leaf() != nullptr;
-    bool isBLeaf = nodeB->leaf() != nullptr;
 
-    if (nodeA->isLeaf() && nodeB->isLeaf()) {
+template <typename NodeTypeA, typename NodeTypeB>
+void intersectBvhNodesRecursive(
+        const TreePair<NodeTypeA, NodeTypeB>& trees,
+        NodeRef nodeA,
+        NodeRef nodeB,
+        std::vector<std::pair<NodeRef, NodeRef>>& intersectedNodes
+) {
+    if (nodeA < 0 && nodeB < 0) {
         intersectedNodes.push_back({nodeA, nodeB});
         return;
     }
 
-    if (nodeA->isLeaf()) {  // A is leaf, B is inner
-        if (intersectBoxBox(nodeA->leaf()->bounds, nodeB->branch()->bounds[0])) {
-            intersectBvhNodesRecursive(nodeA, nodeB->branch()->children[0], intersectedNodes);
+    if (nodeA < 0) {  // A is leaf, B is inner
+        const MBoundingBox boundsA = trees.leafBoundsA(nodeA);
+        const NodeTypeB& innerB = trees.nodesB[nodeB];
+        if (intersectBoxBox(boundsA, innerB.bounds(0))) {
+            intersectBvhNodesRecursive(trees, nodeA, innerB.children[0], intersectedNodes);
         }
 
-        if (intersectBoxBox(nodeA->leaf()->bounds, nodeB->branch()->bounds[1])) {
-            intersectBvhNodesRecursive(nodeA, nodeB->branch()->children[1], intersectedNodes);
+        if (intersectBoxBox(boundsA, innerB.bounds(1))) {
+            intersectBvhNodesRecursive(trees, nodeA, innerB.children[1], intersectedNodes);
         }
         return;
     }
 
-    if (nodeB->isLeaf()) {  // A is inner, B is leaf
-        if (intersectBoxBox(nodeB->leaf()->bounds, nodeA->branch()->bounds[0])) {
-            intersectBvhNodesRecursive(nodeA->branch()->children[0], nodeB, intersectedNodes);
+    if (nodeB < 0) {  // A is inner, B is leaf
+        const MBoundingBox boundsB = trees.leafBoundsB(nodeB);
+        const NodeTypeA& innerA = trees.nodesA[nodeA];
+        if (intersectBoxBox(boundsB, innerA.bounds(0))) {
+            intersectBvhNodesRecursive(trees, innerA.children[0], nodeB, intersectedNodes);
         }
 
-        if (intersectBoxBox(nodeB->leaf()->bounds, nodeA->branch()->bounds[1])) {
-            intersectBvhNodesRecursive(nodeA->branch()->children[1], nodeB, intersectedNodes);
+        if (intersectBoxBox(boundsB, innerA.bounds(1))) {
+            intersectBvhNodesRecursive(trees, innerA.children[1], nodeB, intersectedNodes);
         }
         return;
     }
 
-    // Both are inner nodes
-    if (intersectBoxBox(nodeA->branch()->bounds[0], nodeB->branch()->bounds[0])) {
-        intersectBvhNodesRecursive(nodeA->branch()->children[0], nodeB->branch()->children[0], intersectedNodes);
+    // Both are inner nodes, decode each child box once
+    const NodeTypeA& innerA = trees.nodesA[nodeA];
+    const NodeTypeB& innerB = trees.nodesB[nodeB];
+    const MBoundingBox boundsA[2] = { innerA.bounds(0), innerA.bounds(1) };
+    const MBoundingBox boundsB[2] = { innerB.bounds(0), innerB.bounds(1) };
+
+    if (intersectBoxBox(boundsA[0], boundsB[0])) {
+        intersectBvhNodesRecursive(trees, innerA.children[0], innerB.children[0], intersectedNodes);
     }
 
-    if (intersectBoxBox(nodeA->branch()->bounds[0], nodeB->branch()->bounds[1])) {
-        intersectBvhNodesRecursive(nodeA->branch()->children[0], nodeB->branch()->children[1], intersectedNodes);
+    if (intersectBoxBox(boundsA[0], boundsB[1])) {
+        intersectBvhNodesRecursive(trees, innerA.children[0], innerB.children[1], intersectedNodes);
     }
 
-    if (intersectBoxBox(nodeA->branch()->bounds[1], nodeB->branch()->bounds[0])) {
-        intersectBvhNodesRecursive(nodeA->branch()->children[1], nodeB->branch()->children[0], intersectedNodes);
+    if (intersectBoxBox(boundsA[1], boundsB[0])) {
+        intersectBvhNodesRecursive(trees, innerA.children[1], innerB.children[0], intersectedNodes);
     }
 
-    if (intersectBoxBox(nodeA->branch()->bounds[1], nodeB->branch()->bounds[1])) {
-        intersectBvhNodesRecursive(nodeA->branch()->children[1], nodeB->branch()->children[1], intersectedNodes);
+    if (intersectBoxBox(boundsA[1], boundsB[1])) {
+        intersectBvhNodesRecursive(trees, innerA.children[1], innerB.children[1], intersectedNodes);
+    }
+}
+
+
+template <typename NodeTypeA, typename NodeTypeB>
+static void intersectTrees(
+    const EmbreeTree& treeA,
+    const EmbreeTree& treeB,
+    std::vector<TriangleData>& intersectedTrianglesA,
+    std::vector<TriangleData>& intersectedTrianglesB
+) {
+    const TreePair<NodeTypeA, NodeTypeB> trees(treeA, treeB);
+
+    std::vector<std::pair<NodeRef, NodeRef>> intersectedNodes;
+    intersectBvhNodesRecursive(trees, treeA.root, treeB.root, intersectedNodes);
+
+    for (const auto& pair : intersectedNodes) {
+        const LeafData& leafA = treeA.leaves[~pair.first];
+        const LeafData& leafB = treeB.leaves[~pair.second];
+
+        for (unsigned a = leafA.first; a < leafA.first + leafA.count; ++a) {
+            const PrimitiveData& primA = treeA.primitives[a];
+            if (!intersectBoxBox(primA.bbox, leafB.bounds)) {
+                continue;
+            }
+
+            for (unsigned b = leafB.first; b < leafB.first + leafB.count; ++b) {
+                const PrimitiveData& primB = treeB.primitives[b];
+                if (!intersectBoxBox(primA.bbox, primB.bbox)) {
+                    continue;
+                }
+
+                // triangle tests only for primitive pairs whose boxes overlap
+                for (unsigned ta = primA.first; ta < primA.first + primA.count; ++ta) {
+                    const TriangleData& triA = treeA.triangles[ta];
+                    for (unsigned tb = primB.first; tb < primB.first + primB.count; ++tb) {
+                        const TriangleData& triB = treeB.triangles[tb];
+                        if (intersectBoxBox(triA.bbox, triB.bbox) && intersectTriangleTriangle(triA, triB)) {
+                            intersectedTrianglesA.push_back(triA);
+                            intersectedTrianglesB.push_back(triB);
+                        }
+                    }
+                }
+            }
+        }
     }
 }
 
@@ -321,26 +981,26 @@ K2KIntersection EmbreeKernel::intersectKernelKernel(
         return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
     }
 
-    std::vector<std::pair<Node*, Node*>> intersectedNodes;
-    intersectBvhNodesRecursive(this->root, other->root, intersectedNodes);
-
-    for (const auto& pair : intersectedNodes) {
-        Node* nodeA = pair.first;
-        Node* nodeB = pair.second;
+    const EmbreeTree& treeA = *this->tree;
+    const EmbreeTree& treeB = *other->tree;
+    if (treeA.quantized && treeB.quantized) {
+        intersectTrees<QuantizedNode, QuantizedNode>(treeA, treeB, intersectedTrianglesA, intersectedTrianglesB);
+    } else if (treeA.quantized) {
+        intersectTrees<QuantizedNode, BoxNode>(treeA, treeB, intersectedTrianglesA, intersectedTrianglesB);
+    } else if (treeB.quantized) {
+        intersectTrees<BoxNode, QuantizedNode>(treeA, treeB, intersectedTrianglesA, intersectedTrianglesB);
+    } else {
+        intersectTrees<BoxNode, BoxNode>(treeA, treeB, intersectedTrianglesA, intersectedTrianglesB);
+    }
 
-        if (nodeA->isLeaf() && nodeB->isLeaf()) {
-            int nodeAId = nodeA->leaf()->id;
-            int nodeBId = nodeB->leaf()->id;
+    return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
+}
 
-            TriangleData triA = this->triangles[nodeAId];
-            TriangleData triB = other->triangles[nodeBId];
 
-            if (intersectTriangleTriangle(triA, triB)) {
-                intersectedTrianglesA.push_back(triA);
-                intersectedTrianglesB.push_back(triB);
-            }
-        }
+size_t EmbreeKernel::nodeBytes() const
+{
+    if (!this->tree) {
+        return 0;
     }
-
-    return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
+    return this->tree->boxNodes.size * sizeof(BoxNode) + this->tree->quantizedNodes.size * sizeof(QuantizedNode);
 }
@@ -14,44 +14,41 @@
 
 #include <cassert>
 #include <cstdint>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
 
-struct InnerNode;
-struct LeafNode;
+class MappedFile;
 
-struct Node
-{
-    virtual  InnerNode* branch() { return nullptr; }
-    virtual   LeafNode* leaf()   { return nullptr; }
-    virtual       bool  isLeaf()   { return false; }
 
-             InnerNode* parent() { return nullptr; }
-};
+// Reports Embree device errors through MGlobal. Shared by the Embree kernels.
+void errorHandler(void* userPtr, enum RTCError code, const char* str);
 
 
-struct NodePair
+// Nodes as the Embree builder creates them, in memory owned by the builder.
+// They only live until the tree is flattened into EmbreeTree.
+struct BuildNode
 {
-    Node* nodeA;
-    Node* nodeB;
+    bool leaf;
 };
 
 
-struct InnerNode : public Node
+struct BuildInnerNode : public BuildNode
 {
-    MBoundingBox bounds[2];
-    Node* children[2];
-    bool  isLeaf()   { return false; }
-
-    InnerNode() {
-        bounds[0] = bounds[1] = MBoundingBox();
-        children[0] = children[1] = nullptr;
-    }
+    BuildNode* children[2];
+    RTCBounds bounds[2];
 
     static void* create (RTCThreadLocalAllocator alloc, unsigned int numChildren, void* userPtr)
     {
         assert(numChildren == 2);
-        void* ptr = rtcThreadLocalAlloc(alloc, sizeof(InnerNode), 16);
+        void* ptr = rtcThreadLocalAlloc(alloc, sizeof(BuildInnerNode), 16);
 
-        Node *node = new (ptr) InnerNode;
+        BuildInnerNode* node = new (ptr) BuildInnerNode;
+        node->leaf = false;
         return (void *)node;
     }
 
@@ -59,7 +56,7 @@ struct InnerNode : public Node
     {
         assert(numChildren == 2);
         for (size_t i=0; i<2; i++) {
-            ((InnerNode*)nodePtr)->children[i] = (Node*) childPtr[i];
+            ((BuildInnerNode*)nodePtr)->children[i] = (BuildNode*) childPtr[i];
         }
     }
 
@@ -67,70 +64,226 @@ struct InnerNode : public Node
     {
         assert(numChildren == 2);
         for (size_t i=0; i<2; i++) {
-            MBoundingBox box(
-                MPoint(bounds[i]->lower_x, bounds[i]->lower_y, bounds[i]->lower_z),
-                MPoint(bounds[i]->upper_x, bounds[i]->upper_y, bounds[i]->upper_z)
-            );
-            ((InnerNode*)nodePtr)->bounds[i] = box;
+            ((BuildInnerNode*)nodePtr)->bounds[i] = *bounds[i];
         }
     }
-
-    InnerNode *branch() { return this; }
 };
 
-struct LeafNode : public Node
+
+// Primitive ids of all leaves of one build, filled by BuildLeafNode::create.
+// Each leaf reserves its range with an atomic add, so builder threads never
+// wait on a lock.
+struct LeafStorage
 {
-    unsigned id;
-    MBoundingBox bounds;
-    bool  isLeaf()   { return true; }
+    std::atomic<unsigned> size { 0 };
+    unsigned* primitives = nullptr;
+};
+
 
-    LeafNode (unsigned id, const MBoundingBox& bounds)
-        : id(id), bounds(bounds) {}
+struct BuildLeafNode : public BuildNode
+{
+    unsigned first;         // range in LeafStorage::primitives
+    unsigned count;
 
     static void* create (RTCThreadLocalAllocator alloc, const RTCBuildPrimitive* prims, size_t numPrims, void* userPtr)
     {
-        assert(numPrims == 1);
-        void* ptr = rtcThreadLocalAlloc(alloc,sizeof(LeafNode),16);
-        // return (void*) new (ptr) LeafNode(prims->primID,*(MBoundingBox*)prims);
-            MBoundingBox box(
-                MPoint(prims->lower_x, prims->lower_y, prims->lower_z),
-                MPoint(prims->upper_x, prims->upper_y, prims->upper_z)
-            );
-
-        Node *node = new (ptr) LeafNode(prims->primID, box);
-        // Node *node = new (ptr) LeafNode(prims->primID, *(MBoundingBox*)prims);
+        LeafStorage* storage = (LeafStorage*)userPtr;
+        unsigned first = storage->size.fetch_add((unsigned)numPrims);
+
+        for (size_t i = 0; i < numPrims; ++i) {
+            storage->primitives[first + i] = prims[i].primID;
+        }
+
+        void* ptr = rtcThreadLocalAlloc(alloc, sizeof(BuildLeafNode), 16);
+        BuildLeafNode* node = new (ptr) BuildLeafNode;
+        node->leaf = true;
+        node->first = first;
+        node->count = (unsigned)numPrims;
         return (void *)node;
     }
+};
+
+
+// Child reference in the flattened tree: an inner node index, or the bitwise
+// complement of a leaf index.
+using NodeRef = int32_t;
+
+
+// Inner node with both child boxes at full float precision.
+struct BoxNode
+{
+    float lower[2][3];
+    float upper[2][3];
+    NodeRef children[2];
+
+    MBoundingBox bounds(int i) const
+    {
+        return MBoundingBox(
+            MPoint(lower[i][0], lower[i][1], lower[i][2]),
+            MPoint(upper[i][0], upper[i][1], upper[i][2])
+        );
+    }
+
+    void setBounds(const RTCBounds* bounds[2])
+    {
+        for (int i = 0; i < 2; ++i) {
+            for (int k = 0; k < 3; ++k) {
+                lower[i][k] = (&bounds[i]->lower_x)[k];
+                upper[i][k] = (&bounds[i]->upper_x)[k];
+            }
+        }
+    }
+};
+
+
+// Inner node storing the child boxes as 8 bit steps on a float grid spanning
+// both children. Lower bounds are rounded down and upper bounds up, so the
+// decoded boxes always contain the exact ones.
+struct QuantizedNode
+{
+    float origin[3];
+    float step[3];
+    uint8_t lower[2][3];
+    uint8_t upper[2][3];
+    NodeRef children[2];
+
+    static float decode(float origin, float step, int q) { return origin + (float)q * step; }
+
+    MBoundingBox bounds(int i) const
+    {
+        return MBoundingBox(
+            MPoint(decode(origin[0], step[0], lower[i][0]), decode(origin[1], step[1], lower[i][1]), decode(origin[2], step[2], lower[i][2])),
+            MPoint(decode(origin[0], step[0], upper[i][0]), decode(origin[1], step[1], upper[i][1]), decode(origin[2], step[2], upper[i][2]))
+        );
+    }
+
+    void setBounds(const RTCBounds* bounds[2])
+    {
+        for (int k = 0; k < 3; ++k) {
+            const float lo = std::min((&bounds[0]->lower_x)[k], (&bounds[1]->lower_x)[k]);
+            const float hi = std::max((&bounds[0]->upper_x)[k], (&bounds[1]->upper_x)[k]);
+
+            // smallest step whose 255th multiple still reaches the upper end
+            float step = (hi - lo) / 255.0f;
+            while (decode(lo, step, 255) < hi) {
+                step = std::nextafter(step, std::numeric_limits<float>::max());
+            }
+            this->origin[k] = lo;
+            this->step[k] = step;
+
+            for (int i = 0; i < 2; ++i) {
+                const float childLower = (&bounds[i]->lower_x)[k];
+                const float childUpper = (&bounds[i]->upper_x)[k];
+
+                int q = step > 0.0f ? std::min(255, std::max(0, (int)std::floor((childLower - lo) / step))) : 0;
+                while (q > 0 && decode(lo, step, q) > childLower) {
+                    q--;
+                }
+                this->lower[i][k] = (uint8_t)q;
+
+                q = step > 0.0f ? std::min(255, std::max(0, (int)std::ceil((childUpper - lo) / step))) : 0;
+                while (q < 255 && decode(lo, step, q) < childUpper) {
+                    q++;
+                }
+                this->upper[i][k] = (uint8_t)q;
+            }
+        }
+    }
+};
+
+
+struct LeafData
+{
+    unsigned first;         // range in EmbreeTree::primitives
+    unsigned count;
+    MBoundingBox bounds;
+};
 
-    LeafNode *leaf() { return this; }
+
+// What the tree is built over: a quad face kept whole as its two triangles,
+// or a single triangle of any other face. Quad meshes get half the
+// primitives, and a quad's triangles are only tested once its box overlaps.
+struct PrimitiveData
+{
+    unsigned first;         // range in EmbreeTree::triangles
+    unsigned count;
+    MBoundingBox bbox;
 };
 
 
 using IDMapper = std::vector<std::pair<int, int>>;
 using TriangleStorage = std::vector<TriangleData>;
-class EmbreeKernel : public SpatialDivisionKernel
+using PrimitiveStorage = std::vector<PrimitiveData>;
+
+
+// Read only view of an array, either owned by EmbreeTree or in a mapped file.
+template <typename T>
+struct ArrayView
 {
-public:
-    ~EmbreeKernel() override
+    const T* data = nullptr;
+    size_t size = 0;
+
+    ArrayView() {}
+    ArrayView(const T* data, size_t size) : data(data), size(size) {}
+    ArrayView(const std::vector<T>& v) : data(v.data()), size(v.size()) {}
+
+    const T& operator[](size_t i) const { return data[i]; }
+};
+
+
+// A built hierarchy flattened into plain arrays, inner nodes in depth first
+// order. Primitives and triangles are stored in depth first leaf order, so
+// the triangles below any node are one contiguous run; each triangle keeps
+// its face and triangle id for the results. The arrays are owned here, except
+// for the inner nodes of a tree loaded from a prebuilt kernel file, which
+// point into the mapped file.
+struct EmbreeTree
+{
+    bool quantized = false;
+    NodeRef root = 0;
+    size_t meshTriangles = 0;     // before spatial splits copied any
+
+    ArrayView<BoxNode> boxNodes;
+    ArrayView<QuantizedNode> quantizedNodes;
+    ArrayView<LeafData> leaves;
+    ArrayView<PrimitiveData> primitives;
+    ArrayView<TriangleData> triangles;
+
+    std::vector<BoxNode> boxNodeStorage;
+    std::vector<QuantizedNode> quantizedNodeStorage;
+    std::vector<LeafData> leafStorage;
+    PrimitiveStorage primitiveStorage;
+    TriangleStorage triangleStorage;
+    std::shared_ptr<MappedFile> file;
+
+    // point the views at the owned storage
+    void bind()
     {
-        if (this->bvh) {
-            rtcReleaseBVH(this->bvh);
-        }
-        if (this->device) {
-            rtcReleaseDevice(this->device);
-        }
+        this->boxNodes = this->boxNodeStorage;
+        this->quantizedNodes = this->quantizedNodeStorage;
+        this->leaves = this->leafStorage;
+        this->primitives = this->primitiveStorage;
+        this->triangles = this->triangleStorage;
     }
+};
+
+
+class EmbreeKernel : public SpatialDivisionKernel
+{
+public:
+    explicit EmbreeKernel(bool quantizedNodes = false) : quantizedNodes(quantizedNodes) {}
+            ~EmbreeKernel() override {}
 
 
                       MStatus build(const MObject& meshObject, const MBoundingBox& bbox, const MMatrix& offsetMatrix) override;
     std::vector<TriangleData> intersectKernelTriangle(const TriangleData& triangle) const override;
-              K2KIntersection intersectKernelKernel(SpatialDivisionKernel& otherKernel) const;
+              K2KIntersection intersectKernelKernel(SpatialDivisionKernel& otherKernel) const override;
+
+    // bytes of inner nodes in the built tree, for the benchmarks
+    size_t nodeBytes() const;
 
 private:
-         RTCBVH bvh;
-      RTCDevice device;
-           Node *root;
-            int bvhDepth;
-TriangleStorage triangles;
+    bool quantizedNodes;
+    std::shared_ptr<const EmbreeTree> tree;
 
 };
@@ -0,0 +1,354 @@
+#include "EmbreeSceneKernel.h"
+#include "EmbreeKernel.h"
+#include "BuildCache.h"
+#include "TriangleBlocks.h"
+#include "../utility.h"
+
+#include <embree4/rtcore.h>
+
+#include <maya/MStatus.h>
+#include <maya/MMatrix.h>
+#include <maya/MFnMesh.h>
+#include <maya/MBoundingBox.h>
+#include <maya/MPoint.h>
+#include <maya/MPointArray.h>
+#include <maya/MIntArray.h>
+#include <maya/MGlobal.h>
+
+#include <omp.h>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+
+const size_t SCENE_TOPOLOGY_CACHE_SIZE = 32;
+const int RAY_PACKET_SIZE = 8;
+const double POINT_QUERY_PAD_ULPS = 8.0;      // K2T query sphere pad, in float ulps of the largest coordinate
+
+
+static std::shared_ptr<SceneTopology> computeSceneTopology(
+    int numVertices,
+    const MIntArray& triangleCounts,
+    const MIntArray& triangleVertices
+) {
+    std::shared_ptr<SceneTopology> topo = std::make_shared<SceneTopology>();
+    topo->numVertices = numVertices;
+
+    const int numTriangles = (int)triangleVertices.length() / 3;
+    topo->triangleVertices.resize(numTriangles * 3);
+    for (int i = 0; i < numTriangles * 3; ++i) {
+        topo->triangleVertices[i] = (unsigned)triangleVertices[i];
+    }
+
+    topo->faceIndices.resize(numTriangles);
+    topo->triangleIndices.resize(numTriangles);
+    int triangleId = 0;
+    for (unsigned int faceIndex = 0; faceIndex < triangleCounts.length(); ++faceIndex) {
+        for (int i = 0; i < triangleCounts[faceIndex]; ++i) {
+            topo->faceIndices[triangleId] = faceIndex;
+            topo->triangleIndices[triangleId] = i;
+            triangleId++;
+        }
+    }
+
+    // unique edges: sort the (lower vertex, upper vertex, triangle) records of
+    // all triangle edges, then group equal vertex pairs
+    struct EdgeRecord { int v0, v1, triangle; };
+    std::vector<EdgeRecord> records;
+    records.reserve(numTriangles * 3);
+    for (int t = 0; t < numTriangles; ++t) {
+        for (int k = 0; k < 3; ++k) {
+            int a = triangleVertices[t * 3 + k];
+            int b = triangleVertices[t * 3 + (k + 1) % 3];
+            records.push_back({ std::min(a, b), std::max(a, b), t });
+        }
+    }
+    std::sort(records.begin(), records.end(), [](const EdgeRecord& a, const EdgeRecord& b) {
+        return a.v0 != b.v0 ? a.v0 < b.v0 : a.v1 < b.v1;
+    });
+
+    topo->edgeOffsets.push_back(0);
+    for (size_t i = 0; i < records.size(); ++i) {
+        if (i > 0 && (records[i].v0 != records[i - 1].v0 || records[i].v1 != records[i - 1].v1)) {
+            topo->edgeOffsets.push_back((int)i);
+        }
+        if (topo->edgeOffsets.back() == (int)i) {
+            topo->edgeVertices.push_back(records[i].v0);
+            topo->edgeVertices.push_back(records[i].v1);
+        }
+        topo->edgeTriangles.push_back(records[i].triangle);
+    }
+    topo->edgeOffsets.push_back((int)records.size());
+
+    return topo;
+}
+
+
+EmbreeSceneKernel::~EmbreeSceneKernel()
+{
+    release();
+}
+
+
+void EmbreeSceneKernel::release()
+{
+    if (this->scene) {
+        rtcReleaseScene(this->scene);
+        this->scene = nullptr;
+    }
+    if (this->device) {
+        rtcReleaseDevice(this->device);
+        this->device = nullptr;
+    }
+}
+
+
+MStatus EmbreeSceneKernel::build(const MObject& meshObject, const MBoundingBox& bbox, const MMatrix& offsetMatrix)
+{
+    MStatus status;
+
+    MFnMesh meshFn(meshObject, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    status = meshFn.getPoints(this->points, MSpace::kObject);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    const int numVertices = (int)this->points.length();
+    transformPoints(this->points, offsetMatrix);
+
+    MIntArray triangleCounts;
+    MIntArray triangleVertices;
+    status = meshFn.getTriangles(triangleCounts, triangleVertices);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    if (triangleVertices.length() == 0) {
+        return MStatus::kFailure;
+    }
+
+    // triangle and edge lists, once per topology
+    const uint64_t key = topologyHash64(numVertices, triangleVertices);
+
+    static BuildCache<SceneTopology> cache(SCENE_TOPOLOGY_CACHE_SIZE);
+    this->topology = cache.get(key);
+    if (!this->topology ||
+        this->topology->numVertices != numVertices ||
+        this->topology->triangleVertices.size() != triangleVertices.length()
+    ) {
+        this->topology = computeSceneTopology(numVertices, triangleCounts, triangleVertices);
+        cache.put(key, this->topology);
+    }
+
+    // scene, replacing the one of an earlier build
+    release();
+    this->device = rtcNewDevice(nullptr);
+    if (!this->device) {
+        MGlobal::displayError("Failed to create Embree device");
+        return MStatus::kFailure;
+    }
+    rtcSetDeviceErrorFunction(this->device, errorHandler, nullptr);
+
+    RTCGeometry geometry = rtcNewGeometry(this->device, RTC_GEOMETRY_TYPE_TRIANGLE);
+
+    float* vertices = (float*)rtcSetNewGeometryBuffer(
+        geometry, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 3 * sizeof(float), numVertices);
+    #pragma omp parallel for
+    for (int i = 0; i < numVertices; ++i) {
+        vertices[i * 3 + 0] = (float)this->points[i].x;
+        vertices[i * 3 + 1] = (float)this->points[i].y;
+        vertices[i * 3 + 2] = (float)this->points[i].z;
+    }
+
+    // the topology outlives the scene, share its index buffer
+    rtcSetSharedGeometryBuffer(
+        geometry, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3,
+        this->topology->triangleVertices.data(), 0, 3 * sizeof(unsigned), this->topology->faceIndices.size());
+
+    rtcSetGeometryBuildQuality(geometry, RTC_BUILD_QUALITY_LOW);
+    rtcCommitGeometry(geometry);
+
+    this->scene = rtcNewScene(this->device);
+    rtcSetSceneFlags(this->scene, (RTCSceneFlags)(RTC_SCENE_FLAG_ROBUST | RTC_SCENE_FLAG_FILTER_FUNCTION_IN_ARGUMENTS));
+    rtcSetSceneBuildQuality(this->scene, RTC_BUILD_QUALITY_LOW);
+    rtcAttachGeometry(this->scene, geometry);
+    rtcReleaseGeometry(geometry);
+    rtcCommitScene(this->scene);
+
+    return MStatus::kSuccess;
+}
+
+
+TriangleData EmbreeSceneKernel::triangle(int index) const
+{
+    const unsigned* v = &this->topology->triangleVertices[index * 3];
+    return TriangleData(
+        this->topology->faceIndices[index],
+        this->topology->triangleIndices[index],
+        this->points[v[0]],
+        this->points[v[1]],
+        this->points[v[2]]);
+}
+
+
+// Ray query context that collects every hit instead of the closest one.
+struct EdgeQueryContext
+{
+    RTCRayQueryContext context;             // must be first, Embree hands it back to the filter
+    std::vector<std::pair<int, int>>* hits; // (edge, triangle)
+};
+
+
+static void collectEdgeHits(const RTCFilterFunctionNArguments* args)
+{
+    EdgeQueryContext* query = (EdgeQueryContext*)args->context;
+    for (unsigned int i = 0; i < args->N; ++i) {
+        if (args->valid[i] == 0) {
+            continue;
+        }
+        query->hits->emplace_back(
+            (int)RTCRayN_id(args->ray, args->N, i),
+            (int)RTCHitN_primID(args->hit, args->N, i));
+
+        // reject the hit so that traversal goes on along the segment
+        args->valid[i] = 0;
+    }
+}
+
+
+std::vector<std::pair<int, int>> EmbreeSceneKernel::castEdges(const EmbreeSceneKernel& source) const
+{
+    std::vector<std::pair<int, int>> hits;
+    const SceneTopology& topo = *source.topology;
+    const int numEdges = topo.numEdges();
+
+    #pragma omp parallel
+    {
+        std::vector<std::pair<int, int>> localHits;
+
+        EdgeQueryContext query;
+        rtcInitRayQueryContext(&query.context);
+        query.hits = &localHits;
+
+        RTCIntersectArguments arguments;
+        rtcInitIntersectArguments(&arguments);
+        arguments.flags = RTC_RAY_QUERY_FLAG_INVOKE_ARGUMENT_FILTER;
+        arguments.context = &query.context;
+        arguments.filter = collectEdgeHits;
+
+        #pragma omp for schedule(dynamic, 64)
+        for (int first = 0; first < numEdges; first += RAY_PACKET_SIZE) {
+            alignas(32) RTCRayHit8 packet;
+            alignas(32) int valid[RAY_PACKET_SIZE];
+
+            for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+                int edge = first + i;
+                valid[i] = edge < numEdges ? -1 : 0;
+                if (edge >= numEdges) {
+                    continue;
+                }
+
+                // segment p0 -> p1 as a ray over t in [0, 1]
+                const MPoint& p0 = source.points[topo.edgeVertices[edge * 2]];
+                const MPoint& p1 = source.points[topo.edgeVertices[edge * 2 + 1]];
+                packet.ray.org_x[i] = (float)p0.x;
+                packet.ray.org_y[i] = (float)p0.y;
+                packet.ray.org_z[i] = (float)p0.z;
+                packet.ray.dir_x[i] = (float)(p1.x - p0.x);
+                packet.ray.dir_y[i] = (float)(p1.y - p0.y);
+                packet.ray.dir_z[i] = (float)(p1.z - p0.z);
+                packet.ray.tnear[i] = 0.0f;
+                packet.ray.tfar[i] = 1.0f;
+                packet.ray.time[i] = 0.0f;
+                packet.ray.mask[i] = 0xFFFFFFFF;
+                packet.ray.id[i] = (unsigned)edge;
+                packet.ray.flags[i] = 0;
+                packet.hit.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+            }
+
+            rtcIntersect8(valid, this->scene, &packet, &arguments);
+        }
+
+        #pragma omp critical
+        {
+            hits.insert(hits.end(), localHits.begin(), localHits.end());
+        }
+    }
+
+    return hits;
+}
+
+
+// K2T candidates: every triangle in a leaf overlapping the sphere around the
+// query triangle's bounds gets the exact test.
+static bool collectTriangleCandidates(RTCPointQueryFunctionArguments* args)
+{
+    ((std::vector<int>*)args->userPtr)->push_back((int)args->primID);
+    return false;
+}
+
+
+std::vector<TriangleData> EmbreeSceneKernel::intersectKernelTriangle(const TriangleData& incoming) const
+{
+    std::vector<TriangleData> intersectedTriangles;
+
+    std::vector<int> candidates;
+
+    // The center and the scene's vertices are rounded to float, each by up to
+    // half an ulp of its coordinates, so the pad grows with the distance from
+    // the origin; a fixed one misses grazing contacts far from it.
+    MPoint center = incoming.bbox.center();
+    const double radius = 0.5 * (incoming.bbox.max() - incoming.bbox.min()).length();
+    const double magnitude = std::max({ std::fabs(center.x), std::fabs(center.y), std::fabs(center.z) }) + radius;
+
+    RTCPointQuery pointQuery;
+    pointQuery.x = (float)center.x;
+    pointQuery.y = (float)center.y;
+    pointQuery.z = (float)center.z;
+    pointQuery.time = 0.0f;
+    pointQuery.radius = (float)(radius * 1.0001 + magnitude * POINT_QUERY_PAD_ULPS * FLT_EPSILON + 1e-6);
+
+    RTCPointQueryContext context;
+    rtcInitPointQueryContext(&context);
+    rtcPointQuery(this->scene, &pointQuery, &context, collectTriangleCandidates, &candidates);
+
+    for (int index : candidates) {
+        TriangleData ourTri = triangle(index);
+        if (intersectBoxBox(ourTri.bbox, incoming.bbox) && intersectTriangleTriangle(ourTri, incoming)) {
+            intersectedTriangles.push_back(ourTri);
+        }
+    }
+
+    return intersectedTriangles;
+}
+
+
+K2KIntersection EmbreeSceneKernel::intersectKernelKernel(SpatialDivisionKernel& otherKernel) const
+{
+    std::vector<TriangleData> intersectedTrianglesA;
+    std::vector<TriangleData> intersectedTrianglesB;
+
+    EmbreeSceneKernel* other = dynamic_cast<EmbreeSceneKernel*>(&otherKernel);
+    if (other == nullptr) {
+        MGlobal::displayError("Cannot intersect Embree scene kernel with other kernel type!");
+        return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
+    }
+
+    // edges of B through triangles of A
+    for (const std::pair<int, int>& hit : this->castEdges(*other)) {
+        TriangleData triA = this->triangle(hit.second);
+        for (int i = other->topology->edgeOffsets[hit.first]; i < other->topology->edgeOffsets[hit.first + 1]; ++i) {
+            intersectedTrianglesA.push_back(triA);
+            intersectedTrianglesB.push_back(other->triangle(other->topology->edgeTriangles[i]));
+        }
+    }
+
+    // edges of A through triangles of B
+    for (const std::pair<int, int>& hit : other->castEdges(*this)) {
+        TriangleData triB = other->triangle(hit.second);
+        for (int i = this->topology->edgeOffsets[hit.first]; i < this->topology->edgeOffsets[hit.first + 1]; ++i) {
+            intersectedTrianglesA.push_back(this->triangle(this->topology->edgeTriangles[i]));
+            intersectedTrianglesB.push_back(triB);
+        }
+    }
+
+    return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
+}
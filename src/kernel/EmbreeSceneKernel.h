@@ -0,0 +1,59 @@
+#pragma once
+
+#include "../SpatialDivisionKernel.h"
+#include "../utility.h"
+
+#include <maya/MPoint.h>
+#include <maya/MPointArray.h>
+#include <maya/MStatus.h>
+#include <maya/MMatrix.h>
+#include <maya/MBoundingBox.h>
+
+#include <embree4/rtcore.h>
+
+#include <vector>
+#include <memory>
+#include <utility>
+
+
+// Triangle and edge lists of one mesh topology. Computed once per topology hash.
+struct SceneTopology
+{
+    int numVertices = 0;
+    std::vector<unsigned> triangleVertices;   // 3 vertex ids per triangle, the geometry index buffer
+    std::vector<int> faceIndices;             // per triangle
+    std::vector<int> triangleIndices;         // per triangle
+
+    std::vector<int> edgeVertices;            // 2 vertex ids per unique edge
+    std::vector<int> edgeOffsets;             // edge e is shared by edgeTriangles[edgeOffsets[e], edgeOffsets[e+1])
+    std::vector<int> edgeTriangles;
+
+    int numEdges() const { return (int)edgeOffsets.size() - 1; }
+};
+
+
+// Puts the mesh into a native Embree scene as triangle geometry and leaves the
+// traversal to Embree. K2K shoots every edge of each mesh into the other
+// mesh's scene as a ray segment; a triangle hit by an edge intersects every
+// triangle sharing that edge. Coplanar contact is not reported, since a ray
+// in the plane of a triangle does not hit it.
+class EmbreeSceneKernel : public SpatialDivisionKernel
+{
+public:
+     EmbreeSceneKernel() {}
+    ~EmbreeSceneKernel() override;
+
+                      MStatus build(const MObject& meshObject, const MBoundingBox& bbox, const MMatrix& offsetMatrix) override;
+    std::vector<TriangleData> intersectKernelTriangle(const TriangleData& triangle) const override;
+              K2KIntersection intersectKernelKernel(SpatialDivisionKernel& otherKernel) const override;
+
+private:
+    RTCDevice device = nullptr;
+    RTCScene scene = nullptr;
+    std::shared_ptr<const SceneTopology> topology;
+    MPointArray points;
+
+    void release();
+    TriangleData triangle(int index) const;
+    std::vector<std::pair<int, int>> castEdges(const EmbreeSceneKernel& source) const;
+};
@@ -0,0 +1,448 @@
+#include "OBBTreeKernel.h"
+#include "BuildCache.h"
+#include "../utility.h"
+
+#include <maya/MStatus.h>
+#include <maya/MMatrix.h>
+#include <maya/MFnMesh.h>
+#include <maya/MPoint.h>
+#include <maya/MVector.h>
+#include <maya/MPointArray.h>
+#include <maya/MIntArray.h>
+#include <maya/MGlobal.h>
+
+#include <omp.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+
+const int OBB_MAX_TRIANGLES_PER_LEAF = 4;
+const size_t OBB_TREE_CACHE_SIZE = 64;
+
+// Relative slack on the separating axis tests, so that touching boxes
+// are never rejected because of rounding.
+const double OBB_SAT_TOLERANCE = 1e-9;
+const double OBB_TRIANGLE_TOLERANCE = 1e-5;     // box-triangle test runs in float
+
+
+// Eigenvectors of a symmetric 3x3 matrix by cyclic Jacobi rotations.
+static void symmetricEigenvectors(double a[3][3], MVector axes[3])
+{
+    double v[3][3] = { {1, 0, 0}, {0, 1, 0}, {0, 0, 1} };
+
+    for (int sweep = 0; sweep < 32; ++sweep) {
+        double off = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+        if (off < 1e-30) {
+            break;
+        }
+
+        for (int p = 0; p < 2; ++p) {
+            for (int q = p + 1; q < 3; ++q) {
+                if (std::fabs(a[p][q]) < 1e-30) {
+                    continue;
+                }
+
+                double theta = (a[q][q] - a[p][p]) / (2.0 * a[p][q]);
+                double t = (theta >= 0.0 ? 1.0 : -1.0) / (std::fabs(theta) + std::sqrt(theta * theta + 1.0));
+                double c = 1.0 / std::sqrt(t * t + 1.0);
+                double s = t * c;
+
+                for (int k = 0; k < 3; ++k) {
+                    double akp = a[k][p], akq = a[k][q];
+                    a[k][p] = c * akp - s * akq;
+                    a[k][q] = s * akp + c * akq;
+                }
+                for (int k = 0; k < 3; ++k) {
+                    double apk = a[p][k], aqk = a[q][k];
+                    a[p][k] = c * apk - s * aqk;
+                    a[q][k] = s * apk + c * aqk;
+                }
+                for (int k = 0; k < 3; ++k) {
+                    double vkp = v[k][p], vkq = v[k][q];
+                    v[k][p] = c * vkp - s * vkq;
+                    v[k][q] = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
+
+    axes[0] = MVector(v[0][0], v[1][0], v[2][0]).normal();
+    axes[1] = MVector(v[0][1], v[1][1], v[2][1]).normal();
+    axes[2] = (axes[0] ^ axes[1]).normal();
+}
+
+
+// Fit a box to the triangles by the principal axes of their vertices.
+static void fitOBB(const TriangleData* triangles, int count, OBBNode& node)
+{
+    MVector mean(0.0, 0.0, 0.0);
+    for (int i = 0; i < count; ++i) {
+        for (const MPoint& p : triangles[i].vertices) {
+            mean += MVector(p);
+        }
+    }
+    mean = mean / (3.0 * count);
+
+    double covariance[3][3] = { {0, 0, 0}, {0, 0, 0}, {0, 0, 0} };
+    for (int i = 0; i < count; ++i) {
+        for (const MPoint& p : triangles[i].vertices) {
+            MVector d = MVector(p) - mean;
+            for (int r = 0; r < 3; ++r) {
+                for (int c = 0; c < 3; ++c) {
+                    covariance[r][c] += d[r] * d[c];
+                }
+            }
+        }
+    }
+
+    symmetricEigenvectors(covariance, node.axes);
+
+    double lower[3] = { DBL_MAX, DBL_MAX, DBL_MAX };
+    double upper[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+    for (int i = 0; i < count; ++i) {
+        for (const MPoint& p : triangles[i].vertices) {
+            for (int k = 0; k < 3; ++k) {
+                double d = MVector(p) * node.axes[k];
+                lower[k] = std::min(lower[k], d);
+                upper[k] = std::max(upper[k], d);
+            }
+        }
+    }
+
+    MVector center(0.0, 0.0, 0.0);
+    for (int k = 0; k < 3; ++k) {
+        center += node.axes[k] * (0.5 * (lower[k] + upper[k]));
+        node.extents[k] = 0.5 * (upper[k] - lower[k]);
+    }
+    node.center = MPoint(center);
+}
+
+
+static int buildOBBNodeRecursive(OBBTree& tree, int first, int count)
+{
+    int index = (int)tree.nodes.size();
+    tree.nodes.emplace_back();
+    fitOBB(&tree.triangles[first], count, tree.nodes[index]);
+    tree.nodes[index].first = first;
+    tree.nodes[index].count = count;
+
+    if (count <= OBB_MAX_TRIANGLES_PER_LEAF) {
+        return index;
+    }
+
+    // split at the mean of the triangle centers along the longest box axis
+    const OBBNode& node = tree.nodes[index];
+    int axis = 0;
+    if (node.extents[1] > node.extents[axis]) axis = 1;
+    if (node.extents[2] > node.extents[axis]) axis = 2;
+    MVector splitAxis = node.axes[axis];
+
+    double splitValue = 0.0;
+    for (int i = first; i < first + count; ++i) {
+        splitValue += MVector(tree.triangles[i].center()) * splitAxis;
+    }
+    splitValue /= count;
+
+    auto begin = tree.triangles.begin() + first;
+    auto end = begin + count;
+    auto middle = std::partition(begin, end, [&](const TriangleData& triangle) {
+        return MVector(triangle.center()) * splitAxis < splitValue;
+    });
+
+    if (middle == begin || middle == end) {
+        middle = begin + count / 2;
+        std::nth_element(begin, middle, end, [&](const TriangleData& a, const TriangleData& b) {
+            return MVector(a.center()) * splitAxis < MVector(b.center()) * splitAxis;
+        });
+    }
+
+    int leftCount = (int)(middle - begin);
+    int left = buildOBBNodeRecursive(tree, first, leftCount);
+    int right = buildOBBNodeRecursive(tree, first + leftCount, count - leftCount);
+
+    tree.nodes[index].children[0] = left;
+    tree.nodes[index].children[1] = right;
+    return index;
+}
+
+
+// Separating axis test between box A and box B mapped into A's space by bToA.
+// B is carried as a center and three half edge vectors, so any affine bToA
+// (including scale and shear) is handled.
+static bool overlapOBBOBB(const OBBNode& a, const OBBNode& b, const MMatrix& bToA)
+{
+    MVector T = (b.center * bToA) - a.center;
+    MVector h[3] = {
+        (b.axes[0] * b.extents[0]) * bToA,
+        (b.axes[1] * b.extents[1]) * bToA,
+        (b.axes[2] * b.extents[2]) * bToA
+    };
+
+    auto radiusA = [&](const MVector& axis) {
+        return a.extents[0] * std::fabs(a.axes[0] * axis) +
+               a.extents[1] * std::fabs(a.axes[1] * axis) +
+               a.extents[2] * std::fabs(a.axes[2] * axis);
+    };
+    auto radiusB = [&](const MVector& axis) {
+        return std::fabs(h[0] * axis) + std::fabs(h[1] * axis) + std::fabs(h[2] * axis);
+    };
+    auto separated = [&](const MVector& axis) {
+        double r = (radiusA(axis) + radiusB(axis)) * (1.0 + OBB_SAT_TOLERANCE);
+        return std::fabs(T * axis) > r;
+    };
+
+    // face normals of A
+    for (int i = 0; i < 3; ++i) {
+        if (separated(a.axes[i])) return false;
+    }
+
+    // face normals of B
+    for (int i = 0; i < 3; ++i) {
+        MVector n = h[(i + 1) % 3] ^ h[(i + 2) % 3];
+        if (n * n > 0.0 && separated(n)) return false;
+    }
+
+    // edge pairs
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            MVector axis = a.axes[i] ^ h[j];
+            if (axis * axis > 1e-20 * (h[j] * h[j]) && separated(axis)) return false;
+        }
+    }
+
+    return true;
+}
+
+
+// Separating axis test between box A and a triangle in A's space.
+static bool overlapOBBTriangle(const OBBNode& a, const MPoint vertices[3])
+{
+    // triangle in the box frame, where the box is centered and axis aligned
+    MVector q[3];
+    double scale = std::max({a.extents[0], a.extents[1], a.extents[2]});
+    for (int k = 0; k < 3; ++k) {
+        MVector d = vertices[k] - a.center;
+        q[k] = MVector(d * a.axes[0], d * a.axes[1], d * a.axes[2]);
+        scale = std::max({scale, std::fabs(q[k].x), std::fabs(q[k].y), std::fabs(q[k].z)});
+    }
+
+    // grow the box by more than the float rounding of the test
+    const double pad = OBB_TRIANGLE_TOLERANCE * scale;
+    return overlapCenteredBoxTriangle(
+        glm::vec3((float)(a.extents[0] + pad), (float)(a.extents[1] + pad), (float)(a.extents[2] + pad)),
+        glm::vec3((float)q[0].x, (float)q[0].y, (float)q[0].z),
+        glm::vec3((float)q[1].x, (float)q[1].y, (float)q[1].z),
+        glm::vec3((float)q[2].x, (float)q[2].y, (float)q[2].z));
+}
+
+
+MStatus OBBTreeKernel::build(const MObject& meshObject, const MBoundingBox& bbox, const MMatrix& offsetMatrix)
+{
+    MStatus status;
+
+    this->offsetMatrix = offsetMatrix;
+    this->inverseOffsetMatrix = offsetMatrix.inverse();
+
+    MFnMesh meshFn(meshObject, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    MPointArray points;
+    status = meshFn.getPoints(points, MSpace::kObject);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    MIntArray triangleCounts;
+    MIntArray triangleVertices;
+    status = meshFn.getTriangles(triangleCounts, triangleVertices);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    if (triangleVertices.length() == 0) {
+        return MStatus::kFailure;
+    }
+
+    // The tree only depends on the object space shape, not on the offset matrix,
+    // so a rigidly moving mesh hits the cache on every frame. The triangle
+    // counts decide the faceIndex of every triangle, so they are part of it.
+    std::vector<double> pointData(points.length() * 4);
+    std::vector<int> countData(triangleCounts.length());
+    std::vector<int> indexData(triangleVertices.length());
+    points.get((double(*)[4])pointData.data());
+    triangleCounts.get(countData.data());
+    triangleVertices.get(indexData.data());
+    uint64_t key = hashBytes64(pointData.data(), sizeof(double) * pointData.size());
+    key = hashBytes64(countData.data(), sizeof(int) * countData.size(), key);
+    key = hashBytes64(indexData.data(), sizeof(int) * indexData.size(), key);
+
+    static BuildCache<OBBTree> cache(OBB_TREE_CACHE_SIZE);
+    this->tree = cache.get(key);
+    if (this->tree &&
+        this->tree->numVertices == (int)points.length() &&
+        this->tree->triangles.size() == triangleVertices.length() / 3
+    ) {
+        return MStatus::kSuccess;
+    }
+
+    std::shared_ptr<OBBTree> newTree = std::make_shared<OBBTree>();
+    newTree->numVertices = (int)points.length();
+    newTree->triangles.reserve(triangleVertices.length() / 3);
+
+    int triangleOffset = 0;
+    for (unsigned int faceIndex = 0; faceIndex < triangleCounts.length(); ++faceIndex) {
+        for (int triangleIndex = 0; triangleIndex < triangleCounts[faceIndex]; ++triangleIndex) {
+            newTree->triangles.emplace_back(
+                faceIndex,
+                triangleIndex,
+                points[triangleVertices[triangleOffset + 0]],
+                points[triangleVertices[triangleOffset + 1]],
+                points[triangleVertices[triangleOffset + 2]]);
+            triangleOffset += 3;
+        }
+    }
+
+    newTree->nodes.reserve(2 * newTree->triangles.size() / OBB_MAX_TRIANGLES_PER_LEAF + 1);
+    buildOBBNodeRecursive(*newTree, 0, (int)newTree->triangles.size());
+
+    this->tree = newTree;
+    cache.put(key, this->tree);
+
+    return MStatus::kSuccess;
+}
+
+
+TriangleData OBBTreeKernel::toWorld(const TriangleData& triangle) const
+{
+    return TriangleData(
+        triangle.faceIndex,
+        triangle.triangleIndex,
+        triangle.vertices[0] * this->offsetMatrix,
+        triangle.vertices[1] * this->offsetMatrix,
+        triangle.vertices[2] * this->offsetMatrix);
+}
+
+
+std::vector<TriangleData> OBBTreeKernel::intersectKernelTriangle(const TriangleData& triangle) const
+{
+    std::vector<TriangleData> intersectedTriangles;
+
+    // bring the incoming world space triangle into our object space
+    const TriangleData local(
+        triangle.faceIndex,
+        triangle.triangleIndex,
+        triangle.vertices[0] * this->inverseOffsetMatrix,
+        triangle.vertices[1] * this->inverseOffsetMatrix,
+        triangle.vertices[2] * this->inverseOffsetMatrix);
+
+    std::vector<int> stack;
+    stack.push_back(0);
+
+    while (!stack.empty()) {
+        const OBBNode& node = this->tree->nodes[stack.back()];
+        stack.pop_back();
+
+        if (!overlapOBBTriangle(node, local.vertices)) {
+            continue;
+        }
+
+        if (node.isLeaf()) {
+            for (int i = node.first; i < node.first + node.count; ++i) {
+                const TriangleData& ourTri = this->tree->triangles[i];
+                if (intersectTriangleTriangle(ourTri, local)) {
+                    intersectedTriangles.push_back(toWorld(ourTri));
+                }
+            }
+        } else {
+            stack.push_back(node.children[0]);
+            stack.push_back(node.children[1]);
+        }
+    }
+
+    return intersectedTriangles;
+}
+
+
+K2KIntersection OBBTreeKernel::intersectKernelKernel(SpatialDivisionKernel& otherKernel) const
+{
+    std::vector<TriangleData> intersectedTrianglesA;
+    std::vector<TriangleData> intersectedTrianglesB;
+
+    OBBTreeKernel* other = dynamic_cast<OBBTreeKernel*>(&otherKernel);
+    if (other == nullptr) {
+        MGlobal::displayError("Cannot intersect OBB tree with other kernel type!");
+        return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
+    }
+
+    // other object space -> world -> our object space
+    const MMatrix bToA = other->offsetMatrix * this->inverseOffsetMatrix;
+
+    const std::vector<OBBNode>& nodesA = this->tree->nodes;
+    const std::vector<OBBNode>& nodesB = other->tree->nodes;
+
+    std::vector<std::pair<int, int>> leafPairs;
+    std::vector<std::pair<int, int>> stack;
+    stack.emplace_back(0, 0);
+
+    while (!stack.empty()) {
+        std::pair<int, int> current = stack.back();
+        stack.pop_back();
+
+        const OBBNode& nodeA = nodesA[current.first];
+        const OBBNode& nodeB = nodesB[current.second];
+
+        if (!overlapOBBOBB(nodeA, nodeB, bToA)) {
+            continue;
+        }
+
+        if (nodeA.isLeaf() && nodeB.isLeaf()) {
+            leafPairs.push_back(current);
+            continue;
+        }
+
+        // descend into the larger box
+        double volumeA = nodeA.extents[0] * nodeA.extents[1] * nodeA.extents[2];
+        double volumeB = nodeB.extents[0] * nodeB.extents[1] * nodeB.extents[2];
+        if (nodeB.isLeaf() || (!nodeA.isLeaf() && volumeA >= volumeB)) {
+            stack.emplace_back(nodeA.children[0], current.second);
+            stack.emplace_back(nodeA.children[1], current.second);
+        } else {
+            stack.emplace_back(current.first, nodeB.children[0]);
+            stack.emplace_back(current.first, nodeB.children[1]);
+        }
+    }
+
+    #pragma omp parallel
+    {
+        std::vector<TriangleData> localA;
+        std::vector<TriangleData> localB;
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int n = 0; n < (int)leafPairs.size(); ++n) {
+            const OBBNode& leafA = nodesA[leafPairs[n].first];
+            const OBBNode& leafB = nodesB[leafPairs[n].second];
+
+            for (int j = leafB.first; j < leafB.first + leafB.count; ++j) {
+                const TriangleData& triB = other->tree->triangles[j];
+                const TriangleData triBInA(
+                    triB.faceIndex,
+                    triB.triangleIndex,
+                    triB.vertices[0] * bToA,
+                    triB.vertices[1] * bToA,
+                    triB.vertices[2] * bToA);
+
+                for (int i = leafA.first; i < leafA.first + leafA.count; ++i) {
+                    const TriangleData& triA = this->tree->triangles[i];
+                    if (intersectTriangleTriangle(triA, triBInA)) {
+                        localA.push_back(toWorld(triA));
+                        localB.push_back(other->toWorld(triB));
+                    }
+                }
+            }
+        }
+
+        #pragma omp critical
+        {
+            intersectedTrianglesA.insert(intersectedTrianglesA.end(), localA.begin(), localA.end());
+            intersectedTrianglesB.insert(intersectedTrianglesB.end(), localB.begin(), localB.end());
+        }
+    }
+
+    return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "../SpatialDivisionKernel.h"
+#include "../utility.h"
+
+#include <maya/MPoint.h>
+#include <maya/MVector.h>
+#include <maya/MStatus.h>
+#include <maya/MMatrix.h>
+#include <maya/MBoundingBox.h>
+
+#include <vector>
+#include <memory>
+
+
+struct OBBNode
+{
+    MPoint  center;
+    MVector axes[3];        // orthonormal, object space
+    double  extents[3];     // half size along each axis
+
+    int     children[2] = { -1, -1 };
+    int     first = 0;      // leaf range in OBBTree::triangles
+    int     count = 0;
+
+    bool isLeaf() const { return children[0] < 0; }
+};
+
+
+// Object space tree of one rigid mesh. Shared by every kernel built from
+// the same object space points and topology.
+struct OBBTree
+{
+    std::vector<OBBNode> nodes;            // nodes[0] is the root
+    std::vector<TriangleData> triangles;   // object space, reordered by leaf
+    int numVertices = 0;
+};
+
+
+// Oriented bounding box tree kernel for rigid geometry. The tree is built once
+// in object space and kept while the mesh points stay the same, so only the
+// offset matrix changes between frames. K2K brings the other tree into this
+// tree's space with the relative transform instead of rebuilding either one.
+class OBBTreeKernel : public SpatialDivisionKernel
+{
+public:
+     OBBTreeKernel() {}
+    ~OBBTreeKernel() override {}
+
+                      MStatus build(const MObject& meshObject, const MBoundingBox& bbox, const MMatrix& offsetMatrix) override;
+    std::vector<TriangleData> intersectKernelTriangle(const TriangleData& triangle) const override;
+              K2KIntersection intersectKernelKernel(SpatialDivisionKernel& otherKernel) const override;
+
+private:
+    std::shared_ptr<const OBBTree> tree;
+    MMatrix offsetMatrix;
+    MMatrix inverseOffsetMatrix;
+
+    TriangleData toWorld(const TriangleData& triangle) const;
+};
@@ -11,7 +11,8 @@
 #include <maya/MGlobal.h>
 #include <maya/MStatus.h>
 
-#include <queue>
+#include <omp.h>
+#include <vector>
 
 
 MStatus OctreeKernel::build(const MObject& meshObject, const MBoundingBox& bbox, const MMatrix& offsetMatrix)
@@ -49,13 +50,21 @@ MStatus OctreeKernel::build(const MObject& meshObject, const MBoundingBox& bbox,
             insertTriangle(root, triangle, 0);
         }
     }
+    finalizeNode(root);
 
     return MStatus::kSuccess;
 }
 
 
 int MAX_TRIANGLES_PER_NODE = 10;
-int MAX_DEPTH = 32;
+const int MAX_DEPTH = 32;
+
+// Nodes exist down to depth MAX_DEPTH + 1; a depth first walk keeps at most
+// seven siblings per level waiting plus the node being expanded
+const int OCTREE_STACK_SIZE = 7 * (MAX_DEPTH + 2) + 1;
+
+// Node pairs per thread the kernel-kernel traversal splits into before going parallel
+const int OCTREE_PAIRS_PER_THREAD = 16;
 
 void OctreeKernel::insertTriangle(OctreeNode* node, const TriangleData& triangle, int depth)
 {
@@ -156,40 +165,76 @@ void OctreeKernel::splitNode(OctreeNode* node)
 }
 
 
+// Every triangle of the subtree that intersects `triangle`. Depth first with
+// a fixed stack; a child is only pushed when its occupancy bit is set and its
+// bounds pass the box test, the exact box/triangle test runs once popped.
+static void intersectOctreeTriangle(
+        const OctreeNode* root,
+        const TriangleData& triangle,
+        std::vector<TriangleData>& intersected
+) {
+    if (root->isEmpty() || !intersectBoxBox(root->bounds, triangle.bbox)) {
+        return;
+    }
+
+    const OctreeNode* stack[OCTREE_STACK_SIZE];
+    int top = 0;
+    stack[top++] = root;
+
+    while (top > 0) {
+        const OctreeNode* node = stack[--top];
+
+        if (!intersectBoxTriangle(node->bounds, triangle)) {
+            continue;
+        }
+
+        for (const TriangleData& ourTri : node->triangles) {
+            if (intersectBoxBox(ourTri.bbox, triangle.bbox) && intersectTriangleTriangle(ourTri, triangle)) {
+                intersected.push_back(ourTri);
+            }
+        }
+
+        for (int i = 0; i < 8; ++i) {
+            if ((node->childMask & (1 << i)) && intersectBoxBox(node->children[i]->bounds, triangle.bbox)) {
+                stack[top++] = node->children[i];
+            }
+        }
+    }
+}
+
+
 std::vector<TriangleData> OctreeKernel::intersectKernelTriangle(const TriangleData& incomingTri) const
 {
     std::vector<TriangleData> intersectedTriangles;
-    std::queue<OctreeNode*> nodesToCheck;
-    
+
     if (root != nullptr) {
-        nodesToCheck.push(root);
+        intersectOctreeTriangle(root, incomingTri, intersectedTriangles);
     }
 
-    while (!nodesToCheck.empty()) {
-        OctreeNode* currentNode = nodesToCheck.front();
-        nodesToCheck.pop();
+    return intersectedTriangles;
+}
 
-        if (intersectBoxTriangle(currentNode->boundingBox, incomingTri)) {
 
-            if (currentNode->isLeaf()) {
-                for (const TriangleData& ourTri: currentNode->triangles) {
-                    if (intersectTriangleTriangle(ourTri, incomingTri)) {
-                        intersectedTriangles.push_back(ourTri);
-                    }
-                }
-            } else {
-                // If the current node is a leaf and its bounding box intersects with the triangle,
-                // If the current node is not a leaf, then check its children
-                for (int i = 0; i < 8; ++i) {
-                    if (currentNode->children[i] != nullptr) {
-                        nodesToCheck.push(currentNode->children[i]);
-                    }
-                }
-            }
-        }
+// Fill in `bounds` and `childMask` bottom up.
+void OctreeKernel::finalizeNode(OctreeNode* node)
+{
+    node->bounds.clear();
+    node->childMask = 0;
+
+    for (const TriangleData& triangle : node->triangles) {
+        node->bounds.expand(triangle.bbox);
     }
 
-    return intersectedTriangles;
+    for (int i = 0; i < 8; ++i) {
+        if (node->children[i] == nullptr) {
+            continue;
+        }
+        finalizeNode(node->children[i]);
+        if (!node->children[i]->isEmpty()) {
+            node->childMask |= (uint8_t)(1 << i);
+            node->bounds.expand(node->children[i]->bounds);
+        }
+    }
 }
 
 
@@ -209,39 +254,100 @@ void OctreeKernel::clear(OctreeNode* node)
 }
 
 
-void intersectOctreeNodesRecursive(
-        OctreeNode* nodeA,
-        OctreeNode* nodeB,
-        std::vector<std::pair<OctreeNode*, OctreeNode*>>& intersectedNodes
+struct OctreeNodePair
+{
+    const OctreeNode* nodeA;
+    const OctreeNode* nodeB;
+};
+
+
+// Whether the pair is split on A's side: the node with the larger cell is
+// split, so both sides shrink at about the same rate.
+static bool descendA(const OctreeNode* nodeA, const OctreeNode* nodeB)
+{
+    if (nodeA->childMask == 0 || nodeB->childMask == 0) {
+        return nodeA->childMask != 0;
+    }
+
+    const MBoundingBox& a = nodeA->boundingBox;
+    const MBoundingBox& b = nodeB->boundingBox;
+    return a.width() + a.height() + a.depth() >= b.width() + b.height() + b.depth();
+}
+
+
+// One step of the dual traversal. All pairs of A x B triangles are the
+// triangles held by the split node itself against the whole other subtree,
+// plus each occupied child of the split node against the other node. The
+// first part is tested here, the child pairs whose bounds overlap are handed
+// back in `pairs`.
+static void splitOctreeNodePair(
+        const OctreeNodePair& pair,
+        std::vector<OctreeNodePair>& pairs,
+        std::vector<TriangleData>& intersectedA,
+        std::vector<TriangleData>& intersectedB
 ) {
-    if (!nodeA->boundingBox.intersects(nodeB->boundingBox)) {
+    const OctreeNode* nodeA = pair.nodeA;
+    const OctreeNode* nodeB = pair.nodeB;
+
+    if (nodeA->childMask == 0 && nodeB->childMask == 0) {
+        for (const TriangleData& triA : nodeA->triangles) {
+            if (!intersectBoxBox(triA.bbox, nodeB->bounds)) {
+                continue;
+            }
+            for (const TriangleData& triB : nodeB->triangles) {
+                if (intersectBoxBox(triA.bbox, triB.bbox) && intersectTriangleTriangle(triA, triB)) {
+                    intersectedA.push_back(triA);
+                    intersectedB.push_back(triB);
+                }
+            }
+        }
         return;
     }
 
-    if (nodeA->isLeaf() && nodeB->isLeaf()) {
-        intersectedNodes.push_back(std::make_pair(nodeA, nodeB));
-    } else {
-        if (nodeA->isLeaf()) {
-            for (int i = 0; i < 8; ++i) {
-                if (nodeB->children[i] != nullptr) {
-                    intersectOctreeNodesRecursive(nodeA, nodeB->children[i], intersectedNodes);
-                }
+    std::vector<TriangleData> hits;
+    if (descendA(nodeA, nodeB)) {
+        for (const TriangleData& triA : nodeA->triangles) {
+            hits.clear();
+            intersectOctreeTriangle(nodeB, triA, hits);
+            for (const TriangleData& triB : hits) {
+                intersectedA.push_back(triA);
+                intersectedB.push_back(triB);
             }
-        } else if (nodeB->isLeaf()) {
-            for (int i = 0; i < 8; ++i) {
-                if (nodeA->children[i] != nullptr) {
-                    intersectOctreeNodesRecursive(nodeA->children[i], nodeB, intersectedNodes);
-                }
+        }
+        for (int i = 0; i < 8; ++i) {
+            const OctreeNode* child = nodeA->children[i];
+            if ((nodeA->childMask & (1 << i)) && intersectBoxBox(child->bounds, nodeB->bounds)) {
+                pairs.push_back({ child, nodeB });
             }
-        } else {
-            for (int i = 0; i < 8; ++i) {
-                for (int j = 0; j < 8; ++j) {
-                    if (nodeA->children[i] != nullptr && nodeB->children[j] != nullptr) {
-                        intersectOctreeNodesRecursive(nodeA->children[i], nodeB->children[j], intersectedNodes);
-                    }
-                }
+        }
+    } else {
+        for (const TriangleData& triB : nodeB->triangles) {
+            hits.clear();
+            intersectOctreeTriangle(nodeA, triB, hits);
+            for (const TriangleData& triA : hits) {
+                intersectedA.push_back(triA);
+                intersectedB.push_back(triB);
             }
         }
+        for (int i = 0; i < 8; ++i) {
+            const OctreeNode* child = nodeB->children[i];
+            if ((nodeB->childMask & (1 << i)) && intersectBoxBox(nodeA->bounds, child->bounds)) {
+                pairs.push_back({ nodeA, child });
+            }
+        }
+    }
+}
+
+
+static void intersectOctreeNodesRecursive(
+        const OctreeNodePair& pair,
+        std::vector<TriangleData>& intersectedA,
+        std::vector<TriangleData>& intersectedB
+) {
+    std::vector<OctreeNodePair> pairs;
+    splitOctreeNodePair(pair, pairs, intersectedA, intersectedB);
+    for (const OctreeNodePair& child : pairs) {
+        intersectOctreeNodesRecursive(child, intersectedA, intersectedB);
     }
 }
 
@@ -259,23 +365,45 @@ K2KIntersection OctreeKernel::intersectKernelKernel(
         return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
     }
 
-    std::vector<std::pair<OctreeNode*, OctreeNode*>> intersectedNodes;
-    intersectOctreeNodesRecursive(this->root, other->root, intersectedNodes);
-
-    for (const auto& pair : intersectedNodes) {
-        OctreeNode* nodeA = pair.first;
-        OctreeNode* nodeB = pair.second;
+    if (this->root == nullptr || other->root == nullptr ||
+        this->root->isEmpty() || other->root->isEmpty() ||
+        !intersectBoxBox(this->root->bounds, other->root->bounds)
+    ) {
+        return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
+    }
 
-        if (nodeA->isLeaf() && nodeB->isLeaf()) {
-            for (TriangleData triA : nodeA->triangles) {
-                for (TriangleData triB : nodeB->triangles) {
-                    if (intersectTriangleTriangle(triA, triB)) {
-                        intersectedTrianglesA.push_back(triA);
-                        intersectedTrianglesB.push_back(triB);
-                    }
-                }
+    // Split breadth first on this thread until there is enough independent
+    // work, then finish each pair's subtrees in parallel
+    std::vector<OctreeNodePair> pairs = { { this->root, other->root } };
+    const size_t targetPairs = (size_t)omp_get_max_threads() * OCTREE_PAIRS_PER_THREAD;
+    while (!pairs.empty() && pairs.size() < targetPairs) {
+        std::vector<OctreeNodePair> next;
+        bool split = false;
+        for (const OctreeNodePair& pair : pairs) {
+            if (pair.nodeA->childMask == 0 && pair.nodeB->childMask == 0) {
+                next.push_back(pair);
+                continue;
             }
+            splitOctreeNodePair(pair, next, intersectedTrianglesA, intersectedTrianglesB);
+            split = true;
         }
+        pairs.swap(next);
+        if (!split) {
+            break;
+        }
+    }
+
+    std::vector<std::vector<TriangleData>> pairHitsA(pairs.size());
+    std::vector<std::vector<TriangleData>> pairHitsB(pairs.size());
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < (int)pairs.size(); ++i) {
+        intersectOctreeNodesRecursive(pairs[i], pairHitsA[i], pairHitsB[i]);
+    }
+
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        intersectedTrianglesA.insert(intersectedTrianglesA.end(), pairHitsA[i].begin(), pairHitsA[i].end());
+        intersectedTrianglesB.insert(intersectedTrianglesB.end(), pairHitsB[i].begin(), pairHitsB[i].end());
     }
 
     return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
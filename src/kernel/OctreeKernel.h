@@ -7,12 +7,22 @@
 #include <maya/MPoint.h>
 #include <maya/MStatus.h>
 
+#include <cstdint>
+
 
 struct OctreeNode {
     MBoundingBox boundingBox;
     std::vector<TriangleData> triangles;
     OctreeNode* children[8] = { nullptr };
 
+    // Set once the tree is built. Triangles are placed by their vertices and
+    // may stick out of the cell, so queries prune with `bounds`, the box of
+    // everything stored in the subtree, rather than with `boundingBox`.
+    MBoundingBox bounds;
+    uint8_t childMask = 0;      // children whose subtree holds any triangle
+
+    bool isEmpty() const { return childMask == 0 && triangles.empty(); }
+
     bool isLeaf() const
     {
         for (int i = 0; i < 8; ++i) {
@@ -48,4 +58,5 @@ private:
            void clear(OctreeNode* node);
     K2KIntersection intersectKernelKernel(SpatialDivisionKernel& otherKernel) const override;
            void splitNode(OctreeNode* node);
+           void finalizeNode(OctreeNode* node);
 };
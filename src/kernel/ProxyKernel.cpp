@@ -0,0 +1,362 @@
+#include "ProxyKernel.h"
+#include "BuildCache.h"
+#include "TriangleBlocks.h"
+#include "../utility.h"
+
+#include <maya/MStatus.h>
+#include <maya/MMatrix.h>
+#include <maya/MFnMesh.h>
+#include <maya/MBoundingBox.h>
+#include <maya/MPoint.h>
+#include <maya/MPointArray.h>
+#include <maya/MIntArray.h>
+#include <maya/MGlobal.h>
+
+#include <omp.h>
+#include <array>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+
+// Average number of original vertices collapsed into one proxy vertex.
+const int PROXY_VERTICES_PER_CLUSTER = 16;
+const size_t PROXY_TOPOLOGY_CACHE_SIZE = 32;
+
+
+struct ClusterTripletHash {
+    std::size_t operator () (const std::array<int, 3>& c) const {
+        std::size_t h = std::hash<int>{}(c[0]);
+        h ^= std::hash<int>{}(c[1]) + 0x9e3779b9 + (h << 6) + (h >> 2);
+        h ^= std::hash<int>{}(c[2]) + 0x9e3779b9 + (h << 6) + (h >> 2);
+        return h;
+    }
+};
+
+
+static std::shared_ptr<ProxyTopology> computeTopology(
+    const MPointArray& points,
+    const std::vector<int>& triangleVertices
+) {
+    std::shared_ptr<ProxyTopology> topo = std::make_shared<ProxyTopology>();
+    topo->numVertices = (int)points.length();
+
+    // Choose a grid cell so that each cell holds about PROXY_VERTICES_PER_CLUSTER
+    // vertices on average, using the surface area as the measure of the mesh.
+    MBoundingBox bbox;
+    for (unsigned int i = 0; i < points.length(); ++i) {
+        bbox.expand(points[i]);
+    }
+
+    double surfaceArea = 0.0;
+    const int numTriangles = (int)triangleVertices.size() / 3;
+    for (int i = 0; i < numTriangles; ++i) {
+        const MPoint& p0 = points[triangleVertices[i * 3 + 0]];
+        const MPoint& p1 = points[triangleVertices[i * 3 + 1]];
+        const MPoint& p2 = points[triangleVertices[i * 3 + 2]];
+        surfaceArea += 0.5 * ((p1 - p0) ^ (p2 - p0)).length();
+    }
+
+    double targetClusters = std::max(1.0, (double)topo->numVertices / PROXY_VERTICES_PER_CLUSTER);
+    double cellSize = std::sqrt(surfaceArea / targetClusters);
+    if (!(cellSize > 0.0)) {
+        cellSize = std::max({bbox.width(), bbox.height(), bbox.depth(), 1.0});
+    }
+
+    // vertex clustering on the grid
+    MPoint origin = bbox.min();
+    std::unordered_map<int64_t, int> cellToCluster;
+    topo->vertexCluster.resize(topo->numVertices);
+    for (int i = 0; i < topo->numVertices; ++i) {
+        int64_t ix = (int64_t)std::floor((points[i].x - origin.x) / cellSize);
+        int64_t iy = (int64_t)std::floor((points[i].y - origin.y) / cellSize);
+        int64_t iz = (int64_t)std::floor((points[i].z - origin.z) / cellSize);
+        int64_t key = (ix & 0x1FFFFF) | ((iy & 0x1FFFFF) << 21) | ((iz & 0x1FFFFF) << 42);
+
+        auto found = cellToCluster.emplace(key, (int)cellToCluster.size());
+        topo->vertexCluster[i] = found.first->second;
+    }
+    topo->numClusters = (int)cellToCluster.size();
+
+    // Collapse every triangle onto its clusters. Triangles that collapse onto the
+    // same cluster triplet share one proxy primitive; degenerate ones (edges, points)
+    // are kept so that every original triangle is covered by some proxy.
+    std::unordered_map<std::array<int, 3>, int, ClusterTripletHash> tripletToProxy;
+    std::vector<int> triangleProxy(numTriangles);
+    for (int i = 0; i < numTriangles; ++i) {
+        std::array<int, 3> c = {
+            topo->vertexCluster[triangleVertices[i * 3 + 0]],
+            topo->vertexCluster[triangleVertices[i * 3 + 1]],
+            topo->vertexCluster[triangleVertices[i * 3 + 2]]
+        };
+        std::sort(c.begin(), c.end());
+
+        auto found = tripletToProxy.emplace(c, (int)tripletToProxy.size());
+        if (found.second) {
+            topo->proxyClusters.insert(topo->proxyClusters.end(), c.begin(), c.end());
+        }
+        triangleProxy[i] = found.first->second;
+    }
+
+    // proxy -> original triangles (CSR)
+    const int numProxies = (int)tripletToProxy.size();
+    topo->proxyOffsets.assign(numProxies + 1, 0);
+    for (int i = 0; i < numTriangles; ++i) {
+        topo->proxyOffsets[triangleProxy[i] + 1]++;
+    }
+    for (int p = 0; p < numProxies; ++p) {
+        topo->proxyOffsets[p + 1] += topo->proxyOffsets[p];
+    }
+
+    std::vector<int> cursor(topo->proxyOffsets.begin(), topo->proxyOffsets.end() - 1);
+    topo->proxyTriangles.resize(numTriangles);
+    for (int i = 0; i < numTriangles; ++i) {
+        topo->proxyTriangles[cursor[triangleProxy[i]]++] = i;
+    }
+
+    return topo;
+}
+
+
+std::shared_ptr<const ProxyTopology> ProxyKernel::getTopology(
+    uint64_t topologyHash,
+    const MPointArray& points,
+    const std::vector<int>& triangleVertices
+) {
+    static BuildCache<ProxyTopology> cache(PROXY_TOPOLOGY_CACHE_SIZE);
+
+    std::shared_ptr<const ProxyTopology> topo = cache.get(topologyHash);
+    if (topo &&
+        topo->numVertices == (int)points.length() &&
+        topo->proxyTriangles.size() == triangleVertices.size() / 3
+    ) {
+        return topo;
+    }
+
+    topo = computeTopology(points, triangleVertices);
+    cache.put(topologyHash, topo);
+
+    return topo;
+}
+
+
+MStatus ProxyKernel::build(const MObject& meshObject, const MBoundingBox& bbox, const MMatrix& offsetMatrix)
+{
+    MStatus status;
+
+    MFnMesh meshFn(meshObject, &status);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    MPointArray points;
+    status = meshFn.getPoints(points, MSpace::kObject);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+    transformPoints(points, offsetMatrix);
+
+    MIntArray triangleCounts;
+    MIntArray triangleVertexArray;
+    status = meshFn.getTriangles(triangleCounts, triangleVertexArray);
+    CHECK_MSTATUS_AND_RETURN_IT(status);
+
+    std::vector<int> triangleVertices(triangleVertexArray.length());
+    for (unsigned int i = 0; i < triangleVertexArray.length(); ++i) {
+        triangleVertices[i] = triangleVertexArray[i];
+    }
+    if (triangleVertices.empty()) {
+        return MStatus::kFailure;
+    }
+
+    // exact triangles, in the same order as triangleVertices
+    this->triangles.clear();
+    this->triangles.reserve(triangleVertices.size() / 3);
+    int triangleOffset = 0;
+    for (unsigned int faceIndex = 0; faceIndex < triangleCounts.length(); ++faceIndex) {
+        for (int triangleIndex = 0; triangleIndex < triangleCounts[faceIndex]; ++triangleIndex) {
+            this->triangles.emplace_back(
+                faceIndex,
+                triangleIndex,
+                points[triangleVertices[triangleOffset + 0]],
+                points[triangleVertices[triangleOffset + 1]],
+                points[triangleVertices[triangleOffset + 2]]);
+            triangleOffset += 3;
+        }
+    }
+
+    // the decimation only depends on the topology
+    int numVertices = (int)points.length();
+    this->topology = getTopology(topologyHash64(numVertices, triangleVertices), points, triangleVertices);
+
+    // Per build, move each proxy vertex to the centroid of its cluster and record
+    // the largest distance from it to an original vertex. Every original triangle
+    // lies within that distance of its proxy triangle, so growing the proxy bounds
+    // by it keeps the pre-pass conservative even when the mesh has deformed
+    // since the topology was first clustered.
+    const int numClusters = this->topology->numClusters;
+    std::vector<MPoint> representatives(numClusters, MPoint(0.0, 0.0, 0.0));
+    std::vector<int> clusterSizes(numClusters, 0);
+    std::vector<double> clusterErrors(numClusters, 0.0);
+
+    for (int i = 0; i < numVertices; ++i) {
+        int c = this->topology->vertexCluster[i];
+        representatives[c] = representatives[c] + MVector(points[i]);
+        clusterSizes[c]++;
+    }
+    for (int c = 0; c < numClusters; ++c) {
+        representatives[c] = representatives[c] / std::max(1, clusterSizes[c]);
+    }
+    for (int i = 0; i < numVertices; ++i) {
+        int c = this->topology->vertexCluster[i];
+        clusterErrors[c] = std::max(clusterErrors[c], points[i].distanceTo(representatives[c]));
+    }
+
+    const int numProxies = (int)this->topology->proxyOffsets.size() - 1;
+    this->proxies.resize(numProxies);
+    this->bounds.clear();
+    for (int p = 0; p < numProxies; ++p) {
+        const int* c = &this->topology->proxyClusters[p * 3];
+
+        MBoundingBox box;
+        box.expand(representatives[c[0]]);
+        box.expand(representatives[c[1]]);
+        box.expand(representatives[c[2]]);
+        double error = std::max({clusterErrors[c[0]], clusterErrors[c[1]], clusterErrors[c[2]]});
+
+        this->proxies[p].id = p;
+        this->proxies[p].bounds = inflate(box, error);
+        this->bounds.expand(this->proxies[p].bounds);
+    }
+
+    std::sort(this->proxies.begin(), this->proxies.end(), [](const ProxyPrimitive& a, const ProxyPrimitive& b) {
+        return a.bounds.min().x < b.bounds.min().x;
+    });
+
+    return MStatus::kSuccess;
+}
+
+
+std::vector<TriangleData> ProxyKernel::intersectKernelTriangle(const TriangleData& triangle) const
+{
+    std::vector<TriangleData> intersectedTriangles;
+    if (!intersectBoxBox(this->bounds, triangle.bbox)) {
+        return intersectedTriangles;
+    }
+
+    const double maxX = triangle.bbox.max().x;
+    for (const ProxyPrimitive& proxy : this->proxies) {
+        if (proxy.bounds.min().x > maxX) {
+            break;
+        }
+        if (!intersectBoxBox(proxy.bounds, triangle.bbox)) {
+            continue;
+        }
+
+        for (int k = this->topology->proxyOffsets[proxy.id]; k < this->topology->proxyOffsets[proxy.id + 1]; ++k) {
+            const TriangleData& ourTri = this->triangles[this->topology->proxyTriangles[k]];
+            if (intersectBoxBox(ourTri.bbox, triangle.bbox) && intersectTriangleTriangle(ourTri, triangle)) {
+                intersectedTriangles.push_back(ourTri);
+            }
+        }
+    }
+
+    return intersectedTriangles;
+}
+
+
+// Sweep and prune along x over two proxy lists already sorted by min x.
+static void collectOverlappingProxies(
+    const std::vector<ProxyPrimitive>& proxiesA,
+    const std::vector<ProxyPrimitive>& proxiesB,
+    std::vector<std::pair<int, int>>& overlappingPairs
+) {
+    std::vector<int> activeA;
+    std::vector<int> activeB;
+
+    size_t i = 0, j = 0;
+    while (i < proxiesA.size() || j < proxiesB.size()) {
+        bool takeA = j >= proxiesB.size() ||
+            (i < proxiesA.size() && proxiesA[i].bounds.min().x <= proxiesB[j].bounds.min().x);
+
+        const ProxyPrimitive& current = takeA ? proxiesA[i] : proxiesB[j];
+        const double minX = current.bounds.min().x;
+
+        std::vector<int>& others = takeA ? activeB : activeA;
+        const std::vector<ProxyPrimitive>& otherProxies = takeA ? proxiesB : proxiesA;
+        others.erase(
+            std::remove_if(others.begin(), others.end(), [&](int k) { return otherProxies[k].bounds.max().x < minX; }),
+            others.end());
+
+        for (int k : others) {
+            if (intersectBoxBox(current.bounds, otherProxies[k].bounds)) {
+                if (takeA) {
+                    overlappingPairs.emplace_back((int)i, k);
+                } else {
+                    overlappingPairs.emplace_back(k, (int)j);
+                }
+            }
+        }
+
+        if (takeA) {
+            activeA.push_back((int)i++);
+        } else {
+            activeB.push_back((int)j++);
+        }
+    }
+}
+
+
+K2KIntersection ProxyKernel::intersectKernelKernel(SpatialDivisionKernel& otherKernel) const
+{
+    std::vector<TriangleData> intersectedTrianglesA;
+    std::vector<TriangleData> intersectedTrianglesB;
+
+    ProxyKernel* other = dynamic_cast<ProxyKernel*>(&otherKernel);
+    if (other == nullptr) {
+        MGlobal::displayError("Cannot intersect proxy kernel with other kernel type!");
+        return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
+    }
+
+    if (!intersectBoxBox(this->bounds, other->bounds)) {
+        return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
+    }
+
+    // 1. coarse pass on the proxies
+    std::vector<std::pair<int, int>> overlappingPairs;
+    collectOverlappingProxies(this->proxies, other->proxies, overlappingPairs);
+
+    // 2. exact pass on the original triangles under each overlapping proxy pair
+    const ProxyTopology& topoA = *this->topology;
+    const ProxyTopology& topoB = *other->topology;
+
+    #pragma omp parallel
+    {
+        std::vector<TriangleData> localA;
+        std::vector<TriangleData> localB;
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int n = 0; n < (int)overlappingPairs.size(); ++n) {
+            int proxyA = this->proxies[overlappingPairs[n].first].id;
+            int proxyB = other->proxies[overlappingPairs[n].second].id;
+
+            for (int a = topoA.proxyOffsets[proxyA]; a < topoA.proxyOffsets[proxyA + 1]; ++a) {
+                const TriangleData& triA = this->triangles[topoA.proxyTriangles[a]];
+
+                for (int b = topoB.proxyOffsets[proxyB]; b < topoB.proxyOffsets[proxyB + 1]; ++b) {
+                    const TriangleData& triB = other->triangles[topoB.proxyTriangles[b]];
+
+                    if (intersectBoxBox(triA.bbox, triB.bbox) && intersectTriangleTriangle(triA, triB)) {
+                        localA.push_back(triA);
+                        localB.push_back(triB);
+                    }
+                }
+            }
+        }
+
+        #pragma omp critical
+        {
+            intersectedTrianglesA.insert(intersectedTrianglesA.end(), localA.begin(), localA.end());
+            intersectedTrianglesB.insert(intersectedTrianglesB.end(), localB.begin(), localB.end());
+        }
+    }
+
+    return std::make_pair(intersectedTrianglesA, intersectedTrianglesB);
+}
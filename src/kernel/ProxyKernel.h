@@ -0,0 +1,64 @@
+#pragma once
+
+#include "../SpatialDivisionKernel.h"
+#include "../utility.h"
+
+#include <maya/MPoint.h>
+#include <maya/MPointArray.h>
+#include <maya/MStatus.h>
+#include <maya/MMatrix.h>
+#include <maya/MBoundingBox.h>
+
+#include <vector>
+#include <memory>
+
+
+// Vertex clustering of one mesh topology. Computed once per topology hash
+// and reused while the mesh deforms; only the cluster representatives and
+// their errors are recomputed each build.
+struct ProxyTopology
+{
+    int numVertices = 0;
+    int numClusters = 0;
+
+    std::vector<int> vertexCluster;         // vertex id -> cluster id
+
+    // proxy primitive p represents the original triangles
+    // proxyTriangles[proxyOffsets[p] .. proxyOffsets[p+1]]
+    std::vector<int> proxyClusters;         // 3 cluster ids per proxy primitive
+    std::vector<int> proxyOffsets;
+    std::vector<int> proxyTriangles;
+};
+
+
+struct ProxyPrimitive
+{
+    int id;
+    MBoundingBox bounds;  // proxy triangle bounds grown by its decimation error
+};
+
+
+// Two-level kernel for dense meshes. A decimated proxy of the mesh is
+// intersected first and the exact triangle test only runs on the original
+// triangles that belong to overlapping proxy primitives.
+class ProxyKernel : public SpatialDivisionKernel
+{
+public:
+     ProxyKernel() {}
+    ~ProxyKernel() override {}
+
+                      MStatus build(const MObject& meshObject, const MBoundingBox& bbox, const MMatrix& offsetMatrix) override;
+    std::vector<TriangleData> intersectKernelTriangle(const TriangleData& triangle) const override;
+              K2KIntersection intersectKernelKernel(SpatialDivisionKernel& otherKernel) const override;
+
+private:
+    std::shared_ptr<const ProxyTopology> topology;
+    std::vector<ProxyPrimitive> proxies;    // sorted by bounds.min().x
+    std::vector<TriangleData> triangles;
+    MBoundingBox bounds;
+
+    static std::shared_ptr<const ProxyTopology> getTopology(
+        uint64_t topologyHash,
+        const MPointArray& points,
+        const std::vector<int>& triangleVertices);
+};
@@ -0,0 +1,199 @@
+#include "TriangleBlocks.h"
+
+#include <maya/MPoint.h>
+#include <maya/MVector.h>
+
+#include <omp.h>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+
+void TriangleBlocks::resize(size_t size)
+{
+    for (int i = 0; i < 9; ++i) {
+        v[i].resize(size);
+    }
+    for (int i = 0; i < 3; ++i) {
+        lower[i].resize(size);
+        upper[i].resize(size);
+    }
+}
+
+
+BlockView TriangleBlocks::view() const
+{
+    BlockView view;
+    for (int i = 0; i < 9; ++i) {
+        view.v[i] = v[i].data();
+    }
+    for (int i = 0; i < 3; ++i) {
+        view.lower[i] = lower[i].data();
+        view.upper[i] = upper[i].data();
+    }
+    return view;
+}
+
+
+void TriangleBlocks::set(int slot, const MPoint& p0, const MPoint& p1, const MPoint& p2)
+{
+    const MPoint* p[3] = { &p0, &p1, &p2 };
+    for (int c = 0; c < 3; ++c) {
+        float a = (float)(*p[0])[c];
+        float b = (float)(*p[1])[c];
+        float d = (float)(*p[2])[c];
+        v[0 + c][slot] = a;
+        v[3 + c][slot] = b;
+        v[6 + c][slot] = d;
+        lower[c][slot] = std::min({a, b, d});
+        upper[c][slot] = std::max({a, b, d});
+    }
+}
+
+
+BlockQuery::BlockQuery(const TriangleData& triangle)
+{
+    MVector n = (triangle.vertices[1] - triangle.vertices[0]) ^ (triangle.vertices[2] - triangle.vertices[0]);
+    double d = n * MVector(triangle.vertices[0]);
+
+    double scale = 0.0;
+    for (int c = 0; c < 3; ++c) {
+        double lo = triangle.bbox.min()[c];
+        double hi = triangle.bbox.max()[c];
+        double pad = 1e-6 * std::max(std::fabs(lo), std::fabs(hi)) + 1e-6;
+        lower[c] = (float)(lo - pad);
+        upper[c] = (float)(hi + pad);
+        normal[c] = (float)n[c];
+        scale = std::max(scale, std::max(std::fabs(lo), std::fabs(hi)));
+    }
+    offset = (float)d;
+
+    // float rounding of the plane distances grows with the coordinates;
+    // stay well above it so that the prefilter never rejects a pair the
+    // exact test would accept
+    tolerance = (float)(1e-5 + 1e-4 * (n.length() * scale + std::fabs(d)));
+}
+
+
+static FilterBlockFunction filterBlock = sse2::filterBlock;
+static TransformPointsFunction transformPointsBlock = sse2::transformPoints;
+
+
+int filterTriangleBlock(const TriangleBlocks& blocks, int first, int count, const BlockQuery& query, int* candidates)
+{
+    const BlockView view = blocks.view();
+
+    int numCandidates = 0;
+    for (int offset = 0; offset < count; offset += TRIANGLE_BLOCK_SIZE) {
+        int size = std::min(TRIANGLE_BLOCK_SIZE, count - offset);
+        numCandidates += filterBlock(view, first + offset, size, query, candidates + numCandidates);
+    }
+    return numCandidates;
+}
+
+
+void transformPoints(MPointArray& points, const MMatrix& matrix)
+{
+    const int CHUNK_SIZE = 256;
+    const int numPoints = (int)points.length();
+
+    // The block kernels want packed x y z w doubles. Each chunk goes through a
+    // small buffer that stays in cache and is written straight back into
+    // `points`, whose storage Maya does not document.
+    #pragma omp parallel for
+    for (int first = 0; first < numPoints; first += CHUNK_SIZE) {
+        const int count = std::min(CHUNK_SIZE, numPoints - first);
+        double xyzw[4 * CHUNK_SIZE];
+        for (int i = 0; i < count; ++i) {
+            const MPoint& p = points[first + i];
+            xyzw[4 * i + 0] = p.x;
+            xyzw[4 * i + 1] = p.y;
+            xyzw[4 * i + 2] = p.z;
+            xyzw[4 * i + 3] = p.w;
+        }
+
+        transformPointsBlock(xyzw, count, matrix.matrix);
+
+        for (int i = 0; i < count; ++i) {
+            MPoint& p = points[first + i];
+            p.x = xyzw[4 * i + 0];
+            p.y = xyzw[4 * i + 1];
+            p.z = xyzw[4 * i + 2];
+            p.w = xyzw[4 * i + 3];
+        }
+    }
+}
+
+
+enum class CpuIsa { SSE2, SSE42, AVX2, AVX512 };
+
+static CpuIsa detectCpuIsa()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    const bool sse42 = (info[2] & (1 << 20)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    const bool fma = (info[2] & (1 << 12)) != 0;
+
+    // the OS must save the wider registers on context switches
+    const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+    const bool osAvx = (xcr0 & 0x6) == 0x6;
+    const bool osAvx512 = (xcr0 & 0xE6) == 0xE6;
+
+    bool avx2 = false;
+    bool avx512 = false;
+    if (maxLeaf >= 7) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+        avx512 = (info[1] & (1 << 16)) != 0 &&     // F
+                 (info[1] & (1 << 17)) != 0 &&     // DQ
+                 (info[1] & (1 << 30)) != 0 &&     // BW
+                 (info[1] & (1 << 31)) != 0;       // VL
+    }
+
+    if (avx512 && osAvx512) return CpuIsa::AVX512;
+    if (avx2 && avx && fma && osAvx) return CpuIsa::AVX2;
+    if (sse42) return CpuIsa::SSE42;
+    return CpuIsa::SSE2;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") &&
+        __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) return CpuIsa::AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return CpuIsa::AVX2;
+    if (__builtin_cpu_supports("sse4.2")) return CpuIsa::SSE42;
+    return CpuIsa::SSE2;
+#endif
+}
+
+
+const char* selectBlockKernels()
+{
+    switch (detectCpuIsa()) {
+    case CpuIsa::AVX512:
+        filterBlock = avx512::filterBlock;
+        transformPointsBlock = avx512::transformPoints;
+        return "AVX-512";
+    case CpuIsa::AVX2:
+        filterBlock = avx2::filterBlock;
+        transformPointsBlock = avx2::transformPoints;
+        return "AVX2";
+    case CpuIsa::SSE42:
+        filterBlock = sse42::filterBlock;
+        transformPointsBlock = sse42::transformPoints;
+        return "SSE4.2";
+    default:
+        filterBlock = sse2::filterBlock;
+        transformPointsBlock = sse2::transformPoints;
+        return "SSE2";
+    }
+}
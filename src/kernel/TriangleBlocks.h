@@ -0,0 +1,46 @@
+#pragma once
+
+#include "../utility.h"
+#include "BlockKernels.h"
+
+#include <maya/MPoint.h>
+#include <maya/MPointArray.h>
+#include <maya/MMatrix.h>
+
+#include <vector>
+
+
+// Triangles stored with one float array per component, so that a run of
+// triangles can be tested against one query triangle with SIMD.
+struct TriangleBlocks
+{
+    std::vector<float> v[9];              // x0 y0 z0 x1 y1 z1 x2 y2 z2
+    std::vector<float> lower[3];
+    std::vector<float> upper[3];
+
+    void resize(size_t size);
+    void set(int slot, const MPoint& p0, const MPoint& p1, const MPoint& p2);
+    BlockView view() const;
+};
+
+
+// One triangle prepared for testing against triangle blocks.
+struct BlockQuery : public BlockQueryData
+{
+    explicit BlockQuery(const TriangleData& triangle);
+};
+
+
+// Narrow the slots [first, first + count) down to the triangles whose bounds
+// overlap the query and which straddle the query plane. Never rejects a pair
+// that intersectTriangleTriangle would accept. `candidates` receives the slot
+// ids and must hold `count` entries; returns how many were written.
+int filterTriangleBlock(const TriangleBlocks& blocks, int first, int count, const BlockQuery& query, int* candidates);
+
+// points[i] = points[i] * matrix for the whole array, in parallel.
+void transformPoints(MPointArray& points, const MMatrix& matrix);
+
+// Switch the block kernels above to the widest instruction set this CPU and OS
+// support. Called once at plugin load; until then the SSE2 build is used.
+// Returns the name of the chosen variant.
+const char* selectBlockKernels();
@@ -12,10 +12,12 @@
 #include <maya/MStatus.h>
 #include <maya/MDrawRegistry.h>
 #include <maya/MEventMessage.h>
+#include <maya/MGlobal.h>
 
 #include "intersectionMarkerNode.h"
 #include "intersectionMarkerCommand.h"
 #include "intersectionMarkerDrawOverride.h"
+#include "kernel/TriangleBlocks.h"
 
 
 const char* kAUTHOR = "Takayoshi Matsumoto";
@@ -117,6 +119,11 @@ MStatus initializePlugin(MObject obj)
 {
     MStatus status;
     MFnPlugin fnPlugin(obj, kAUTHOR, kVERSION, kREQUIRED_API_VERSION);
+
+    // pick the block kernel variant for this CPU before any node evaluates
+    const char* isa = selectBlockKernels();
+    MGlobal::displayInfo(MString("intersectionMarker: using ") + isa + " block kernels");
+
 	  REGISTER_LOCATOR_NODE(IntersectionMarkerNode);
     REGISTER_DRAW_OVERRIDE(IntersectionMarkerNode, IntersectionMarkerDrawOverride);
     REGISTER_COMMAND(IntersectionMarkerCommand);
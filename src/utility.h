@@ -9,6 +9,10 @@
 #include <vector>
 #include <unordered_map>
 #include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
 
 #include <maya/MGlobal.h>
 #include <maya/MItMeshVertex.h>
@@ -42,6 +46,11 @@ struct TriangleData
     MPoint vertices[3];
     MBoundingBox bbox;
 
+    // plane normal from the double precision edges, so it does not depend on
+    // where the triangle sits in the scene, and a bound on its rounding error
+    glm::vec3 normal;
+    float normalError;
+
     TriangleData() = default;
     TriangleData(int faceIndex, int triangleIndex, MPoint v0, MPoint v1, MPoint v2)
         : faceIndex(faceIndex), triangleIndex(triangleIndex)
@@ -53,6 +62,17 @@ struct TriangleData
         bbox.expand(v0);
         bbox.expand(v1);
         bbox.expand(v2);
+
+        const MVector e1 = v1 - v0;
+        const MVector e2 = v2 - v0;
+        const MVector n = e1 ^ e2;
+        normal = glm::vec3((float)n.x, (float)n.y, (float)n.z);
+
+        const double magnitude = std::max({
+            std::fabs(e1.y * e2.z) + std::fabs(e1.z * e2.y),
+            std::fabs(e1.z * e2.x) + std::fabs(e1.x * e2.z),
+            std::fabs(e1.x * e2.y) + std::fabs(e1.y * e2.x)});
+        normalError = (float)(4.0 * DBL_EPSILON * magnitude);
     }
 
     MPoint center() const
@@ -127,6 +147,71 @@ public:
 };
 
 
+static inline uint64_t mixHash64(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+
+static inline uint64_t hashChunk64(const unsigned char* bytes, size_t size, uint64_t seed)
+{
+    uint64_t h = mixHash64(seed ^ (uint64_t)size);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, 8);
+        h = (h ^ mixHash64(word)) * 0x9e3779b97f4a7c15ULL;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes + i, size - i);
+    return mixHash64(h ^ tail);
+}
+
+
+// 64 bit hash for keys that outlive the process, such as the names of files
+// shared between sessions, where the 32 bit PolyChecksum would collide. Large
+// ranges are hashed in parallel chunks that are combined in order.
+static inline uint64_t hashBytes64(const void* data, size_t size, uint64_t seed = 0)
+{
+    const size_t chunkSize = 1 << 20;
+    const int numChunks = (int)((size + chunkSize - 1) / chunkSize);
+    const unsigned char* bytes = (const unsigned char*)data;
+
+    std::vector<uint64_t> chunks(numChunks);
+    #pragma omp parallel for schedule(static)
+    for (int c = 0; c < numChunks; ++c) {
+        const size_t first = (size_t)c * chunkSize;
+        chunks[c] = hashChunk64(bytes + first, std::min(chunkSize, size - first), (uint64_t)c);
+    }
+
+    uint64_t h = mixHash64(seed ^ (uint64_t)size);
+    for (uint64_t chunk : chunks) {
+        h = mixHash64(h ^ chunk) * 0x9e3779b97f4a7c15ULL;
+    }
+    return h;
+}
+
+
+// Key of a triangulated topology, for kernel data cached per topology.
+static inline uint64_t topologyHash64(int numVertices, const std::vector<int>& triangleVertices)
+{
+    return hashBytes64(triangleVertices.data(), sizeof(int) * triangleVertices.size(), (uint64_t)numVertices);
+}
+
+
+static inline uint64_t topologyHash64(int numVertices, const MIntArray& triangleVertices)
+{
+    std::vector<int> indices(triangleVertices.length());
+    triangleVertices.get(indices.data());
+    return topologyHash64(numVertices, indices);
+}
+
+
 static inline int getVertexChecksum(MObject polyObject, MMatrix& offsetMatrix)
 {
     PolyChecksum checksum;
@@ -303,6 +388,13 @@ __forceinline const MBoundingBox merge(const MBoundingBox& bbox1, const MBoundin
 }
 
 
+__forceinline const MBoundingBox inflate(const MBoundingBox& bbox, double amount)
+{
+    MVector delta(amount, amount, amount);
+    return MBoundingBox(bbox.min() - delta, bbox.max() + delta);
+}
+
+
 
 __forceinline int maxDim( const MFloatVector& a )
 {
@@ -330,18 +422,17 @@ __forceinline float det(const glm::vec2& a, const glm::vec2& b) {
     return a.x * b.y - a.y * b.x;
 }
 
-__forceinline float computePointOnSegment(
-        float pointA,
-        float pointB,
-        float ratioA,
-        float ratioB
+// Point where the plane distance crosses zero between two points on a line.
+// Callers make sure ratioA != ratioB.
+template <typename T>
+__forceinline T computePointOnSegment(
+        T pointA,
+        T pointB,
+        T ratioA,
+        T ratioB
 ) {
-    if (std::fabs(ratioA - ratioB) < std::numeric_limits<float>::epsilon()) {
-        throw std::invalid_argument("ratioA and ratioB are too close");
-    }
-
-    float ratio = ratioA / (ratioA - ratioB);
-    return glm::mix(pointA, pointB, ratio);
+    T ratio = ratioA / (ratioA - ratioB);
+    return pointA + (pointB - pointA) * ratio;
 }
 
 
@@ -389,9 +480,6 @@ static inline bool intersectTriangleTriangle (
     const glm::vec2& b1,
     const glm::vec2& b2
 ) {
-
-    return true;
-
     const bool a01_b01 = intersect_line_line(a0,a1,b0,b1); 
     if (a01_b01) return true;
 
@@ -437,23 +525,22 @@ static inline bool intersectTriangleTriangle (
 }
 
 
+// Triangle-triangle test with both plane equations already known.
 static inline bool intersectTriangleTriangle (
     const glm::vec3& a0,
     const glm::vec3& a1,
     const glm::vec3& a2,
+    const glm::vec3& Na,
+    const float      Ca,
 
     const glm::vec3& b0,
     const glm::vec3& b1,
-    const glm::vec3& b2
+    const glm::vec3& b2,
+    const glm::vec3& Nb,
+    const float      Cb
 ) {
     const float eps = 1E-5f;
 
-    /* calculate triangle planes */
-    const glm::vec3 Na = cross(a1-a0,a2-a0);
-    const float     Ca = dot(Na,a0);
-    const glm::vec3 Nb = cross(b1-b0,b2-b0);
-    const float     Cb = dot(Nb,b0);
-
     /* project triangle A onto plane B */
     const float    da0 = dot(Nb,a0)-Cb;
     const float    da1 = dot(Nb,a1)-Cb;
@@ -505,19 +592,38 @@ static inline bool intersectTriangleTriangle (
     const float pb2 = dot(D,b2);
 
     BoundingBox1D ba;
-    if (std::min(da0,da1) <= 0.0f && std::max(da0,da1) >= 0.0f && abs(da0-da1) > 0.0f) ba.expand(computePointOnSegment(pa0,pa1,da0,da1));
-    if (std::min(da1,da2) <= 0.0f && std::max(da1,da2) >= 0.0f && abs(da1-da2) > 0.0f) ba.expand(computePointOnSegment(pa1,pa2,da1,da2));
-    if (std::min(da2,da0) <= 0.0f && std::max(da2,da0) >= 0.0f && abs(da2-da0) > 0.0f) ba.expand(computePointOnSegment(pa2,pa0,da2,da0));
+    if (std::min(da0,da1) <= 0.0f && std::max(da0,da1) >= 0.0f && std::fabs(da0-da1) > 0.0f) ba.expand(computePointOnSegment(pa0,pa1,da0,da1));
+    if (std::min(da1,da2) <= 0.0f && std::max(da1,da2) >= 0.0f && std::fabs(da1-da2) > 0.0f) ba.expand(computePointOnSegment(pa1,pa2,da1,da2));
+    if (std::min(da2,da0) <= 0.0f && std::max(da2,da0) >= 0.0f && std::fabs(da2-da0) > 0.0f) ba.expand(computePointOnSegment(pa2,pa0,da2,da0));
 
     BoundingBox1D bb;
-    if (std::min(db0,db1) <= 0.0f && std::max(db0,db1) >= 0.0f && abs(db0-db1) > 0.0f) bb.expand(computePointOnSegment(pb0,pb1,db0,db1));
-    if (std::min(db1,db2) <= 0.0f && std::max(db1,db2) >= 0.0f && abs(db1-db2) > 0.0f) bb.expand(computePointOnSegment(pb1,pb2,db1,db2));
-    if (std::min(db2,db0) <= 0.0f && std::max(db2,db0) >= 0.0f && abs(db2-db0) > 0.0f) bb.expand(computePointOnSegment(pb2,pb0,db2,db0));
+    if (std::min(db0,db1) <= 0.0f && std::max(db0,db1) >= 0.0f && std::fabs(db0-db1) > 0.0f) bb.expand(computePointOnSegment(pb0,pb1,db0,db1));
+    if (std::min(db1,db2) <= 0.0f && std::max(db1,db2) >= 0.0f && std::fabs(db1-db2) > 0.0f) bb.expand(computePointOnSegment(pb1,pb2,db1,db2));
+    if (std::min(db2,db0) <= 0.0f && std::max(db2,db0) >= 0.0f && std::fabs(db2-db0) > 0.0f) bb.expand(computePointOnSegment(pb2,pb0,db2,db0));
 
     return ba.intersect(bb);
 }
 
 
+static inline bool intersectTriangleTriangle (
+    const glm::vec3& a0,
+    const glm::vec3& a1,
+    const glm::vec3& a2,
+
+    const glm::vec3& b0,
+    const glm::vec3& b1,
+    const glm::vec3& b2
+) {
+    /* calculate triangle planes */
+    const glm::vec3 Na = cross(a1-a0,a2-a0);
+    const float     Ca = dot(Na,a0);
+    const glm::vec3 Nb = cross(b1-b0,b2-b0);
+    const float     Cb = dot(Nb,b0);
+
+    return intersectTriangleTriangle(a0,a1,a2, Na,Ca, b0,b1,b2, Nb,Cb);
+}
+
+
 static inline bool intersectTriangleTriangle (
     const MFloatVector& a0,
     const MFloatVector& a1,
@@ -581,19 +687,324 @@ static inline bool intersectTriangleTriangle (
     );
 }
 
+// Outcome of a test run at limited precision.
+enum class FilteredResult { False, True, Uncertain };
+
+// Rounding error of a plane distance dot(N, p - q), relative to the sum of the
+// absolute products it is made of, and of the interval end points on the
+// intersection line, relative to the largest projection. Both leave slack over
+// the worst case.
+const float  FLOAT_PLANE_DISTANCE_ERROR  = 4.0f * FLT_EPSILON;
+const double DOUBLE_PLANE_DISTANCE_ERROR = 8.0 * DBL_EPSILON;
+const float  FLOAT_INTERVAL_ERROR        = 32.0f * FLT_EPSILON;
+const double DOUBLE_INTERVAL_ERROR       = 32.0 * DBL_EPSILON;
+
+
+template <typename T>
+__forceinline T dot3(const T a[3], const T b[3])
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+
+template <typename T>
+__forceinline T absDot3(const T a[3], const T b[3])
+{
+    return std::fabs(a[0] * b[0]) + std::fabs(a[1] * b[1]) + std::fabs(a[2] * b[2]);
+}
+
+
+// Twice the signed area of (p, q, r) and a bound on its rounding error.
+template <typename T>
+__forceinline T orient2D(const T p[2], const T q[2], const T r[2], const T relativeError, T& error)
+{
+    const T left = (q[0] - p[0]) * (r[1] - p[1]);
+    const T right = (q[1] - p[1]) * (r[0] - p[0]);
+    error = relativeError * (std::fabs(left) + std::fabs(right));
+    return left - right;
+}
+
+
+// Separating axis test of two coplanar triangles projected to 2D: they are
+// apart when all of one lies strictly outside an edge line of the other, or,
+// for collinear (degenerate) input, strictly beyond either end along an edge.
+// Signs within the rounding error are Uncertain, or with `decide` set,
+// touching.
+template <typename T>
+static inline FilteredResult intersectTriangleTriangle2D (
+    const T a[3][2],
+    const T b[3][2],
+    const T relativeError,
+    const bool decide
+) {
+    bool uncertain = false;
+    bool degenerate = false;
+
+    // true when `edges` has an edge line with all of `other` strictly on the far side
+    const auto separatedByEdges = [&](const T edges[3][2], const T other[3][2]) {
+        T error;
+        const T side = orient2D(edges[0], edges[1], edges[2], relativeError, error);
+        // a collinear triangle has no inside, try both sides of its line
+        const bool flat = std::fabs(side) <= error;
+        degenerate = degenerate || flat;
+        for (int i = 0; i < 3; ++i) {
+            const T* p = edges[i];
+            const T* q = edges[(i + 1) % 3];
+            bool below = true, above = true, belowOrOn = true, aboveOrOn = true;
+            for (int k = 0; k < 3; ++k) {
+                const T o = orient2D(p, q, other[k], relativeError, error);
+                below = below && o < -error;
+                above = above && o > error;
+                belowOrOn = belowOrOn && o <= error;
+                aboveOrOn = aboveOrOn && o >= -error;
+            }
+            if (((side > 0 || flat) && below) || ((side < 0 || flat) && above)) {
+                // strictly apart unless the line itself is in doubt
+                uncertain = flat;
+                return true;
+            }
+            if (((side > 0 || flat) && belowOrOn) || ((side < 0 || flat) && aboveOrOn)) {
+                uncertain = true;
+            }
+        }
+        return false;
+    };
+
+    if (separatedByEdges(a, b) || separatedByEdges(b, a)) {
+        return (uncertain && !decide) ? FilteredResult::Uncertain : FilteredResult::False;
+    }
+
+    if (degenerate) {
+        // collinear segments are only separated along their own direction
+        for (const T (*edges)[2] : { a, b }) {
+            for (int i = 0; i < 3; ++i) {
+                const T* p = edges[i];
+                const T* q = edges[(i + 1) % 3];
+                const T d[2] = { q[0] - p[0], q[1] - p[1] };
+                if (d[0] == 0 && d[1] == 0) {
+                    continue;
+                }
+                T aMin = std::numeric_limits<T>::max(), aMax = -std::numeric_limits<T>::max();
+                T bMin = std::numeric_limits<T>::max(), bMax = -std::numeric_limits<T>::max();
+                T extent = 0;
+                for (int k = 0; k < 3; ++k) {
+                    const T pa = d[0] * a[k][0] + d[1] * a[k][1];
+                    const T pb = d[0] * b[k][0] + d[1] * b[k][1];
+                    aMin = std::min(aMin, pa);
+                    aMax = std::max(aMax, pa);
+                    bMin = std::min(bMin, pb);
+                    bMax = std::max(bMax, pb);
+                    extent = std::max({extent, std::fabs(d[0] * a[k][0]) + std::fabs(d[1] * a[k][1]), std::fabs(d[0] * b[k][0]) + std::fabs(d[1] * b[k][1])});
+                }
+                const T gap = std::max(aMin - bMax, bMin - aMax);
+                const T tolerance = relativeError * extent;
+                if (gap > tolerance) {
+                    return FilteredResult::False;
+                }
+                if (gap >= -tolerance) {
+                    uncertain = true;
+                }
+            }
+        }
+    }
+
+    if (uncertain && !decide) {
+        return FilteredResult::Uncertain;
+    }
+    return FilteredResult::True;
+}
+
+
+// Plane and interval test of two triangles given relative to a0: `ra` and `rb`
+// are the vertices, `da` the distances of A's vertices to plane B and `db` of
+// B's to plane A, each with an error bound. When a sign or the interval
+// overlap is within the rounding error the result is Uncertain, or with
+// `decide` set, the pair counts as touching.
+template <typename T>
+static inline FilteredResult intersectTriangleTriangleFiltered (
+    const T ra[3][3],
+    const T rb[3][3],
+    const T Na[3],
+    const T Nb[3],
+    T da[3],
+    T db[3],
+    const T daError[3],
+    const T dbError[3],
+    const T intervalError,
+    const bool decide
+) {
+    // below this the rounding is no longer relative, leave it to higher precision
+    const T smallest = std::numeric_limits<T>::min() / std::numeric_limits<T>::epsilon();
+
+    for (int i = 0; i < 3; ++i) {
+        if (!decide && (daError[i] < smallest || dbError[i] < smallest)) {
+            return FilteredResult::Uncertain;
+        }
+        if (std::fabs(da[i]) <= daError[i]) {
+            if (!decide) return FilteredResult::Uncertain;
+            da[i] = 0;
+        }
+        if (std::fabs(db[i]) <= dbError[i]) {
+            if (!decide) return FilteredResult::Uncertain;
+            db[i] = 0;
+        }
+    }
+
+    /* all of A on one side of plane B, or all of B on one side of plane A */
+    if (std::max({da[0],da[1],da[2]}) < 0 || std::min({da[0],da[1],da[2]}) > 0) return FilteredResult::False;
+    if (std::max({db[0],db[1],db[2]}) < 0 || std::min({db[0],db[1],db[2]}) > 0) return FilteredResult::False;
+
+    if (unlikely
+            // coplanar
+            (
+                (da[0] == 0 && da[1] == 0 && da[2] == 0) ||
+                (db[0] == 0 && db[1] == 0 && db[2] == 0)
+            )
+    ) {
+        // project on the plane of the triangle the other one lies in, at this precision
+        const T* normal = (da[0] == 0 && da[1] == 0 && da[2] == 0) ? Nb : Na;
+        const int dz = (std::fabs(normal[0]) > std::fabs(normal[1]))
+            ? (std::fabs(normal[0]) > std::fabs(normal[2]) ? 0 : 2)
+            : (std::fabs(normal[1]) > std::fabs(normal[2]) ? 1 : 2);
+        const int dx = (dz+1)%3;
+        const int dy = (dx+1)%3;
+        T a2[3][2], b2[3][2];
+        for (int i = 0; i < 3; ++i) {
+            a2[i][0] = ra[i][dx];
+            a2[i][1] = ra[i][dy];
+            b2[i][0] = rb[i][dx];
+            b2[i][1] = rb[i][dy];
+        }
+        return intersectTriangleTriangle2D(a2, b2, intervalError, decide);
+    }
+
+    /* both triangles cross the line of the two planes, compare their intervals on it */
+    const T D[3] = {
+        Na[1] * Nb[2] - Na[2] * Nb[1],
+        Na[2] * Nb[0] - Na[0] * Nb[2],
+        Na[0] * Nb[1] - Na[1] * Nb[0]
+    };
+
+    T pa[3], pb[3];
+    T extent = 0;
+    for (int i = 0; i < 3; ++i) {
+        pa[i] = dot3(D, ra[i]);
+        pb[i] = dot3(D, rb[i]);
+        extent = std::max({extent, std::fabs(ra[i][0]), std::fabs(ra[i][1]), std::fabs(ra[i][2])});
+        extent = std::max({extent, std::fabs(rb[i][0]), std::fabs(rb[i][1]), std::fabs(rb[i][2])});
+    }
+
+    T aMin = std::numeric_limits<T>::max(), aMax = -std::numeric_limits<T>::max();
+    T bMin = std::numeric_limits<T>::max(), bMax = -std::numeric_limits<T>::max();
+    for (int i = 0; i < 3; ++i) {
+        const int j = (i + 1) % 3;
+        if (std::min(da[i],da[j]) <= 0 && std::max(da[i],da[j]) >= 0 && da[i] != da[j]) {
+            const T p = computePointOnSegment(pa[i],pa[j],da[i],da[j]);
+            aMin = std::min(aMin, p);
+            aMax = std::max(aMax, p);
+        }
+        if (std::min(db[i],db[j]) <= 0 && std::max(db[i],db[j]) >= 0 && db[i] != db[j]) {
+            const T p = computePointOnSegment(pb[i],pb[j],db[i],db[j]);
+            bMin = std::min(bMin, p);
+            bMax = std::max(bMax, p);
+        }
+    }
+
+    // positive when the intervals are apart
+    const T gap = std::max(aMin - bMax, bMin - aMax);
+    const T tolerance = intervalError * (std::fabs(D[0]) + std::fabs(D[1]) + std::fabs(D[2])) * extent;
+    if (!decide && tolerance < smallest) {
+        return FilteredResult::Uncertain;
+    }
+    if (std::fabs(gap) <= tolerance) {
+        return decide ? FilteredResult::True : FilteredResult::Uncertain;
+    }
+    return gap < 0 ? FilteredResult::True : FilteredResult::False;
+}
+
+
+// Adaptive precision triangle-triangle test. Both triangles are re-centred on
+// a0 in double, then tested in float with error bounds on every sign the
+// result depends on. Only pairs that land within those bounds are tested
+// again in double, where anything still within rounding error is taken as
+// touching. Far from the origin and at any scale the result is exact up to
+// that last case.
 static inline bool intersectTriangleTriangle (
     const TriangleData& a,
     const TriangleData& b
 ) {
-    return intersectTriangleTriangle(
-        a.vertices[0],
-        a.vertices[1],
-        a.vertices[2],
+    // differences in double, then rounded once
+    const MVector ea[3] = { MVector(), a.vertices[1] - a.vertices[0], a.vertices[2] - a.vertices[0] };
+    const MVector eb[3] = { b.vertices[0] - a.vertices[0], b.vertices[1] - a.vertices[0], b.vertices[2] - a.vertices[0] };
+    const MVector fa[3] = { a.vertices[0] - b.vertices[0], a.vertices[1] - b.vertices[0], a.vertices[2] - b.vertices[0] };
 
-        b.vertices[0],
-        b.vertices[1],
-        b.vertices[2]
-    );
+    {
+        float ra[3][3], rb[3][3], sa[3][3];
+        for (int i = 0; i < 3; ++i) {
+            for (int k = 0; k < 3; ++k) {
+                ra[i][k] = (float)ea[i][k];
+                rb[i][k] = (float)eb[i][k];
+                sa[i][k] = (float)fa[i][k];
+            }
+        }
+        const float Na[3] = { a.normal.x, a.normal.y, a.normal.z };
+        const float Nb[3] = { b.normal.x, b.normal.y, b.normal.z };
+
+        float da[3], db[3], daError[3], dbError[3];
+        for (int i = 0; i < 3; ++i) {
+            da[i] = dot3(Nb, sa[i]);
+            db[i] = dot3(Na, rb[i]);
+            daError[i] = FLOAT_PLANE_DISTANCE_ERROR * absDot3(Nb, sa[i]) + b.normalError * (std::fabs(sa[i][0]) + std::fabs(sa[i][1]) + std::fabs(sa[i][2]));
+            dbError[i] = FLOAT_PLANE_DISTANCE_ERROR * absDot3(Na, rb[i]) + a.normalError * (std::fabs(rb[i][0]) + std::fabs(rb[i][1]) + std::fabs(rb[i][2]));
+        }
+
+        FilteredResult result = intersectTriangleTriangleFiltered<float>(ra, rb, Na, Nb, da, db, daError, dbError, FLOAT_INTERVAL_ERROR, false);
+        if (likely(result != FilteredResult::Uncertain)) {
+            return result == FilteredResult::True;
+        }
+    }
+
+    double ra[3][3], rb[3][3], sa[3][3];
+    for (int i = 0; i < 3; ++i) {
+        for (int k = 0; k < 3; ++k) {
+            ra[i][k] = ea[i][k];
+            rb[i][k] = eb[i][k];
+            sa[i][k] = fa[i][k];
+        }
+    }
+    const MVector eb1 = b.vertices[1] - b.vertices[0];
+    const MVector eb2 = b.vertices[2] - b.vertices[0];
+    const double Na[3] = {
+        ea[1].y * ea[2].z - ea[1].z * ea[2].y,
+        ea[1].z * ea[2].x - ea[1].x * ea[2].z,
+        ea[1].x * ea[2].y - ea[1].y * ea[2].x
+    };
+    const double Nb[3] = {
+        eb1.y * eb2.z - eb1.z * eb2.y,
+        eb1.z * eb2.x - eb1.x * eb2.z,
+        eb1.x * eb2.y - eb1.y * eb2.x
+    };
+    // per component sums of absolute products, the scale of the normals' rounding
+    const double Pa[3] = {
+        std::fabs(ea[1].y * ea[2].z) + std::fabs(ea[1].z * ea[2].y),
+        std::fabs(ea[1].z * ea[2].x) + std::fabs(ea[1].x * ea[2].z),
+        std::fabs(ea[1].x * ea[2].y) + std::fabs(ea[1].y * ea[2].x)
+    };
+    const double Pb[3] = {
+        std::fabs(eb1.y * eb2.z) + std::fabs(eb1.z * eb2.y),
+        std::fabs(eb1.z * eb2.x) + std::fabs(eb1.x * eb2.z),
+        std::fabs(eb1.x * eb2.y) + std::fabs(eb1.y * eb2.x)
+    };
+
+    double da[3], db[3], daError[3], dbError[3];
+    for (int i = 0; i < 3; ++i) {
+        da[i] = dot3(Nb, sa[i]);
+        db[i] = dot3(Na, rb[i]);
+        daError[i] = DOUBLE_PLANE_DISTANCE_ERROR * absDot3(Pb, sa[i]);
+        dbError[i] = DOUBLE_PLANE_DISTANCE_ERROR * absDot3(Pa, rb[i]);
+    }
+
+    return intersectTriangleTriangleFiltered<double>(ra, rb, Na, Nb, da, db, daError, dbError, DOUBLE_INTERVAL_ERROR, true) == FilteredResult::True;
 }
 
 
@@ -630,55 +1041,79 @@ static inline bool boxContainsAllVertices (
 }
 
 
-static inline bool intersectBoxTriangle (
-    const MBoundingBox& box,
-    const TriangleData& triangle
+// Separating axis test between an axis aligned box, given by its half size,
+// and a triangle given relative to the box center: the 3 box normals, the
+// triangle normal and the 9 box edge x triangle edge axes. No early outs, so
+// the compiler can keep it branch free.
+// ref: Akenine-Moller, "Fast 3D Triangle-Box Overlap Testing"
+static inline bool overlapCenteredBoxTriangle (
+    const glm::vec3& h,
+    const glm::vec3& v0,
+    const glm::vec3& v1,
+    const glm::vec3& v2
 ) {
+    bool separated = false;
 
-    // if any vertex is inside the box, return true
-    if (boxContainsAnyVertices(box, triangle)) { return true; }
-
-    // if no bounding box intersection, return false
-    MBoundingBox triBox;
-    triBox.expand(triangle.vertices[0]);
-    triBox.expand(triangle.vertices[1]);
-    triBox.expand(triangle.vertices[2]);
-    if(!intersectBoxBox(box, triBox)){  return false; }
-
-    const glm::vec3& a0 = glm::vec3(triangle.vertices[0].x, triangle.vertices[0].y, triangle.vertices[0].z);
-    const glm::vec3& a1 = glm::vec3(triangle.vertices[1].x, triangle.vertices[1].y, triangle.vertices[1].z);
-    const glm::vec3& a2 = glm::vec3(triangle.vertices[2].x, triangle.vertices[2].y, triangle.vertices[2].z);
-
-    const glm::vec3& min = glm::vec3(box.min().x, box.min().y, box.min().z);
-    const glm::vec3& max = glm::vec3(box.max().x, box.max().y, box.max().z);
-
-    const glm::vec3& b0 = glm::vec3(min.x, min.y, min.z);
-    const glm::vec3& b1 = glm::vec3(min.x, min.y, max.z);
-    const glm::vec3& b2 = glm::vec3(min.x, max.y, min.z);
-    const glm::vec3& b3 = glm::vec3(min.x, max.y, max.z);
-    const glm::vec3& b4 = glm::vec3(max.x, min.y, min.z);
-    const glm::vec3& b5 = glm::vec3(max.x, min.y, max.z);
-    const glm::vec3& b6 = glm::vec3(max.x, max.y, min.z);
-    const glm::vec3& b7 = glm::vec3(max.x, max.y, max.z);
-
-
-    return intersectTriangleTriangle(a0,a1,a2, b0,b2,b6) ||
-           intersectTriangleTriangle(a0,a1,a2, b0,b6,b4) ||
-
-           intersectTriangleTriangle(a0,a1,a2, b0,b1,b3) ||
-           intersectTriangleTriangle(a0,a1,a2, b0,b3,b2) ||
-
-           intersectTriangleTriangle(a0,a1,a2, b0,b4,b5) ||
-           intersectTriangleTriangle(a0,a1,a2, b0,b5,b1) ||
+    // box normals
+    const glm::vec3 lower = glm::min(v0, glm::min(v1, v2));
+    const glm::vec3 upper = glm::max(v0, glm::max(v1, v2));
+    for (int k = 0; k < 3; ++k) {
+        separated |= (lower[k] > h[k]) | (upper[k] < -h[k]);
+    }
 
-           intersectTriangleTriangle(a0,a1,a2, b7,b3,b1) ||
-           intersectTriangleTriangle(a0,a1,a2, b7,b1,b5) ||
+    // triangle normal
+    const glm::vec3 e[3] = { v1 - v0, v2 - v1, v0 - v2 };
+    const glm::vec3 n = glm::cross(e[0], e[1]);
+    const glm::vec3 an = glm::abs(n);
+    separated |= std::fabs(glm::dot(n, v0)) > an.x * h.x + an.y * h.y + an.z * h.z;
+
+    // box edge k x triangle edge j projects a point p to p[w] * e[u] - p[u] * e[w]
+    const glm::vec3* v[3] = { &v0, &v1, &v2 };
+    for (int j = 0; j < 3; ++j) {
+        for (int k = 0; k < 3; ++k) {
+            const int u = (k + 1) % 3;
+            const int w = (k + 2) % 3;
+            float p0 = (*v[0])[w] * e[j][u] - (*v[0])[u] * e[j][w];
+            float p1 = (*v[1])[w] * e[j][u] - (*v[1])[u] * e[j][w];
+            float p2 = (*v[2])[w] * e[j][u] - (*v[2])[u] * e[j][w];
+            float r = h[u] * std::fabs(e[j][w]) + h[w] * std::fabs(e[j][u]);
+            separated |= (std::fmin(p0, std::fmin(p1, p2)) > r) | (std::fmax(p0, std::fmax(p1, p2)) < -r);
+        }
+    }
 
-           intersectTriangleTriangle(a0,a1,a2, b7,b6,b2) ||
-           intersectTriangleTriangle(a0,a1,a2, b7,b2,b3) ||
+    return !separated;
+}
 
-           intersectTriangleTriangle(a0,a1,a2, b7,b4,b6) ||
-           intersectTriangleTriangle(a0,a1,a2, b7,b5,b4);
 
+static inline bool intersectBoxTriangle (
+    const MBoundingBox& box,
+    const TriangleData& triangle
+) {
+    // if no bounding box intersection, return false
+    if (!intersectBoxBox(box, triangle.bbox)) { return false; }
+
+    // re-center in double before going to float, and grow the box by more
+    // than the float rounding so that the test stays conservative
+    const MPoint center = box.center();
+    const MVector d0 = triangle.vertices[0] - center;
+    const MVector d1 = triangle.vertices[1] - center;
+    const MVector d2 = triangle.vertices[2] - center;
+
+    double scale = 0.5 * std::max({box.width(), box.height(), box.depth()});
+    for (const MVector* d : { &d0, &d1, &d2 }) {
+        scale = std::max({scale, std::fabs(d->x), std::fabs(d->y), std::fabs(d->z)});
+    }
+    const float pad = (float)(1e-5 * scale);
+
+    const glm::vec3 h(
+        (float)(0.5 * box.width()) + pad,
+        (float)(0.5 * box.height()) + pad,
+        (float)(0.5 * box.depth()) + pad);
+
+    return overlapCenteredBoxTriangle(
+        h,
+        glm::vec3((float)d0.x, (float)d0.y, (float)d0.z),
+        glm::vec3((float)d1.x, (float)d1.y, (float)d1.z),
+        glm::vec3((float)d2.x, (float)d2.y, (float)d2.z));
 }
 
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <maya/MFloatPoint.h>
+#include <maya/MFloatPointArray.h>
+#include <maya/MFnMesh.h>
+#include <maya/MFnMeshData.h>
+#include <maya/MIntArray.h>
+#include <maya/MLibrary.h>
+#include <maya/MObject.h>
+#include <maya/MStatus.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+
+// Generated meshes for the tests and benchmarks, which run as Maya library
+// applications because kernels build from mesh data.
+
+
+// A deterministic value in [-1, 1] for the given seed and index.
+inline double testNoise(uint32_t seed, uint32_t index)
+{
+    uint32_t h = seed * 0x9e3779b9u ^ (index + 0x7f4a7c15u);
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return (double)h / 2147483647.5 - 1.0;
+}
+
+
+// A closed sphere of quads with triangle fans at the poles, every vertex
+// pushed along its normal by up to `noise` times the radius. `segments`
+// around, `rings` from pole to pole.
+inline MObject createSphere(int segments, int rings, double radius, double cx, double cy, double cz, double noise = 0.0, uint32_t seed = 1)
+{
+    const double pi = 3.14159265358979323846;
+
+    MFloatPointArray points;
+    for (int r = 1; r < rings; ++r) {
+        const double theta = pi * r / rings;
+        for (int s = 0; s < segments; ++s) {
+            const double phi = 2.0 * pi * s / segments;
+            const double scale = radius * (1.0 + noise * testNoise(seed, (uint32_t)points.length()));
+            points.append(MFloatPoint(
+                (float)(cx + scale * std::sin(theta) * std::cos(phi)),
+                (float)(cy + scale * std::cos(theta)),
+                (float)(cz + scale * std::sin(theta) * std::sin(phi))));
+        }
+    }
+    const int top = (int)points.length();
+    points.append(MFloatPoint((float)cx, (float)(cy + radius), (float)cz));
+    const int bottom = (int)points.length();
+    points.append(MFloatPoint((float)cx, (float)(cy - radius), (float)cz));
+
+    auto vertex = [segments](int ring, int segment) { return (ring - 1) * segments + segment % segments; };
+
+    MIntArray polygonCounts;
+    MIntArray polygonConnects;
+    for (int s = 0; s < segments; ++s) {
+        polygonCounts.append(3);
+        polygonConnects.append(top);
+        polygonConnects.append(vertex(1, s + 1));
+        polygonConnects.append(vertex(1, s));
+    }
+    for (int r = 1; r < rings - 1; ++r) {
+        for (int s = 0; s < segments; ++s) {
+            polygonCounts.append(4);
+            polygonConnects.append(vertex(r, s));
+            polygonConnects.append(vertex(r, s + 1));
+            polygonConnects.append(vertex(r + 1, s + 1));
+            polygonConnects.append(vertex(r + 1, s));
+        }
+    }
+    for (int s = 0; s < segments; ++s) {
+        polygonCounts.append(3);
+        polygonConnects.append(bottom);
+        polygonConnects.append(vertex(rings - 1, s));
+        polygonConnects.append(vertex(rings - 1, s + 1));
+    }
+
+    MFnMeshData dataFn;
+    MObject meshData = dataFn.create();
+    MFnMesh meshFn;
+    meshFn.create(points.length(), polygonCounts.length(), points, polygonCounts, polygonConnects, meshData);
+    return meshData;
+}
+
+
+// The same mesh with its faces in random order, like a mesh that was edited
+// or combined from parts. Vertex ids stay the same.
+inline MObject shuffleFaces(const MObject& mesh, uint32_t seed)
+{
+    MFnMesh sourceFn(mesh);
+    MFloatPointArray points;
+    sourceFn.getPoints(points);
+    MIntArray polygonCounts;
+    MIntArray polygonConnects;
+    sourceFn.getVertices(polygonCounts, polygonConnects);
+
+    std::vector<int> offsets(polygonCounts.length() + 1, 0);
+    for (unsigned int face = 0; face < polygonCounts.length(); ++face) {
+        offsets[face + 1] = offsets[face] + polygonCounts[face];
+    }
+    std::vector<int> order(polygonCounts.length());
+    for (int face = 0; face < (int)order.size(); ++face) {
+        order[face] = face;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937(seed));
+
+    MIntArray shuffledCounts;
+    MIntArray shuffledConnects;
+    for (int face : order) {
+        shuffledCounts.append(polygonCounts[face]);
+        for (int i = offsets[face]; i < offsets[face + 1]; ++i) {
+            shuffledConnects.append(polygonConnects[i]);
+        }
+    }
+
+    MFnMeshData dataFn;
+    MObject meshData = dataFn.create();
+    MFnMesh meshFn;
+    meshFn.create(points.length(), shuffledCounts.length(), points, shuffledCounts, shuffledConnects, meshData);
+    return meshData;
+}
+
+
+// Initializes Maya for the lifetime of a test or benchmark.
+class MayaSession
+{
+public:
+    explicit MayaSession(const char* name)
+    {
+        MStatus status = MLibrary::initialize(true, (char*)name, true);
+        this->initialized = status == MStatus::kSuccess;
+        if (!this->initialized) {
+            std::cerr << "cannot initialize Maya: " << status.errorString().asChar() << "\n";
+        }
+    }
+
+    ~MayaSession()
+    {
+        if (this->initialized) {
+            MLibrary::cleanup(0, false);
+        }
+    }
+
+    bool ok() const { return this->initialized; }
+
+private:
+    bool initialized = false;
+};
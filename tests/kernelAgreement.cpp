@@ -0,0 +1,377 @@
+// Checks every kernel against BruteForceKernel, the reference that tests
+// every triangle pair, on generated mesh pairs in both collision modes, and
+// incremental updates against full passes over a few frames of a moving patch,
+// and the skip apart test on pairs that are apart, overlap and close in.
+// Exits with 1 when an exact kernel reports other faces than the reference.
+
+#include "TestMeshes.h"
+#include "BatchScan.h"
+#include "IncrementalIntersection.h"
+#include "MotionBound.h"
+#include "kernel/BruteForceKernel.h"
+#include "kernel/TriangleBlocks.h"
+
+#include <maya/MFloatPointArray.h>
+#include <maya/MFnMesh.h>
+#include <maya/MMatrix.h>
+
+#include <algorithm>
+#include <iostream>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+
+struct KernelCase
+{
+    short type;             // createKernel type
+    const char* name;
+    bool quantizedNodes;
+    bool exact[2];          // per collision mode, must match the reference, otherwise differences are only printed
+};
+
+// KDTreeKernel predates the reference: its triangle query misses pairs and
+// its kernel-kernel query is not implemented. EmbreeSceneKernel's edge rays
+// do not report coplanar contact.
+const KernelCase KERNELS[] = {
+    { 0, "Embree", false, { true, true } },
+    { 0, "Embree compressed", true, { true, true } },
+    { 1, "Octree", false, { true, true } },
+    { 2, "KDTree", false, { false, false } },
+    { 3, "Proxy", false, { true, true } },
+    { 4, "OBBTree", false, { true, true } },
+    { 5, "Cluster", false, { true, true } },
+    { 7, "Auto", false, { true, true } },
+    { 8, "EmbreeScene", false, { true, false } },
+};
+
+
+struct MeshPair
+{
+    std::string name;
+    MObject meshA;
+    MObject meshB;
+    MMatrix offsetA;
+    MMatrix offsetB;
+};
+
+
+using FaceSets = std::pair<std::set<int>, std::set<int>>;
+
+
+static MMatrix translation(double x, double y, double z)
+{
+    MMatrix matrix;
+    matrix[3][0] = x;
+    matrix[3][1] = y;
+    matrix[3][2] = z;
+    return matrix;
+}
+
+
+static int countTriangles(const MObject& mesh)
+{
+    MFnMesh meshFn(mesh);
+    return meshFn.numFaceVertices() - 2 * meshFn.numPolygons();
+}
+
+
+static bool buildKernel(SpatialDivisionKernel& kernel, const MObject& mesh, const MMatrix& offset)
+{
+    return kernel.build(mesh, pointsBoundingBox(mesh, offset), offset) == MStatus::kSuccess;
+}
+
+
+static FaceSets toSets(const std::unordered_set<int>& facesA, const std::unordered_set<int>& facesB)
+{
+    return { std::set<int>(facesA.begin(), facesA.end()), std::set<int>(facesB.begin(), facesB.end()) };
+}
+
+
+static bool intersectPair(const MeshPair& pair, std::shared_ptr<SpatialDivisionKernel> kernelA, std::shared_ptr<SpatialDivisionKernel> kernelB, int collisionMode, FaceSets& result)
+{
+    if (!kernelA || !buildKernel(*kernelA, pair.meshA, pair.offsetA)) {
+        return false;
+    }
+
+    std::unordered_set<int> facesA;
+    std::unordered_set<int> facesB;
+    if (collisionMode == 0) {
+        if (intersectKernelMesh(*kernelA, pair.meshB, pair.offsetB, facesA, facesB) != MStatus::kSuccess) {
+            return false;
+        }
+    } else {
+        if (!kernelB || !buildKernel(*kernelB, pair.meshB, pair.offsetB)) {
+            return false;
+        }
+        K2KIntersection pairs = kernelA->intersectKernelKernel(*kernelB);
+        for (const TriangleData& triangle : pairs.first) {
+            facesA.insert(triangle.faceIndex);
+        }
+        for (const TriangleData& triangle : pairs.second) {
+            facesB.insert(triangle.faceIndex);
+        }
+    }
+    result = toSets(facesA, facesB);
+    return true;
+}
+
+
+static size_t countDifferences(const std::set<int>& expected, const std::set<int>& actual)
+{
+    std::vector<int> difference;
+    std::set_symmetric_difference(expected.begin(), expected.end(), actual.begin(), actual.end(), std::back_inserter(difference));
+    return difference.size();
+}
+
+
+static std::vector<MeshPair> createPairs()
+{
+    std::vector<MeshPair> pairs;
+
+    // noisy spheres cutting through each other, below the Auto brute force size
+    MObject small = createSphere(24, 16, 1.0, 0.0, 0.0, 0.0, 0.02, 1);
+    pairs.push_back({ "small overlap", small, createSphere(20, 12, 0.6, 0.9, 0.2, 0.0, 0.02, 2), MMatrix(), MMatrix() });
+
+    // above it, so that Auto picks the BVH
+    MObject large = createSphere(80, 48, 1.0, 0.0, 0.0, 0.0, 0.01, 3);
+    pairs.push_back({ "large overlap", large, createSphere(64, 40, 0.8, 0.7, -0.3, 0.2, 0.01, 4), MMatrix(), MMatrix() });
+
+    // the same pair placed through offset matrices, far from the origin
+    pairs.push_back({ "offset overlap", large, createSphere(64, 40, 0.8, 0.0, 0.0, 0.0, 0.01, 4),
+        translation(1000.0, 0.0, -500.0), translation(1000.7, -0.3, -499.8) });
+
+    // one sphere inside the other, no surfaces touch
+    pairs.push_back({ "nested", large, createSphere(32, 20, 0.5, 0.1, 0.0, 0.0, 0.0, 5), MMatrix(), MMatrix() });
+
+    // apart
+    pairs.push_back({ "apart", small, createSphere(20, 12, 0.6, 3.0, 0.0, 0.0, 0.02, 6), MMatrix(), MMatrix() });
+
+    return pairs;
+}
+
+
+// Moves `count` vertices of the mesh, starting at `first`, by (dx, dy, dz).
+static void movePatch(const MObject& mesh, int first, int count, float dx, float dy, float dz)
+{
+    MFnMesh meshFn(mesh);
+    MFloatPointArray points;
+    meshFn.getPoints(points);
+    for (int v = first; v < first + count && v < (int)points.length(); ++v) {
+        points[v] = MFloatPoint(points[v].x + dx, points[v].y + dy, points[v].z + dz);
+    }
+    meshFn.setPoints(points);
+}
+
+
+// Runs IncrementalIntersection over frames in which a patch of each mesh moves
+// through the other and compares every frame with the reference. The last
+// frame shuffles the faces of B, a topology change with the same counts, which
+// must be turned down by update() and rebuilt.
+static int checkIncremental(short kernelType, const char* name)
+{
+    MObject meshA = createSphere(24, 16, 1.0, 0.0, 0.0, 0.0, 0.02, 7);
+    MObject meshB = createSphere(20, 12, 0.6, 1.2, 0.2, 0.0, 0.02, 8);
+    const MMatrix identity;
+
+    ScanSettings settings;
+    settings.kernel = kernelType;
+
+    IncrementalIntersection incremental;
+    if (incremental.rebuild(meshA, identity, meshB, identity, settings) != MStatus::kSuccess) {
+        std::cout << "FAIL incremental, " << name << ": rebuild failed\n";
+        return 1;
+    }
+
+    const int NUM_FRAMES = 6;
+    int failures = 0;
+    for (int frame = 0; frame <= NUM_FRAMES; ++frame) {
+        bool updated = true;
+        if (frame == NUM_FRAMES) {
+            meshB = shuffleFaces(meshB, 9);
+            updated = incremental.update(meshA, identity, meshB, identity, settings);
+            if (updated) {
+                std::cout << "FAIL incremental, " << name << ": a topology change was taken as an update\n";
+                ++failures;
+            }
+            if (incremental.rebuild(meshA, identity, meshB, identity, settings) != MStatus::kSuccess) {
+                std::cout << "FAIL incremental, " << name << ": rebuild failed\n";
+                return failures + 1;
+            }
+        } else if (frame > 0) {
+            // B's first rings sweep into A and out again, A's cap moves on odd frames
+            movePatch(meshB, 0, 40, frame < 4 ? -0.15f : 0.2f, 0.0f, 0.0f);
+            if (frame % 2 == 1) {
+                movePatch(meshA, 0, 30, 0.0f, 0.05f, 0.0f);
+            }
+            updated = incremental.update(meshA, identity, meshB, identity, settings);
+            if (!updated) {
+                std::cout << "FAIL incremental, " << name << ", frame " << frame << ": update turned down\n";
+                ++failures;
+                continue;
+            }
+        }
+
+        std::unordered_set<int> facesA;
+        std::unordered_set<int> facesB;
+        incremental.getIntersectedFaces(facesA, facesB);
+        const FaceSets actual = toSets(facesA, facesB);
+
+        FaceSets expected;
+        const MeshPair pair = { "incremental", meshA, meshB, identity, identity };
+        if (!intersectPair(pair, std::make_shared<BruteForceKernel>(), nullptr, 0, expected)) {
+            std::cout << "FAIL incremental, " << name << ": the reference failed\n";
+            return failures + 1;
+        }
+
+        const size_t differences = countDifferences(expected.first, actual.first) + countDifferences(expected.second, actual.second);
+        if (differences != 0) {
+            std::cout << "FAIL incremental, " << name << ", frame " << frame << ": " << differences << " faces differ from the "
+                << expected.first.size() << " + " << expected.second.size() << " expected\n";
+            ++failures;
+        }
+    }
+    return failures;
+}
+
+
+// The skip apart test on a pair whose world boxes are apart and one whose
+// boxes overlap, both placed by B's offset matrix so an object space box would
+// overlap in either case. Then B closes in on A, slowly and then fast, and
+// every frame the motion bound skips must be free of contact in the reference.
+static int checkSkipApart()
+{
+    MObject meshA = createSphere(24, 16, 1.0, 0.0, 0.0, 0.0, 0.02, 7);
+    MObject meshB = createSphere(20, 12, 0.6, 0.0, 0.0, 0.0, 0.02, 8);
+    const MMatrix identity;
+
+    FrameSettings settings;
+    settings.scan.kernel = 6;
+    settings.skipApartFrames = true;
+    settings.sharedResults = false;
+
+    int failures = 0;
+    std::unordered_set<int> facesA;
+    std::unordered_set<int> facesB;
+    const struct { const char* name; double x; bool apart; } PLACEMENTS[] = {
+        { "apart", 3.0, true },
+        { "overlapping", 1.2, false },
+    };
+    for (const auto& placement : PLACEMENTS) {
+        const FrameMesh frameA(meshA, identity);
+        const FrameMesh frameB(meshB, translation(placement.x, 0.0, 0.0));
+
+        MotionBound motionBound;
+        bool skipped = false;
+        if (intersectFrame(frameA, frameB, settings, 0.0, &motionBound, nullptr, facesA, facesB, &skipped) != MStatus::kSuccess) {
+            std::cout << "FAIL skip apart, " << placement.name << ": the frame failed\n";
+            ++failures;
+            continue;
+        }
+
+        FaceSets expected;
+        const MeshPair pair = { placement.name, meshA, meshB, identity, frameB.offset };
+        if (!intersectPair(pair, std::make_shared<BruteForceKernel>(), nullptr, 0, expected)) {
+            std::cout << "FAIL skip apart, " << placement.name << ": the reference failed\n";
+            return failures + 1;
+        }
+
+        const FaceSets actual = toSets(facesA, facesB);
+        if (skipped != placement.apart || actual != expected || expected.first.empty() == !placement.apart) {
+            std::cout << "FAIL skip apart, " << placement.name << ": " << (skipped ? "skipped" : "tested") << ", "
+                << actual.first.size() << " + " << actual.second.size() << " faces, "
+                << expected.first.size() << " + " << expected.second.size() << " expected\n";
+            ++failures;
+        }
+    }
+
+    // B starts 3.4 away and closes in by 0.05 a frame, then by 0.4
+    MotionBound motionBound;
+    double x = 5.0;
+    int skippedFrames = 0;
+    for (int frame = 0; frame < 30; ++frame) {
+        x -= frame < 12 ? 0.05 : 0.4;
+        const FrameMesh frameA(meshA, identity);
+        const FrameMesh frameB(meshB, translation(x, 0.0, 0.0));
+
+        bool skipped = false;
+        if (intersectFrame(frameA, frameB, settings, frame, &motionBound, nullptr, facesA, facesB, &skipped) != MStatus::kSuccess) {
+            std::cout << "FAIL skip apart, frame " << frame << ": the frame failed\n";
+            return failures + 1;
+        }
+        if (!skipped) {
+            continue;
+        }
+        ++skippedFrames;
+
+        FaceSets expected;
+        const MeshPair pair = { "closing in", meshA, meshB, identity, frameB.offset };
+        if (!intersectPair(pair, std::make_shared<BruteForceKernel>(), nullptr, 0, expected)) {
+            std::cout << "FAIL skip apart: the reference failed\n";
+            return failures + 1;
+        }
+        if (!expected.first.empty()) {
+            std::cout << "FAIL skip apart, frame " << frame << ": skipped a frame with "
+                << expected.first.size() << " + " << expected.second.size() << " faces\n";
+            ++failures;
+        }
+    }
+    if (skippedFrames == 0) {
+        std::cout << "FAIL skip apart: the motion bound skipped no frame\n";
+        ++failures;
+    }
+    return failures;
+}
+
+
+int main(int, char** argv)
+{
+    MayaSession session(argv[0]);
+    if (!session.ok()) {
+        return 2;
+    }
+    selectBlockKernels();
+
+    int failures = 0;
+    for (const MeshPair& pair : createPairs()) {
+        const int numTriangles = std::max(countTriangles(pair.meshA), countTriangles(pair.meshB));
+
+        for (int collisionMode = 0; collisionMode < 2; ++collisionMode) {
+            FaceSets expected;
+            if (!intersectPair(pair, std::make_shared<BruteForceKernel>(), std::make_shared<BruteForceKernel>(), collisionMode, expected)) {
+                std::cerr << pair.name << ": the reference failed\n";
+                return 2;
+            }
+
+            for (const KernelCase& kernel : KERNELS) {
+                FaceSets actual;
+                const bool built = intersectPair(pair,
+                    createKernel(kernel.type, kernel.quantizedNodes, numTriangles),
+                    createKernel(kernel.type, kernel.quantizedNodes, numTriangles),
+                    collisionMode, actual);
+
+                const size_t differences = built
+                    ? countDifferences(expected.first, actual.first) + countDifferences(expected.second, actual.second)
+                    : expected.first.size() + expected.second.size();
+                if (built && differences == 0) {
+                    continue;
+                }
+
+                const bool exact = kernel.exact[collisionMode];
+                std::cout << (exact ? "FAIL " : "note ") << pair.name << ", mode " << collisionMode << ", " << kernel.name << ": "
+                    << (built ? std::to_string(differences) + " faces differ from the " : "build failed, ")
+                    << expected.first.size() << " + " << expected.second.size() << " expected\n";
+                failures += exact ? 1 : 0;
+            }
+        }
+    }
+
+    // kernels that move their points in place, see kernelUpdatesPoints
+    failures += checkIncremental(5, "Cluster");
+    failures += checkIncremental(6, "BruteForce");
+    failures += checkSkipApart();
+
+    std::cout << (failures == 0 ? "all kernels agree with the reference\n" : "kernels disagree with the reference\n");
+    return failures == 0 ? 0 : 1;
+}
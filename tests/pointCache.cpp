@@ -0,0 +1,215 @@
+// Writes a point cache of a mesh moving over a few frames, opens it and
+// checks the topology, the times and the points of every frame, in the mapped
+// file and in the mesh data made from it. Then damages copies of the file,
+// truncated or with a header that does not describe it, which open() must
+// turn down. Exits with 1 on any failure.
+
+#include "TestMeshes.h"
+#include "PointCache.h"
+
+#include <maya/MFloatPointArray.h>
+#include <maya/MFnMesh.h>
+#include <maya/MIntArray.h>
+#include <maya/MPointArray.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+
+const char* const CACHE_PATH = "pointCache.test.impc";
+const char* const DAMAGED_PATH = "pointCache.damaged.impc";
+const int NUM_FRAMES = 5;
+
+
+// The mesh's points at a frame, moved along x by a tenth per frame.
+static MPointArray framePoints(const MObject& mesh, int frame)
+{
+    MPointArray points;
+    MFnMesh(mesh).getPoints(points);
+    for (unsigned int i = 0; i < points.length(); ++i) {
+        points[i].x += 0.1 * frame;
+    }
+    return points;
+}
+
+
+static std::vector<char> readFile(const char* path)
+{
+    std::ifstream in(path, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+
+static void writeFile(const char* path, const std::vector<char>& bytes)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), (std::streamsize)bytes.size());
+}
+
+
+static bool sameArray(const MIntArray& a, const MIntArray& b)
+{
+    if (a.length() != b.length()) {
+        return false;
+    }
+    for (unsigned int i = 0; i < a.length(); ++i) {
+        if (a[i] != b[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static int checkRoundTrip(const MObject& mesh)
+{
+    MFnMesh meshFn(mesh);
+    MIntArray polygonCounts;
+    MIntArray polygonConnects;
+    meshFn.getVertices(polygonCounts, polygonConnects);
+
+    PointCacheWriter writer;
+    bool written = writer.open(CACHE_PATH, polygonCounts, polygonConnects, meshFn.numVertices()) == MStatus::kSuccess;
+    for (int frame = 0; frame < NUM_FRAMES && written; ++frame) {
+        written = writer.appendFrame(1001.0 + frame, framePoints(mesh, frame)) == MStatus::kSuccess;
+    }
+    if (!written || writer.close() != MStatus::kSuccess) {
+        std::cout << "FAIL round trip: the cache was not written\n";
+        return 1;
+    }
+
+    std::shared_ptr<PointCache> cache = PointCache::open(CACHE_PATH);
+    if (!cache) {
+        std::cout << "FAIL round trip: the cache does not open\n";
+        return 1;
+    }
+    if (cache->numVertices() != (unsigned int)meshFn.numVertices() ||
+        cache->numPolygons() != (unsigned int)meshFn.numPolygons() ||
+        cache->numFrames() != (size_t)NUM_FRAMES
+    ) {
+        std::cout << "FAIL round trip: " << cache->numVertices() << " vertices, " << cache->numPolygons() << " polygons, "
+            << cache->numFrames() << " frames\n";
+        return 1;
+    }
+
+    int failures = 0;
+    MObject meshData;
+    if (cache->createMesh(meshData) != MStatus::kSuccess) {
+        std::cout << "FAIL round trip: no mesh from the cache\n";
+        return 1;
+    }
+    MIntArray cachedCounts;
+    MIntArray cachedConnects;
+    MFnMesh(meshData).getVertices(cachedCounts, cachedConnects);
+    if (!sameArray(cachedCounts, polygonCounts) || !sameArray(cachedConnects, polygonConnects)) {
+        std::cout << "FAIL round trip: the topology differs\n";
+        ++failures;
+    }
+
+    for (int frame = 0; frame < NUM_FRAMES; ++frame) {
+        if (cache->time(frame) != 1001.0 + frame) {
+            std::cout << "FAIL round trip, frame " << frame << ": time " << cache->time(frame) << "\n";
+            ++failures;
+        }
+
+        cache->setPoints(meshData, frame);
+        MFloatPointArray meshPoints;
+        MFnMesh(meshData).getPoints(meshPoints);
+        const MPointArray expected = framePoints(mesh, frame);
+        const float* values = cache->points(frame);
+
+        int differences = 0;
+        for (unsigned int i = 0; i < expected.length(); ++i) {
+            const float x = (float)expected[i].x, y = (float)expected[i].y, z = (float)expected[i].z;
+            differences += (values[i * 3 + 0] != x || values[i * 3 + 1] != y || values[i * 3 + 2] != z) ? 1 : 0;
+            differences += (meshPoints[i].x != x || meshPoints[i].y != y || meshPoints[i].z != z) ? 1 : 0;
+        }
+        if (differences > 0) {
+            std::cout << "FAIL round trip, frame " << frame << ": " << differences << " points differ\n";
+            ++failures;
+        }
+    }
+    return failures;
+}
+
+
+// Copies of the cache, each damaged in one way, must not open.
+static int checkDamaged()
+{
+    const std::vector<char> original = readFile(CACHE_PATH);
+    PointCacheHeader header;
+    std::memcpy(&header, original.data(), sizeof(header));
+
+    struct Damage
+    {
+        const char* name;
+        std::function<void(std::vector<char>&, PointCacheHeader&)> apply;
+    };
+    const Damage DAMAGES[] = {
+        { "truncated in the last frame", [](std::vector<char>& bytes, PointCacheHeader& h) { bytes.resize((size_t)(h.framesOffset + h.frameStride * (h.numFrames - 1) + 16)); } },
+        { "truncated in the header", [](std::vector<char>& bytes, PointCacheHeader&) { bytes.resize(sizeof(PointCacheHeader) / 2); } },
+        { "zero frame stride", [](std::vector<char>&, PointCacheHeader& h) { h.frameStride = 0; } },
+        { "zero frame stride without vertices", [](std::vector<char>&, PointCacheHeader& h) { h.frameStride = 0; h.numVertices = 0; h.numPolygons = 0; h.numFaceVertices = 0; } },
+        { "frame stride below the points", [](std::vector<char>&, PointCacheHeader& h) { h.frameStride -= 4096; } },
+        { "vertex count that overflows the frame size", [](std::vector<char>&, PointCacheHeader& h) { h.numVertices = 0x1555555555555556ULL; } },
+        { "vertex count beyond the cached vertices", [](std::vector<char>&, PointCacheHeader& h) { h.numVertices = 1u << 20; } },
+        { "face vertex count off by one", [](std::vector<char>&, PointCacheHeader& h) { h.numFaceVertices -= 1; } },
+        { "frames past the end of the file", [](std::vector<char>&, PointCacheHeader& h) { h.numFrames += 1; } },
+        { "other version", [](std::vector<char>&, PointCacheHeader& h) { h.version += 1; } },
+    };
+
+    int failures = 0;
+    for (const Damage& damage : DAMAGES) {
+        std::vector<char> bytes = original;
+        PointCacheHeader damagedHeader = header;
+        damage.apply(bytes, damagedHeader);
+        if (bytes.size() >= sizeof(damagedHeader)) {
+            std::memcpy(bytes.data(), &damagedHeader, sizeof(damagedHeader));
+        }
+        writeFile(DAMAGED_PATH, bytes);
+
+        if (PointCache::open(DAMAGED_PATH)) {
+            std::cout << "FAIL damaged cache, " << damage.name << ": opened\n";
+            ++failures;
+        }
+    }
+
+    // a vertex id past the vertex count
+    std::vector<char> bytes = original;
+    const int32_t badVertex = (int32_t)header.numVertices;
+    std::memcpy(bytes.data() + header.connectsOffset, &badVertex, sizeof(badVertex));
+    writeFile(DAMAGED_PATH, bytes);
+    if (PointCache::open(DAMAGED_PATH)) {
+        std::cout << "FAIL damaged cache, vertex id out of range: opened\n";
+        ++failures;
+    }
+
+    std::remove(DAMAGED_PATH);
+    return failures;
+}
+
+
+int main(int, char** argv)
+{
+    MayaSession session(argv[0]);
+    if (!session.ok()) {
+        return 2;
+    }
+
+    MObject mesh = createSphere(24, 16, 1.0, 0.0, 0.0, 0.0, 0.02, 7);
+
+    int failures = checkRoundTrip(mesh);
+    if (failures == 0) {
+        failures += checkDamaged();
+    }
+    std::remove(CACHE_PATH);
+
+    std::cout << (failures == 0 ? "point caches read back what was written\n" : "point caches failed\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,190 @@
+// Checks the shared result cache with threads that insert and look up results
+// at the same time, each in its own mapping of one file like the processes on
+// a host, and with an arena that runs full: a result that does not fit must
+// not keep smaller ones out. Exits with 1 on any failure.
+
+#include "TestMeshes.h"
+#include "SharedResultCache.h"
+
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+
+const char* const CACHE_PATH = "sharedResultCache.test.imsrc";
+const int NUM_THREADS = 8;
+const int KEYS_PER_THREAD = 500;
+
+
+// The result stored under a key: a few faces that depend on it.
+static void resultOf(uint64_t key, std::unordered_set<int>& facesA, std::unordered_set<int>& facesB)
+{
+    facesA.clear();
+    facesB.clear();
+    for (int i = 0; i < (int)(key % 7) + 1; ++i) {
+        facesA.insert((int)(key * 3 + i));
+        facesB.insert((int)(key * 5 + i * 2));
+    }
+}
+
+
+static std::unique_ptr<SharedResultCache> openCache(size_t size)
+{
+    std::unique_ptr<SharedResultCache> cache(new SharedResultCache());
+    if (!cache->open(CACHE_PATH, size)) {
+        return nullptr;
+    }
+    return cache;
+}
+
+
+static bool holds(const SharedResultCache& cache, uint64_t key)
+{
+    std::unordered_set<int> facesA, facesB, expectedA, expectedB;
+    resultOf(key, expectedA, expectedB);
+    return cache.find(key, facesA, facesB) && facesA == expectedA && facesB == expectedB;
+}
+
+
+// Every thread inserts its own keys and the first half of every other
+// thread's, and looks up keys of the others while they are being written. A
+// result that is found must be complete; once all threads are done every key
+// must be found.
+static int checkConcurrent()
+{
+    std::remove(CACHE_PATH);
+
+    std::atomic<int> wrongResults { 0 };
+    std::atomic<int> openFailures { 0 };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < NUM_THREADS; ++t) {
+        threads.emplace_back([t, &wrongResults, &openFailures]() {
+            std::unique_ptr<SharedResultCache> cache = openCache(16 << 20);
+            if (!cache) {
+                openFailures++;
+                return;
+            }
+
+            std::unordered_set<int> facesA, facesB, expectedA, expectedB;
+            for (int i = 0; i < KEYS_PER_THREAD; ++i) {
+                const uint64_t own = (uint64_t)t * KEYS_PER_THREAD + i + 1;
+                resultOf(own, facesA, facesB);
+                cache->insert(own, facesA, facesB);
+
+                const uint64_t shared = (uint64_t)((t + i) % NUM_THREADS) * KEYS_PER_THREAD + i % (KEYS_PER_THREAD / 2) + 1;
+                resultOf(shared, facesA, facesB);
+                cache->insert(shared, facesA, facesB);
+
+                const uint64_t other = (uint64_t)((t + 1) % NUM_THREADS) * KEYS_PER_THREAD + i + 1;
+                if (cache->find(other, facesA, facesB)) {
+                    resultOf(other, expectedA, expectedB);
+                    if (facesA != expectedA || facesB != expectedB) {
+                        wrongResults++;
+                    }
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    int failures = 0;
+    if (openFailures > 0 || wrongResults > 0) {
+        std::cout << "FAIL concurrent: " << openFailures << " mappings failed, " << wrongResults << " wrong results found\n";
+        ++failures;
+    }
+
+    std::unique_ptr<SharedResultCache> cache = openCache(16 << 20);
+    int missing = 0;
+    for (uint64_t key = 1; cache && key <= (uint64_t)NUM_THREADS * KEYS_PER_THREAD; ++key) {
+        missing += holds(*cache, key) ? 0 : 1;
+    }
+    if (!cache || missing > 0) {
+        std::cout << "FAIL concurrent: " << missing << " of " << NUM_THREADS * KEYS_PER_THREAD << " results missing\n";
+        ++failures;
+    }
+    return failures;
+}
+
+
+// A result larger than the whole arena is turned down without taking a slot
+// or arena space: smaller results still go in after it, the large key can be
+// stored once it fits, and a full arena keeps what it holds.
+static int checkArenaFull()
+{
+    std::remove(CACHE_PATH);
+    std::unique_ptr<SharedResultCache> cache = openCache(64 << 10);
+    if (!cache) {
+        std::cout << "FAIL arena full: the cache does not open\n";
+        return 1;
+    }
+
+    int failures = 0;
+    std::unordered_set<int> facesA, facesB;
+    for (int face = 0; face < 20000; ++face) {
+        facesA.insert(face);
+    }
+    const uint64_t largeKey = 1000;
+    cache->insert(largeKey, facesA, facesB);
+    if (cache->find(largeKey, facesA, facesB)) {
+        std::cout << "FAIL arena full: a result larger than the arena was stored\n";
+        ++failures;
+    }
+
+    resultOf(1, facesA, facesB);
+    cache->insert(1, facesA, facesB);
+    if (!holds(*cache, 1)) {
+        std::cout << "FAIL arena full: a small result after a large one was not stored\n";
+        ++failures;
+    }
+
+    resultOf(largeKey, facesA, facesB);
+    cache->insert(largeKey, facesA, facesB);
+    if (!holds(*cache, largeKey)) {
+        std::cout << "FAIL arena full: a key that did not fit before could not be stored\n";
+        ++failures;
+    }
+
+    // fill the rest, then everything stored so far must still be found
+    std::vector<uint64_t> stored = { 1, largeKey };
+    for (uint64_t key = 2; key < 20000; ++key) {
+        if (key == largeKey) {
+            continue;
+        }
+        resultOf(key, facesA, facesB);
+        cache->insert(key, facesA, facesB);
+        if (cache->find(key, facesA, facesB)) {
+            stored.push_back(key);
+        }
+    }
+    int missing = 0;
+    for (uint64_t key : stored) {
+        missing += holds(*cache, key) ? 0 : 1;
+    }
+    if (stored.size() < 10 || missing > 0) {
+        std::cout << "FAIL arena full: " << stored.size() << " results stored, " << missing << " of them lost\n";
+        ++failures;
+    }
+    return failures;
+}
+
+
+int main(int, char** argv)
+{
+    MayaSession session(argv[0]);
+    if (!session.ok()) {
+        return 2;
+    }
+
+    int failures = checkConcurrent();
+    failures += checkArenaFull();
+    std::remove(CACHE_PATH);
+
+    std::cout << (failures == 0 ? "the shared result cache keeps what was inserted\n" : "the shared result cache failed\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,186 @@
+// Checks the adaptive precision triangle-triangle test against an exact
+// integer reference on random lattice triangles, many of them coplanar,
+// placed at several scales and far from the origin. Touching counts as
+// intersecting in both. Exits with 1 on any disagreement.
+
+#include "utility.h"
+
+#include <maya/MPoint.h>
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <random>
+
+
+using Lattice = int64_t[3];
+
+const int LATTICE_SIZE = 4;
+const int PAIRS = 200000;
+
+
+struct Placement
+{
+    const char* name;
+    double scale;
+    double offset;
+};
+
+// The offset placements keep every coordinate exact in double, so the
+// reference on the integer lattice stays the truth.
+const Placement PLACEMENTS[] = {
+    { "unit", 1.0, 0.0 },
+    { "2^-20", std::ldexp(1.0, -20), 0.0 },
+    { "2^-40", std::ldexp(1.0, -40), 0.0 },
+    { "unit at 2^20", 1.0, std::ldexp(1.0, 20) },
+    { "2^-20 at 2^20", std::ldexp(1.0, -20), std::ldexp(1.0, 20) },
+};
+
+
+static void cross(const int64_t a[3], const int64_t b[3], int64_t out[3])
+{
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+
+// Separating axis test on closed, non-degenerate triangles: the normals, the
+// edge cross products and the in-plane edge normals cover coplanar pairs too.
+static bool referenceIntersects(const Lattice a[3], const Lattice b[3])
+{
+    int64_t ea[3][3], eb[3][3];
+    for (int i = 0; i < 3; ++i) {
+        for (int k = 0; k < 3; ++k) {
+            ea[i][k] = a[(i + 1) % 3][k] - a[i][k];
+            eb[i][k] = b[(i + 1) % 3][k] - b[i][k];
+        }
+    }
+    int64_t na[3], nb[3];
+    cross(ea[0], ea[1], na);
+    cross(eb[0], eb[1], nb);
+
+    int64_t axes[17][3];
+    int count = 0;
+    for (int k = 0; k < 3; ++k) {
+        axes[0][k] = na[k];
+        axes[1][k] = nb[k];
+    }
+    count = 2;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            cross(ea[i], eb[j], axes[count++]);
+        }
+        cross(na, ea[i], axes[count++]);
+        cross(nb, eb[i], axes[count++]);
+    }
+
+    for (int n = 0; n < count; ++n) {
+        const int64_t* axis = axes[n];
+        int64_t aMin = INT64_MAX, aMax = INT64_MIN, bMin = INT64_MAX, bMax = INT64_MIN;
+        for (int i = 0; i < 3; ++i) {
+            const int64_t pa = axis[0] * a[i][0] + axis[1] * a[i][1] + axis[2] * a[i][2];
+            const int64_t pb = axis[0] * b[i][0] + axis[1] * b[i][1] + axis[2] * b[i][2];
+            aMin = std::min(aMin, pa);
+            aMax = std::max(aMax, pa);
+            bMin = std::min(bMin, pb);
+            bMax = std::max(bMax, pb);
+        }
+        if (aMax < bMin || bMax < aMin) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static bool degenerate(const Lattice t[3])
+{
+    const int64_t e1[3] = { t[1][0] - t[0][0], t[1][1] - t[0][1], t[1][2] - t[0][2] };
+    const int64_t e2[3] = { t[2][0] - t[0][0], t[2][1] - t[0][1], t[2][2] - t[0][2] };
+    int64_t n[3];
+    cross(e1, e2, n);
+    return n[0] == 0 && n[1] == 0 && n[2] == 0;
+}
+
+
+static TriangleData place(const Lattice t[3], const Placement& placement)
+{
+    MPoint points[3];
+    for (int i = 0; i < 3; ++i) {
+        points[i] = MPoint(
+            placement.offset + t[i][0] * placement.scale,
+            placement.offset + t[i][1] * placement.scale,
+            placement.offset + t[i][2] * placement.scale);
+    }
+    return TriangleData(0, 0, points[0], points[1], points[2]);
+}
+
+
+// Returns the number of placements where the test disagrees with the reference.
+static int check(const char* name, const Lattice a[3], const Lattice b[3], bool verbose)
+{
+    const bool expected = referenceIntersects(a, b);
+    int failures = 0;
+    for (const Placement& placement : PLACEMENTS) {
+        const TriangleData ta = place(a, placement);
+        const TriangleData tb = place(b, placement);
+        if (intersectTriangleTriangle(ta, tb) != expected || intersectTriangleTriangle(tb, ta) != expected) {
+            if (verbose || failures == 0) {
+                std::cout << "FAIL " << name << " at " << placement.name << ": expected "
+                          << (expected ? "intersecting" : "apart") << "\n";
+            }
+            ++failures;
+        }
+    }
+    return failures;
+}
+
+
+int main()
+{
+    int failures = 0;
+
+    // coplanar and apart, must not be reported
+    {
+        const Lattice a[3] = { { 0, 0, 0 }, { 1, 0, 0 }, { 0, 1, 0 } };
+        const Lattice b[3] = { { 5, 5, 0 }, { 6, 5, 0 }, { 5, 6, 0 } };
+        failures += check("disjoint coplanar", a, b, true);
+    }
+    // coplanar, sharing only an edge
+    {
+        const Lattice a[3] = { { 0, 0, 0 }, { 2, 0, 0 }, { 0, 2, 0 } };
+        const Lattice b[3] = { { 2, 0, 0 }, { 0, 2, 0 }, { 2, 2, 0 } };
+        failures += check("coplanar shared edge", a, b, true);
+    }
+    // coplanar, one inside the other
+    {
+        const Lattice a[3] = { { 0, 0, 0 }, { 4, 0, 0 }, { 0, 4, 0 } };
+        const Lattice b[3] = { { 1, 1, 0 }, { 2, 1, 0 }, { 1, 2, 0 } };
+        failures += check("coplanar contained", a, b, true);
+    }
+
+    std::mt19937 random(1);
+    std::uniform_int_distribution<int> coordinate(0, LATTICE_SIZE);
+    int tested = 0, intersecting = 0;
+    while (tested < PAIRS) {
+        // every other pair lies in z = 0
+        const bool coplanar = tested % 2 == 0;
+        Lattice a[3], b[3];
+        for (int i = 0; i < 3; ++i) {
+            for (int k = 0; k < 3; ++k) {
+                a[i][k] = (coplanar && k == 2) ? 0 : coordinate(random);
+                b[i][k] = (coplanar && k == 2) ? 0 : coordinate(random);
+            }
+        }
+        if (degenerate(a) || degenerate(b)) {
+            continue;
+        }
+        ++tested;
+        intersecting += referenceIntersects(a, b) ? 1 : 0;
+        failures += check(coplanar ? "random coplanar" : "random", a, b, false);
+    }
+
+    std::cout << tested << " lattice pairs, " << intersecting << " intersecting, " << failures << " failures\n";
+    return failures == 0 ? 0 : 1;
+}